@@ -11,7 +11,15 @@ extern "C" {
 #endif
 
 #include <CoreFoundation/CoreFoundation.h>
+#ifdef __APPLE__
 #include <mach/error.h>
+#else
+/* the simulated backend (sim_device.c) builds without mach */
+typedef int mach_error_t;
+#define ERR_SUCCESS   0
+#define err_system(x) (((x) & 0x3f) << 26)
+#define err_sub(x)    (((x) & 0xfff) << 14)
+#endif
 
 /* Error codes */
 #define MDERR_APPLE_MOBILE  (err_system(0x3a))
@@ -44,7 +52,8 @@ extern "C" {
 /* Services, found in /System/Library/Lockdown/Services.plist */
 #define AMSVC_AFC                   CFSTR("com.apple.afc")
 #define AMSVC_BACKUP                CFSTR("com.apple.mobilebackup")
-#define AMSVC_CRASH_REPORT_COPY     CFSTR("com.apple.crashreportcopy")
+#define AMSVC_CRASH_REPORT_COPY     CFSTR("com.apple.crashreportcopymobile")
+#define AMSVC_CRASH_REPORT_MOVER    CFSTR("com.apple.crashreportmover")
 #define AMSVC_DEBUG_IMAGE_MOUNT     CFSTR("com.apple.mobile.debug_image_mount")
 #define AMSVC_NOTIFICATION_PROXY    CFSTR("com.apple.mobile.notification_proxy")
 #define AMSVC_PURPLE_TEST           CFSTR("com.apple.purpletestr")
@@ -511,6 +520,8 @@ void AMDAddLogFileDescriptor(int fd);
 int AMDeviceTransferApplication(int fd, CFStringRef path, CFDictionaryRef options, void *callback, int cbarg);
 int AMDeviceInstallApplication(int fd, CFStringRef path, CFDictionaryRef options, void *callback, int cbarg);
 
+int AMDeviceSecureTransferPath(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int cbarg);
+int AMDeviceSecureInstallApplication(int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int cbarg);
 int AMDeviceSecureUninstallApplication(int unknown0, struct am_device *device, CFStringRef bundle_id, int unknown1, void *callback, int cbarg);
 
 //int AMDeviceLookupApplications(struct am_device *device, int unknown0, CFDictionaryRef* apps);
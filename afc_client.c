@@ -0,0 +1,296 @@
+#include "afc_client.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define AFC_FLUSH_SIZE (256 * 1024)
+#define AFC_MAX_REPLY  (8 * 1024 * 1024)  /* payload; reads ask for at most 1 MiB */
+
+struct afc_client
+{
+  int fd;
+  int failed;
+  uint64_t sent;                /* next packet number */
+  uint64_t received;            /* packet number the next reply must carry */
+  char *out;                    /* requests not written yet */
+  size_t out_len, out_cap;
+  char *in;                     /* payload of the last reply */
+  size_t in_cap;
+};
+
+static void put_le64(char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    p[i] = (char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get_le64(const char *p)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--) {
+    v = (v << 8) | (unsigned char)p[i];
+  }
+  return v;
+}
+
+static int afc_write_all(int fd, const char *p, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int afc_read_all(int fd, char *p, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int afc_flush(struct afc_client *client)
+{
+  if (client->out_len > 0 && !client->failed) {
+    client->failed = afc_write_all(client->fd, client->out, client->out_len) != 0;
+  }
+  client->out_len = 0;
+  return client->failed ? -1 : 0;
+}
+
+static char *afc_reserve(struct afc_client *client, size_t len)
+{
+  if (client->out_len + len > client->out_cap) {
+    client->out_cap = (client->out_len + len) * 2;
+    client->out = realloc(client->out, client->out_cap);
+  }
+  char *p = client->out + client->out_len;
+  client->out_len += len;
+  return p;
+}
+
+/*
+  Queues one packet: header, then `header_len` bytes of operation header
+  (numbers and paths), then `data_len` bytes of payload. Large payloads
+  are written straight from the caller's buffer.
+*/
+static int afc_send(struct afc_client *client, uint64_t op, const char *header, size_t header_len,
+                    const void *data, size_t data_len)
+{
+  if (client->failed) {
+    return -1;
+  }
+  char *p = afc_reserve(client, AFC_HEADER_SIZE + header_len);
+  memcpy(p, AFC_MAGIC, 8);
+  put_le64(p + 8, AFC_HEADER_SIZE + header_len + data_len);
+  put_le64(p + 16, AFC_HEADER_SIZE + header_len);
+  put_le64(p + 24, client->sent++);
+  put_le64(p + 32, op);
+  memcpy(p + AFC_HEADER_SIZE, header, header_len);
+
+  if (data_len >= AFC_FLUSH_SIZE) {
+    if (afc_flush(client) != 0) return -1;
+    client->failed = afc_write_all(client->fd, data, data_len) != 0;
+  } else if (data_len > 0) {
+    memcpy(afc_reserve(client, data_len), data, data_len);
+  }
+  if (client->out_len >= AFC_FLUSH_SIZE) {
+    afc_flush(client);
+  }
+  return client->failed ? -1 : 0;
+}
+
+static int afc_send_path(struct afc_client *client, uint64_t op, const char *path)
+{
+  return afc_send(client, op, path, strlen(path) + 1, NULL, 0);
+}
+
+static int afc_send_number(struct afc_client *client, uint64_t op, uint64_t a, uint64_t b, int count)
+{
+  char header[16];
+  put_le64(header, a);
+  put_le64(header + 8, b);
+  return afc_send(client, op, header, 8 * count, NULL, 0);
+}
+
+struct afc_client *afc_client_new(int fd)
+{
+  struct afc_client *client = calloc(1, sizeof(*client));
+  client->fd = fd;
+  return client;
+}
+
+void afc_client_free(struct afc_client *client)
+{
+  if (client == NULL) {
+    return;
+  }
+  close(client->fd);
+  free(client->out);
+  free(client->in);
+  free(client);
+}
+
+size_t afc_client_pending(const struct afc_client *client)
+{
+  return (size_t)(client->sent - client->received);
+}
+
+int afc_send_read_dir(struct afc_client *client, const char *path)
+{
+  return afc_send_path(client, AFC_OP_READ_DIR, path);
+}
+
+int afc_send_file_info(struct afc_client *client, const char *path)
+{
+  return afc_send_path(client, AFC_OP_GET_FILE_INFO, path);
+}
+
+int afc_send_remove(struct afc_client *client, const char *path)
+{
+  return afc_send_path(client, AFC_OP_REMOVE_PATH, path);
+}
+
+int afc_send_make_dir(struct afc_client *client, const char *path)
+{
+  return afc_send_path(client, AFC_OP_MAKE_DIR, path);
+}
+
+/* Operation header of 8 * `count` numbers followed by up to two strings. */
+static int afc_send_args(struct afc_client *client, uint64_t op, const uint64_t *numbers, int count,
+                         const char *a, const char *b)
+{
+  size_t la = a ? strlen(a) + 1 : 0, lb = b ? strlen(b) + 1 : 0;
+  char *header = malloc(8 * count + la + lb + 1);
+  int i;
+  for (i = 0; i < count; i++) {
+    put_le64(header + 8 * i, numbers[i]);
+  }
+  if (la > 0) memcpy(header + 8 * count, a, la);
+  if (lb > 0) memcpy(header + 8 * count + la, b, lb);
+  int ret = afc_send(client, op, header, 8 * count + la + lb, NULL, 0);
+  free(header);
+  return ret;
+}
+
+int afc_send_open(struct afc_client *client, const char *path, uint64_t mode)
+{
+  return afc_send_args(client, AFC_OP_FILE_OPEN, &mode, 1, path, NULL);
+}
+
+int afc_send_read(struct afc_client *client, uint64_t handle, uint64_t len)
+{
+  return afc_send_number(client, AFC_OP_FILE_READ, handle, len, 2);
+}
+
+int afc_send_write(struct afc_client *client, uint64_t handle, const void *buf, size_t len)
+{
+  char header[8];
+  put_le64(header, handle);
+  return afc_send(client, AFC_OP_FILE_WRITE, header, 8, buf, len);
+}
+
+int afc_send_close(struct afc_client *client, uint64_t handle)
+{
+  return afc_send_number(client, AFC_OP_FILE_CLOSE, handle, 0, 1);
+}
+
+int afc_send_seek(struct afc_client *client, uint64_t handle, uint64_t whence, int64_t offset)
+{
+  uint64_t numbers[3] = { handle, whence, (uint64_t)offset };
+  return afc_send_args(client, AFC_OP_FILE_SEEK, numbers, 3, NULL, NULL);
+}
+
+int afc_send_set_size(struct afc_client *client, uint64_t handle, uint64_t size)
+{
+  return afc_send_number(client, AFC_OP_FILE_SET_SIZE, handle, size, 2);
+}
+
+int afc_send_rename(struct afc_client *client, const char *from, const char *to)
+{
+  return afc_send_args(client, AFC_OP_RENAME_PATH, NULL, 0, from, to);
+}
+
+int afc_send_link(struct afc_client *client, uint64_t type, const char *target, const char *name)
+{
+  return afc_send_args(client, AFC_OP_MAKE_LINK, &type, 1, target, name);
+}
+
+int afc_recv(struct afc_client *client, struct afc_reply *reply)
+{
+  char header[AFC_HEADER_SIZE];
+
+  memset(reply, 0, sizeof(*reply));
+  if (client->received == client->sent || afc_flush(client) != 0) {
+    return -1;
+  }
+  if (afc_read_all(client->fd, header, sizeof(header)) != 0 || memcmp(header, AFC_MAGIC, 8) != 0) {
+    client->failed = 1;
+    return -1;
+  }
+  uint64_t entire = get_le64(header + 8);
+  uint64_t this_len = get_le64(header + 16);
+  uint64_t packet = get_le64(header + 24);
+  if (this_len < AFC_HEADER_SIZE || entire < this_len || packet != client->received ||
+      entire - AFC_HEADER_SIZE > AFC_MAX_REPLY) {
+    client->failed = 1;
+    return -1;
+  }
+  client->received++;
+
+  /* operation header and payload are read together; the payload follows */
+  size_t len = (size_t)(entire - AFC_HEADER_SIZE);
+  if (len + 1 > client->in_cap) {
+    client->in_cap = len + 1;
+    client->in = realloc(client->in, client->in_cap);
+  }
+  if (afc_read_all(client->fd, client->in, len) != 0) {
+    client->failed = 1;
+    return -1;
+  }
+  client->in[len] = '\0';
+
+  size_t header_len = (size_t)(this_len - AFC_HEADER_SIZE);
+  reply->op = get_le64(header + 32);
+  if (reply->op == AFC_OP_STATUS && header_len >= 8) {
+    reply->status = get_le64(client->in);
+  } else if (reply->op == AFC_OP_FILE_OPEN_RES && header_len >= 8) {
+    reply->handle = get_le64(client->in);
+  } else if (reply->op == AFC_OP_DATA) {
+    reply->data = client->in + header_len;
+    reply->data_len = len - header_len;
+  }
+  return 0;
+}
+
+int afc_read_complete(const struct afc_reply *reply, uint64_t requested, int last)
+{
+  if (reply->op != AFC_OP_DATA || reply->data_len > requested) {
+    return 0;
+  }
+  return reply->data_len == requested || last;
+}
+
+const char *afc_reply_next(const struct afc_reply *reply, size_t *offset)
+{
+  if (reply->data == NULL || *offset >= reply->data_len) {
+    return NULL;
+  }
+  const char *str = reply->data + *offset;
+  size_t len = strnlen(str, reply->data_len - *offset);
+  *offset += len + 1;
+  return str;
+}
@@ -0,0 +1,97 @@
+/* ----------------------------------------------------------------------------
+ *   afc_client.h - AFC wire protocol with pipelined requests
+ *
+ *   MobileDevice's AFC* calls wait for every reply before sending the next
+ *   request, so each stat or open of a small file costs a full round trip.
+ *   This client talks AFC directly on the service socket: afc_send_*()
+ *   queue requests, afc_recv() returns their replies in the same order, and
+ *   any number of requests may be outstanding in between. Requests are
+ *   buffered and go out together when a reply is waited for.
+ * ------------------------------------------------------------------------- */
+
+#ifndef AFC_CLIENT_H
+#define AFC_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AFC_MAGIC       "CFA6LPAA"
+#define AFC_HEADER_SIZE 40
+
+enum afc_op
+{
+  AFC_OP_STATUS        = 0x01,
+  AFC_OP_DATA          = 0x02,
+  AFC_OP_READ_DIR      = 0x03,
+  AFC_OP_REMOVE_PATH   = 0x08,
+  AFC_OP_MAKE_DIR      = 0x09,
+  AFC_OP_GET_FILE_INFO = 0x0a,
+  AFC_OP_FILE_OPEN     = 0x0d,
+  AFC_OP_FILE_OPEN_RES = 0x0e,
+  AFC_OP_FILE_READ     = 0x0f,
+  AFC_OP_FILE_WRITE    = 0x10,
+  AFC_OP_FILE_SEEK     = 0x11,
+  AFC_OP_FILE_CLOSE    = 0x14,
+  AFC_OP_FILE_SET_SIZE = 0x15,
+  AFC_OP_RENAME_PATH   = 0x18,
+  AFC_OP_MAKE_LINK     = 0x1c
+};
+
+/* AFC status codes used by idb; anything non-zero is a failure */
+enum afc_status
+{
+  AFC_STATUS_SUCCESS     = 0,
+  AFC_STATUS_UNKNOWN     = 1,
+  AFC_STATUS_INVALID_ARG = 7,
+  AFC_STATUS_NOT_FOUND   = 8,
+  AFC_STATUS_IS_DIR      = 9,
+  AFC_STATUS_PERM_DENIED = 10,
+  AFC_STATUS_EXISTS      = 16,
+  AFC_STATUS_IO_ERROR    = 20
+};
+
+struct afc_client;
+
+struct afc_reply
+{
+  uint64_t op;                  /* AFC_OP_STATUS, AFC_OP_DATA or AFC_OP_FILE_OPEN_RES */
+  uint64_t status;              /* 0 unless op is AFC_OP_STATUS with an error */
+  uint64_t handle;              /* AFC_OP_FILE_OPEN_RES */
+  const char *data;             /* AFC_OP_DATA, valid until the next afc_recv() */
+  size_t data_len;
+};
+
+/* Takes over `fd`, which afc_client_free() closes. */
+struct afc_client *afc_client_new(int fd);
+void afc_client_free(struct afc_client *client);
+
+/* Requests sent but not yet received. */
+size_t afc_client_pending(const struct afc_client *client);
+
+/* Each returns 0, or -1 once the connection failed. */
+int afc_send_read_dir(struct afc_client *client, const char *path);
+int afc_send_file_info(struct afc_client *client, const char *path);
+int afc_send_open(struct afc_client *client, const char *path, uint64_t mode);
+int afc_send_read(struct afc_client *client, uint64_t handle, uint64_t len);
+int afc_send_write(struct afc_client *client, uint64_t handle, const void *buf, size_t len);
+int afc_send_close(struct afc_client *client, uint64_t handle);
+int afc_send_seek(struct afc_client *client, uint64_t handle, uint64_t whence, int64_t offset);
+int afc_send_set_size(struct afc_client *client, uint64_t handle, uint64_t size);
+int afc_send_remove(struct afc_client *client, const char *path);
+int afc_send_make_dir(struct afc_client *client, const char *path);
+int afc_send_rename(struct afc_client *client, const char *from, const char *to);
+int afc_send_link(struct afc_client *client, uint64_t type, const char *target, const char *name);
+
+/* Reply to the oldest outstanding request; -1 on I/O or protocol errors,
+   including replies larger than the client buffers (8 MiB). */
+int afc_recv(struct afc_client *client, struct afc_reply *reply);
+
+/* Non-zero if `reply` holds all `requested` bytes of a read. A short read is
+   only complete as the `last` read of a file, where it ends at end of file. */
+int afc_read_complete(const struct afc_reply *reply, uint64_t requested, int last);
+
+/* Walks the NUL separated strings of a DATA reply (names, key/value pairs);
+   NULL at the end. Start with *offset = 0. */
+const char *afc_reply_next(const struct afc_reply *reply, size_t *offset);
+
+#endif
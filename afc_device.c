@@ -0,0 +1,236 @@
+/* ----------------------------------------------------------------------------
+ *   afc_device.c - MobileDevice's AFC* calls on the native AFC client
+ *
+ *   For backends that replace MobileDevice.framework (sim_device.c,
+ *   usbmux_device.c): a service handle is the socket of the AFC service,
+ *   and each AFC* call is one request and its reply on an afc_client.
+ * ------------------------------------------------------------------------- */
+
+#include "MobileDevice.h"
+#include "afc_client.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the opaque MobileDevice structs are packed; ours start with them and are
+   only ever reached through pointers we allocated */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+#endif
+
+#define AFC_DEVICE_ERR 1        /* any failure; callers only test for non-zero */
+
+struct afc_device
+{
+  struct afc_connection base;
+  struct afc_client *client;
+  pthread_mutex_t lock;
+};
+
+/* directory listings and file info: the NUL separated strings of a reply */
+struct afc_strings
+{
+  size_t len, next;
+  char data[];
+};
+
+/* Every AFC call is one request and its reply on the client; a connection
+   may be shared by idb's worker threads, hence the lock around both. */
+static afc_error_t afc_device_call(afc_connection *conn, int sent, struct afc_reply *reply)
+{
+  struct afc_reply ignored;
+  if (reply == NULL) reply = &ignored;
+  if (sent != 0 || afc_recv(((struct afc_device *)conn)->client, reply) != 0) {
+    return AFC_DEVICE_ERR;
+  }
+  return (reply->op == AFC_OP_STATUS && reply->status != AFC_STATUS_SUCCESS) ? AFC_DEVICE_ERR : ERR_SUCCESS;
+}
+
+static struct afc_client *afc_device_lock(afc_connection *conn)
+{
+  struct afc_device *afc = (struct afc_device *)conn;
+  pthread_mutex_lock(&afc->lock);
+  return afc->client;
+}
+
+static void afc_device_unlock(afc_connection *conn)
+{
+  pthread_mutex_unlock(&((struct afc_device *)conn)->lock);
+}
+
+/* afc_device_done(conn, afc_send_x(afc_device_lock(conn), ...), &reply) */
+static afc_error_t afc_device_done(afc_connection *conn, int sent, struct afc_reply *reply)
+{
+  afc_error_t ret = afc_device_call(conn, sent, reply);
+  afc_device_unlock(conn);
+  return ret;
+}
+
+/* Strings of a DATA reply, copied out of the client's buffer. */
+static struct afc_strings *afc_strings(const struct afc_reply *reply)
+{
+  struct afc_strings *list = malloc(sizeof(*list) + reply->data_len + 1);
+  list->len = reply->data_len;
+  list->next = 0;
+  memcpy(list->data, reply->data, reply->data_len);
+  list->data[reply->data_len] = '\0';
+  return list;
+}
+
+static char *afc_strings_next(struct afc_strings *list)
+{
+  if (list->next >= list->len) {
+    return NULL;
+  }
+  char *str = list->data + list->next;
+  list->next += strlen(str) + 1;
+  return str;
+}
+
+afc_error_t AFCConnectionOpen(service_conn_t handle, unsigned int io_timeout, struct afc_connection **conn)
+{
+  struct afc_device *afc = calloc(1, sizeof(*afc));
+  afc->base.handle = handle;
+  afc->client = afc_client_new(handle);
+  pthread_mutex_init(&afc->lock, NULL);
+  *conn = &afc->base;
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCConnectionClose(afc_connection *conn)
+{
+  struct afc_device *afc = (struct afc_device *)conn;
+  afc_client_free(afc->client);
+  pthread_mutex_destroy(&afc->lock);
+  free(afc);
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCDirectoryOpen(afc_connection *conn, const char *path, struct afc_directory **dir)
+{
+  struct afc_reply reply;
+  struct afc_client *client = afc_device_lock(conn);
+  afc_error_t ret = afc_device_call(conn, afc_send_read_dir(client, path), &reply);
+  if (ret == ERR_SUCCESS && reply.op == AFC_OP_DATA) {
+    *dir = (struct afc_directory *)afc_strings(&reply);
+  } else {
+    ret = AFC_DEVICE_ERR;
+  }
+  afc_device_unlock(conn);
+  return ret;
+}
+
+afc_error_t AFCDirectoryRead(afc_connection *conn, struct afc_directory *dir, char **dirent)
+{
+  *dirent = afc_strings_next((struct afc_strings *)dir);
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCDirectoryClose(afc_connection *conn, struct afc_directory *dir)
+{
+  free(dir);
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCDirectoryCreate(afc_connection *conn, const char *dirname)
+{
+  struct afc_reply reply;
+  afc_error_t ret = afc_device_done(conn, afc_send_make_dir(afc_device_lock(conn), dirname), &reply);
+  return (ret == ERR_SUCCESS || reply.status == AFC_STATUS_EXISTS) ? ERR_SUCCESS : AFC_DEVICE_ERR;
+}
+
+afc_error_t AFCRemovePath(afc_connection *conn, const char *path)
+{
+  return afc_device_done(conn, afc_send_remove(afc_device_lock(conn), path), NULL);
+}
+
+afc_error_t AFCRenamePath(afc_connection *conn, const char *from, const char *to)
+{
+  return afc_device_done(conn, afc_send_rename(afc_device_lock(conn), from, to), NULL);
+}
+
+/* link_type 1: hard link, 2: symbolic link (target is stored as given) */
+afc_error_t AFCLinkPath(afc_connection *conn, long long int link_type, const char *target, const char *link_name)
+{
+  return afc_device_done(conn, afc_send_link(afc_device_lock(conn), (uint64_t)link_type, target, link_name), NULL);
+}
+
+/* Key/value pairs of the reply; AFCKeyValueRead walks them two at a time. */
+afc_error_t AFCFileInfoOpen(afc_connection *conn, const char *path, struct afc_dictionary **info)
+{
+  struct afc_reply reply;
+  struct afc_client *client = afc_device_lock(conn);
+  afc_error_t ret = afc_device_call(conn, afc_send_file_info(client, path), &reply);
+  if (ret == ERR_SUCCESS && reply.op == AFC_OP_DATA) {
+    *info = (struct afc_dictionary *)afc_strings(&reply);
+  } else {
+    ret = AFC_DEVICE_ERR;
+  }
+  afc_device_unlock(conn);
+  return ret;
+}
+
+afc_error_t AFCKeyValueRead(struct afc_dictionary *info, char **key, char **value)
+{
+  struct afc_strings *list = (struct afc_strings *)info;
+  *key = afc_strings_next(list);
+  *value = (*key != NULL) ? afc_strings_next(list) : NULL;
+  if (*value == NULL) {
+    *key = NULL;
+  }
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCKeyValueClose(struct afc_dictionary *info)
+{
+  free(info);
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCFileRefOpen(afc_connection *conn, const char *path, unsigned long long mode, afc_file_ref *ref)
+{
+  struct afc_reply reply;
+  afc_error_t ret = afc_device_done(conn, afc_send_open(afc_device_lock(conn), path, mode), &reply);
+  if (ret != ERR_SUCCESS || reply.op != AFC_OP_FILE_OPEN_RES) {
+    return AFC_DEVICE_ERR;
+  }
+  *ref = (afc_file_ref)reply.handle;
+  return ERR_SUCCESS;
+}
+
+afc_error_t AFCFileRefSeek(afc_connection *conn, afc_file_ref ref, unsigned long long offset1, unsigned long long offset2)
+{
+  return afc_device_done(conn, afc_send_seek(afc_device_lock(conn), ref, offset2, (int64_t)offset1), NULL);
+}
+
+afc_error_t AFCFileRefRead(afc_connection *conn, afc_file_ref ref, void *buf, unsigned int *len)
+{
+  struct afc_reply reply;
+  struct afc_client *client = afc_device_lock(conn);
+  afc_error_t ret = afc_device_call(conn, afc_send_read(client, ref, *len), &reply);
+  if (ret == ERR_SUCCESS && reply.op == AFC_OP_DATA && reply.data_len <= *len) {
+    memcpy(buf, reply.data, reply.data_len);
+    *len = (unsigned int)reply.data_len;
+  } else {
+    *len = 0;
+    ret = AFC_DEVICE_ERR;
+  }
+  afc_device_unlock(conn);
+  return ret;
+}
+
+afc_error_t AFCFileRefSetFileSize(afc_connection *conn, afc_file_ref ref, unsigned long long offset)
+{
+  return afc_device_done(conn, afc_send_set_size(afc_device_lock(conn), ref, offset), NULL);
+}
+
+afc_error_t AFCFileRefWrite(afc_connection *conn, afc_file_ref ref, const void *buf, unsigned int len)
+{
+  return afc_device_done(conn, afc_send_write(afc_device_lock(conn), ref, buf, len), NULL);
+}
+
+afc_error_t AFCFileRefClose(afc_connection *conn, afc_file_ref ref)
+{
+  return afc_device_done(conn, afc_send_close(afc_device_lock(conn), ref), NULL);
+}
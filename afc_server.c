@@ -0,0 +1,495 @@
+#include "afc_server.h"
+#include "afc_client.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define AFC_SERVER_FILES 256
+
+struct afc_out
+{
+  struct afc_out *next;
+  uint64_t due;                 /* ns, when the reply may leave */
+  size_t len;
+  char data[];
+};
+
+struct afc_server
+{
+  int fd;
+  char *root;
+  uint64_t latency_ns;
+  double bandwidth;
+  uint64_t link_free;           /* ns, when the link has sent everything queued */
+  int files[AFC_SERVER_FILES];  /* handle - 1 -> fd, -1 when free */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct afc_out *head, *tail;
+  int done;
+};
+
+static uint64_t afc_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void afc_sleep_until(uint64_t when)
+{
+  uint64_t now = afc_now();
+  if (when > now) {
+    struct timespec ts = { (time_t)((when - now) / 1000000000ULL), (long)((when - now) % 1000000000ULL) };
+    nanosleep(&ts, NULL);
+  }
+}
+
+/* Time `bytes` occupy the link. */
+static uint64_t afc_link(struct afc_server *server, size_t bytes)
+{
+  return server->bandwidth > 0 ? (uint64_t)(bytes * 1e9 / server->bandwidth) : 0;
+}
+
+static void put_le64(char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    p[i] = (char)(v >> (8 * i));
+  }
+}
+
+static uint64_t get_le64(const char *p)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--) {
+    v = (v << 8) | (unsigned char)p[i];
+  }
+  return v;
+}
+
+static void afc_reply(struct afc_server *server, uint64_t due, uint64_t packet, uint64_t op,
+                      const char *header, size_t header_len, const char *data, size_t data_len)
+{
+  struct afc_out *out = malloc(sizeof(*out) + AFC_HEADER_SIZE + header_len + data_len);
+  char *p = out->data;
+
+  memcpy(p, AFC_MAGIC, 8);
+  put_le64(p + 8, AFC_HEADER_SIZE + header_len + data_len);
+  put_le64(p + 16, AFC_HEADER_SIZE + header_len);
+  put_le64(p + 24, packet);
+  put_le64(p + 32, op);
+  if (header_len > 0) {
+    memcpy(p + AFC_HEADER_SIZE, header, header_len);
+  }
+  if (data_len > 0) {
+    memcpy(p + AFC_HEADER_SIZE + header_len, data, data_len);
+  }
+  out->len = AFC_HEADER_SIZE + header_len + data_len;
+  out->due = due;
+  out->next = NULL;
+
+  pthread_mutex_lock(&server->lock);
+  if (server->tail != NULL) {
+    server->tail->next = out;
+  } else {
+    server->head = out;
+  }
+  server->tail = out;
+  pthread_cond_signal(&server->changed);
+  pthread_mutex_unlock(&server->lock);
+}
+
+static void afc_status(struct afc_server *server, uint64_t due, uint64_t packet, uint64_t status)
+{
+  char header[8];
+  put_le64(header, status);
+  afc_reply(server, due, packet, AFC_OP_STATUS, header, 8, NULL, 0);
+}
+
+static uint64_t afc_errno_status(int err)
+{
+  switch (err) {
+  case ENOENT: return AFC_STATUS_NOT_FOUND;
+  case EISDIR: return AFC_STATUS_IS_DIR;
+  case EACCES:
+  case EPERM:  return AFC_STATUS_PERM_DENIED;
+  case EEXIST:
+  case ENOTEMPTY: return AFC_STATUS_EXISTS;
+  case EINVAL: return AFC_STATUS_INVALID_ARG;
+  default:     return AFC_STATUS_IO_ERROR;
+  }
+}
+
+static char *afc_local_path(struct afc_server *server, const char *path)
+{
+  while (*path == '/') path++;
+  char *local = malloc(strlen(server->root) + 1 + strlen(path) + 1);
+  sprintf(local, "%s/%s", server->root, path);
+  return local;
+}
+
+/* Growable buffer for DATA replies. */
+struct afc_buf
+{
+  char *data;
+  size_t len, cap;
+};
+
+static void afc_buf_put(struct afc_buf *buf, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  if (buf->len + len > buf->cap) {
+    buf->cap = (buf->len + len) * 2;
+    buf->data = realloc(buf->data, buf->cap);
+  }
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+}
+
+static void afc_read_dir(struct afc_server *server, uint64_t due, uint64_t packet, const char *path)
+{
+  char *local = afc_local_path(server, path);
+  DIR *dir = opendir(local);
+  struct afc_buf buf = { NULL, 0, 0 };
+  struct dirent *entry;
+
+  free(local);
+  if (dir == NULL) {
+    afc_status(server, due, packet, afc_errno_status(errno));
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    afc_buf_put(&buf, entry->d_name);
+  }
+  closedir(dir);
+  afc_reply(server, due, packet, AFC_OP_DATA, NULL, 0, buf.data, buf.len);
+  free(buf.data);
+}
+
+static void afc_file_info(struct afc_server *server, uint64_t due, uint64_t packet, const char *path)
+{
+  char *local = afc_local_path(server, path);
+  struct afc_buf buf = { NULL, 0, 0 };
+  struct stat st;
+  char value[1024];
+
+  if (lstat(local, &st) != 0) {
+    afc_status(server, due, packet, afc_errno_status(errno));
+    free(local);
+    return;
+  }
+  afc_buf_put(&buf, "st_size");
+  snprintf(value, sizeof(value), "%lld", (long long)st.st_size);
+  afc_buf_put(&buf, value);
+  afc_buf_put(&buf, "st_blocks");
+  snprintf(value, sizeof(value), "%lld", (long long)st.st_blocks);
+  afc_buf_put(&buf, value);
+  afc_buf_put(&buf, "st_nlink");
+  snprintf(value, sizeof(value), "%lu", (unsigned long)st.st_nlink);
+  afc_buf_put(&buf, value);
+  afc_buf_put(&buf, "st_ifmt");
+  afc_buf_put(&buf, S_ISDIR(st.st_mode) ? "S_IFDIR" : S_ISLNK(st.st_mode) ? "S_IFLNK" : "S_IFREG");
+  snprintf(value, sizeof(value), "%lld", (long long)st.st_mtime * 1000000000LL);
+  afc_buf_put(&buf, "st_mtime");
+  afc_buf_put(&buf, value);
+  afc_buf_put(&buf, "st_birthtime");
+  afc_buf_put(&buf, value);
+  if (S_ISLNK(st.st_mode)) {
+    ssize_t n = readlink(local, value, sizeof(value) - 1);
+    if (n >= 0) {
+      value[n] = '\0';
+      afc_buf_put(&buf, "LinkTarget");
+      afc_buf_put(&buf, value);
+    }
+  }
+  free(local);
+  afc_reply(server, due, packet, AFC_OP_DATA, NULL, 0, buf.data, buf.len);
+  free(buf.data);
+}
+
+/* Modes as idb uses them: 1 read, 2 write (create, truncate), 3 read/write;
+   4 truncating read/write and 5/6 append. */
+static void afc_open(struct afc_server *server, uint64_t due, uint64_t packet, uint64_t mode, const char *path)
+{
+  static const int flags[] = {
+    0, O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_RDWR | O_CREAT, O_RDWR | O_CREAT | O_TRUNC,
+    O_WRONLY | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_APPEND
+  };
+  int i;
+
+  if (mode < 1 || mode > 6) {
+    afc_status(server, due, packet, AFC_STATUS_INVALID_ARG);
+    return;
+  }
+  for (i = 0; i < AFC_SERVER_FILES && server->files[i] >= 0; i++) {
+  }
+  if (i == AFC_SERVER_FILES) {
+    afc_status(server, due, packet, AFC_STATUS_IO_ERROR);
+    return;
+  }
+  char *local = afc_local_path(server, path);
+  int fd = open(local, flags[mode], 0644);
+  free(local);
+  if (fd < 0) {
+    afc_status(server, due, packet, afc_errno_status(errno));
+    return;
+  }
+  server->files[i] = fd;
+
+  char header[8];
+  put_le64(header, i + 1);
+  afc_reply(server, due, packet, AFC_OP_FILE_OPEN_RES, header, 8, NULL, 0);
+}
+
+static int afc_file(struct afc_server *server, uint64_t handle)
+{
+  return (handle >= 1 && handle <= AFC_SERVER_FILES) ? server->files[handle - 1] : -1;
+}
+
+static void afc_read(struct afc_server *server, uint64_t due, uint64_t packet, uint64_t handle, uint64_t len)
+{
+  int fd = afc_file(server, handle);
+  if (fd < 0 || len > (64 << 20)) {
+    afc_status(server, due, packet, AFC_STATUS_INVALID_ARG);
+    return;
+  }
+  char *buf = malloc(len ? len : 1);
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = read(fd, buf + got, len - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      free(buf);
+      afc_status(server, due, packet, AFC_STATUS_IO_ERROR);
+      return;
+    }
+    if (n == 0) break;
+    got += n;
+  }
+  due += afc_link(server, got);
+  afc_reply(server, due, packet, AFC_OP_DATA, NULL, 0, buf, got);
+  free(buf);
+}
+
+static void afc_handle(struct afc_server *server, uint64_t due, uint64_t packet, uint64_t op,
+                       const char *header, size_t header_len, const char *data, size_t data_len)
+{
+  char *a = NULL, *b = NULL;
+  int ret = 0;
+
+  switch (op) {
+  case AFC_OP_READ_DIR:
+    afc_read_dir(server, due, packet, header);
+    return;
+  case AFC_OP_GET_FILE_INFO:
+    afc_file_info(server, due, packet, header);
+    return;
+  case AFC_OP_FILE_OPEN:
+    if (header_len < 9) break;
+    afc_open(server, due, packet, get_le64(header), header + 8);
+    return;
+  case AFC_OP_FILE_READ:
+    if (header_len < 16) break;
+    afc_read(server, due, packet, get_le64(header), get_le64(header + 8));
+    return;
+  case AFC_OP_FILE_WRITE: {
+    if (header_len < 8) break;
+    int fd = afc_file(server, get_le64(header));
+    ret = (fd < 0) ? (errno = EINVAL, -1) : 0;
+    while (ret == 0 && data_len > 0) {
+      ssize_t n = write(fd, data, data_len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) ret = -1;
+      else {
+        data += n;
+        data_len -= n;
+      }
+    }
+    break;
+  }
+  case AFC_OP_FILE_SEEK: {
+    if (header_len < 24) break;
+    int fd = afc_file(server, get_le64(header));
+    ret = (fd < 0 || lseek(fd, (off_t)get_le64(header + 16), (int)get_le64(header + 8)) < 0) ? -1 : 0;
+    break;
+  }
+  case AFC_OP_FILE_SET_SIZE:
+    if (header_len < 16) break;
+    ret = ftruncate(afc_file(server, get_le64(header)), (off_t)get_le64(header + 8));
+    break;
+  case AFC_OP_FILE_CLOSE: {
+    if (header_len < 8) break;
+    uint64_t handle = get_le64(header);
+    int fd = afc_file(server, handle);
+    ret = (fd < 0) ? (errno = EINVAL, -1) : close(fd);
+    if (fd >= 0) server->files[handle - 1] = -1;
+    break;
+  }
+  case AFC_OP_REMOVE_PATH:
+    a = afc_local_path(server, header);
+    ret = remove(a);
+    break;
+  case AFC_OP_MAKE_DIR:
+    a = afc_local_path(server, header);
+    ret = mkdir(a, 0755);
+    break;
+  case AFC_OP_RENAME_PATH:
+    a = afc_local_path(server, header);
+    b = afc_local_path(server, header + strlen(header) + 1);
+    ret = rename(a, b);
+    break;
+  case AFC_OP_MAKE_LINK: {
+    if (header_len < 10) break;
+    const char *target = header + 8;
+    b = afc_local_path(server, target + strlen(target) + 1);
+    if (get_le64(header) == 2) {
+      ret = symlink(target, b);   /* symbolic links keep the target as given */
+    } else {
+      a = afc_local_path(server, target);
+      ret = link(a, b);
+    }
+    break;
+  }
+  default:
+    afc_status(server, due, packet, 15);  /* operation not supported */
+    return;
+  }
+  free(a);
+  free(b);
+  afc_status(server, due, packet, ret == 0 ? AFC_STATUS_SUCCESS : afc_errno_status(errno));
+}
+
+static void *afc_server_writer(void *arg)
+{
+  struct afc_server *server = arg;
+
+  pthread_mutex_lock(&server->lock);
+  for (;;) {
+    while (server->head == NULL && !server->done) {
+      pthread_cond_wait(&server->changed, &server->lock);
+    }
+    struct afc_out *out = server->head;
+    if (out == NULL) {
+      break;
+    }
+    server->head = out->next;
+    if (server->head == NULL) server->tail = NULL;
+    /* replies leave in order, each once due and the link is free */
+    uint64_t when = out->due > server->link_free ? out->due : server->link_free;
+    server->link_free = when + afc_link(server, out->len);
+    pthread_mutex_unlock(&server->lock);
+
+    afc_sleep_until(when);
+    size_t off = 0;
+    while (off < out->len) {
+      ssize_t n = write(server->fd, out->data + off, out->len - off);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      off += n;
+    }
+    free(out);
+    pthread_mutex_lock(&server->lock);
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  int i;
+  for (i = 0; i < AFC_SERVER_FILES; i++) {
+    if (server->files[i] >= 0) close(server->files[i]);
+  }
+  close(server->fd);
+  free(server->root);
+  free(server);
+  return NULL;
+}
+
+static void *afc_server_reader(void *arg)
+{
+  struct afc_server *server = arg;
+  char header[AFC_HEADER_SIZE];
+  char *body = NULL;
+  size_t cap = 0;
+
+  for (;;) {
+    size_t got = 0;
+    while (got < sizeof(header)) {
+      ssize_t n = read(server->fd, header + got, sizeof(header) - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) goto done;
+      got += n;
+    }
+    uint64_t entire = get_le64(header + 8), this_len = get_le64(header + 16);
+    if (memcmp(header, AFC_MAGIC, 8) != 0 || this_len < AFC_HEADER_SIZE || entire < this_len ||
+        entire > (256 << 20)) {
+      goto done;
+    }
+    size_t len = (size_t)(entire - AFC_HEADER_SIZE);
+    if (len + 1 > cap) {
+      cap = len + 1;
+      body = realloc(body, cap);
+    }
+    for (got = 0; got < len;) {
+      ssize_t n = read(server->fd, body + got, len - got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) goto done;
+      got += n;
+    }
+    body[len] = '\0';
+
+    uint64_t due = afc_now() + server->latency_ns + afc_link(server, entire);
+    size_t header_len = (size_t)(this_len - AFC_HEADER_SIZE);
+    afc_handle(server, due, get_le64(header + 24), get_le64(header + 32),
+               body, header_len, body + header_len, len - header_len);
+  }
+done:
+  free(body);
+  pthread_mutex_lock(&server->lock);
+  server->done = 1;
+  pthread_cond_signal(&server->changed);
+  pthread_mutex_unlock(&server->lock);
+  return NULL;
+}
+
+int afc_server_start(int fd, const char *root, long latency_us, double bandwidth)
+{
+  struct afc_server *server = calloc(1, sizeof(*server));
+  pthread_t reader, writer;
+  int i;
+
+  server->fd = fd;
+  server->root = strdup(root);
+  server->latency_ns = (uint64_t)latency_us * 1000;
+  server->bandwidth = bandwidth;
+  for (i = 0; i < AFC_SERVER_FILES; i++) {
+    server->files[i] = -1;
+  }
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->changed, NULL);
+
+  if (pthread_create(&writer, NULL, afc_server_writer, server) != 0) {
+    close(fd);
+    free(server->root);
+    free(server);
+    return -1;
+  }
+  pthread_detach(writer);
+  if (pthread_create(&reader, NULL, afc_server_reader, server) != 0) {
+    /* the writer closes fd and frees the server */
+    pthread_mutex_lock(&server->lock);
+    server->done = 1;
+    pthread_cond_signal(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+    return -1;
+  }
+  pthread_detach(reader);
+  return 0;
+}
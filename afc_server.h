@@ -0,0 +1,17 @@
+/* ----------------------------------------------------------------------------
+ *   afc_server.h - AFC protocol server on a local directory
+ *
+ *   Stand-in for a device's afcd, used by the simulated backend so the
+ *   native AFC client (afc_client.h) runs against a real wire protocol.
+ *   Replies leave `latency_us` after their request arrived and share
+ *   `bandwidth` bytes/s, so pipelined requests overlap like on a USB link.
+ * ------------------------------------------------------------------------- */
+
+#ifndef AFC_SERVER_H
+#define AFC_SERVER_H
+
+/* Serves `fd` from `root` on background threads until the peer closes it;
+   fd is closed afterwards, or right away on failure. */
+int afc_server_start(int fd, const char *root, long latency_us, double bandwidth);
+
+#endif
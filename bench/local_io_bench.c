@@ -0,0 +1,134 @@
+/* ----------------------------------------------------------------------------
+ *   local_io_bench.c - files/s of the local_io backends on small-file trees
+ *
+ *   usage: local_io_bench [-n files] [-s size] [-w files_per_dir] [-d depth]
+ *                         [-b stdio|uring] [-o dir]
+ * ------------------------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 700
+
+#include "local_io.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (64 * 1024)
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+/* Directory of file i: one level per `depth`, `per_dir` files per leaf. */
+static void dir_of(char *buf, size_t size, const char *root, long i, long per_dir, int depth)
+{
+  long leaf = i / per_dir;
+  int level;
+  size_t len = snprintf(buf, size, "%s", root);
+  for (level = depth - 1; level >= 0; level--) {
+    long part = (level == 0) ? leaf : leaf / (level * 16L + 1);
+    len += snprintf(buf + len, size - len, "/d%ld", part % 1000000);
+  }
+}
+
+static int run(enum local_io_backend backend, const char *root, long files, long size,
+               long per_dir, int depth)
+{
+  char *chunk = malloc(CHUNK_SIZE);
+  char dir[4096], last_dir[4096] = "", path[4200];
+  long i;
+
+  memset(chunk, 'x', CHUNK_SIZE);
+  struct local_io *io = local_io_create(backend);
+  if (backend == LOCAL_IO_URING && strcmp(local_io_name(io), "uring") != 0) {
+    fprintf(stderr, "io_uring not available, skipping\n");
+    local_io_destroy(io);
+    free(chunk);
+    return 0;
+  }
+
+  double start = now();
+  local_io_mkdir(io, root);
+  for (i = 0; i < files; i++) {
+    dir_of(dir, sizeof(dir), root, i, per_dir, depth);
+    if (strcmp(dir, last_dir) != 0) {
+      /* create each missing level once */
+      char *p = dir + strlen(root);
+      while ((p = strchr(p + 1, '/')) != NULL) {
+        *p = '\0';
+        if (strncmp(dir, last_dir, strlen(dir)) != 0 || last_dir[strlen(dir)] != '/') {
+          local_io_mkdir(io, dir);
+        }
+        *p = '/';
+      }
+      local_io_mkdir(io, dir);
+      strcpy(last_dir, dir);
+    }
+    snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+    struct local_file *file = local_io_open(io, path);
+    long left = size;
+    while (left > 0) {
+      long n = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+      local_io_write(io, file, chunk, n);
+      left -= n;
+    }
+    local_io_close(io, file);
+  }
+  int errors = local_io_wait(io);
+  double seconds = now() - start;
+
+  printf("{\"bench\":\"local_io\",\"backend\":\"%s\",\"files\":%ld,\"file_size\":%ld,"
+         "\"files_per_dir\":%ld,\"depth\":%d,\"seconds\":%.3f,\"files_per_sec\":%.0f,"
+         "\"mb_per_sec\":%.1f,\"errors\":%d}\n",
+         local_io_name(io), files, size, per_dir, depth, seconds, files / seconds,
+         files * (double)size / seconds / (1024 * 1024), errors);
+  fflush(stdout);
+
+  local_io_destroy(io);
+  nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  free(chunk);
+  return errors ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  long files = 20000, size = 4096, per_dir = 100;
+  int depth = 2;
+  const char *backend = NULL;
+  char root[256];
+  int opt, status = 0;
+
+  snprintf(root, sizeof(root), "local_io_bench.%d", (int)getpid());
+  while ((opt = getopt(argc, argv, "n:s:w:d:b:o:")) != -1) {
+    switch (opt) {
+    case 'n': files = atol(optarg); break;
+    case 's': size = atol(optarg); break;
+    case 'w': per_dir = atol(optarg) > 0 ? atol(optarg) : 1; break;
+    case 'd': depth = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+    case 'b': backend = optarg; break;
+    case 'o': snprintf(root, sizeof(root), "%s", optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-n files] [-s size] [-w files_per_dir] [-d depth] [-b stdio|uring] [-o dir]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (backend == NULL || strcmp(backend, "stdio") == 0) {
+    status |= run(LOCAL_IO_STDIO, root, files, size, per_dir, depth);
+  }
+  if (backend == NULL || strcmp(backend, "uring") == 0) {
+    status |= run(LOCAL_IO_URING, root, files, size, per_dir, depth);
+  }
+  return status;
+}
@@ -0,0 +1,191 @@
+/* ----------------------------------------------------------------------------
+ *   plist_bench.c - app listings decoded through CF vs read in place (bplist.h)
+ *
+ *   Builds a synthetic AMDeviceLookupApplications result and times what
+ *   `idb apps` does with it both ways. From the cache file: building CF
+ *   objects from the binary plist and converting the printed values to C
+ *   strings, or reading the same values in place. From the device, whose
+ *   answer MobileDevice already hands over as CF objects: converting those
+ *   directly, which is what idb does on a cache miss, or encoding them to a
+ *   binary plist first and reading that in place.
+ *
+ *   usage: plist_bench [-n apps] [-k extra_keys_per_app] [-r rounds]
+ * ------------------------------------------------------------------------- */
+
+#include "bplist.h"
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static CFStringRef make_string(const char *fmt, long i)
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), fmt, i);
+  return CFStringCreateWithCString(NULL, buf, kCFStringEncodingUTF8);
+}
+
+/* bundle id -> attributes, every third display name non-ASCII like on real devices */
+static CFDictionaryRef make_apps(long apps, long extra)
+{
+  CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                            &kCFTypeDictionaryValueCallBacks);
+  long i, k;
+  for (i = 0; i < apps; i++) {
+    CFMutableDictionaryRef app = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                           &kCFTypeDictionaryValueCallBacks);
+    CFStringRef id = make_string("com.example.bench.app%05ld", i);
+    CFStringRef name = make_string((i % 3 == 0) ? "Bench \xc3\x84pp %ld" : "Bench App %ld", i);
+    CFStringRef container = make_string("/private/var/mobile/Containers/Data/Application/%08lX-0000-0000-0000-000000000000", i);
+    CFDictionarySetValue(app, CFSTR("CFBundleIdentifier"), id);
+    CFDictionarySetValue(app, CFSTR("CFBundleDisplayName"), name);
+    CFDictionarySetValue(app, CFSTR("Container"), container);
+    CFDictionarySetValue(app, CFSTR("ApplicationType"), CFSTR("User"));
+    for (k = 0; k < extra; k++) {
+      CFStringRef key = make_string("InfoKey%03ld", k);
+      CFStringRef value = make_string("info value %ld of the app's Info.plist", k);
+      CFDictionarySetValue(app, key, value);
+      CFRelease(value);
+      CFRelease(key);
+    }
+    CFDictionarySetValue(result, id, app);
+    CFRelease(container);
+    CFRelease(name);
+    CFRelease(id);
+    CFRelease(app);
+  }
+  return result;
+}
+
+static char *cf_cstring(CFStringRef str)
+{
+  CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+  char *buf = malloc(size);
+  if (!CFStringGetCString(str, buf, size, kCFStringEncodingUTF8)) buf[0] = '\0';
+  return buf;
+}
+
+/* Sum of the printed lengths, so neither decoder's work can be skipped. */
+static size_t walk_cf(CFDictionaryRef apps)
+{
+  CFIndex i, count = CFDictionaryGetCount(apps);
+  const void **keys = malloc(count * sizeof(*keys)), **values = malloc(count * sizeof(*values));
+  size_t total = 0;
+
+  CFDictionaryGetKeysAndValues(apps, keys, values);
+  for (i = 0; i < count; i++) {
+    CFStringRef type = CFDictionaryGetValue(values[i], CFSTR("ApplicationType"));
+    CFStringRef name = CFDictionaryGetValue(values[i], CFSTR("CFBundleDisplayName"));
+    CFStringRef container = CFDictionaryGetValue(values[i], CFSTR("Container"));
+    if (type != NULL && CFStringCompare(type, CFSTR("User"), 0) != kCFCompareEqualTo) continue;
+    char *id_str = cf_cstring(keys[i]), *name_str = cf_cstring(name), *container_str = cf_cstring(container);
+    total += strlen(id_str) + strlen(name_str) + strlen(container_str);
+    free(container_str);
+    free(name_str);
+    free(id_str);
+  }
+  free(values);
+  free(keys);
+  return total;
+}
+
+static size_t decode_cf(CFDataRef data)
+{
+  CFDictionaryRef apps = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+  size_t total = walk_cf(apps);
+  CFRelease(apps);
+  return total;
+}
+
+static size_t decode_bplist(const UInt8 *bytes, size_t len)
+{
+  struct bplist pl;
+  struct bplist_obj root;
+  size_t total = 0;
+  uint64_t i;
+
+  if (bplist_open(&pl, bytes, len) != 0 || bplist_root(&pl, &root) != 0) {
+    return 0;
+  }
+  for (i = 0; i < root.count; i++) {
+    struct bplist_obj key, app, type, name, container;
+    size_t id_len;
+    if (bplist_dict_entry(&pl, &root, i, &key, &app) != 0) continue;
+    if (bplist_dict_get(&pl, &app, "ApplicationType", &type) == 0 && !bplist_string_equal(&type, "User")) continue;
+    if (bplist_dict_get(&pl, &app, "CFBundleDisplayName", &name) != 0 ||
+        bplist_dict_get(&pl, &app, "Container", &container) != 0) continue;
+    const char *id = bplist_ascii(&key, &id_len);
+    char *name_str = bplist_strdup(&name), *container_str = bplist_strdup(&container);
+    total += (id != NULL ? id_len : 0) + strlen(name_str) + strlen(container_str);
+    free(container_str);
+    free(name_str);
+  }
+  return total;
+}
+
+/* a cache miss read through bplist.h: encode the CF answer, then read it */
+static size_t encode_bplist(CFDictionaryRef apps)
+{
+  CFDataRef data = CFPropertyListCreateData(NULL, apps, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+  size_t total = decode_bplist(CFDataGetBytePtr(data), CFDataGetLength(data));
+  CFRelease(data);
+  return total;
+}
+
+int main(int argc, char *argv[])
+{
+  long apps = 500, extra = 40, rounds = 20, r;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:k:r:")) != -1) {
+    switch (opt) {
+    case 'n': apps = atol(optarg); break;
+    case 'k': extra = atol(optarg); break;
+    case 'r': rounds = atol(optarg) > 0 ? atol(optarg) : 1; break;
+    default:
+      fprintf(stderr, "usage: %s [-n apps] [-k extra_keys_per_app] [-r rounds]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  CFDictionaryRef dict = make_apps(apps, extra);
+  CFDataRef data = CFPropertyListCreateData(NULL, dict, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+  const UInt8 *bytes = CFDataGetBytePtr(data);
+  size_t len = CFDataGetLength(data), cf_total = 0, bp_total = 0, walk_total = 0, enc_total = 0;
+
+  double start = now();
+  for (r = 0; r < rounds; r++) cf_total = decode_cf(data);
+  double cf_seconds = (now() - start) / rounds;
+
+  start = now();
+  for (r = 0; r < rounds; r++) bp_total = decode_bplist(bytes, len);
+  double bp_seconds = (now() - start) / rounds;
+
+  start = now();
+  for (r = 0; r < rounds; r++) walk_total = walk_cf(dict);
+  double walk_seconds = (now() - start) / rounds;
+
+  start = now();
+  for (r = 0; r < rounds; r++) enc_total = encode_bplist(dict);
+  double enc_seconds = (now() - start) / rounds;
+
+  int match = cf_total == bp_total && cf_total == walk_total && cf_total == enc_total;
+  printf("{\"bench\":\"plist\",\"apps\":%ld,\"keys_per_app\":%ld,\"bytes\":%zu,"
+         "\"cf_ms\":%.3f,\"bplist_ms\":%.3f,\"speedup\":%.1f,"
+         "\"cf_objects_ms\":%.3f,\"encode_bplist_ms\":%.3f,\"uncached_speedup\":%.1f,\"match\":%s}\n",
+         apps, extra + 4, len, cf_seconds * 1e3, bp_seconds * 1e3, cf_seconds / bp_seconds,
+         walk_seconds * 1e3, enc_seconds * 1e3, walk_seconds / enc_seconds, match ? "true" : "false");
+  CFRelease(data);
+  CFRelease(dict);
+  return match ? 0 : 1;
+}
@@ -0,0 +1,236 @@
+/* ----------------------------------------------------------------------------
+ *   transfer_bench.c - files/s, MB/s and peak RSS of idb ls/cp/up
+ *
+ *   Generates a synthetic app container on a simulated device (see
+ *   sim_device.c), runs idb-sim ls, cp and up against it and prints one
+ *   JSON line per command.
+ *
+ *   usage: transfer_bench [-i idb] [-p tiny|huge|deep] [-n files] [-s size]
+ *                         [-w files_per_dir] [-d depth] [-l latency_us]
+ *                         [-B bytes_per_sec] [-o dir]
+ *
+ *   Profiles: tiny  10000 x 1 KiB in one directory
+ *             huge  4 x 128 MiB
+ *             deep  2000 x 4 KiB, 10 per directory, 24 levels deep
+ *   -n/-s/-w/-d override the profile; without -p every profile runs.
+ * ------------------------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE         /* wait4 */
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define BUNDLE_ID  "com.example.bench"
+#define SIM_UDID   "sim-device-00"
+
+struct profile
+{
+  const char *name;
+  long files, size, per_dir;
+  int depth;
+};
+
+static const struct profile profiles[] = {
+  { "tiny", 10000, 1024, 10000, 1 },
+  { "huge", 4, 128L * 1024 * 1024, 4, 1 },
+  { "deep", 2000, 4096, 10, 24 },
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+static void make_dirs(const char *path)
+{
+  char buf[4096];
+  char *p;
+  snprintf(buf, sizeof(buf), "%s", path);
+  for (p = buf + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(buf, 0755);
+      *p = '/';
+    }
+  }
+  mkdir(buf, 0755);
+}
+
+/* Directory of file i relative to the container: leaf i / per_dir, `depth` levels. */
+static void dir_of(char *buf, size_t size, long i, long per_dir, int depth)
+{
+  int level;
+  size_t len = snprintf(buf, size, "Documents/l%ld", i / per_dir);
+  for (level = 1; level < depth && len < size; level++) {
+    len += snprintf(buf + len, size - len, "/n%d", level);
+  }
+}
+
+static void generate(const char *container, const struct profile *p)
+{
+  char *chunk = malloc(CHUNK_SIZE);
+  char dir[4096], last_dir[4096] = "", path[8400];
+  long i;
+
+  memset(chunk, 'x', CHUNK_SIZE);
+  for (i = 0; i < p->files; i++) {
+    dir_of(dir, sizeof(dir), i, p->per_dir, p->depth);
+    if (strcmp(dir, last_dir) != 0) {
+      snprintf(path, sizeof(path), "%s/%s", container, dir);
+      make_dirs(path);
+      strcpy(last_dir, dir);
+    }
+    snprintf(path, sizeof(path), "%s/%s/f%ld", container, dir, i);
+    FILE *file = fopen(path, "wb");
+    long left = p->size;
+    while (file != NULL && left > 0) {
+      long n = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+      fwrite(chunk, 1, n, file);
+      left -= n;
+    }
+    if (file != NULL) fclose(file);
+  }
+  free(chunk);
+}
+
+/* Runs idb in `cwd` with output discarded; fills wall time and peak RSS in KiB. */
+static int run_idb(const char *idb, const char *cwd, char *const args[], double *seconds, long *rss_kb)
+{
+  struct rusage usage;
+  int status = -1;
+  double start = now();
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (chdir(cwd) != 0) _exit(127);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(idb, args);
+    _exit(127);
+  }
+  if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+    return -1;
+  }
+  *seconds = now() - start;
+#ifdef __APPLE__
+  *rss_kb = usage.ru_maxrss / 1024;     /* bytes on macOS */
+#else
+  *rss_kb = usage.ru_maxrss;
+#endif
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int bench(const char *idb, const char *work, const struct profile *p, long latency_us, long bandwidth)
+{
+  char sim_root[4096], container[4200], local[4096], leaf[4096];
+  char latency[32], bw[32];
+  const char *commands[] = { "ls", "cp", "up" };
+  int c, status = 0;
+
+  snprintf(sim_root, sizeof(sim_root), "%s/sim", work);
+  snprintf(container, sizeof(container), "%s/%s/apps/%s", sim_root, SIM_UDID, BUNDLE_ID);
+  snprintf(local, sizeof(local), "%s/local", work);
+  make_dirs(container);
+  make_dirs(local);
+  generate(container, p);
+
+  snprintf(latency, sizeof(latency), "%ld", latency_us);
+  snprintf(bw, sizeof(bw), "%ld", bandwidth);
+  setenv("IDB_SIM_ROOT", sim_root, 1);
+  setenv("IDB_SIM_DEVICES", "1", 1);
+  setenv("IDB_SIM_LATENCY_US", latency, 1);
+  setenv("IDB_SIM_BANDWIDTH", bw, 1);
+  setenv("IDB_NO_DAEMON", "1", 1);
+  setenv("HOME", work, 1);              /* keep ~/.idb caches out of the numbers */
+
+  /* ls lists the first leaf directory, cp and up move the whole tree */
+  dir_of(leaf, sizeof(leaf), 0, p->per_dir, p->depth);
+  for (c = 0; c < 3; c++) {
+    char *args[] = { (char *)idb, (char *)commands[c], BUNDLE_ID, c == 0 ? leaf : "Documents", NULL };
+    long files = (c == 0) ? (p->files < p->per_dir ? p->files : p->per_dir) : p->files;
+    double bytes = (c == 0) ? 0 : (double)p->files * p->size;
+    double seconds = 0;
+    long rss_kb = 0;
+    int ret = run_idb(idb, local, args, &seconds, &rss_kb);
+
+    printf("{\"bench\":\"transfer\",\"profile\":\"%s\",\"command\":\"%s\",\"files\":%ld,"
+           "\"file_size\":%ld,\"depth\":%d,\"latency_us\":%ld,\"bandwidth\":%ld,"
+           "\"seconds\":%.3f,\"files_per_sec\":%.0f,\"mb_per_sec\":%.1f,"
+           "\"peak_rss_kb\":%ld,\"exit\":%d}\n",
+           p->name, commands[c], files, p->size, p->depth, latency_us, bandwidth,
+           seconds, files / seconds, bytes / seconds / (1024 * 1024), rss_kb, ret);
+    fflush(stdout);
+    status |= (ret != 0);
+  }
+
+  nftw(work, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  return status;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *idb = "./idb-sim", *only = NULL;
+  long files = -1, size = -1, per_dir = -1, latency_us = 0, bandwidth = 0;
+  int depth = -1;
+  char work[256], work_path[2048], idb_path[4096];
+  int opt, i, status = 0;
+
+  snprintf(work, sizeof(work), "transfer_bench.%d", (int)getpid());
+  while ((opt = getopt(argc, argv, "i:p:n:s:w:d:l:B:o:")) != -1) {
+    switch (opt) {
+    case 'i': idb = optarg; break;
+    case 'p': only = optarg; break;
+    case 'n': files = atol(optarg); break;
+    case 's': size = atol(optarg); break;
+    case 'w': per_dir = atol(optarg) > 0 ? atol(optarg) : 1; break;
+    case 'd': depth = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+    case 'l': latency_us = atol(optarg); break;
+    case 'B': bandwidth = atol(optarg); break;
+    case 'o': snprintf(work, sizeof(work), "%s", optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-i idb] [-p tiny|huge|deep] [-n files] [-s size] [-w files_per_dir] "
+              "[-d depth] [-l latency_us] [-B bytes_per_sec] [-o dir]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  /* idb runs from inside the work directory, so both paths are made absolute */
+  if (realpath(idb, idb_path) == NULL) {
+    fprintf(stderr, "%s not found, build it with `rake sim`\n", idb);
+    return 1;
+  }
+  make_dirs(work);
+  if (realpath(work, work_path) == NULL) {
+    perror(work);
+    return 1;
+  }
+
+  for (i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++) {
+    struct profile p = profiles[i];
+    if (only != NULL && strcmp(only, p.name) != 0) continue;
+    if (files > 0) p.files = files;
+    if (size >= 0) p.size = size;
+    if (per_dir > 0) p.per_dir = per_dir;
+    if (depth > 0) p.depth = depth;
+    status |= bench(idb_path, work_path, &p, latency_us, bandwidth);
+  }
+  return status;
+}
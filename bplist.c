@@ -0,0 +1,342 @@
+#include "bplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BPLIST_MAGIC        "bplist00"
+#define BPLIST_HEADER_SIZE  8
+#define BPLIST_TRAILER_SIZE 32
+
+static uint64_t get_be(const uint8_t *p, unsigned int size)
+{
+  uint64_t v = 0;
+  unsigned int i;
+  for (i = 0; i < size; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+int bplist_open(struct bplist *pl, const void *data, size_t len)
+{
+  const uint8_t *bytes = data;
+
+  if (len < BPLIST_HEADER_SIZE + BPLIST_TRAILER_SIZE || memcmp(bytes, BPLIST_MAGIC, BPLIST_HEADER_SIZE) != 0) {
+    return -1;
+  }
+  const uint8_t *trailer = bytes + len - BPLIST_TRAILER_SIZE;
+  pl->data = bytes;
+  pl->len = len;
+  pl->offset_size = trailer[6];
+  pl->ref_size = trailer[7];
+  pl->count = get_be(trailer + 8, 8);
+  pl->root = get_be(trailer + 16, 8);
+  uint64_t table = get_be(trailer + 24, 8);
+
+  if (pl->offset_size < 1 || pl->offset_size > 8 || pl->ref_size < 1 || pl->ref_size > 8 ||
+      pl->root >= pl->count || table < BPLIST_HEADER_SIZE || table > len - BPLIST_TRAILER_SIZE ||
+      pl->count > (len - BPLIST_TRAILER_SIZE - table) / pl->offset_size) {
+    return -1;
+  }
+  pl->offsets = bytes + table;
+  return 0;
+}
+
+/* Count in the marker's low nibble, or in the int object after it (0xF). */
+static int read_count(const struct bplist *pl, const uint8_t **p, uint8_t info, uint64_t *count)
+{
+  const uint8_t *end = pl->offsets;
+  if (info != 0x0f) {
+    *count = info;
+    return 0;
+  }
+  if (*p >= end || (**p & 0xf0) != 0x10) {
+    return -1;
+  }
+  unsigned int size = 1u << (**p & 0x0f);
+  if (size > 8 || (size_t)(end - *p) < 1 + size) {
+    return -1;
+  }
+  *count = get_be(*p + 1, size);
+  *p += 1 + size;
+  return 0;
+}
+
+int bplist_object(const struct bplist *pl, uint64_t ref, struct bplist_obj *out)
+{
+  struct bplist_obj decoded, *obj = &decoded;   /* *out is left alone on errors */
+
+  if (ref >= pl->count) {
+    return -1;
+  }
+  uint64_t offset = get_be(pl->offsets + ref * pl->offset_size, pl->offset_size);
+  /* objects all sit between the header and the offset table */
+  if (offset < BPLIST_HEADER_SIZE || pl->data + offset >= pl->offsets) {
+    return -1;
+  }
+  const uint8_t *p = pl->data + offset;
+  uint8_t marker = *p++, info = marker & 0x0f;
+  uint64_t width = 1;           /* bytes per counted unit */
+
+  memset(obj, 0, sizeof(*obj));
+  obj->info = info;
+  switch (marker >> 4) {
+  case 0x0:
+    if (info == 0x08 || info == 0x09) {
+      obj->type = BPLIST_BOOL;
+    } else if (info == 0x00) {
+      obj->type = BPLIST_NULL;
+    } else {
+      return -1;
+    }
+    *out = decoded;
+    return 0;
+  case 0x1:
+    if (info > 4) return -1;
+    obj->type = BPLIST_INT;
+    obj->count = 1u << info;
+    break;
+  case 0x2:
+    if (info != 2 && info != 3) return -1;
+    obj->type = BPLIST_REAL;
+    obj->count = 1u << info;
+    break;
+  case 0x3:
+    if (info != 3) return -1;
+    obj->type = BPLIST_DATE;
+    obj->count = 8;
+    break;
+  case 0x4:
+    obj->type = BPLIST_DATA;
+    if (read_count(pl, &p, info, &obj->count) != 0) return -1;
+    break;
+  case 0x5:
+  case 0x7:                     /* UTF-8, same handling as ASCII */
+    obj->type = BPLIST_STRING;
+    if (read_count(pl, &p, info, &obj->count) != 0) return -1;
+    break;
+  case 0x6:
+    obj->type = BPLIST_STRING;
+    obj->utf16 = 1;
+    width = 2;
+    if (read_count(pl, &p, info, &obj->count) != 0) return -1;
+    break;
+  case 0x8:
+    obj->type = BPLIST_UID;
+    obj->count = info + 1;
+    break;
+  case 0xa:
+  case 0xc:
+    obj->type = (marker >> 4) == 0xa ? BPLIST_ARRAY : BPLIST_SET;
+    width = pl->ref_size;
+    if (read_count(pl, &p, info, &obj->count) != 0) return -1;
+    break;
+  case 0xd:
+    obj->type = BPLIST_DICT;
+    width = 2 * pl->ref_size;
+    if (read_count(pl, &p, info, &obj->count) != 0) return -1;
+    break;
+  default:
+    return -1;
+  }
+  if (obj->count > (uint64_t)(pl->offsets - p) / width) {
+    return -1;
+  }
+  obj->body = p;
+  *out = decoded;
+  return 0;
+}
+
+int bplist_root(const struct bplist *pl, struct bplist_obj *obj)
+{
+  return bplist_object(pl, pl->root, obj);
+}
+
+int bplist_array_get(const struct bplist *pl, const struct bplist_obj *array, uint64_t i, struct bplist_obj *value)
+{
+  if ((array->type != BPLIST_ARRAY && array->type != BPLIST_SET) || i >= array->count) {
+    return -1;
+  }
+  return bplist_object(pl, get_be(array->body + i * pl->ref_size, pl->ref_size), value);
+}
+
+int bplist_dict_entry(const struct bplist *pl, const struct bplist_obj *dict, uint64_t i,
+                      struct bplist_obj *key, struct bplist_obj *value)
+{
+  if (dict->type != BPLIST_DICT || i >= dict->count) {
+    return -1;
+  }
+  const uint8_t *keys = dict->body, *values = dict->body + dict->count * pl->ref_size;
+  if (key != NULL && bplist_object(pl, get_be(keys + i * pl->ref_size, pl->ref_size), key) != 0) {
+    return -1;
+  }
+  if (value != NULL && bplist_object(pl, get_be(values + i * pl->ref_size, pl->ref_size), value) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int bplist_dict_get(const struct bplist *pl, const struct bplist_obj *dict, const char *key, struct bplist_obj *value)
+{
+  uint64_t i;
+  if (dict->type != BPLIST_DICT) {
+    return -1;
+  }
+  for (i = 0; i < dict->count; i++) {
+    struct bplist_obj k;
+    if (bplist_dict_entry(pl, dict, i, &k, NULL) == 0 && bplist_string_equal(&k, key)) {
+      return bplist_dict_entry(pl, dict, i, NULL, value);
+    }
+  }
+  return -1;
+}
+
+/* Next code point of a UTF-16 string, advancing *i. */
+static uint32_t utf16_next(const struct bplist_obj *obj, uint64_t *i)
+{
+  uint32_t c = get_be(obj->body + 2 * *i, 2);
+  (*i)++;
+  if (c >= 0xd800 && c < 0xdc00 && *i < obj->count) {
+    uint32_t low = get_be(obj->body + 2 * *i, 2);
+    if (low >= 0xdc00 && low < 0xe000) {
+      (*i)++;
+      c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+    }
+  }
+  return c;
+}
+
+static size_t utf8_encode(uint32_t c, char *out)
+{
+  if (c < 0x80) {
+    out[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    out[0] = 0xc0 | (c >> 6);
+    out[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    out[0] = 0xe0 | (c >> 12);
+    out[1] = 0x80 | ((c >> 6) & 0x3f);
+    out[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (c >> 18);
+  out[1] = 0x80 | ((c >> 12) & 0x3f);
+  out[2] = 0x80 | ((c >> 6) & 0x3f);
+  out[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+int bplist_string_equal(const struct bplist_obj *obj, const char *str)
+{
+  if (obj->type != BPLIST_STRING) {
+    return 0;
+  }
+  if (!obj->utf16) {
+    return strlen(str) == obj->count && memcmp(obj->body, str, obj->count) == 0;
+  }
+  /* keys are short; compare the UTF-8 form without allocating */
+  size_t pos = 0, len = strlen(str);
+  uint64_t i = 0;
+  while (i < obj->count) {
+    char utf8[4];
+    size_t n = utf8_encode(utf16_next(obj, &i), utf8);
+    if (pos + n > len || memcmp(str + pos, utf8, n) != 0) {
+      return 0;
+    }
+    pos += n;
+  }
+  return pos == len;
+}
+
+const char *bplist_ascii(const struct bplist_obj *obj, size_t *len)
+{
+  if (obj->type != BPLIST_STRING || obj->utf16) {
+    return NULL;
+  }
+  *len = obj->count;
+  return (const char *)obj->body;
+}
+
+size_t bplist_string(const struct bplist_obj *obj, char *buf, size_t size)
+{
+  size_t need = 0;
+
+  if (obj->type != BPLIST_STRING) {
+    if (size > 0) buf[0] = '\0';
+    return 0;
+  }
+  if (!obj->utf16) {
+    need = obj->count;
+    if (size > 0) {
+      size_t n = need < size - 1 ? need : size - 1;
+      memcpy(buf, obj->body, n);
+      buf[n] = '\0';
+    }
+    return need;
+  }
+  uint64_t i = 0;
+  size_t written = 0;
+  int full = (size == 0);
+  while (i < obj->count) {
+    char utf8[4];
+    size_t n = utf8_encode(utf16_next(obj, &i), utf8);
+    if (!full && written + n < size) {
+      memcpy(buf + written, utf8, n);   /* whole characters only */
+      written += n;
+    } else {
+      full = 1;
+    }
+    need += n;
+  }
+  if (size > 0) {
+    buf[written] = '\0';
+  }
+  return need;
+}
+
+char *bplist_strdup(const struct bplist_obj *obj)
+{
+  size_t len = bplist_string(obj, NULL, 0);
+  char *str = malloc(len + 1);
+  bplist_string(obj, str, len + 1);
+  return str;
+}
+
+int64_t bplist_int(const struct bplist_obj *obj)
+{
+  if (obj->type != BPLIST_INT) {
+    return 0;
+  }
+  /* 16 byte ints hold unsigned 64 bit values in their low half */
+  if (obj->count == 16) {
+    return (int64_t)get_be(obj->body + 8, 8);
+  }
+  return (int64_t)get_be(obj->body, (unsigned int)obj->count);
+}
+
+double bplist_real(const struct bplist_obj *obj)
+{
+  if (obj->type == BPLIST_INT) {
+    return (double)bplist_int(obj);
+  }
+  if (obj->type != BPLIST_REAL && obj->type != BPLIST_DATE) {
+    return 0;
+  }
+  if (obj->count == 4) {
+    uint32_t bits = (uint32_t)get_be(obj->body, 4);
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+  }
+  uint64_t bits = get_be(obj->body, 8);
+  double d;
+  memcpy(&d, &bits, 8);
+  return d;
+}
+
+int bplist_bool(const struct bplist_obj *obj)
+{
+  return obj->type == BPLIST_BOOL && obj->info == 0x09;
+}
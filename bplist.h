@@ -0,0 +1,90 @@
+/* ----------------------------------------------------------------------------
+ *   bplist.h - binary property lists read in place
+ *
+ *   Decodes "bplist00" data without building CF objects: an object is a
+ *   view of its bytes in the caller's buffer, found through the offset
+ *   table when asked for, so looking up a few keys of a large dictionary
+ *   touches only those keys and values. ASCII strings are handed out as
+ *   pointers into the buffer; UTF-16 ones are converted on request. The
+ *   buffer must outlive every view taken from it. Offsets are checked, but
+ *   hostile data can make containers refer back to themselves, so code
+ *   walking a whole tree bounds its depth.
+ * ------------------------------------------------------------------------- */
+
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum bplist_type
+{
+  BPLIST_NULL,
+  BPLIST_BOOL,
+  BPLIST_INT,
+  BPLIST_REAL,
+  BPLIST_DATE,                  /* seconds since 2001-01-01 00:00:00 UTC */
+  BPLIST_DATA,
+  BPLIST_STRING,
+  BPLIST_UID,
+  BPLIST_ARRAY,
+  BPLIST_SET,
+  BPLIST_DICT
+};
+
+struct bplist
+{
+  const uint8_t *data;
+  size_t len;
+  const uint8_t *offsets;       /* offset table */
+  unsigned int offset_size;
+  unsigned int ref_size;
+  uint64_t count;               /* objects */
+  uint64_t root;
+};
+
+struct bplist_obj
+{
+  enum bplist_type type;
+  uint8_t info;                 /* low nibble of the marker: bool value, number width */
+  int utf16;                    /* BPLIST_STRING of big-endian UTF-16 units */
+  const uint8_t *body;          /* payload, or the object refs of a container */
+  uint64_t count;               /* bytes, characters or entries */
+};
+
+/* Checks the header and trailer of `len` bytes at `data`; 0 or -1. */
+int bplist_open(struct bplist *pl, const void *data, size_t len);
+
+/* Object `ref` / the top object; 0 or -1 if it is out of bounds. */
+int bplist_object(const struct bplist *pl, uint64_t ref, struct bplist_obj *obj);
+int bplist_root(const struct bplist *pl, struct bplist_obj *obj);
+
+/* Element `i` of an array or set. */
+int bplist_array_get(const struct bplist *pl, const struct bplist_obj *array, uint64_t i, struct bplist_obj *value);
+
+/* Entry `i` of a dictionary, in stored order. */
+int bplist_dict_entry(const struct bplist *pl, const struct bplist_obj *dict, uint64_t i,
+                      struct bplist_obj *key, struct bplist_obj *value);
+
+/* Value of the string key `key`; -1 if there is none. A linear scan, which
+   compares lengths before bytes and never decodes non-matching entries. */
+int bplist_dict_get(const struct bplist *pl, const struct bplist_obj *dict, const char *key, struct bplist_obj *value);
+
+/* Non-zero if `obj` is the string `str`. */
+int bplist_string_equal(const struct bplist_obj *obj, const char *str);
+
+/* ASCII string bytes in the buffer (not NUL terminated), NULL for UTF-16. */
+const char *bplist_ascii(const struct bplist_obj *obj, size_t *len);
+
+/* String as UTF-8 into `buf` (NUL terminated, truncated to `size`); the
+   length it needs without the NUL. */
+size_t bplist_string(const struct bplist_obj *obj, char *buf, size_t size);
+
+/* Malloc'ed UTF-8 copy of a string. */
+char *bplist_strdup(const struct bplist_obj *obj);
+
+int64_t bplist_int(const struct bplist_obj *obj);
+double bplist_real(const struct bplist_obj *obj);       /* also dates */
+int bplist_bool(const struct bplist_obj *obj);
+
+#endif
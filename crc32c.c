@@ -0,0 +1,114 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+/* slicing-by-8 tables for the portable path */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len && ((uintptr_t)p & 7)) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t crc64;
+
+  while (len && ((uintptr_t)p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+  crc64 = crc;
+  while (len >= 8) {
+    crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len && ((uintptr_t)p & 7)) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    crc = __crc32cd(crc, *(const uint64_t *)p);
+    p += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = __crc32cb(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+  uint32_t i, j, crc;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+
+  crc32c_impl = crc32c_soft;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_sse42;
+  }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c_impl = crc32c_armv8;
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_impl(~crc, (const unsigned char *)buf, len);
+}
@@ -0,0 +1,15 @@
+/* ----------------------------------------------------------------------------
+ *   crc32c.h - CRC-32C (Castagnoli) with hardware acceleration
+ *
+ * ------------------------------------------------------------------------- */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Continues a checksum; start with crc = 0. */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,140 @@
+#include "devicelink.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEVICELINK_MAX_MESSAGE (64 * 1024 * 1024)
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int devicelink_send_bytes(int fd, const void *bytes, size_t len)
+{
+  unsigned char header[4] = { len >> 24, len >> 16, len >> 8, len };
+  if (write_all(fd, header, 4) != 0) {
+    return -1;
+  }
+  return write_all(fd, bytes, len);
+}
+
+int devicelink_send(int fd, CFPropertyListRef plist)
+{
+  CFDataRef data = CFPropertyListCreateData(NULL, plist, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+  if (data == NULL) {
+    return -1;
+  }
+  int ret = devicelink_send_bytes(fd, CFDataGetBytePtr(data), CFDataGetLength(data));
+  CFRelease(data);
+  return ret;
+}
+
+int devicelink_recv(int fd, struct devicelink_msg *msg)
+{
+  unsigned char header[4];
+  if (read_all(fd, header, 4) != 0) {
+    return -1;
+  }
+  uint32_t len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+  if (len > DEVICELINK_MAX_MESSAGE) {
+    return -1;
+  }
+  if (len > msg->cap) {
+    uint8_t *buf = realloc(msg->buf, len);
+    if (buf == NULL) {
+      return -1;
+    }
+    msg->buf = buf;
+    msg->cap = len;
+  }
+  msg->len = len;
+  if (read_all(fd, msg->buf, len) != 0 || bplist_open(&msg->pl, msg->buf, len) != 0 ||
+      bplist_root(&msg->pl, &msg->root) != 0 || msg->root.type != BPLIST_ARRAY) {
+    return -1;
+  }
+  return 0;
+}
+
+int devicelink_is(const struct devicelink_msg *msg, const char *name)
+{
+  struct bplist_obj first;
+  return bplist_array_get(&msg->pl, &msg->root, 0, &first) == 0 && bplist_string_equal(&first, name);
+}
+
+static int send_array(int fd, const void **values, CFIndex count)
+{
+  CFArrayRef array = CFArrayCreate(NULL, values, count, &kCFTypeArrayCallBacks);
+  int ret = devicelink_send(fd, array);
+  CFRelease(array);
+  return ret;
+}
+
+int devicelink_handshake(int fd, struct devicelink_msg *msg)
+{
+  struct bplist_obj major;
+  if (devicelink_recv(fd, msg) != 0 || !devicelink_is(msg, "DLMessageVersionExchange") ||
+      bplist_array_get(&msg->pl, &msg->root, 1, &major) != 0) {
+    return -1;
+  }
+  /* agree to the device's version; the messages used here never changed */
+  int64_t version = bplist_int(&major);
+  CFNumberRef number = CFNumberCreate(NULL, kCFNumberSInt64Type, &version);
+  const void *reply[] = { CFSTR("DLMessageVersionExchange"), CFSTR("DLVersionsOk"), number };
+  int ret = send_array(fd, reply, 3);
+  CFRelease(number);
+  if (ret != 0 || devicelink_recv(fd, msg) != 0 || !devicelink_is(msg, "DLMessageDeviceReady")) {
+    return -1;
+  }
+  return 0;
+}
+
+int devicelink_process(int fd, CFDictionaryRef dict)
+{
+  const void *message[] = { CFSTR("DLMessageProcessMessage"), dict };
+  return send_array(fd, message, 2);
+}
+
+int devicelink_payload(const struct devicelink_msg *msg, struct bplist_obj *dict)
+{
+  if (!devicelink_is(msg, "DLMessageProcessMessage") ||
+      bplist_array_get(&msg->pl, &msg->root, 1, dict) != 0 || dict->type != BPLIST_DICT) {
+    return -1;
+  }
+  return 0;
+}
+
+void devicelink_disconnect(int fd)
+{
+  const void *message[] = { CFSTR("DLMessageDisconnect"), CFSTR("___EmptyParameterString___") };
+  send_array(fd, message, 2);
+}
+
+void devicelink_msg_free(struct devicelink_msg *msg)
+{
+  free(msg->buf);
+  memset(msg, 0, sizeof(*msg));
+}
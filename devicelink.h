@@ -0,0 +1,58 @@
+/* ----------------------------------------------------------------------------
+ *   devicelink.h - DeviceLink message framing (screenshotr)
+ *
+ *   DeviceLink services exchange arrays such as ["DLMessageProcessMessage",
+ *   {...}] as binary plists behind a 4 byte big-endian length, after a
+ *   version exchange the device opens. Messages are received into a buffer
+ *   the caller keeps and reuses, and read in place through bplist.h, so a
+ *   large payload such as a screenshot is never copied or converted to CF.
+ * ------------------------------------------------------------------------- */
+
+#ifndef DEVICELINK_H
+#define DEVICELINK_H
+
+#include "bplist.h"
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEVICELINK_VERSION 300
+
+struct devicelink_msg
+{
+  uint8_t *buf;                 /* grown as needed, kept between messages */
+  size_t cap;
+  size_t len;
+  struct bplist pl;
+  struct bplist_obj root;       /* the message array */
+};
+
+/* Sends `plist` as a binary plist; 0 or -1. */
+int devicelink_send(int fd, CFPropertyListRef plist);
+
+/* Sends an already encoded message. */
+int devicelink_send_bytes(int fd, const void *bytes, size_t len);
+
+/* Receives the next message into msg->buf; -1 on I/O errors or if it is not
+   an array. */
+int devicelink_recv(int fd, struct devicelink_msg *msg);
+
+/* Non-zero if the message is ["<name>", ...]. */
+int devicelink_is(const struct devicelink_msg *msg, const char *name);
+
+/* Host side of the version exchange, up to DLMessageDeviceReady. */
+int devicelink_handshake(int fd, struct devicelink_msg *msg);
+
+/* Sends ["DLMessageProcessMessage", dict]. */
+int devicelink_process(int fd, CFDictionaryRef dict);
+
+/* The dictionary of a received DLMessageProcessMessage. */
+int devicelink_payload(const struct devicelink_msg *msg, struct bplist_obj *dict);
+
+/* Sends ["DLMessageDisconnect", "..."]; the socket stays open. */
+void devicelink_disconnect(int fd);
+
+void devicelink_msg_free(struct devicelink_msg *msg);
+
+#endif
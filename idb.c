@@ -1,5 +1,19 @@
 #include "MobileDevice.h"
+#include "afc_client.h"
+#include "bplist.h"
+#include "crc32c.h"
+#include "devicelink.h"
+#include "json.h"
+#include "sha256.h"
+#include "local_io.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
@@ -8,14 +22,27 @@
 
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/file.h>         /* flock(2) */
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #define LS_BORDER_DAY 180
+#define WALK_JOBS 4
+#define MAX_DEVICES 32
+#define MAX_CACHED_CONNS 64
+#define WAIT_DEVICE 5           /* seconds to wait for targeted devices to attach */
+#define SETTLE_MSEC 500         /* --all: quiet period after the last device attached */
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define HDOC( ... ) #__VA_ARGS__ "\n";
 
 #define CSTR2CFSTR(str) CFStringCreateWithCString(NULL, str, kCFStringEncodingUTF8)
@@ -44,6 +71,14 @@ enum {
   AFC_FILE_WRITE,
   AFC_FILE_READWRITE
 };
+enum {
+  AFC_HARDLINK = 1,
+  AFC_SYMLINK
+};
+enum {
+  TUNNEL_ROUND_ROBIN,
+  TUNNEL_LEAST_CONN
+};
 /************************************************************************************************/
 enum CommandType
 {
@@ -56,55 +91,428 @@ enum CommandType
   APP_DIR,
   UP_DIR,
   PRINT_SYSLOG,
-  TUNNEL
+  TUNNEL,
+  FIND,
+  MOVE,
+  LINK,
+  REMOVE,
+  CAT,
+  VERIFY,
+  CRASHES,
+  SCREENSHOT,
+  BATCH
 };
-struct
+/*
+  Per thread so that batch lines marked with `&` can run side by side;
+  worker threads get a copy of their creator's through start_worker().
+*/
+__thread struct idb_command
 {
   enum CommandType type;
-  struct am_device_notification *notification;
   const char *app_path;
   const char *bundle_id;
   const char *dir_path;
   uint16_t port_ios;
   uint16_t port_local;
+  int jobs;
+  char **paths;
+  int path_count;
+  int link_type;
+  int recursive;
+  int dry_run;
+  long long offset;             /* cat: < 0 counts back from the end */
+  long long length;             /* cat: < 0 reads to the end */
+  int follow;
+  struct manifest *manifest;    /* cp/up: entries of this run, merged in on close */
+  const char *local_root;       /* cp/verify: local tree, <udid>/<bundle_id> when several devices run */
+  struct local_io *local_io;
+  const char *script;           /* batch: file, or "-" for stdin */
+  int keep_going;
+  const char *udids[MAX_DEVICES];   /* --udid, may be repeated */
+  int udid_count;
+  int all_devices;              /* --all */
+  int stats;                    /* --stats */
+  const char *trace;            /* --trace: Chrome trace JSON file */
+  int json;                     /* --json: one JSON record per line on stdout */
+  int balance;                  /* tunnel: TUNNEL_ROUND_ROBIN or TUNNEL_LEAST_CONN */
+  struct install_stage *stage;  /* install: package prepared once for every device */
+  long cache_ttl;               /* info/apps: seconds a cached result stays valid, < 0 bypasses the cache */
+  const char *process;          /* crashes: only reports of this process */
+  int loop;                     /* screenshot: capture frames into a directory */
+  double rate;                  /* screenshot: target frames/s, 0 = as fast as the device answers */
+  long frames;                  /* screenshot: stop after this many, 0 = no limit */
+  double seconds;               /* screenshot: stop after this long, 0 = no limit */
 } command;
 
+struct find_number
+{
+  int cmp;                      /* -1: less than, 0: equal, 1: greater than */
+  unsigned long long value;
+  unsigned long long unit;
+};
+
+__thread struct find_expr
+{
+  const char *name;
+  char type;
+  int has_size, has_mmin, has_mtime;
+  struct find_number size;
+  struct find_number mmin;      /* -mmin and -mtime both apply when given */
+  struct find_number mtime;
+  int max_depth;
+} find_expr;
+
+struct am_device_notification *device_notification;
+
 struct
 {
   struct passwd *pwd;
   struct group  *grp ;  
 } user;
 
+struct
+{
+  int enabled;
+  pthread_mutex_t lock;         /* one request at a time: cwd and stdio are process wide */
+} idbd = { 0, PTHREAD_MUTEX_INITIALIZER };
+
 typedef struct am_device *AMDeviceRef;
 
 #define ON_ERROR(...)              \
   do                               \
   {                                \
-    fprintf(stderr, __VA_ARGS__);  \
+    idb_eprintf(__VA_ARGS__);  \
     unregister_notification(EXIT_FAILURE); \
     fflush(stderr);                        \
   } while (0)
 
+/************************************************************************************************/
+/* Stats and trace */
+/*
+  --stats times every MobileDevice call and local file operation, --trace
+  records them as spans. Each call site below goes through a wrapper of the
+  same name; with both off the wrappers cost one predictable branch.
+*/
+static inline uint64_t probe_begin()
+{
+  return (stats_enabled || trace_enabled) ? stats_now() : 0;
+}
+
+static inline void probe_end(struct stats_hist *hist, const char *cat, const char *name, const char *detail,
+                             uint64_t start, uint64_t bytes)
+{
+  if (start == 0) {
+    return;
+  }
+  uint64_t end = stats_now();
+  if (stats_enabled && hist != NULL) {
+    stats_add(hist, end - start, bytes);
+  }
+  if (trace_enabled) {
+    trace_span(cat, name, detail, start, end);
+  }
+}
+
+#define STATS_WRAP(cat, type, name, params, args, bytes)           \
+  static struct stats_hist stats_hist_##name;                      \
+  static inline type stats_##name params                           \
+  {                                                                \
+    uint64_t start = probe_begin();                                \
+    type ret = name args;                                          \
+    probe_end(&stats_hist_##name, cat, #name, NULL, start, bytes); \
+    return ret;                                                    \
+  }
+
+STATS_WRAP("device", mach_error_t, AMDeviceConnect, (struct am_device *device), (device), 0)
+STATS_WRAP("device", int, AMDeviceIsPaired, (struct am_device *device), (device), 0)
+STATS_WRAP("device", mach_error_t, AMDeviceValidatePairing, (struct am_device *device), (device), 0)
+STATS_WRAP("device", mach_error_t, AMDeviceStartSession, (struct am_device *device), (device), 0)
+STATS_WRAP("device", mach_error_t, AMDeviceStopSession, (struct am_device *device), (device), 0)
+STATS_WRAP("device", CFStringRef, AMDeviceCopyValue, (struct am_device *device, unsigned int domain, CFStringRef key),
+           (device, domain, key), 0)
+STATS_WRAP("service", mach_error_t, AMDeviceStartService,
+           (struct am_device *device, CFStringRef name, service_conn_t *handle, unsigned int *unknown),
+           (device, name, handle, unknown), 0)
+STATS_WRAP("service", mach_error_t, AMDeviceStartHouseArrestService,
+           (struct am_device *device, CFStringRef id, void *unknown, service_conn_t *handle, unsigned int *what),
+           (device, id, unknown, handle, what), 0)
+STATS_WRAP("device", int, AMDeviceLookupApplications, (struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps),
+           (device, options, apps), 0)
+STATS_WRAP("device", int, AMDeviceSecureTransferPath,
+           (int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int cbarg),
+           (unknown0, device, url, options, callback, cbarg), 0)
+STATS_WRAP("device", int, AMDeviceSecureInstallApplication,
+           (int unknown0, struct am_device *device, CFURLRef url, CFDictionaryRef options, void *callback, int cbarg),
+           (unknown0, device, url, options, callback, cbarg), 0)
+STATS_WRAP("device", int, AMDeviceSecureUninstallApplication,
+           (int unknown0, struct am_device *device, CFStringRef bundle_id, int unknown1, void *callback, int cbarg),
+           (unknown0, device, bundle_id, unknown1, callback, cbarg), 0)
+STATS_WRAP("service", int, USBMuxConnectByPort, (int conn, int port, service_conn_t *handle), (conn, port, handle), 0)
+STATS_WRAP("afc", afc_error_t, AFCConnectionOpen, (service_conn_t handle, unsigned int io_timeout, afc_connection **conn),
+           (handle, io_timeout, conn), 0)
+STATS_WRAP("afc", afc_error_t, AFCConnectionClose, (afc_connection *conn), (conn), 0)
+STATS_WRAP("afc", afc_error_t, AFCDirectoryOpen, (afc_connection *conn, const char *path, struct afc_directory **dir),
+           (conn, path, dir), 0)
+STATS_WRAP("afc", afc_error_t, AFCDirectoryRead, (afc_connection *conn, struct afc_directory *dir, char **dirent),
+           (conn, dir, dirent), 0)
+STATS_WRAP("afc", afc_error_t, AFCDirectoryClose, (afc_connection *conn, struct afc_directory *dir), (conn, dir), 0)
+STATS_WRAP("afc", afc_error_t, AFCFileInfoOpen, (afc_connection *conn, const char *path, struct afc_dictionary **info),
+           (conn, path, info), 0)
+STATS_WRAP("afc", afc_error_t, AFCFileRefOpen, (afc_connection *conn, const char *path, unsigned long long mode, afc_file_ref *ref),
+           (conn, path, mode, ref), 0)
+STATS_WRAP("afc", afc_error_t, AFCFileRefSeek,
+           (afc_connection *conn, afc_file_ref ref, unsigned long long offset1, unsigned long long offset2),
+           (conn, ref, offset1, offset2), 0)
+STATS_WRAP("afc", afc_error_t, AFCFileRefRead, (afc_connection *conn, afc_file_ref ref, void *buf, unsigned int *len),
+           (conn, ref, buf, len), *len)
+STATS_WRAP("afc", afc_error_t, AFCFileRefWrite, (afc_connection *conn, afc_file_ref ref, const void *buf, unsigned int len),
+           (conn, ref, buf, len), len)
+STATS_WRAP("afc", afc_error_t, AFCFileRefClose, (afc_connection *conn, afc_file_ref ref), (conn, ref), 0)
+STATS_WRAP("afc", afc_error_t, AFCRemovePath, (afc_connection *conn, const char *path), (conn, path), 0)
+STATS_WRAP("afc", afc_error_t, AFCRenamePath, (afc_connection *conn, const char *from, const char *to), (conn, from, to), 0)
+STATS_WRAP("afc", afc_error_t, AFCLinkPath, (afc_connection *conn, long long int link_type, const char *target, const char *link_name),
+           (conn, link_type, target, link_name), 0)
+STATS_WRAP("afc", int, afc_recv, (struct afc_client *client, struct afc_reply *reply), (client, reply), reply->data_len)
+STATS_WRAP("local", struct local_file *, local_io_open, (struct local_io *io, const char *path), (io, path), 0)
+STATS_WRAP("local", int, local_io_write, (struct local_io *io, struct local_file *file, const void *buf, size_t len),
+           (io, file, buf, len), len)
+STATS_WRAP("local", int, local_io_close, (struct local_io *io, struct local_file *file), (io, file), 0)
+static struct stats_hist stats_hist_local_read;     /* up: fread() of the local tree */
+
+#define AMDeviceConnect                    stats_AMDeviceConnect
+#define AMDeviceIsPaired                   stats_AMDeviceIsPaired
+#define AMDeviceValidatePairing            stats_AMDeviceValidatePairing
+#define AMDeviceStartSession               stats_AMDeviceStartSession
+#define AMDeviceStopSession                stats_AMDeviceStopSession
+#define AMDeviceCopyValue                  stats_AMDeviceCopyValue
+#define AMDeviceStartService               stats_AMDeviceStartService
+#define AMDeviceStartHouseArrestService    stats_AMDeviceStartHouseArrestService
+#define AMDeviceLookupApplications         stats_AMDeviceLookupApplications
+#define AMDeviceSecureTransferPath         stats_AMDeviceSecureTransferPath
+#define AMDeviceSecureInstallApplication   stats_AMDeviceSecureInstallApplication
+#define AMDeviceSecureUninstallApplication stats_AMDeviceSecureUninstallApplication
+#define USBMuxConnectByPort                stats_USBMuxConnectByPort
+#define AFCConnectionOpen                  stats_AFCConnectionOpen
+#define AFCConnectionClose                 stats_AFCConnectionClose
+#define AFCDirectoryOpen                   stats_AFCDirectoryOpen
+#define AFCDirectoryRead                   stats_AFCDirectoryRead
+#define AFCDirectoryClose                  stats_AFCDirectoryClose
+#define AFCFileInfoOpen                    stats_AFCFileInfoOpen
+#define AFCFileRefOpen                     stats_AFCFileRefOpen
+#define AFCFileRefSeek                     stats_AFCFileRefSeek
+#define AFCFileRefRead                     stats_AFCFileRefRead
+#define AFCFileRefWrite                    stats_AFCFileRefWrite
+#define AFCFileRefClose                    stats_AFCFileRefClose
+#define AFCRemovePath                      stats_AFCRemovePath
+#define AFCRenamePath                      stats_AFCRenamePath
+#define AFCLinkPath                        stats_AFCLinkPath
+#define afc_recv                           stats_afc_recv
+#define local_io_open                      stats_local_io_open
+#define local_io_write                     stats_local_io_write
+#define local_io_close                     stats_local_io_close
+
+#define STATS_OP(name) { #name, &stats_hist_##name }
+static const struct
+{
+  const char *name;
+  struct stats_hist *hist;
+} stats_ops[] = {
+  STATS_OP(AMDeviceConnect), STATS_OP(AMDeviceIsPaired), STATS_OP(AMDeviceValidatePairing),
+  STATS_OP(AMDeviceStartSession), STATS_OP(AMDeviceStopSession), STATS_OP(AMDeviceCopyValue),
+  STATS_OP(AMDeviceStartService), STATS_OP(AMDeviceStartHouseArrestService),
+  STATS_OP(AMDeviceLookupApplications), STATS_OP(AMDeviceSecureTransferPath),
+  STATS_OP(AMDeviceSecureInstallApplication), STATS_OP(AMDeviceSecureUninstallApplication),
+  STATS_OP(USBMuxConnectByPort), STATS_OP(AFCConnectionOpen), STATS_OP(AFCConnectionClose),
+  STATS_OP(AFCDirectoryOpen), STATS_OP(AFCDirectoryRead), STATS_OP(AFCDirectoryClose),
+  STATS_OP(AFCFileInfoOpen), STATS_OP(AFCFileRefOpen), STATS_OP(AFCFileRefSeek),
+  STATS_OP(AFCFileRefRead), STATS_OP(AFCFileRefWrite), STATS_OP(AFCFileRefClose),
+  STATS_OP(AFCRemovePath), STATS_OP(AFCRenamePath), STATS_OP(AFCLinkPath), STATS_OP(afc_recv),
+  STATS_OP(local_io_open), STATS_OP(local_io_write), STATS_OP(local_io_close), STATS_OP(local_read)
+};
+
+/* atexit handler for --stats: one line per operation that was called, times in ms. */
+static void print_stats()
+{
+  size_t i;
+  fprintf(stderr, "%-34s %8s %12s %9s %9s %9s %9s %10s\n",
+          "operation", "calls", "bytes", "p50", "p90", "p99", "max", "total");
+  for (i = 0; i < sizeof(stats_ops) / sizeof(stats_ops[0]); i++) {
+    const struct stats_hist *hist = stats_ops[i].hist;
+    if (hist->calls == 0) continue;
+    fprintf(stderr, "%-34s %8llu %12llu %9.3f %9.3f %9.3f %9.3f %10.1f\n",
+            stats_ops[i].name, (unsigned long long)hist->calls, (unsigned long long)hist->bytes,
+            stats_quantile(hist, 0.5) / 1e6, stats_quantile(hist, 0.9) / 1e6,
+            stats_quantile(hist, 0.99) / 1e6, hist->max_ns / 1e6, hist->total_ns / 1e6);
+  }
+}
+
 /************************************************************************************************/
 /* Prototype */
 static void on_device_notification(struct am_device_notification_callback_info *info, void *arg);
 static void on_device_connected(AMDeviceRef device);
 void register_notification();
 void unregister_notification(int status);
+int run_command(AMDeviceRef device);
+int parse_command(int argc, char *argv[]);
 
 /* stats */
-void print_udid(AMDeviceRef device);
-void print_info(AMDeviceRef device);
-void print_apps(AMDeviceRef device);
-void print_syslog(AMDeviceRef device);
-
-void install(AMDeviceRef device);
-void uninstall(AMDeviceRef device);
-void create_tunnel(AMDeviceRef device);
-void app_dir(AMDeviceRef device);
-void copy_dir(AMDeviceRef device);
-void up_dir(AMDeviceRef device);
+int print_udid(AMDeviceRef device);
+int print_info(AMDeviceRef device);
+int print_apps(AMDeviceRef device);
+int print_syslog(AMDeviceRef device);
+
+int install(AMDeviceRef device);
+int uninstall(AMDeviceRef device);
+int create_tunnel(AMDeviceRef device);
+int app_dir(AMDeviceRef device);
+int copy_dir(AMDeviceRef device);
+int up_dir(AMDeviceRef device);
+int up_dir_broadcast(AMDeviceRef *list, int count);
+int tunnel_balance(AMDeviceRef *list, int count);
+int find_dir(AMDeviceRef device);
+int move_path(AMDeviceRef device);
+int link_path(AMDeviceRef device);
+int remove_path(AMDeviceRef device);
+int cat_file(AMDeviceRef device);
+int verify_dir(AMDeviceRef device);
+int crash_reports(AMDeviceRef device);
+int screenshot(AMDeviceRef device);
+int run_batch(AMDeviceRef device);
+int run_fanout(AMDeviceRef *list, int count);
+static int fanout_each(AMDeviceRef *list, int count);
+static int idbd_local_only();
+
+/************************************************************************************************/
+/* Output */
+/*
+  When a command runs on several devices at once, each line it prints is
+  prefixed with the device's udid. Lines are assembled per thread and
+  written whole so devices don't interleave mid-line. Without a prefix the
+  helpers are plain stdio. --json records are always whole lines and
+  carry the udid as a field instead of the prefix.
+*/
+__thread char output_prefix[64];
+static __thread struct
+{
+  char *buf;
+  size_t len, cap;
+} output_line[2];               /* stdout, stderr */
+static __thread struct json_writer output_json;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void output_put(int stream, const char *buf, size_t len, int flush)
+{
+  FILE *file = stream ? stderr : stdout;
+  char *nl;
+
+  if (output_prefix[0] == '\0') {
+    fwrite(buf, 1, len, file);
+    return;
+  }
+  if (output_line[stream].len + len > output_line[stream].cap) {
+    output_line[stream].cap = (output_line[stream].len + len) * 2;
+    output_line[stream].buf = realloc(output_line[stream].buf, output_line[stream].cap);
+  }
+  memcpy(output_line[stream].buf + output_line[stream].len, buf, len);
+  output_line[stream].len += len;
+
+  char *start = output_line[stream].buf;
+  char *end = start + output_line[stream].len;
+  pthread_mutex_lock(&output_lock);
+  while ((nl = memchr(start, '\n', end - start)) != NULL || (flush && start < end)) {
+    size_t n = nl ? (size_t)(nl - start) : (size_t)(end - start);
+    fputs(output_prefix, file);
+    fwrite(start, 1, n, file);
+    fputc('\n', file);
+    start += n + (nl ? 1 : 0);
+  }
+  fflush(file);
+  pthread_mutex_unlock(&output_lock);
+  output_line[stream].len = end - start;
+  memmove(output_line[stream].buf, start, output_line[stream].len);
+}
+
+static int output_vprintf(int stream, const char *format, va_list ap)
+{
+  char small[512];
+  va_list copy;
+
+  va_copy(copy, ap);
+  int len = vsnprintf(small, sizeof(small), format, copy);
+  va_end(copy);
+  if (len < 0) return len;
+  if ((size_t)len < sizeof(small)) {
+    output_put(stream, small, len, 0);
+  } else {
+    char *buf = malloc(len + 1);
+    vsnprintf(buf, len + 1, format, ap);
+    output_put(stream, buf, len, 0);
+    free(buf);
+  }
+  return len;
+}
+
+int idb_printf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  int len = output_vprintf(0, format, ap);
+  va_end(ap);
+  return len;
+}
 
+int idb_eprintf(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  int len = output_vprintf(1, format, ap);
+  va_end(ap);
+  return len;
+}
+
+void idb_perror(const char *str)
+{
+  int saved = errno;
+  idb_eprintf("%s: %s\n", str, strerror(saved));
+}
+
+void idb_write(const void *buf, size_t len)
+{
+  output_put(0, buf, len, 0);
+}
+
+static void output_json_write(const char *line, size_t len)
+{
+  pthread_mutex_lock(&output_lock);
+  fwrite(line, 1, len, stdout);
+  pthread_mutex_unlock(&output_lock);
+}
+
+/* Starts a --json record on this thread's writer; finish it with json_end(). */
+struct json_writer *json_record()
+{
+  struct json_writer *w = &output_json;
+  w->write = output_json_write;
+  json_begin(w);
+  if (output_prefix[0] != '\0') {
+    /* the prefix is "[udid] " */
+    json_stringn(w, "udid", output_prefix + 1, strlen(output_prefix) - 3);
+  }
+  return w;
+}
+
+/* Writes out a trailing partial line; called when a prefixed thread is done. */
+void output_flush()
+{
+  if (output_prefix[0] != '\0') {
+    output_put(0, "", 0, 1);
+    output_put(1, "", 0, 1);
+  }
+  free(output_line[0].buf);
+  free(output_line[1].buf);
+  memset(output_line, 0, sizeof(output_line));
+  json_free(&output_json);
+}
 /************************************************************************************************/
 char* str_join(const char *a, const char *b)
 {
@@ -129,15 +537,78 @@ char* file_join(const char *a, const char *b)
   return p;
 }
 
+/* `path` with "." and empty components dropped and ".." applied, never above
+   the start; "" (or "/") for the root itself. */
+char* path_normalize(const char *path)
+{
+  char *p = malloc(strlen(path) + 2);
+  size_t len = 0;
+
+  if (path[0] == '/') p[len++] = '/';
+  size_t root = len;
+  while (*path) {
+    size_t n = strcspn(path, "/");
+    if (n == 2 && path[0] == '.' && path[1] == '.') {
+      while (len > root && p[len - 1] != '/') len--;   /* drop the last component */
+      if (len > root) len--;                            /* and its separator */
+    } else if (n > 0 && !(n == 1 && path[0] == '.')) {
+      if (len > root) p[len++] = '/';
+      memcpy(p + len, path, n);
+      len += n;
+    }
+    path += n;
+    path += strspn(path, "/");
+  }
+  p[len] = '\0';
+  return p;
+}
+
 void make_dir(const char *path)
 {
   struct stat statbuf;
   mode_t mode = 0755;
-  stat(path, &statbuf);
-  if (!S_ISDIR(statbuf.st_mode)) {
+  if (stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
     mkdir(path, mode);
   }
 }
+
+/* mkdir -p of the directories above `path`. */
+static void make_parent_dirs(const char *path)
+{
+  char *dir = strdup(path), *p;
+  for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    make_dir(dir);
+    *p = '/';
+  }
+  free(dir);
+}
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
 CFURLRef get_absolute_file_url(const char *file_path)
 {
   CFStringRef path = CFStringCreateWithCString(NULL, file_path, kCFStringEncodingUTF8);
@@ -149,190 +620,1524 @@ CFURLRef get_absolute_file_url(const char *file_path)
   return url;
 }
 /************************************************************************************************/
-void print_device_value(AMDeviceRef device, CFStringRef key)
-{
-  CFStringRef value = AMDeviceCopyValue(device, 0, key);
-  if (value != NULL) {
-    printf("%-40s\t%s\n", CFSTR2CSTR(key), CFSTR2CSTR(value));
-    CFRelease(value);
-  }
-}
-
 void register_notification()
 {
-  AMDeviceNotificationSubscribe(&on_device_notification, 0, 0, 0, &command.notification);
+  AMDeviceNotificationSubscribe(&on_device_notification, 0, 0, 0, &device_notification);
   CFRunLoopRun();
 }
 void unregister_notification(int status)
 {
-  AMDeviceNotificationUnsubscribe(command.notification);
+  AMDeviceNotificationUnsubscribe(device_notification);
   exit(status);
 }
 
-void connect_device(AMDeviceRef device)
+/*
+  Attached devices keep their lockdown session open until they go away,
+  so commands run by the daemon skip pairing validation and session setup.
+*/
+struct attached_device
+{
+  AMDeviceRef device;
+  int session;
+};
+
+struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct attached_device list[MAX_DEVICES];
+  int count;
+} devices = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct attached_device *find_attached(AMDeviceRef device)
 {
-  AMDeviceConnect(device);
-  assert(AMDeviceIsPaired(device));
-  assert(AMDeviceValidatePairing(device) == 0);
-  assert(AMDeviceStartSession(device) == 0);
+  int i;
+  for (i = 0; i < devices.count; i++) {
+    if (devices.list[i].device == device) return &devices.list[i];
+  }
+  return NULL;
 }
-void disconnect_device(AMDeviceRef device)
+
+void attach_device(AMDeviceRef device)
 {
-  assert(AMDeviceStopSession(device) == 0);
-  assert(AMDeviceDisconnect(device) == 0);
+  pthread_mutex_lock(&devices.lock);
+  if (find_attached(device) == NULL && devices.count < MAX_DEVICES) {
+    AMDeviceRetain(device);
+    devices.list[devices.count].device = device;
+    devices.list[devices.count].session = 0;
+    devices.count++;
+    pthread_cond_broadcast(&devices.changed);
+  }
+  pthread_mutex_unlock(&devices.lock);
 }
-void connect_service(AMDeviceRef device, CFStringRef serviceName, unsigned int *serviceFd)
+
+void detach_device(AMDeviceRef device)
 {
-  connect_device(device);
-  assert(AMDeviceStartService(device, serviceName, serviceFd, NULL) == 0);
-  disconnect_device(device);
+  pthread_mutex_lock(&devices.lock);
+  struct attached_device *entry = find_attached(device);
+  if (entry != NULL) {
+    *entry = devices.list[--devices.count];
+    AMDeviceRelease(device);
+    pthread_cond_broadcast(&devices.changed);
+  }
+  pthread_mutex_unlock(&devices.lock);
 }
-/************************************************************************************************/
-/* Notification */
-static void on_device_notification(struct am_device_notification_callback_info *info, void *arg)
+
+void copy_udid(AMDeviceRef device, char *buf, size_t size)
 {
-  switch (info->msg) {
-  case ADNCI_MSG_CONNECTED:
-    on_device_connected(info->dev);
-    default:
+  CFStringRef udid = AMDeviceCopyDeviceIdentifier(device);
+  buf[0] = '\0';
+  if (udid != NULL) {
+    CFStringGetCString(udid, buf, size, kCFStringEncodingUTF8);
+    CFRelease(udid);
+  }
+}
+
+/* Whether the device is one the command targets (any device without --udid). */
+int device_selected(AMDeviceRef device)
+{
+  char udid[64];
+  int i;
+
+  if (command.udid_count == 0) return 1;
+  copy_udid(device, udid, sizeof(udid));
+  for (i = 0; i < command.udid_count; i++) {
+    if (strcasecmp(command.udids[i], udid) == 0) return 1;
+  }
+  return 0;
+}
+
+static int target_ready(int settle_msec, struct timespec *settled)
+{
+  int i, selected = 0;
+  for (i = 0; i < devices.count; i++) {
+    selected += device_selected(devices.list[i].device);
+  }
+  if (command.udid_count > 0) return selected == command.udid_count;
+  if (!command.all_devices) return selected > 0;
+  if (selected == 0) return 0;
+  /* --all: wait until no device has shown up for settle_msec */
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (now.tv_sec - settled->tv_sec) * 1000 + (now.tv_nsec - settled->tv_nsec) / 1000000 >= settle_msec;
+}
+
+/*
+  Fills `list` with the attached devices the command targets: the udids
+  given with --udid, every device with --all, otherwise the first one.
+  Waits up to `seconds` for them to attach; missing udids are reported.
+*/
+int select_devices(AMDeviceRef *list, int seconds, int settle_msec)
+{
+  struct timespec deadline, settled;
+  int i, count = 0;
+
+  clock_gettime(CLOCK_REALTIME, &settled);
+  deadline = settled;
+  deadline.tv_sec += seconds;
+  pthread_mutex_lock(&devices.lock);
+  int seen = devices.count;
+  while (!target_ready(settle_msec, &settled)) {
+    struct timespec wake = deadline, now;
+    if (command.all_devices && devices.count > 0) {
+      wake = settled;
+      wake.tv_nsec += (long)settle_msec * 1000000;
+      wake.tv_sec += wake.tv_nsec / 1000000000;
+      wake.tv_nsec %= 1000000000;
+    }
+    pthread_cond_timedwait(&devices.changed, &devices.lock, &wake);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (devices.count != seen) {
+      seen = devices.count;
+      settled = now;
+    } else if (now.tv_sec > deadline.tv_sec ||
+               (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
       break;
+    }
+  }
+  for (i = 0; i < devices.count; i++) {
+    if (device_selected(devices.list[i].device)) {
+      list[count++] = devices.list[i].device;
+      if (!command.all_devices && command.udid_count == 0) break;
+    }
   }
+  pthread_mutex_unlock(&devices.lock);
+
+  for (i = 0; i < command.udid_count; i++) {
+    int j, found = 0;
+    char udid[64];
+    for (j = 0; j < count && !found; j++) {
+      copy_udid(list[j], udid, sizeof(udid));
+      found = (strcasecmp(command.udids[i], udid) == 0);
+    }
+    if (!found) {
+      idb_eprintf("%s: device not attached\n", command.udids[i]);
+    }
+  }
+  return count;
 }
-static void on_device_connected(AMDeviceRef device)
+
+int start_session(AMDeviceRef device)
 {
-  if (command.type == PRINT_UDID) {
-    print_udid(device);
-  } else if (command.type == PRINT_INFO) {
-    print_info(device);
-  } else if (command.type == PRINT_APPS) {
-    print_apps(device);
-  } else if (command.type == PRINT_SYSLOG) {
-    print_syslog(device);
-  } else if (command.type == INSTALL) {
-    install(device);
-  } else if (command.type == UNINSTLL) {
-    uninstall(device);
-  } else if (command.type == TUNNEL) {
-    create_tunnel(device);
-  } else if (command.type == APP_DIR) {
-    app_dir(device);
-  } else if (command.type == COPY_DIR) {
-    copy_dir(device);
-  } else if (command.type == UP_DIR) {
-    up_dir(device);
+  int ret = 0;
+
+  pthread_mutex_lock(&devices.lock);
+  struct attached_device *entry = find_attached(device);
+  if (entry == NULL || !entry->session) {
+    AMDeviceConnect(device);
+    if (!AMDeviceIsPaired(device)) {
+      ret = -1;
+    } else if ((ret = AMDeviceValidatePairing(device)) == 0 &&
+               (ret = AMDeviceStartSession(device)) == 0 && entry != NULL) {
+      entry->session = 1;
+    }
   }
+  pthread_mutex_unlock(&devices.lock);
+  return ret;
 }
 
-void create_user()
+int connect_device(AMDeviceRef device)
 {
-  uid_t uid;
-  struct passwd *pwd;
-  struct group *grp ;
+  uint64_t start = probe_begin();
+  int ret = start_session(device);
+  probe_end(NULL, "device", "connect_device", NULL, start, 0);
+  if (ret != 0) {
+    idb_eprintf("cannot connect to device (%d)\n", ret);
+    return -1;
+  }
+  return 0;
+}
+/* Best effort: a device that went away has no session left to stop. */
+void disconnect_device(AMDeviceRef device)
+{
+  pthread_mutex_lock(&devices.lock);
+  struct attached_device *entry = find_attached(device);
+  if (entry != NULL) {
+    entry->session = 0;
+  }
+  pthread_mutex_unlock(&devices.lock);
+  AMDeviceStopSession(device);
+  AMDeviceDisconnect(device);
+}
+int connect_service(AMDeviceRef device, CFStringRef serviceName, unsigned int *serviceFd)
+{
+  if (connect_device(device) != 0) {
+    return -1;
+  }
+  int ret = AMDeviceStartService(device, serviceName, serviceFd, NULL);
+  if (ret != 0) {
+    idb_eprintf("cannot start service (%d)\n", ret);
+  }
 
-  uid = getuid();
-  pwd = getpwuid(uid);
-  grp = getgrgid( pwd->pw_gid );
+  pthread_mutex_lock(&devices.lock);
+  int warm = (find_attached(device) != NULL);
+  pthread_mutex_unlock(&devices.lock);
+  if (!warm) {
+    disconnect_device(device);
+  }
+  return ret ? -1 : 0;
+}
+struct worker_start
+{
+  void *(*routine)(void *);
+  void *arg;
+  struct idb_command command;
+  struct find_expr find_expr;
+  char output_prefix[sizeof(output_prefix)];
+};
 
-  user.pwd = pwd;
-  user.grp = grp;
+static void *worker_main(void *arg)
+{
+  struct worker_start start = *(struct worker_start *)arg;
+  free(arg);
+  command = start.command;
+  find_expr = start.find_expr;
+  memcpy(output_prefix, start.output_prefix, sizeof(output_prefix));
+  void *ret = start.routine(start.arg);
+  output_flush();
+  return ret;
 }
-/************************************************************************************************/
-/* Command Logic */
 
-/************************************************
- idb udid
-************************************************/
-void print_udid(AMDeviceRef device)
+/* pthread_create(3) for threads that work on behalf of the calling command. */
+int start_worker(pthread_t *thread, void *(*routine)(void *), void *arg)
 {
-  char *udid = CFSTR2CSTR(AMDeviceCopyDeviceIdentifier(device));
-  if (udid == NULL)
-  {
-    unregister_notification(1);
+  struct worker_start *start = malloc(sizeof(*start));
+  start->routine = routine;
+  start->arg = arg;
+  start->command = command;
+  start->find_expr = find_expr;
+  memcpy(start->output_prefix, output_prefix, sizeof(output_prefix));
+  int ret = pthread_create(thread, NULL, worker_main, start);
+  if (ret != 0) {
+    free(start);
   }
-  printf("%s\n", udid);
-  unregister_notification(0);
+  return ret;
 }
-/************************************************
- idb info
-************************************************/
-void print_info(AMDeviceRef device)
+/************************************************************************************************/
+/* AFC */
+struct afc_stat
 {
-  printf ("%s\n","[INFO]");
-  connect_device(device);
+  int is_dir;
+  int is_link;
+  unsigned long long size;
+  unsigned int nlink;
+  time_t mtime;
+};
 
-  print_device_value(device, CFSTR("BasebandStatus"));
-  print_device_value(device, CFSTR("BasebandVersion"));
-  print_device_value(device, CFSTR("BluetoothAddress"));
+static afc_connection *start_house_arrest(AMDeviceRef device, const char *bundle_id)
+{
+  CFStringRef cf_bundle_id = CSTR2CFSTR(bundle_id);
+  service_conn_t socket;
+  afc_connection *afc_conn;
 
-  print_device_value(device, CFSTR("BuildVersion"));
-  
-  print_device_value(device, CFSTR("CPUArchitecture"));
-  print_device_value(device, CFSTR("DeviceClass"));
-  print_device_value(device, CFSTR("DeviceColor"));
-  print_device_value(device, CFSTR("DeviceName"));
-  print_device_value(device, CFSTR("FirmwareVersion"));
-  print_device_value(device, CFSTR("HardwareModel"));
-  print_device_value(device, CFSTR("HardwarePlatform"));
-  print_device_value(device, CFSTR("IntegratedCircuitCardIdentity"));
-  print_device_value(device, CFSTR("InternationalMobileSubscriberIdentity"));
-  print_device_value(device, CFSTR("MLBSerialNumber"));
-
-  print_device_value(device, CFSTR("MobileSubscriberCountryCode"));
-  print_device_value(device, CFSTR("MobileSubscriberNetworkCode"));
-  print_device_value(device, CFSTR("ModelNumber"));
-  print_device_value(device, CFSTR("PhoneNumber"));
-
-  print_device_value(device, CFSTR("ProductType"));
-  print_device_value(device, CFSTR("ProductVersion"));
-  print_device_value(device, CFSTR("ProtocolVersion"));
-
-  print_device_value(device, CFSTR("RegionInfo"));
-  print_device_value(device, CFSTR("SerialNumber"));
-  print_device_value(device, CFSTR("SIMStatus"));
-
-  print_device_value(device, CFSTR("TimeZone"));
-  print_device_value(device, CFSTR("UniqueDeviceID"));
-  print_device_value(device, CFSTR("WiFiAddress"));
-  
-  unregister_notification(0);  
+  int ret = AMDeviceStartHouseArrestService(device, cf_bundle_id, NULL, &socket, 0);
+  CFRelease(cf_bundle_id);
+  if (ret != ERR_SUCCESS) {
+    idb_eprintf("AMDeviceStartHouseArrestService = %i\n", ret);
+    return NULL;
+  }
+  ret = AFCConnectionOpen(socket, 0, &afc_conn);
+  if (ret != ERR_SUCCESS) {
+    idb_eprintf("AFCConnectionOpen = %i\n", ret);
+    return NULL;
+  }
+  return afc_conn;
 }
-/************************************************
- idb apps
-************************************************/
-static void on_app(const void *key, const void *value, void *context)
+
+/*
+  While a batch runs, connections handed back by close_house_arrest() are
+  kept per bundle id and reused by the next command on the same bundle.
+*/
+struct
 {
-  if ((key == NULL) || (value == NULL))
+  pthread_mutex_t lock;
+  int enabled;
+  struct
   {
-    return;
+    AMDeviceRef device;
+    char *bundle_id;
+    afc_connection *afc_conn;
+    int busy;
+  } list[MAX_CACHED_CONNS];
+  int count;
+} afc_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+afc_connection *open_house_arrest(AMDeviceRef device, const char *bundle_id)
+{
+  int i;
+
+  pthread_mutex_lock(&afc_cache.lock);
+  for (i = 0; i < afc_cache.count; i++) {
+    if (!afc_cache.list[i].busy && afc_cache.list[i].device == device &&
+        strcmp(afc_cache.list[i].bundle_id, bundle_id) == 0) {
+      afc_cache.list[i].busy = 1;
+      pthread_mutex_unlock(&afc_cache.lock);
+      return afc_cache.list[i].afc_conn;
+    }
   }
-  char *bundle_id = CFSTR2CSTR((CFStringRef)key);
-  if (bundle_id == NULL) return;
+  pthread_mutex_unlock(&afc_cache.lock);
 
-  CFDictionaryRef app_dict = (CFDictionaryRef)value;
-  /*
-    ApplicationType (System or User)
-    CFBundleDisplayName
-    CFBundleName
+  afc_connection *afc_conn = start_house_arrest(device, bundle_id);
+  if (afc_conn == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&afc_cache.lock);
+  if (afc_cache.enabled && afc_cache.count < MAX_CACHED_CONNS) {
+    afc_cache.list[afc_cache.count].device = device;
+    afc_cache.list[afc_cache.count].bundle_id = strdup(bundle_id);
+    afc_cache.list[afc_cache.count].afc_conn = afc_conn;
+    afc_cache.list[afc_cache.count].busy = 1;
+    afc_cache.count++;
+  }
+  pthread_mutex_unlock(&afc_cache.lock);
+  return afc_conn;
+}
 
-    CFBundleInfoDictionaryVersion: 6.0
-    Entitlements: <CFBasicHash>
-    DTPlatformVersion: 5.1
-    DTSDKName: iphoneos5.1
-    CFBundleName: name
-    ApplicationType: User
-    Container: /private/var/mobile/Applications/<UDID>
-    LSRequiresIPhoneOS: <CFBoolean>
-    CFBundleDisplayName: * include multibyte
-    CodeInfoIdentifier:
-    CFBundleDocumentTypes:
-    DTSDKBuild: 9B176
-    CFBundleSupportedPlatforms: ( iPhoneOS )
-    UISupportedInterfaceOrientations: UIInterfaceOrientationPortrait
-    BuildMachineOSBuild: 11G63
-    SignerIdentity: Apple iPhone OS Application Signing
-    CFBundlePackageType: APPL
-    EnvironmentVariables: <CFBasicHash>
-    CFBundleDevelopmentRegion: ja_JP
+void close_house_arrest(afc_connection *afc_conn)
+{
+  int i;
+
+  pthread_mutex_lock(&afc_cache.lock);
+  for (i = 0; i < afc_cache.count; i++) {
+    if (afc_cache.list[i].afc_conn == afc_conn) {
+      afc_cache.list[i].busy = 0;
+      pthread_mutex_unlock(&afc_cache.lock);
+      return;
+    }
+  }
+  pthread_mutex_unlock(&afc_cache.lock);
+  AFCConnectionClose(afc_conn);
+}
+
+/* Closes every cached connection; none may be in use. */
+void flush_house_arrest_cache()
+{
+  int i;
+
+  pthread_mutex_lock(&afc_cache.lock);
+  for (i = 0; i < afc_cache.count; i++) {
+    AFCConnectionClose(afc_cache.list[i].afc_conn);
+    free(afc_cache.list[i].bundle_id);
+  }
+  afc_cache.count = 0;
+  pthread_mutex_unlock(&afc_cache.lock);
+}
+
+int afc_stat_path(afc_connection *afc_conn, const char *path, struct afc_stat *st)
+{
+  struct afc_dictionary *file_info;
+  char *key, *value;
+
+  memset(st, 0, sizeof(*st));
+  if (AFCFileInfoOpen(afc_conn, path, &file_info)) {
+    return -1;
+  }
+  AFCKeyValueRead(file_info, &key, &value);
+  while (key || value) {
+    if (strcmp(key, "st_ifmt") == 0) {
+      st->is_dir  = (strcmp(value, "S_IFDIR") == 0);
+      st->is_link = (strcmp(value, "S_IFLNK") == 0);
+    } else if (strcmp(key, "st_size") == 0) {
+      st->size = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "st_nlink") == 0) {
+      st->nlink = (unsigned int)strtoul(value, NULL, 10);
+    } else if (strcmp(key, "st_mtime") == 0) {
+      st->mtime = (time_t)(strtoull(value, NULL, 10) / 1000000000ULL);
+    }
+    AFCKeyValueRead(file_info, &key, &value);
+  }
+  AFCKeyValueClose(file_info);
+  return 0;
+}
+
+char *afc_path_join(const char *dir, const char *name)
+{
+  if (strcmp(dir, "") == 0) {
+    return strdup(name);
+  }
+  return file_join(dir, name);
+}
+
+/*
+  Concurrent tree walk. Each worker owns one AFC connection, so up to
+  `jobs` directory reads and stats are in flight at once and the walk is
+  bounded by round trips rather than by a single connection.
+*/
+struct walk;
+typedef int (*walk_callback)(struct walk *walk, afc_connection *afc_conn,
+                             const char *path, struct afc_stat *st);
+
+struct walk_node
+{
+  char *path;
+  int depth;
+  struct walk_node *next;
+};
+
+struct walk
+{
+  walk_callback callback;
+  void *context;
+  int max_depth;                /* -1: unlimited */
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct walk_node *head;
+  int active;
+};
+
+struct walk_worker
+{
+  struct walk *walk;
+  afc_connection *afc_conn;
+};
+
+static void walk_push(struct walk *walk, const char *path, int depth)
+{
+  struct walk_node *node = malloc(sizeof(*node));
+  node->path = strdup(path);
+  node->depth = depth;
+
+  pthread_mutex_lock(&walk->lock);
+  node->next = walk->head;
+  walk->head = node;
+  pthread_cond_signal(&walk->cond);
+  pthread_mutex_unlock(&walk->lock);
+}
+
+static void walk_dir(struct walk *walk, afc_connection *afc_conn, struct walk_node *node)
+{
+  struct afc_directory *dir;
+  char *dirent;
+  char **names = NULL;
+  size_t count = 0, capacity = 0, i;
+
+  if (AFCDirectoryOpen(afc_conn, node->path, &dir)) {
+    idb_eprintf("cannot open dir %s\n", node->path);
+    return;
+  }
+  /* drain the listing first so the directory handle is released before stats */
+  for (;;) {
+    AFCDirectoryRead(afc_conn, dir, &dirent);
+    if (!dirent) break;
+    if (strcmp(dirent, ".") == 0 || strcmp(dirent, "..") == 0) continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      names = realloc(names, capacity * sizeof(char *));
+    }
+    names[count++] = strdup(dirent);
+  }
+  AFCDirectoryClose(afc_conn, dir);
+
+  for (i = 0; i < count; i++) {
+    struct afc_stat st;
+    char *path = afc_path_join(node->path, names[i]);
+    if (afc_stat_path(afc_conn, path, &st) == 0) {
+      int descend = walk->callback(walk, afc_conn, path, &st);
+      if (descend && st.is_dir &&
+          (walk->max_depth < 0 || node->depth + 1 < walk->max_depth)) {
+        walk_push(walk, path, node->depth + 1);
+      }
+    } else {
+      idb_eprintf("%s doesn't exist \n", path);
+    }
+    free(path);
+    free(names[i]);
+  }
+  free(names);
+}
+
+static void *walk_thread(void *arg)
+{
+  struct walk_worker *worker = (struct walk_worker *)arg;
+  struct walk *walk = worker->walk;
+
+  for (;;) {
+    pthread_mutex_lock(&walk->lock);
+    while (walk->head == NULL && walk->active > 0) {
+      pthread_cond_wait(&walk->cond, &walk->lock);
+    }
+    struct walk_node *node = walk->head;
+    if (node == NULL) {
+      pthread_cond_broadcast(&walk->cond);
+      pthread_mutex_unlock(&walk->lock);
+      break;
+    }
+    walk->head = node->next;
+    walk->active++;
+    pthread_mutex_unlock(&walk->lock);
+
+    walk_dir(walk, worker->afc_conn, node);
+    free(node->path);
+    free(node);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->active--;
+    if (walk->head == NULL && walk->active == 0) {
+      pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+  }
+  return NULL;
+}
+
+/* Walks `root` (not reported itself) with one worker per connection. */
+void walk_tree(struct walk *walk, afc_connection **conns, int jobs, const char *root)
+{
+  pthread_t threads[jobs];
+  struct walk_worker workers[jobs];
+  int i;
+
+  pthread_mutex_init(&walk->lock, NULL);
+  pthread_cond_init(&walk->cond, NULL);
+  walk->head = NULL;
+  walk->active = 0;
+  walk_push(walk, root, 0);
+
+  for (i = 0; i < jobs; i++) {
+    workers[i].walk = walk;
+    workers[i].afc_conn = conns[i];
+    start_worker(&threads[i], walk_thread, &workers[i]);
+  }
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_cond_destroy(&walk->cond);
+  pthread_mutex_destroy(&walk->lock);
+}
+
+/* Opens `jobs` house arrest connections for the bundle; returns how many opened. */
+int open_house_arrest_pool(AMDeviceRef device, const char *bundle_id,
+                           afc_connection **conns, int jobs)
+{
+  int i;
+  for (i = 0; i < jobs; i++) {
+    if ((conns[i] = open_house_arrest(device, bundle_id)) == NULL) break;
+  }
+  return i;
+}
+
+/*
+  IDB_AFC=native makes ls, cp and up speak AFC on the house arrest socket
+  themselves (afc_client.h) instead of through the synchronous AFC* calls,
+  keeping up to AFC_WINDOW requests in flight on the one connection.
+*/
+#define AFC_WINDOW     64
+#define AFC_OPEN_AHEAD 16                 /* files opened before their turn */
+#define AFC_BYTES_AHEAD (8 * 1024 * 1024) /* file data requested or sent but not answered */
+
+static int native_afc()
+{
+  const char *env = getenv("IDB_AFC");
+  return env != NULL && strcmp(env, "native") == 0;
+}
+
+struct afc_client *open_native_afc(AMDeviceRef device, const char *bundle_id)
+{
+  CFStringRef cf_bundle_id = CSTR2CFSTR(bundle_id);
+  service_conn_t socket;
+
+  int ret = AMDeviceStartHouseArrestService(device, cf_bundle_id, NULL, &socket, 0);
+  CFRelease(cf_bundle_id);
+  if (ret != ERR_SUCCESS) {
+    idb_eprintf("AMDeviceStartHouseArrestService = %i\n", ret);
+    return NULL;
+  }
+  return afc_client_new(socket);
+}
+
+/* Requests in flight, oldest first; replies come back in the same order. */
+enum afc_pipe_kind
+{
+  AFC_PIPE_STAT,
+  AFC_PIPE_OPEN,
+  AFC_PIPE_DATA,                /* read or write of `len` bytes */
+  AFC_PIPE_CLOSE
+};
+
+struct afc_pipe
+{
+  struct afc_client *client;
+  struct
+  {
+    enum afc_pipe_kind kind;
+    int index;
+    size_t len;
+  } ops[AFC_WINDOW];
+  int head, count;
+  size_t bytes_ahead;
+};
+
+static int afc_pipe_full(const struct afc_pipe *pending)
+{
+  return pending->count == AFC_WINDOW || pending->bytes_ahead >= AFC_BYTES_AHEAD;
+}
+
+/* Records a request that `sent` (the afc_send_* result) put on the wire. */
+static int afc_pipe_push(struct afc_pipe *pending, int sent, enum afc_pipe_kind kind, int index, size_t len)
+{
+  if (sent != 0) {
+    return -1;
+  }
+  int slot = (pending->head + pending->count) % AFC_WINDOW;
+  pending->ops[slot].kind = kind;
+  pending->ops[slot].index = index;
+  pending->ops[slot].len = len;
+  pending->count++;
+  pending->bytes_ahead += len;
+  return 0;
+}
+
+/* Reply to the oldest request; `kind` and `index` say which one it was. */
+static int afc_pipe_recv(struct afc_pipe *pending, struct afc_reply *reply, enum afc_pipe_kind *kind, int *index)
+{
+  if (pending->count == 0 || afc_recv(pending->client, reply) != 0) {
+    return -1;
+  }
+  *kind = pending->ops[pending->head].kind;
+  *index = pending->ops[pending->head].index;
+  pending->bytes_ahead -= pending->ops[pending->head].len;
+  pending->head = (pending->head + 1) % AFC_WINDOW;
+  pending->count--;
+  return 0;
+}
+
+static int afc_reply_ok(const struct afc_reply *reply)
+{
+  return !(reply->op == AFC_OP_STATUS && reply->status != AFC_STATUS_SUCCESS);
+}
+
+/* Entry names of `path`, "." and ".." included, as one allocation; NULL terminated. */
+static char **native_read_dir(struct afc_client *client, const char *path, int *count)
+{
+  struct afc_reply reply;
+  if (afc_send_read_dir(client, path) != 0 || afc_recv(client, &reply) != 0 || reply.op != AFC_OP_DATA) {
+    return NULL;
+  }
+  size_t offset = 0;
+  int n = 0;
+  while (afc_reply_next(&reply, &offset) != NULL) n++;
+
+  char **names = malloc((n + 1) * sizeof(char *) + reply.data_len + 1);
+  char *data = (char *)(names + n + 1);
+  memcpy(data, reply.data, reply.data_len);
+  data[reply.data_len] = '\0';
+  for (offset = 0, n = 0; offset < reply.data_len; n++) {
+    names[n] = data + offset;
+    offset += strlen(names[n]) + 1;
+  }
+  names[n] = NULL;
+  *count = n;
+  return names;
+}
+
+/* st_ifmt, st_size, ... of a GET_FILE_INFO reply, as AFCKeyValueRead would give them. */
+static CFMutableDictionaryRef native_file_dict(const struct afc_reply *reply)
+{
+  CFMutableDictionaryRef file_dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                               &kCFTypeDictionaryKeyCallBacks,
+                                                               &kCFTypeDictionaryValueCallBacks);
+  size_t offset = 0;
+  const char *key, *value;
+  while ((key = afc_reply_next(reply, &offset)) != NULL && (value = afc_reply_next(reply, &offset)) != NULL) {
+    CFStringRef k = CSTR2CFSTR(key);
+    CFStringRef v = CSTR2CFSTR(value);
+    CFDictionarySetValue(file_dict, k, v);
+    CFRelease(k);
+    CFRelease(v);
+  }
+  return file_dict;
+}
+
+/* st_ifmt and st_size straight from the reply, for cp. */
+static void native_file_stat(const struct afc_reply *reply, struct afc_stat *st)
+{
+  size_t offset = 0;
+  const char *key, *value;
+  memset(st, 0, sizeof(*st));
+  while ((key = afc_reply_next(reply, &offset)) != NULL && (value = afc_reply_next(reply, &offset)) != NULL) {
+    if (strcmp(key, "st_ifmt") == 0) {
+      st->is_dir = strcmp(value, "S_IFDIR") == 0;
+      st->is_link = strcmp(value, "S_IFLNK") == 0;
+    } else if (strcmp(key, "st_size") == 0) {
+      st->size = strtoull(value, NULL, 10);
+    }
+  }
+}
+/************************************************************************************************/
+/* Notification */
+static void on_device_notification(struct am_device_notification_callback_info *info, void *arg)
+{
+  switch (info->msg) {
+  case ADNCI_MSG_CONNECTED:
+    if (trace_enabled) {
+      char udid[64];
+      copy_udid(info->dev, udid, sizeof(udid));
+      trace_instant("device", "attach", udid);
+    }
+    if (idbd.enabled || command.udid_count || command.all_devices) {
+      if (!idbd.enabled && !device_selected(info->dev)) break;
+      attach_device(info->dev);
+      if (start_session(info->dev) != 0) {
+        idb_eprintf("idbd: cannot start session on attached device\n");
+      }
+    } else {
+      on_device_connected(info->dev);
+    }
+    break;
+  case ADNCI_MSG_DISCONNECTED:
+    detach_device(info->dev);
+    break;
+    default:
+      break;
+  }
+}
+int run_command(AMDeviceRef device)
+{
+  if (command.type == PRINT_UDID) {
+    return print_udid(device);
+  } else if (command.type == PRINT_INFO) {
+    return print_info(device);
+  } else if (command.type == PRINT_APPS) {
+    return print_apps(device);
+  } else if (command.type == PRINT_SYSLOG) {
+    return print_syslog(device);
+  } else if (command.type == INSTALL) {
+    return install(device);
+  } else if (command.type == UNINSTLL) {
+    return uninstall(device);
+  } else if (command.type == TUNNEL) {
+    return create_tunnel(device);
+  } else if (command.type == APP_DIR) {
+    return app_dir(device);
+  } else if (command.type == COPY_DIR) {
+    return copy_dir(device);
+  } else if (command.type == UP_DIR) {
+    return up_dir(device);
+  } else if (command.type == FIND) {
+    return find_dir(device);
+  } else if (command.type == MOVE) {
+    return move_path(device);
+  } else if (command.type == LINK) {
+    return link_path(device);
+  } else if (command.type == REMOVE) {
+    return remove_path(device);
+  } else if (command.type == CAT) {
+    return cat_file(device);
+  } else if (command.type == VERIFY) {
+    return verify_dir(device);
+  } else if (command.type == CRASHES) {
+    return crash_reports(device);
+  } else if (command.type == SCREENSHOT) {
+    return screenshot(device);
+  } else if (command.type == BATCH) {
+    return run_batch(device);
+  }
+  return 1;
+}
+static void on_device_connected(AMDeviceRef device)
+{
+  unregister_notification(run_command(device));
+}
+
+void create_user()
+{
+  uid_t uid;
+  struct passwd *pwd;
+  struct group *grp ;
+
+  uid = getuid();
+  pwd = getpwuid(uid);
+  grp = getgrgid( pwd->pw_gid );
+
+  user.pwd = pwd;
+  user.grp = grp;
+}
+/************************************************************************************************/
+/* Command Logic */
+
+/************************************************
+ cache
+************************************************/
+/*
+  Device results that are slow to fetch are kept as binary plists in
+  ~/.idb/cache/<udid>/<name>. info.plist holds the phone number, IMSI and
+  ICCID, so the cache is readable by its owner only: directories 0700,
+  files 0600.
+*/
+static void make_cache_dir(const char *path)
+{
+  struct stat st;
+  if (mkdir(path, 0700) != 0 && stat(path, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 077)) {
+    chmod(path, 0700);          /* left 0755 by an earlier idb */
+  }
+}
+
+/* ~/.idb/cache/<subdir>, created if needed. */
+char *cache_dir(const char *subdir)
+{
+  const char *home = getenv("HOME");
+
+  if (home == NULL) {
+    struct passwd *pwd = getpwuid(getuid());
+    home = (pwd != NULL) ? pwd->pw_dir : "/tmp";
+  }
+  char *root = file_join(home, ".idb");
+  char *cache = file_join(root, "cache");
+  char *dir = file_join(cache, subdir);
+  make_dir(root);
+  make_cache_dir(cache);
+  make_cache_dir(dir);
+  free(cache);
+  free(root);
+  return dir;
+}
+
+char *cache_path(AMDeviceRef device, const char *name)
+{
+  char udid[64];
+
+  copy_udid(device, udid, sizeof(udid));
+  if (udid[0] == '\0') {
+    return NULL;
+  }
+  char *dir = cache_dir(udid);
+  char *path = file_join(dir, name);
+  free(dir);
+  return path;
+}
+
+/* Returns the plist stored at `path` if it is at most `ttl` seconds old. */
+CFPropertyListRef cache_load(const char *path, long ttl)
+{
+  struct stat st;
+  if (path == NULL || stat(path, &st) != 0 || time(NULL) - st.st_mtime > ttl) {
+    return NULL;
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  UInt8 *buf = malloc(st.st_size > 0 ? st.st_size : 1);
+  size_t len = fread(buf, 1, st.st_size, file);
+  fclose(file);
+
+  CFDataRef data = CFDataCreate(NULL, buf, len);
+  free(buf);
+  CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+  CFRelease(data);
+  return plist;
+}
+
+static int cache_store_bytes(const char *path, const UInt8 *bytes, size_t len)
+{
+  /* write then rename so concurrent readers never see half a file */
+  char *tmp = str_join(path, ".tmp");
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  FILE *file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+  int ret = -1;
+  if (file == NULL && fd >= 0) {
+    close(fd);
+  }
+  if (file != NULL) {
+    fchmod(fd, 0600);           /* an old .tmp keeps its mode through O_TRUNC */
+    ret = (fwrite(bytes, 1, len, file) == len) ? 0 : -1;
+    if (fclose(file) != 0 || ret != 0 || rename(tmp, path) != 0) {
+      unlink(tmp);
+      ret = -1;
+    }
+  }
+  free(tmp);
+  return ret;
+}
+
+int cache_store(const char *path, CFPropertyListRef plist)
+{
+  if (path == NULL) {
+    return -1;
+  }
+  CFDataRef data = CFPropertyListCreateData(NULL, plist, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+  if (data == NULL) {
+    return -1;
+  }
+  int ret = cache_store_bytes(path, CFDataGetBytePtr(data), CFDataGetLength(data));
+  CFRelease(data);
+  return ret;
+}
+
+/*
+  A device result, a dictionary. A fresh cache file is mapped and read in
+  place through bplist.h. Otherwise it is the CF dictionary MobileDevice
+  already built for the answer, read directly: encoding it only to parse
+  it again would cost more than the CF objects it saves.
+*/
+struct plist_bytes
+{
+  struct bplist pl;
+  struct bplist_obj root;       /* the dictionary, unless cf is set */
+  void *map;
+  size_t map_len;
+  CFDictionaryRef cf;           /* the device's answer on a cache miss */
+};
+
+static int plist_bytes_open(struct plist_bytes *bytes, const void *data, size_t len)
+{
+  if (bplist_open(&bytes->pl, data, len) != 0 || bplist_root(&bytes->pl, &bytes->root) != 0 ||
+      bytes->root.type != BPLIST_DICT) {
+    return -1;
+  }
+  return 0;
+}
+
+void plist_bytes_free(struct plist_bytes *bytes)
+{
+  if (bytes->map != NULL) {
+    munmap(bytes->map, bytes->map_len);
+  }
+  if (bytes->cf != NULL) {
+    CFRelease(bytes->cf);
+  }
+  memset(bytes, 0, sizeof(*bytes));
+}
+
+/* Maps the cache file at `path` if it is at most `ttl` seconds old. */
+int cache_map(const char *path, long ttl, struct plist_bytes *bytes)
+{
+  struct stat st;
+  int fd;
+
+  memset(bytes, 0, sizeof(*bytes));
+  if (path == NULL || stat(path, &st) != 0 || time(NULL) - st.st_mtime > ttl || st.st_size == 0 ||
+      (fd = open(path, O_RDONLY)) < 0) {
+    return -1;
+  }
+  bytes->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes->map == MAP_FAILED) {
+    bytes->map = NULL;
+    return -1;
+  }
+  bytes->map_len = st.st_size;
+  if (plist_bytes_open(bytes, bytes->map, bytes->map_len) != 0) {
+    plist_bytes_free(bytes);
+    return -1;
+  }
+  return 0;
+}
+
+/* Takes over `plist`, the device's answer; stores it at `path` when given. */
+int plist_bytes_from_cf(CFPropertyListRef plist, const char *path, struct plist_bytes *bytes)
+{
+  memset(bytes, 0, sizeof(*bytes));
+  if (CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+    CFRelease(plist);
+    return -1;
+  }
+  if (path != NULL) {
+    cache_store(path, plist);
+  }
+  bytes->cf = plist;
+  return 0;
+}
+
+/* The value of `key` in a CF result; NULL if it has none. */
+static CFTypeRef plist_bytes_cf_get(CFDictionaryRef dict, const char *key)
+{
+  CFStringRef cf_key = CSTR2CFSTR(key);
+  CFTypeRef value = CFDictionaryGetValue(dict, cf_key);
+  CFRelease(cf_key);
+  return value;
+}
+
+void cache_remove(AMDeviceRef device, const char *name)
+{
+  char *path = cache_path(device, name);
+  if (path != NULL) {
+    unlink(path);
+    free(path);
+  }
+}
+
+static void format_append(char **str, size_t *len, const char *add);
+
+/* Human readable form of any property list value, as format_plist_value()
+   gives it for the same value read in place; the caller frees it. */
+static char *format_value_depth(CFTypeRef value, int depth)
+{
+  CFTypeID type = CFGetTypeID(value);
+  char *str;
+
+  if (type == CFStringGetTypeID()) {
+    CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(value), kCFStringEncodingUTF8) + 1;
+    str = malloc(size);
+    if (!CFStringGetCString(value, str, size, kCFStringEncodingUTF8)) str[0] = '\0';
+  } else if (type == CFBooleanGetTypeID()) {
+    str = strdup(CFBooleanGetValue(value) ? "true" : "false");
+  } else if (type == CFNumberGetTypeID()) {
+    str = malloc(32);
+    if (CFNumberIsFloatType(value)) {
+      double d;
+      CFNumberGetValue(value, kCFNumberDoubleType, &d);
+      snprintf(str, 32, "%g", d);
+    } else {
+      long long n;
+      CFNumberGetValue(value, kCFNumberLongLongType, &n);
+      snprintf(str, 32, "%lld", n);
+    }
+  } else if (type == CFDataGetTypeID()) {
+    CFIndex i, len = CFDataGetLength(value);
+    const UInt8 *bytes = CFDataGetBytePtr(value);
+    str = malloc(len * 2 + 1);
+    for (i = 0; i < len; i++) {
+      sprintf(str + i * 2, "%02x", bytes[i]);
+    }
+    str[len * 2] = '\0';
+  } else if (type == CFDateGetTypeID()) {
+    time_t t = (time_t)CFDateGetAbsoluteTime(value) + 978307200;  /* 2001-01-01 in Unix time */
+    struct tm tm;
+    str = malloc(32);
+    gmtime_r(&t, &tm);
+    strftime(str, 32, "%Y-%m-%d %H:%M:%S +0000", &tm);
+  } else if (type == CFArrayGetTypeID() || type == CFDictionaryGetTypeID()) {
+    int is_dict = (type == CFDictionaryGetTypeID());
+    size_t len = 0;
+    CFIndex i, count = is_dict ? CFDictionaryGetCount(value) : CFArrayGetCount(value);
+    if (depth > 8) {
+      return strdup("...");
+    }
+    const void **keys = malloc((count ? count : 1) * sizeof(*keys));
+    const void **values = malloc((count ? count : 1) * sizeof(*values));
+    if (is_dict) {
+      CFDictionaryGetKeysAndValues(value, keys, values);
+    } else {
+      CFArrayGetValues(value, CFRangeMake(0, count), values);
+    }
+    str = NULL;
+    format_append(&str, &len, is_dict ? "{" : "(");
+    for (i = 0; i < count; i++) {
+      if (is_dict) {
+        char *k = format_value_depth(keys[i], depth + 1);
+        format_append(&str, &len, k);
+        format_append(&str, &len, " = ");
+        free(k);
+      } else if (i > 0) {
+        format_append(&str, &len, ", ");
+      }
+      char *v = format_value_depth(values[i], depth + 1);
+      format_append(&str, &len, v);
+      free(v);
+      if (is_dict) format_append(&str, &len, "; ");
+    }
+    format_append(&str, &len, is_dict ? "}" : ")");
+    free(values);
+    free(keys);
+  } else {
+    CFStringRef desc = CFCopyDescription(value);
+    str = format_value_depth(desc, depth);
+    CFRelease(desc);
+  }
+  return str;
+}
+
+char *format_value(CFTypeRef value)
+{
+  return format_value_depth(value, 0);
+}
+
+static void format_append(char **str, size_t *len, const char *add)
+{
+  size_t n = strlen(add);
+  *str = realloc(*str, *len + n + 1);
+  memcpy(*str + *len, add, n + 1);
+  *len += n;
+}
+
+/* format_value() for a value read in place; containers come out as
+   "(a, b)" and "{k = v; }", at most a few levels deep. */
+static char *format_plist_depth(const struct bplist *pl, const struct bplist_obj *obj, int depth)
+{
+  char *str = NULL;
+  size_t len = 0;
+  uint64_t i;
+
+  switch (obj->type) {
+  case BPLIST_STRING:
+    return bplist_strdup(obj);
+  case BPLIST_BOOL:
+    return strdup(bplist_bool(obj) ? "true" : "false");
+  case BPLIST_INT:
+    str = malloc(32);
+    snprintf(str, 32, "%lld", (long long)bplist_int(obj));
+    return str;
+  case BPLIST_REAL:
+    str = malloc(32);
+    snprintf(str, 32, "%g", bplist_real(obj));
+    return str;
+  case BPLIST_DATE: {
+    time_t t = (time_t)bplist_real(obj) + 978307200;  /* 2001-01-01 in Unix time */
+    struct tm tm;
+    str = malloc(32);
+    gmtime_r(&t, &tm);
+    strftime(str, 32, "%Y-%m-%d %H:%M:%S +0000", &tm);
+    return str;
+  }
+  case BPLIST_DATA:
+    str = malloc(obj->count * 2 + 1);
+    for (i = 0; i < obj->count; i++) {
+      sprintf(str + i * 2, "%02x", obj->body[i]);
+    }
+    str[obj->count * 2] = '\0';
+    return str;
+  case BPLIST_ARRAY:
+  case BPLIST_SET:
+  case BPLIST_DICT:
+    /* hostile data may nest forever or refer back to itself */
+    if (depth > 8) {
+      return strdup("...");
+    }
+    format_append(&str, &len, obj->type == BPLIST_DICT ? "{" : "(");
+    for (i = 0; i < obj->count; i++) {
+      struct bplist_obj key, value;
+      int ret = (obj->type == BPLIST_DICT) ? bplist_dict_entry(pl, obj, i, &key, &value)
+                                           : bplist_array_get(pl, obj, i, &value);
+      if (ret != 0) break;
+      if (obj->type == BPLIST_DICT) {
+        char *k = format_plist_depth(pl, &key, depth + 1);
+        format_append(&str, &len, k);
+        format_append(&str, &len, " = ");
+        free(k);
+      } else if (i > 0) {
+        format_append(&str, &len, ", ");
+      }
+      char *v = format_plist_depth(pl, &value, depth + 1);
+      format_append(&str, &len, v);
+      free(v);
+      if (obj->type == BPLIST_DICT) format_append(&str, &len, "; ");
+    }
+    format_append(&str, &len, obj->type == BPLIST_DICT ? "}" : ")");
+    return str;
+  default:
+    return strdup("");
+  }
+}
+
+char *format_plist_value(const struct bplist *pl, const struct bplist_obj *obj)
+{
+  return format_plist_depth(pl, obj, 0);
+}
+
+/* The --json form of a value read in place: typed, containers nested, dates
+   in ISO 8601 and data as hex like format_plist_value(). */
+static void json_plist_depth(struct json_writer *w, const char *key, const struct bplist *pl,
+                             const struct bplist_obj *obj, int depth)
+{
+  size_t len;
+  uint64_t i;
+
+  switch (obj->type) {
+  case BPLIST_STRING: {
+    const char *ascii = bplist_ascii(obj, &len);
+    if (ascii != NULL) {
+      json_stringn(w, key, ascii, len);
+    } else {
+      char *str = bplist_strdup(obj);
+      json_string(w, key, str);
+      free(str);
+    }
+    break;
+  }
+  case BPLIST_BOOL:
+    json_bool(w, key, bplist_bool(obj));
+    break;
+  case BPLIST_INT:
+  case BPLIST_UID:
+    json_int(w, key, (long long)bplist_int(obj));
+    break;
+  case BPLIST_REAL:
+    json_double(w, key, bplist_real(obj));
+    break;
+  case BPLIST_DATE: {
+    time_t t = (time_t)bplist_real(obj) + 978307200;  /* 2001-01-01 in Unix time */
+    struct tm tm;
+    char str[32];
+    gmtime_r(&t, &tm);
+    strftime(str, sizeof(str), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    json_string(w, key, str);
+    break;
+  }
+  case BPLIST_DATA: {
+    char *str = format_plist_depth(pl, obj, depth);
+    json_string(w, key, str);
+    free(str);
+    break;
+  }
+  case BPLIST_NULL:
+    json_null(w, key);
+    break;
+  case BPLIST_ARRAY:
+  case BPLIST_SET:
+  case BPLIST_DICT:
+    if (depth > 8) {
+      json_null(w, key);
+      break;
+    }
+    json_open(w, key, obj->type == BPLIST_DICT ? '{' : '[');
+    for (i = 0; i < obj->count; i++) {
+      struct bplist_obj k, value;
+      if (obj->type != BPLIST_DICT) {
+        if (bplist_array_get(pl, obj, i, &value) != 0) break;
+        json_plist_depth(w, NULL, pl, &value, depth + 1);
+      } else {
+        if (bplist_dict_entry(pl, obj, i, &k, &value) != 0) break;
+        char *name = format_plist_depth(pl, &k, depth + 1);
+        json_plist_depth(w, name, pl, &value, depth + 1);
+        free(name);
+      }
+    }
+    json_close(w, obj->type == BPLIST_DICT ? '}' : ']');
+    break;
+  }
+}
+
+/* json_plist_depth() for a CF value. */
+static void json_value_depth(struct json_writer *w, const char *key, CFTypeRef value, int depth)
+{
+  CFTypeID type = CFGetTypeID(value);
+
+  if (type == CFBooleanGetTypeID()) {
+    json_bool(w, key, CFBooleanGetValue(value));
+  } else if (type == CFNumberGetTypeID()) {
+    if (CFNumberIsFloatType(value)) {
+      double d;
+      CFNumberGetValue(value, kCFNumberDoubleType, &d);
+      json_double(w, key, d);
+    } else {
+      long long n;
+      CFNumberGetValue(value, kCFNumberLongLongType, &n);
+      json_int(w, key, n);
+    }
+  } else if (type == CFDateGetTypeID()) {
+    time_t t = (time_t)CFDateGetAbsoluteTime(value) + 978307200;  /* 2001-01-01 in Unix time */
+    struct tm tm;
+    char str[32];
+    gmtime_r(&t, &tm);
+    strftime(str, sizeof(str), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    json_string(w, key, str);
+  } else if (type == CFNullGetTypeID()) {
+    json_null(w, key);
+  } else if (type == CFArrayGetTypeID() || type == CFDictionaryGetTypeID()) {
+    int is_dict = (type == CFDictionaryGetTypeID());
+    CFIndex i, count = is_dict ? CFDictionaryGetCount(value) : CFArrayGetCount(value);
+    if (depth > 8) {
+      json_null(w, key);
+      return;
+    }
+    const void **keys = malloc((count ? count : 1) * sizeof(*keys));
+    const void **values = malloc((count ? count : 1) * sizeof(*values));
+    if (is_dict) {
+      CFDictionaryGetKeysAndValues(value, keys, values);
+    } else {
+      CFArrayGetValues(value, CFRangeMake(0, count), values);
+    }
+    json_open(w, key, is_dict ? '{' : '[');
+    for (i = 0; i < count; i++) {
+      char *name = is_dict ? format_value_depth(keys[i], depth + 1) : NULL;
+      json_value_depth(w, name, values[i], depth + 1);
+      free(name);
+    }
+    json_close(w, is_dict ? '}' : ']');
+    free(values);
+    free(keys);
+  } else {
+    /* strings, and data as hex like format_value() */
+    char *str = format_value_depth(value, depth);
+    json_string(w, key, str);
+    free(str);
+  }
+}
+
+/************************************************
+ idb udid
+************************************************/
+int print_udid(AMDeviceRef device)
+{
+  char *udid = CFSTR2CSTR(AMDeviceCopyDeviceIdentifier(device));
+  if (udid == NULL)
+  {
+    return 1;
+  }
+  idb_printf("%s\n", udid);
+  return 0;
+}
+/************************************************
+ idb info
+************************************************/
+static const char *info_keys[] = {
+  "BasebandStatus", "BasebandVersion", "BluetoothAddress",
+  "BuildVersion",
+  "CPUArchitecture", "DeviceClass", "DeviceColor", "DeviceName", "FirmwareVersion",
+  "HardwareModel", "HardwarePlatform", "IntegratedCircuitCardIdentity",
+  "InternationalMobileSubscriberIdentity", "MLBSerialNumber",
+  "MobileSubscriberCountryCode", "MobileSubscriberNetworkCode", "ModelNumber", "PhoneNumber",
+  "ProductType", "ProductVersion", "ProtocolVersion",
+  "RegionInfo", "SerialNumber", "SIMStatus",
+  "TimeZone", "UniqueDeviceID", "WiFiAddress",
+};
+
+/* Every lockdown value in one round trip (NULL key), through the cache when asked. */
+int load_device_values(AMDeviceRef device, struct plist_bytes *values)
+{
+  char *path = (command.cache_ttl >= 0) ? cache_path(device, "info.plist") : NULL;
+  int ret = -1;
+
+  if (path != NULL) {
+    ret = cache_map(path, command.cache_ttl, values);
+  }
+  if (ret != 0) {
+    CFTypeRef cf_values = (connect_device(device) == 0) ? AMDeviceCopyValue(device, 0, NULL) : NULL;
+    if (cf_values != NULL) {
+      ret = plist_bytes_from_cf(cf_values, path, values);
+    }
+  }
+  free(path);
+  return ret;
+}
+
+static void print_info_value(struct plist_bytes *values, const char *key)
+{
+  struct bplist_obj value;
+  CFTypeRef cf_value = NULL;
+  if (values->cf != NULL ? (cf_value = plist_bytes_cf_get(values->cf, key)) == NULL
+                         : bplist_dict_get(&values->pl, &values->root, key, &value) != 0) {
+    return;
+  }
+  if (command.json) {
+    struct json_writer *w = json_record();
+    json_string(w, "key", key);
+    if (cf_value != NULL) {
+      json_value_depth(w, "value", cf_value, 0);
+    } else {
+      json_plist_depth(w, "value", &values->pl, &value, 0);
+    }
+    json_end(w);
+  } else {
+    char *str = (cf_value != NULL) ? format_value(cf_value) : format_plist_value(&values->pl, &value);
+    idb_printf("%-40s\t%s\n", key, str);
+    free(str);
+  }
+}
+
+int print_info(AMDeviceRef device)
+{
+  struct plist_bytes values;
+  int i;
+
+  if (load_device_values(device, &values) != 0) {
+    idb_eprintf("AMDeviceCopyValue failed\n");
+    return 1;
+  }
+
+  if (!command.json) {
+    idb_printf ("%s\n","[INFO]");
+  }
+  if (command.path_count > 0) {
+    for (i = 0; i < command.path_count; i++) {
+      print_info_value(&values, command.paths[i]);
+    }
+  } else {
+    for (i = 0; i < (int)(sizeof(info_keys) / sizeof(info_keys[0])); i++) {
+      print_info_value(&values, info_keys[i]);
+    }
+  }
+  plist_bytes_free(&values);
+  return 0;
+}
+/************************************************
+ idb apps
+************************************************/
+struct app_entry
+{
+  const char *bundle_id;        /* in the plist buffer when it is ASCII */
+  size_t len;
+  char *copy;                   /* else converted */
+  struct bplist_obj app;
+  CFDictionaryRef cf_app;       /* instead of app for a CF result */
+};
+
+/* `key` of one app, in *value or, for a CF result, in *cf_value. */
+static int app_get(const struct plist_bytes *apps, const struct app_entry *e, const char *key,
+                   struct bplist_obj *value, CFTypeRef *cf_value)
+{
+  if (e->cf_app != NULL) {
+    *cf_value = plist_bytes_cf_get(e->cf_app, key);
+    return (*cf_value != NULL) ? 0 : -1;
+  }
+  *cf_value = NULL;
+  return bplist_dict_get(&apps->pl, &e->app, key, value);
+}
+
+/* The printed form of `key`, "-" when the app has none; the caller frees it. */
+static char *app_string(const struct plist_bytes *apps, const struct app_entry *e, const char *key)
+{
+  struct bplist_obj value;
+  CFTypeRef cf_value;
+  if (app_get(apps, e, key, &value, &cf_value) != 0) {
+    return strdup("-");
+  }
+  return (cf_value != NULL) ? format_value(cf_value) : format_plist_value(&apps->pl, &value);
+}
+
+static int app_is_user(const struct plist_bytes *apps, const struct app_entry *e)
+{
+  struct bplist_obj value;
+  CFTypeRef cf_value;
+  if (app_get(apps, e, "ApplicationType", &value, &cf_value) != 0) {
+    return 1;
+  }
+  if (cf_value != NULL) {
+    return CFGetTypeID(cf_value) == CFStringGetTypeID() &&
+      CFStringCompare(cf_value, CFSTR("User"), 0) == kCFCompareEqualTo;
+  }
+  return bplist_string_equal(&value, "User");
+}
+
+/* The apps of a result in the order the device sent them; *n is set. */
+static struct app_entry *app_entries(struct plist_bytes *apps, uint64_t *n)
+{
+  uint64_t i, count = (apps->cf != NULL) ? (uint64_t)CFDictionaryGetCount(apps->cf) : apps->root.count;
+  struct app_entry *entries = calloc(count ? count : 1, sizeof(*entries));
+
+  *n = 0;
+  if (apps->cf != NULL) {
+    const void **keys = malloc((count ? count : 1) * sizeof(*keys));
+    const void **values = malloc((count ? count : 1) * sizeof(*values));
+    CFDictionaryGetKeysAndValues(apps->cf, keys, values);
+    for (i = 0; i < count; i++) {
+      struct app_entry *e = &entries[*n];
+      if (CFGetTypeID(keys[i]) != CFStringGetTypeID() || CFGetTypeID(values[i]) != CFDictionaryGetTypeID()) {
+        continue;
+      }
+      e->bundle_id = e->copy = format_value(keys[i]);
+      e->len = strlen(e->copy);
+      e->cf_app = values[i];
+      (*n)++;
+    }
+    free(values);
+    free(keys);
+    return entries;
+  }
+  for (i = 0; i < count; i++) {
+    struct bplist_obj key;
+    struct app_entry *e = &entries[*n];
+    if (bplist_dict_entry(&apps->pl, &apps->root, i, &key, &e->app) != 0 || key.type != BPLIST_STRING ||
+        e->app.type != BPLIST_DICT) {
+      continue;
+    }
+    if ((e->bundle_id = bplist_ascii(&key, &e->len)) == NULL) {
+      e->bundle_id = e->copy = bplist_strdup(&key);
+      e->len = strlen(e->copy);
+    }
+    (*n)++;
+  }
+  return entries;
+}
+
+static void free_app_entries(struct app_entry *entries, uint64_t n)
+{
+  uint64_t i;
+  for (i = 0; i < n; i++) {
+    free(entries[i].copy);
+  }
+  free(entries);
+}
+
+static void on_app(const struct plist_bytes *apps, const struct app_entry *e)
+{
+  /*
+    ApplicationType (System or User)
+    CFBundleDisplayName
+    CFBundleName
+
+    CFBundleInfoDictionaryVersion: 6.0
+    Entitlements: <CFBasicHash>
+    DTPlatformVersion: 5.1
+    DTSDKName: iphoneos5.1
+    CFBundleName: name
+    ApplicationType: User
+    Container: /private/var/mobile/Applications/<UDID>
+    LSRequiresIPhoneOS: <CFBoolean>
+    CFBundleDisplayName: * include multibyte
+    CodeInfoIdentifier:
+    CFBundleDocumentTypes:
+    DTSDKBuild: 9B176
+    CFBundleSupportedPlatforms: ( iPhoneOS )
+    UISupportedInterfaceOrientations: UIInterfaceOrientationPortrait
+    BuildMachineOSBuild: 11G63
+    SignerIdentity: Apple iPhone OS Application Signing
+    CFBundlePackageType: APPL
+    EnvironmentVariables: <CFBasicHash>
+    CFBundleDevelopmentRegion: ja_JP
     UIPrerenderedIcon: <CFBoolean>
     CFBundleVersion: 1.1
     DTXcodeBuild: 4E2002
@@ -377,598 +2182,4120 @@ static void on_app(const void *key, const void *value, void *context)
           aaa
         );
       }
-    )
+    )
+
+  */
+  if (!app_is_user(apps, e)) {
+    return;
+  }
+  char *app_name_cstr      = app_string(apps, e, "CFBundleDisplayName");
+  char *app_container_cstr = app_string(apps, e, "Container");
+
+  idb_printf ("%-20s\t%s\t %.*s\n",app_name_cstr, app_container_cstr, (int)e->len, e->bundle_id);
+  free(app_name_cstr);
+  free(app_container_cstr);
+}
+static void json_app_field(struct json_writer *w, const char *name, const struct plist_bytes *apps,
+                           const struct app_entry *e, const char *key)
+{
+  struct bplist_obj value;
+  CFTypeRef cf_value;
+  if (app_get(apps, e, key, &value, &cf_value) != 0) {
+    json_null(w, name);
+  } else if (cf_value != NULL) {
+    json_value_depth(w, name, cf_value, 0);
+  } else {
+    json_plist_depth(w, name, &apps->pl, &value, 0);
+  }
+}
+/* apps --json: one record per app in the order the device sent them. */
+static void json_apps(struct plist_bytes *apps)
+{
+  uint64_t i, n;
+  struct app_entry *entries = app_entries(apps, &n);
+  for (i = 0; i < n; i++) {
+    if (!app_is_user(apps, &entries[i])) {
+      continue;
+    }
+    struct json_writer *w = json_record();
+    json_stringn(w, "bundle_id", entries[i].bundle_id, entries[i].len);
+    json_app_field(w, "name", apps, &entries[i], "CFBundleDisplayName");
+    json_app_field(w, "container", apps, &entries[i], "Container");
+    json_end(w);
+  }
+  free_app_entries(entries, n);
+}
+/*
+  Bundle ids in the order the CF listing had (case insensitive, numbers by
+  value), without building CFStrings for them.
+*/
+static int compare_bundle_id(const void *a, const void *b)
+{
+  const struct app_entry *ea = a, *eb = b;
+  const char *x = ea->bundle_id, *x_end = x + ea->len;
+  const char *y = eb->bundle_id, *y_end = y + eb->len;
+
+  while (x < x_end && y < y_end) {
+    if (isdigit((unsigned char)*x) && isdigit((unsigned char)*y)) {
+      const char *xs, *ys;
+      while (x < x_end && *x == '0') x++;
+      while (y < y_end && *y == '0') y++;
+      for (xs = x; x < x_end && isdigit((unsigned char)*x); x++);
+      for (ys = y; y < y_end && isdigit((unsigned char)*y); y++);
+      if (x - xs != y - ys) return (x - xs) < (y - ys) ? -1 : 1;
+      int cmp = memcmp(xs, ys, x - xs);
+      if (cmp != 0) return cmp;
+      continue;
+    }
+    int cx = tolower((unsigned char)*x), cy = tolower((unsigned char)*y);
+    if (cx != cy) return cx - cy;
+    x++;
+    y++;
+  }
+  if (x < x_end || y < y_end) return (x < x_end) ? 1 : -1;
+  int cmp = memcmp(ea->bundle_id, eb->bundle_id, ea->len < eb->len ? ea->len : eb->len);
+  return cmp ? cmp : (ea->len > eb->len) - (ea->len < eb->len);
+}
+/*
+  Only user apps and only the attributes on_app prints; without options the
+  device sends the full Info.plist of every installed app.
+*/
+int load_user_apps(AMDeviceRef device, struct plist_bytes *apps)
+{
+  char *path = (command.cache_ttl >= 0) ? cache_path(device, "apps.plist") : NULL;
+  int ret = -1;
+
+  if (path != NULL) {
+    ret = cache_map(path, command.cache_ttl, apps);
+  }
+  if (ret != 0) {
+    const void *attrs[] = { CFSTR("CFBundleIdentifier"), CFSTR("CFBundleDisplayName"),
+                            CFSTR("Container"), CFSTR("ApplicationType") };
+    CFArrayRef return_attrs = CFArrayCreate(NULL, attrs, sizeof(attrs) / sizeof(attrs[0]), &kCFTypeArrayCallBacks);
+    const void *k[] = { CFSTR("ReturnAttributes"), CFSTR("ApplicationType") };
+    const void *v[] = { return_attrs, CFSTR("User") };
+    CFDictionaryRef options = CFDictionaryCreate(NULL, k, v, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionaryRef cf_apps = NULL;
+
+    if (connect_device(device) == 0 && AMDeviceLookupApplications(device, options, &cf_apps) == 0 && cf_apps != NULL) {
+      ret = plist_bytes_from_cf(cf_apps, path, apps);
+    }
+    CFRelease(options);
+    CFRelease(return_attrs);
+  }
+  free(path);
+  return ret;
+}
+
+int print_apps(AMDeviceRef device)
+{
+  struct plist_bytes apps;
+  if (load_user_apps(device, &apps) != 0) {
+    idb_eprintf("AMDeviceLookupApplications failed\n");
+    return 1;
+  }
+  if (command.json) {
+    json_apps(&apps);
+    plist_bytes_free(&apps);
+    return 0;
+  }
+  uint64_t i, n;
+  struct app_entry *entries = app_entries(&apps, &n);
+
+  qsort(entries, n, sizeof(*entries), compare_bundle_id);
+  for (i = 0; i < n; i++) {
+    on_app(&apps, &entries[i]);
+  }
+  free_app_entries(entries, n);
+  plist_bytes_free(&apps);
+  return 0;
+}
+/************************************************
+ idb log
+************************************************/
+int print_syslog(AMDeviceRef device)
+{
+  unsigned int socket;          /*  (*afc_connection)  */
+  if (connect_service(device, AMSVC_SYSLOG_RELAY, &socket) != 0) {
+    return 1;
+  }
+
+  char c;
+  while(recv(socket, &c, 1, 0) == 1) {
+    if(c != 0)
+      idb_write(&c, 1);
+  }
+  return 0;
+}
+/************************************************
+ idb install 
+************************************************/
+static void print_progress(CFDictionaryRef dict, int base)
+{
+  int percent = 0;
+  char status[128] = "-";
+  CFStringRef cf_status = CFDictionaryGetValue(dict, CFSTR("Status"));
+  CFNumberRef cf_percent = CFDictionaryGetValue(dict, CFSTR("PercentComplete"));
+
+  if (cf_percent != NULL) {
+    CFNumberGetValue(cf_percent, kCFNumberSInt32Type, &percent);
+  }
+  if (cf_status != NULL) {
+    CFStringGetCString(cf_status, status, sizeof(status), kCFStringEncodingUTF8);
+  }
+  idb_printf("[%3d%%] %s\n", base + percent / 2, status);
+}
+static void on_transfer(CFDictionaryRef dict, int arg) {
+  print_progress(dict, 0);
+}
+static void on_install(CFDictionaryRef dict, int arg) {
+  print_progress(dict, 50);
+}
+
+/*
+  Everything about the package that does not depend on the device: the
+  resolved URL and the install options. For several devices the package
+  contents are also read once up front, so concurrent transfers hit the
+  page cache instead of each reading the build from disk; one device reads
+  an .app only while transferring it.
+
+  A package file (.ipa) is also hashed and transferred under the name
+  <sha256>.ipa, linked from a directory of this install's own under
+  ~/.idb/cache/staging, so the copy left in the device's PublicStaging is
+  content addressed and can be installed again without another transfer.
+  The link and its directory are removed with the stage.
+*/
+#define STAGE_LIMIT_MB 2048     /* per device, override with IDB_STAGE_LIMIT_MB */
+
+struct install_stage
+{
+  CFURLRef url;
+  CFDictionaryRef options;
+  unsigned long long bytes;
+  unsigned long files;
+  char staged_name[SHA256_DIGEST_LENGTH * 2 + 16];   /* empty when not content addressed */
+  char *link_dir;               /* ~/.idb/cache/staging/XXXXXX holding the <sha256>.ipa link */
+};
+
+static void stage_read(struct install_stage *stage, const char *path, char *buf, size_t size,
+                       struct sha256 *sha)
+{
+  struct stat st;
+  if (lstat(path, &st) != 0) return;
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    if (dir == NULL) return;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+      char *child = file_join(path, entry->d_name);
+      stage_read(stage, child, buf, size, NULL);
+      free(child);
+    }
+    closedir(dir);
+  } else if (S_ISREG(st.st_mode)) {
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+    if (fd < 0) return;
+    while ((n = read(fd, buf, size)) > 0) {
+      stage->bytes += n;
+      if (sha != NULL) {
+        sha256_update(sha, buf, n);
+      }
+    }
+    close(fd);
+    stage->files++;
+  }
+}
+
+/* `read_ahead`: read an .app tree now too (an .ipa is read to hash it anyway). */
+struct install_stage *stage_package(const char *app_path, int read_ahead)
+{
+  struct stat st;
+  if (stat(app_path, &st) != 0) {
+    idb_perror(app_path);
+    return NULL;
+  }
+
+  struct install_stage *stage = calloc(1, sizeof(*stage));
+  CFStringRef keys[] = { CFSTR("PackageType") }, values[] = { CFSTR("Developer") };
+  stage->options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+  struct sha256 sha;
+  sha256_init(&sha);
+  if (read_ahead || S_ISREG(st.st_mode)) {
+    size_t size = 1024 * 1024;
+    char *buf = malloc(size);
+    stage_read(stage, app_path, buf, size, S_ISREG(st.st_mode) ? &sha : NULL);
+    free(buf);
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    const char *ext = strrchr(app_path, '.');
+    sha256_final(&sha, digest);
+    sha256_hex(digest, hex);
+    snprintf(stage->staged_name, sizeof(stage->staged_name), "%s%s",
+             hex, (ext != NULL && strlen(ext) < 8 && strchr(ext, '/') == NULL) ? ext : "");
+
+    /* a directory per install: concurrent installs of the same package never share a link */
+    char *dir = cache_dir("staging");
+    char *link_dir = file_join(dir, "XXXXXX");
+    char *abs_path = realpath(app_path, NULL);
+    char *link_path = NULL;
+    if (abs_path != NULL && mkdtemp(link_dir) != NULL) {
+      stage->link_dir = link_dir;
+      link_path = file_join(link_dir, stage->staged_name);
+    } else {
+      free(link_dir);
+    }
+    if (link_path != NULL && (link(abs_path, link_path) == 0 || symlink(abs_path, link_path) == 0)) {
+      stage->url = get_absolute_file_url(link_path);
+    } else {
+      stage->staged_name[0] = '\0';
+    }
+    free(abs_path);
+    free(link_path);
+    free(dir);
+  }
+  if (stage->url == NULL) {
+    stage->url = get_absolute_file_url(app_path);
+  }
+  return stage;
+}
+
+static afc_connection *open_media_afc(AMDeviceRef device)
+{
+  service_conn_t socket;
+  afc_connection *afc_conn;
+
+  if (AMDeviceStartService(device, AMSVC_AFC, &socket, NULL) != 0 ||
+      AFCConnectionOpen(socket, 0, &afc_conn) != 0) {
+    return NULL;
+  }
+  return afc_conn;
+}
+
+/* Whether PublicStaging still holds the package from an earlier install. */
+static int staged_on_device(afc_connection *afc_conn, struct install_stage *stage)
+{
+  struct afc_stat st;
+  char *path = file_join("/PublicStaging", stage->staged_name);
+  int found = (afc_stat_path(afc_conn, path, &st) == 0 && !st.is_dir && st.size == stage->bytes);
+  free(path);
+  return found;
+}
+
+/*
+  Records the package in ~/.idb/cache/<udid>/staged.plist and removes the
+  least recently used staged packages once they add up to more than the limit.
+*/
+static void staged_record(AMDeviceRef device, afc_connection *afc_conn, struct install_stage *stage)
+{
+  char *path = cache_path(device, "staged.plist");
+  CFMutableDictionaryRef staged;
+  long long limit = (getenv("IDB_STAGE_LIMIT_MB") ? atoll(getenv("IDB_STAGE_LIMIT_MB")) : STAGE_LIMIT_MB) * 1024 * 1024;
+
+  CFDictionaryRef loaded = cache_load(path, LONG_MAX);
+  if (loaded != NULL && CFGetTypeID(loaded) == CFDictionaryGetTypeID()) {
+    staged = CFDictionaryCreateMutableCopy(NULL, 0, loaded);
+  } else {
+    staged = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  }
+  if (loaded != NULL) {
+    CFRelease(loaded);
+  }
+
+  long long size = (long long)stage->bytes, used = (long long)time(NULL);
+  CFNumberRef cf_size = CFNumberCreate(NULL, kCFNumberLongLongType, &size);
+  CFNumberRef cf_used = CFNumberCreate(NULL, kCFNumberLongLongType, &used);
+  const void *k[] = { CFSTR("Size"), CFSTR("Used") }, *v[] = { cf_size, cf_used };
+  CFDictionaryRef entry = CFDictionaryCreate(NULL, k, v, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFStringRef name = CSTR2CFSTR(stage->staged_name);
+  CFDictionarySetValue(staged, name, entry);
+  CFRelease(name);
+  CFRelease(entry);
+  CFRelease(cf_used);
+  CFRelease(cf_size);
+
+  for (;;) {
+    CFIndex i, count = CFDictionaryGetCount(staged);
+    const void *keys[count], *values[count];
+    long long total = 0, oldest_used = LLONG_MAX;
+    CFIndex oldest = -1;
+
+    CFDictionaryGetKeysAndValues(staged, keys, values);
+    for (i = 0; i < count; i++) {
+      CFNumberRef n;
+      long long entry_size = 0, entry_used = 0;
+      if (CFGetTypeID(values[i]) != CFDictionaryGetTypeID()) continue;
+      if ((n = CFDictionaryGetValue(values[i], CFSTR("Size"))) != NULL) CFNumberGetValue(n, kCFNumberLongLongType, &entry_size);
+      if ((n = CFDictionaryGetValue(values[i], CFSTR("Used"))) != NULL) CFNumberGetValue(n, kCFNumberLongLongType, &entry_used);
+      total += entry_size;
+      if (entry_used < oldest_used) {
+        oldest_used = entry_used;
+        oldest = i;
+      }
+    }
+    if (total <= limit || count <= 1 || oldest < 0) break;
+
+    char *evict = format_value(keys[oldest]);
+    char *remote = file_join("/PublicStaging", evict);
+    AFCRemovePath(afc_conn, remote);
+    idb_printf("Evicted staged package: %s\n", evict);
+    free(remote);
+    free(evict);
+    CFDictionaryRemoveValue(staged, keys[oldest]);
+  }
+
+  cache_store(path, staged);
+  CFRelease(staged);
+  free(path);
+}
+
+void release_stage(struct install_stage *stage)
+{
+  if (stage->link_dir != NULL) {
+    char *link_path = file_join(stage->link_dir, stage->staged_name);
+    unlink(link_path);
+    rmdir(stage->link_dir);
+    free(link_path);
+    free(stage->link_dir);
+  }
+  CFRelease(stage->url);
+  CFRelease(stage->options);
+  free(stage);
+}
+
+int install(AMDeviceRef device)
+{
+  struct install_stage *stage = command.stage;
+  int ret;
+
+  idb_printf("[%3d%%] Start: %s\n", 0, command.app_path);
+  if (stage == NULL && (stage = stage_package(command.app_path, 0)) == NULL) {
+    return 1;
+  }
+
+  /* Transfer, unless this exact package is still staged on the device */
+  ret = connect_device(device);
+  afc_connection *media = (ret == 0 && stage->staged_name[0] != '\0') ? open_media_afc(device) : NULL;
+  if (ret != 0) {
+    /* connect_device() said why */
+  } else if (media != NULL && staged_on_device(media, stage)) {
+    idb_printf("[%3d%%] Reusing staged package %s\n", 50, stage->staged_name);
+  } else if ((ret = AMDeviceSecureTransferPath(0, device, stage->url, stage->options, on_transfer, 0)) != 0) {
+    idb_eprintf("AMDeviceSecureTransferPath failed: %d\n", ret);
+  }
+  if (ret != 0) {
+    /* reported above */
+  } else if ((ret = AMDeviceSecureInstallApplication(0, device, stage->url, stage->options, on_install, 0)) != 0) {
+    idb_eprintf("AMDeviceSecureInstallApplication failed: %d\n", ret);
+  }
+
+  if (ret == 0 && media != NULL) {
+    staged_record(device, media, stage);
+  }
+  if (media != NULL) {
+    AFCConnectionClose(media);
+  }
+  if (stage != command.stage) {
+    release_stage(stage);
+  }
+  cache_remove(device, "apps.plist");
+  if (ret != 0) {
+    return 1;
+  }
+  idb_printf("[OK] Installed app: %s\n", command.app_path);
+  return 0;
+}
+
+/* Stages the package once, then installs on every device concurrently. */
+static int install_all(AMDeviceRef *list, int count)
+{
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  command.stage = stage_package(command.app_path, count > 1);
+  if (command.stage == NULL) {
+    return 1;
+  }
+  int status = fanout_each(list, count);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (command.stage->files > 0) {
+    idb_printf("%s: %lu files, %.1f MB on %d device%s in %.1fs\n", command.app_path,
+               command.stage->files, command.stage->bytes / (1024.0 * 1024.0), count,
+               count == 1 ? "" : "s",
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+  release_stage(command.stage);
+  command.stage = NULL;
+  return status;
+}
+
+/************************************************
+ idb uninstall
+************************************************/
+int uninstall(AMDeviceRef device)
+{
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  CFStringRef bundle_id = CSTR2CFSTR(command.bundle_id);
+  
+  mach_error_t result = AMDeviceSecureUninstallApplication(0,device, bundle_id, 0, NULL, 0);
+  if (result != 0)
+  {
+    idb_printf("AMDeviceSecureUnInstallApplication failed: %d\n", result);
+    return 1;
+  }
+  
+  cache_remove(device, "apps.plist");
+  idb_printf("Uninstalled bundle_id: %s\n", command.bundle_id);  
+  return 0;
+}
+/************************************************
+ idb dir 
+************************************************/
+/*
+  keys
+  - st_ifmt (S_IFDIR, S_IFLNK)
+  - st_nlink
+  - st_size
+  - st_blocks
+  - st_mtime
+  - st_birthtime
+*/
+static void on_file(char *file_name, CFMutableDictionaryRef file_dict)
+{
+
+  time_t std_time;
+  time(&std_time);
+  std_time -= (24 * 60 * 60 * LS_BORDER_DAY);
+
+//  CFShow(file_dict);
+  CFStringRef ifmt = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_ifmt"));
+  char *ifmt_cstr = (CFStringCompare(ifmt,CFSTR("S_IFDIR"), kCFCompareLocalized) == kCFCompareEqualTo) ? "d" : "-";
+
+  CFStringRef nlink = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_nlink"));
+  CFStringRef size = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_size"));
+  CFStringRef mtime = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_mtime"));
+  time_t mtimel = atoll(CFSTR2CSTR(mtime)) / 1000000000L;
+
+  struct tm *mtimetm = localtime(&mtimel);
+
+  char tmbuf[64];
+  if (std_time <= mtimel) {
+    strftime(tmbuf, sizeof tmbuf, "%b %d %H:%M", mtimetm);
+  } else {
+    strftime(tmbuf, sizeof tmbuf, "%b %d  %Y", mtimetm);
+  }
+
+
+  idb_printf ("%s---------%4s %s %6s %6s %s %s\n",
+          ifmt_cstr,
+          CFSTR2CSTR(nlink),    /* TOOD  */
+          user.pwd->pw_name,
+          user.grp->gr_name,
+          CFSTR2CSTR(size),
+          tmbuf,
+          file_name);
+}
+
+/*
+  ls --json: an AFC file info pair as a field of the entry's record, read
+  straight from the reply. st_ifmt becomes "type" (dir, file, link);
+  the other st_* values are numbers under their names without "st_"
+  (times in ns since the epoch). Unknown keys are kept as strings.
+*/
+static void json_file_field(struct json_writer *w, const char *key, const char *value)
+{
+  if (key == NULL || value == NULL) {
+    return;
+  }
+  if (strcmp(key, "st_ifmt") == 0) {
+    const char *type = strcmp(value, "S_IFDIR") == 0 ? "dir"
+                     : strcmp(value, "S_IFLNK") == 0 ? "link"
+                     : strcmp(value, "S_IFREG") == 0 ? "file" : value;
+    json_string(w, "type", type);
+  } else if (strncmp(key, "st_", 3) == 0 && isdigit((unsigned char)value[0])) {
+    json_int(w, key + 3, strtoll(value, NULL, 10));
+  } else {
+    json_string(w, key, value);
+  }
+}
+
+/* ls with IDB_AFC=native: the stats of all entries are in flight together. */
+static int app_dir_native(AMDeviceRef device)
+{
+  struct afc_pipe pending = { open_native_afc(device, command.bundle_id) };
+  if (pending.client == NULL) {
+    return 1;
+  }
+  int count, sent = 0, received = 0, ret = 0;
+  char **names = native_read_dir(pending.client, command.dir_path, &count);
+  if (names == NULL) {
+    idb_printf("%s doesn't exist \n", command.dir_path);
+    afc_client_free(pending.client);
+    return 1;
+  }
+
+  while (received < count) {
+    for (; sent < count && !afc_pipe_full(&pending); sent++) {
+      /* can't traverse */
+      if (strcmp(command.dir_path, ".") == 0 && strcmp(names[sent], "..") == 0) continue;
+      char *dir_path = file_join(command.dir_path, names[sent]);
+      ret = afc_pipe_push(&pending, afc_send_file_info(pending.client, dir_path), AFC_PIPE_STAT, sent, 0);
+      free(dir_path);
+      if (ret != 0) break;
+    }
+    if (pending.count == 0 && ret == 0) {
+      received = sent;
+      continue;
+    }
+    struct afc_reply reply;
+    enum afc_pipe_kind kind;
+    int index;
+    if (ret != 0 || afc_pipe_recv(&pending, &reply, &kind, &index) != 0) {
+      idb_eprintf("AFC connection lost\n");
+      ret = 1;
+      break;
+    }
+    received = index + 1;
+    if (reply.op != AFC_OP_DATA) {
+      (command.json ? idb_eprintf : idb_printf)("%s/%s doesn't exist \n", command.dir_path, names[index]);
+      continue;
+    }
+    if (command.json) {
+      struct json_writer *w = json_record();
+      size_t offset = 0;
+      const char *key, *value;
+      json_string(w, "name", names[index]);
+      while ((key = afc_reply_next(&reply, &offset)) != NULL && (value = afc_reply_next(&reply, &offset)) != NULL) {
+        json_file_field(w, key, value);
+      }
+      json_end(w);
+      continue;
+    }
+    CFMutableDictionaryRef file_dict = native_file_dict(&reply);
+    on_file(names[index], file_dict);
+    CFRelease(file_dict);
+  }
+  free(names);
+  afc_client_free(pending.client);
+  return ret;
+}
+
+int app_dir(AMDeviceRef device)
+{
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  create_user();
+  
+  if (native_afc()) {
+    return app_dir_native(device);
+  }
+  afc_connection *afc_conn = open_house_arrest(device, command.bundle_id);
+  if (afc_conn == NULL) {
+    return 1;
+  }
+  struct afc_directory *dir;
+  char *dirent;
+  
+  AFCDirectoryOpen(afc_conn, command.dir_path, &dir); 
+  for (;;) {
+    AFCDirectoryRead(afc_conn, dir, &dirent);
+    if (!dirent) break;
+
+    /* can't traverse */
+    if (strcmp(command.dir_path, ".") == 0 && strcmp(dirent, "..") == 0) continue;
+
+    struct afc_dictionary *file_info;
+    char *dir_path = str_join(command.dir_path, "/");
+    dir_path = str_join(dir_path, dirent);
+    int r = AFCFileInfoOpen(afc_conn, dir_path, &file_info);
+    if (r) {
+      (command.json ? idb_eprintf : idb_printf)("%s doesn't exist \n", dir_path);
+      continue;
+    }
+    if (command.json) {
+      struct json_writer *w = json_record();
+      char *key, *value;
+      json_string(w, "name", dirent);
+      for (AFCKeyValueRead(file_info, &key, &value); key || value; AFCKeyValueRead(file_info, &key, &value)) {
+        json_file_field(w, key, value);
+      }
+      AFCKeyValueClose(file_info);
+      json_end(w);
+      continue;
+    }
+    CFMutableDictionaryRef file_dict = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                          &kCFTypeDictionaryKeyCallBacks,
+                                                          &kCFTypeDictionaryValueCallBacks);
+    char *key, *value;
+    AFCKeyValueRead(file_info, &key, &value);
+    while(key || value) {
+      CFStringRef k = CSTR2CFSTR(key);
+      CFStringRef v = CSTR2CFSTR(value);
+      CFDictionarySetValue(file_dict, k, v);
+      AFCKeyValueRead(file_info, &key, &value);
+    }
+    AFCKeyValueClose(file_info);
+    on_file(dirent, file_dict);
+  }
+  AFCDirectoryClose(afc_conn, dir);
+  close_house_arrest(afc_conn);
+  return 0;
+}
+
+/************************************************
+ checksum manifest
+************************************************/
+/*
+  <bundle_id>.crc32c lives next to the <bundle_id>/ tree and records
+  "<crc32c> <size> <path>" for every file moved by cp or up. A run only
+  replaces the entries of the files it moved: the lines of other paths
+  are kept, and the result is written to a temporary file renamed over
+  the manifest, under an flock on <bundle_id>.crc32c.lock. cp from several
+  devices at once keeps a tree and manifest per device under <udid>/.
+*/
+struct manifest_entry
+{
+  uint32_t crc;
+  unsigned long long size;
+  char *path;
+};
+
+struct manifest
+{
+  char *path;
+  struct manifest_entry *entries;
+  size_t count, capacity;
+};
+
+char *manifest_path()
+{
+  return str_join(command.local_root ? command.local_root : command.bundle_id, ".crc32c");
+}
+
+/* The local tree of the bundle: <bundle_id>, or <udid>/<bundle_id> with several devices. */
+static char *local_root(AMDeviceRef device)
+{
+  char udid[64];
+
+  if (output_prefix[0] == '\0') {
+    return strdup(command.bundle_id);
+  }
+  copy_udid(device, udid, sizeof(udid));
+  return file_join(udid, command.bundle_id);
+}
+
+void manifest_open()
+{
+  command.manifest = calloc(1, sizeof(struct manifest));
+  command.manifest->path = manifest_path();
+}
+
+void manifest_add(const char *path, uint32_t crc, unsigned long long size)
+{
+  struct manifest *manifest = command.manifest;
+  if (manifest == NULL) {
+    return;
+  }
+  if (manifest->count == manifest->capacity) {
+    manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 256;
+    manifest->entries = realloc(manifest->entries, manifest->capacity * sizeof(struct manifest_entry));
+  }
+  struct manifest_entry *entry = &manifest->entries[manifest->count++];
+  entry->crc = crc;
+  entry->size = size;
+  entry->path = strdup(path);
+}
+
+static int compare_manifest_entry(const void *a, const void *b)
+{
+  return strcmp(((const struct manifest_entry *)a)->path, ((const struct manifest_entry *)b)->path);
+}
+
+/* Copies the lines of `from` whose path this run did not write. */
+static void manifest_keep_others(struct manifest *manifest, FILE *from, FILE *to)
+{
+  char line[4096];
+  while (fgets(line, sizeof(line), from)) {
+    struct manifest_entry key;
+    int n = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%x %llu %n", &key.crc, &key.size, &n) != 2 || n == 0) continue;
+    key.path = line + n;
+    if (bsearch(&key, manifest->entries, manifest->count, sizeof(key), compare_manifest_entry) == NULL) {
+      fprintf(to, "%s\n", line);
+    }
+  }
+}
+
+static int manifest_merge(struct manifest *manifest)
+{
+  char *tmp = str_join(manifest->path, ".XXXXXX");
+  int fd = mkstemp(tmp);
+  FILE *to = (fd >= 0) ? fdopen(fd, "w") : NULL;
+  size_t i;
+  int ret = -1;
+
+  if (to == NULL) {
+    idb_perror(tmp);
+    if (fd >= 0) close(fd);
+    free(tmp);
+    return -1;
+  }
+  fchmod(fd, 0644);             /* mkstemp creates 0600 */
+  FILE *from = fopen(manifest->path, "r");
+  if (from != NULL) {
+    manifest_keep_others(manifest, from, to);
+    fclose(from);
+  }
+  for (i = 0; i < manifest->count; i++) {
+    struct manifest_entry *entry = &manifest->entries[i];
+    fprintf(to, "%08x %llu %s\n", entry->crc, entry->size, entry->path);
+  }
+  if (fclose(to) != 0 || rename(tmp, manifest->path) != 0) {
+    idb_perror(manifest->path);
+    unlink(tmp);
+  } else {
+    ret = 0;
+  }
+  free(tmp);
+  return ret;
+}
+
+void manifest_close()
+{
+  struct manifest *manifest = command.manifest;
+  size_t i;
+
+  if (manifest == NULL) {
+    return;
+  }
+  command.manifest = NULL;
+  qsort(manifest->entries, manifest->count, sizeof(struct manifest_entry), compare_manifest_entry);
+  /* concurrent runs (batch `&` lines, other idb processes) merge one at a time */
+  char *lock_path = str_join(manifest->path, ".lock");
+  int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+    idb_perror(lock_path);
+  }
+  manifest_merge(manifest);
+  if (lock >= 0) {
+    close(lock);                /* releases the lock */
+  }
+  free(lock_path);
+  for (i = 0; i < manifest->count; i++) {
+    free(manifest->entries[i].path);
+  }
+  free(manifest->entries);
+  free(manifest->path);
+  free(manifest);
+}
+
+/************************************************
+ idb cp <bundle_id> <relative_dir>
+************************************************/
+#define BUFFER_SIZE 1024 * 1024
+
+/* 1 if the file could not be read or written, 0 otherwise. */
+int on_copy_file(afc_connection *afc_conn, const char *file_name)
+{
+  char *file_path = file_join(command.local_root, file_name);
+  struct local_file *file = local_io_open(command.local_io, file_path);
+  if (file == NULL) {
+    idb_printf("Cannot Open: %s\n", file_path);
+  }
+
+  afc_file_ref fd;
+  int ret = AFCFileRefOpen(afc_conn, file_name, AFC_FILE_READ, &fd);
+  if (ret) {
+    //idb_printf ( "Cannot Open: %s \n AFCFileRefOpen = %i\n" , file_name, ret );
+    idb_eprintf("[" RED "NG" RESET "] %s/%s \n", command.bundle_id, file_name);
+    local_io_close(command.local_io, file);
+    free(file_path);
+    return 0;
+  }
+  idb_printf("[" GREEN "OK" RESET "] %s/%s \n", command.bundle_id, file_name);
+
+  unsigned int bytesRead;
+  uint32_t crc = 0;
+  unsigned long long size = 0;
+  int failed = 0;
+  char *buf = (char *)malloc(BUFFER_SIZE);
+
+  while (buf != NULL)
+  {
+    bytesRead = BUFFER_SIZE;
+    ret = AFCFileRefRead(afc_conn, fd, buf, &bytesRead);
+    if (ret) {
+      idb_eprintf("Cannot Read: %s AFCFileRefRead = %i\n", file_name, ret);
+      failed = 1;
+      break;
+    }
+    if (bytesRead == 0) break;
+    /* queued on the io_uring backend; failures surface in local_io_wait() */
+    if (local_io_write(command.local_io, file, buf, bytesRead) != 0) {
+      idb_perror(file_path);
+      failed = 1;
+      break;
+    }
+    crc = crc32c_update(crc, buf, bytesRead);
+    size += bytesRead;
+  }
+  if (buf == NULL) {
+    failed = 1;
+  }
+
+  free(buf);
+  AFCFileRefClose(afc_conn, fd);
+  local_io_close(command.local_io, file);
+  if (!failed) {
+    manifest_add(file_name, crc, size);
+  }
+  free(file_path);
+  return failed;
+}
+
+/* Number of files that could not be copied. */
+static int on_copy_dir(afc_connection *afc_conn, const char *path)
+{
+  struct afc_directory *dir;
+  char *dirent;
+  int errors = 0;
+  AFCDirectoryOpen(afc_conn, path, &dir);
+  for (;;) {
+    AFCDirectoryRead(afc_conn, dir, &dirent);
+    if (!dirent) break;
+
+    /* can't traverse */
+    if (strcmp(dirent, ".") == 0 || strcmp(dirent, "..") == 0) continue;
+
+    struct afc_dictionary *file_info;
+
+    char *dir_path = malloc(strlen(path) + 1);
+    strcpy(dir_path, path);
+    if (strcmp(dir_path, "") != 0 ) {
+      dir_path = str_join(dir_path, "/");
+    }
+    dir_path = str_join(dir_path, dirent);
+
+    int r = AFCFileInfoOpen(afc_conn, dir_path, &file_info);
+    if (r) {
+      idb_printf("%s doesn't exist \n", dir_path);
+      continue;
+    }
+    CFMutableDictionaryRef file_dict = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                          &kCFTypeDictionaryKeyCallBacks,
+                                                          &kCFTypeDictionaryValueCallBacks);
+    char *key, *value;
+    AFCKeyValueRead(file_info, &key, &value);
+    while(key || value) {
+      CFStringRef k = CSTR2CFSTR(key);
+      CFStringRef v = CSTR2CFSTR(value);
+      CFDictionarySetValue(file_dict, k, v);
+      AFCKeyValueRead(file_info, &key, &value);
+    }
+    AFCKeyValueClose(file_info);
+
+    CFStringRef ifmt = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_ifmt"));
+    if (CFStringCompare(ifmt,CFSTR("S_IFDIR"), kCFCompareLocalized) == kCFCompareEqualTo) {
+      char *tmp = file_join(command.local_root, dir_path);
+      local_io_mkdir(command.local_io, tmp);
+      free(tmp);
+      errors += on_copy_dir(afc_conn, dir_path);
+    } else {
+      uint64_t start = probe_begin();
+      errors += on_copy_file(afc_conn, dir_path);
+      probe_end(NULL, "file", "cp", dir_path, start, 0);
+    }
+    free(dir_path);
+  }
+  AFCDirectoryClose(afc_conn, dir);
+  return errors;
+}
+
+/*
+  cp with IDB_AFC=native. Each directory is listed, all its entries are
+  stat'ed in one pipelined batch, then its files move through a window:
+  up to AFC_OPEN_AHEAD opens ahead, reads of BUFFER_SIZE up to the stat'ed
+  size, and the close right behind the last read. Replies are handled in
+  order, so each local file is written sequentially.
+*/
+struct native_cp_file
+{
+  char *path;
+  unsigned long long size, requested, received;
+  uint64_t handle;
+  struct local_file *file;
+  uint32_t crc;
+  uint64_t start;
+  int state;                    /* 0 not opened, 1 opening, 2 open, 3 closing, 4 done */
+  int failed;                   /* a read or the close failed: the local copy is not good */
+};
+
+/* Returns 1 once a file has failed, 0 otherwise. */
+static int native_cp_reply(struct native_cp_file *f, const struct afc_reply *reply, enum afc_pipe_kind kind)
+{
+  switch (kind) {
+  case AFC_PIPE_OPEN:
+    if (reply->op != AFC_OP_FILE_OPEN_RES) {
+      idb_eprintf("[" RED "NG" RESET "] %s/%s \n", command.bundle_id, f->path);
+      f->state = 4;
+      break;
+    }
+    idb_printf("[" GREEN "OK" RESET "] %s/%s \n", command.bundle_id, f->path);
+    char *file_path = file_join(command.local_root, f->path);
+    f->file = local_io_open(command.local_io, file_path);
+    if (f->file == NULL) {
+      idb_printf("Cannot Open: %s\n", file_path);
+    }
+    free(file_path);
+    f->handle = reply->handle;
+    f->state = 2;
+    break;
+  case AFC_PIPE_DATA: {
+    if (f->failed) {
+      break;
+    }
+    /* reads go out in order, so this one asked for the next chunk */
+    unsigned long long expected = MIN(f->size - f->received, (unsigned long long)BUFFER_SIZE);
+    if (!afc_read_complete(reply, expected, f->received + expected >= f->size)) {
+      /* an error, or the file shrank since it was stat'ed: later chunks
+         would land at the wrong offset, so drop the file */
+      if (reply->op == AFC_OP_DATA) {
+        idb_eprintf("Cannot Read: %s (short read, %zu of %llu bytes)\n", f->path, reply->data_len, expected);
+      } else {
+        idb_eprintf("Cannot Read: %s (%llu)\n", f->path, (unsigned long long)reply->status);
+      }
+      f->failed = 1;
+      return 1;
+    }
+    /* queued on the io_uring backend; failures surface in local_io_wait() */
+    if (f->file != NULL && local_io_write(command.local_io, f->file, reply->data, reply->data_len) != 0) {
+      idb_perror(f->path);
+    }
+    f->crc = crc32c_update(f->crc, reply->data, reply->data_len);
+    f->received += reply->data_len;
+    break;
+  }
+  case AFC_PIPE_CLOSE:
+    local_io_close(command.local_io, f->file);
+    probe_end(NULL, "file", "cp", f->path, f->start, 0);
+    f->state = 4;
+    if (f->failed) {
+      break;
+    }
+    if (!afc_reply_ok(reply)) {
+      idb_eprintf("Cannot Close: %s (%llu)\n", f->path, (unsigned long long)reply->status);
+      f->failed = 1;
+      return 1;
+    }
+    manifest_add(f->path, f->crc, f->received);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/* Keeps the window full: reads and closes of open files first, then opens. */
+static int native_cp_send(struct afc_pipe *pending, struct native_cp_file *files, int first, int count, int *next_open)
+{
+  int i;
+  for (i = first; i < *next_open && !afc_pipe_full(pending); i++) {
+    struct native_cp_file *f = &files[i];
+    if (f->state != 2) continue;
+    while (f->requested < f->size && !afc_pipe_full(pending)) {
+      size_t len = (f->size - f->requested < BUFFER_SIZE) ? f->size - f->requested : BUFFER_SIZE;
+      if (afc_pipe_push(pending, afc_send_read(pending->client, f->handle, len), AFC_PIPE_DATA, i, len) != 0) {
+        return -1;
+      }
+      f->requested += len;
+    }
+    if (f->requested >= f->size && !afc_pipe_full(pending)) {
+      if (afc_pipe_push(pending, afc_send_close(pending->client, f->handle), AFC_PIPE_CLOSE, i, 0) != 0) {
+        return -1;
+      }
+      f->state = 3;
+    }
+  }
+  while (*next_open < count && *next_open - first < AFC_OPEN_AHEAD && !afc_pipe_full(pending)) {
+    struct native_cp_file *f = &files[*next_open];
+    f->start = probe_begin();
+    if (afc_pipe_push(pending, afc_send_open(pending->client, f->path, AFC_FILE_READ), AFC_PIPE_OPEN,
+                      *next_open, 0) != 0) {
+      return -1;
+    }
+    f->state = 1;
+    (*next_open)++;
+  }
+  return 0;
+}
+
+/* Number of files that failed to copy, or -1 once the connection is lost. */
+static int native_cp_dir(struct afc_pipe *pending, const char *path)
+{
+  int count, i, nfiles = 0, ndirs = 0, stated = 0;
+  char **names = native_read_dir(pending->client, path, &count);
+  if (names == NULL) {
+    idb_printf("%s doesn't exist \n", path);
+    return 0;
+  }
+  char **paths = calloc(count + 1, sizeof(char *));
+  struct native_cp_file *files = calloc(count + 1, sizeof(*files));
+  char **dirs = calloc(count + 1, sizeof(char *));
+  int n = 0, failed = 0, errors = 0;
+
+  for (i = 0; i < count; i++) {
+    /* can't traverse */
+    if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) continue;
+    paths[n++] = (strcmp(path, "") != 0) ? file_join(path, names[i]) : strdup(names[i]);
+  }
+  free(names);
+
+  /* stat every entry */
+  for (i = 0; stated < n && !failed;) {
+    for (; i < n && !afc_pipe_full(pending); i++) {
+      if (afc_pipe_push(pending, afc_send_file_info(pending->client, paths[i]), AFC_PIPE_STAT, i, 0) != 0) {
+        failed = 1;
+        break;
+      }
+    }
+    struct afc_reply reply;
+    enum afc_pipe_kind kind;
+    int index;
+    if (failed || afc_pipe_recv(pending, &reply, &kind, &index) != 0) {
+      failed = 1;
+      break;
+    }
+    stated++;
+    struct afc_stat st;
+    if (reply.op != AFC_OP_DATA) {
+      idb_printf("%s doesn't exist \n", paths[index]);
+      continue;
+    }
+    native_file_stat(&reply, &st);
+    if (st.is_dir) {
+      dirs[ndirs++] = paths[index];
+    } else {
+      files[nfiles].path = paths[index];
+      files[nfiles++].size = st.size;
+    }
+    paths[index] = NULL;
+  }
+  for (i = 0; i < n; i++) {
+    free(paths[i]);
+  }
+
+  /* move the files */
+  int first = 0, next_open = 0;
+  while (!failed && first < nfiles) {
+    if (native_cp_send(pending, files, first, nfiles, &next_open) != 0) {
+      failed = 1;
+      break;
+    }
+    struct afc_reply reply;
+    enum afc_pipe_kind kind;
+    int index;
+    if (afc_pipe_recv(pending, &reply, &kind, &index) != 0) {
+      failed = 1;
+      break;
+    }
+    errors += native_cp_reply(&files[index], &reply, kind);
+    while (first < nfiles && files[first].state == 4) first++;
+  }
+  for (i = 0; i < nfiles; i++) {
+    if (files[i].state != 4 && files[i].file != NULL) {
+      local_io_close(command.local_io, files[i].file);
+    }
+    free(files[i].path);
+  }
+
+  for (i = 0; i < ndirs; i++) {
+    if (!failed) {
+      char *tmp = file_join(command.local_root, dirs[i]);
+      local_io_mkdir(command.local_io, tmp);
+      free(tmp);
+      int sub = native_cp_dir(pending, dirs[i]);
+      if (sub < 0) {
+        failed = 1;
+      } else {
+        errors += sub;
+      }
+    }
+    free(dirs[i]);
+  }
+  free(dirs);
+  free(files);
+  free(paths);
+  return failed ? -1 : errors;
+}
+
+int copy_dir(AMDeviceRef device)
+{
+  struct afc_pipe pending = { NULL };
+  afc_connection *afc_conn = NULL;
+  int failed = 0;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  create_user();
+
+  if (native_afc()) {
+    pending.client = open_native_afc(device, command.bundle_id);
+  } else {
+    afc_conn = open_house_arrest(device, command.bundle_id);
+  }
+  if (afc_conn == NULL && pending.client == NULL) {
+    return 1;
+  }
+
+  /* IDB_LOCAL_IO=stdio|uring picks the local write path */
+  command.local_io = local_io_create(local_io_backend_from_name(getenv("IDB_LOCAL_IO")));
+
+  char *root = local_root(device);
+  command.local_root = root;
+  make_parent_dirs(root);
+  make_dir(root);
+  if (strcmp(command.dir_path, "") != 0 ) {
+    char *root_dir = file_join(root, command.dir_path);
+    make_dir(root_dir);
+    free(root_dir);
+  }
+
+  manifest_open();
+  int errors = (pending.client != NULL) ? native_cp_dir(&pending, command.dir_path)
+                                         : on_copy_dir(afc_conn, command.dir_path);
+  if (errors < 0) {
+    idb_eprintf("AFC connection lost\n");
+  } else if (errors > 0) {
+    idb_eprintf("%d files could not be copied\n", errors);
+  }
+  failed = (errors != 0);
+  manifest_close();
+
+  if (pending.client != NULL) {
+    afc_client_free(pending.client);
+  } else {
+    close_house_arrest(afc_conn);
+  }
+
+  errors = local_io_wait(command.local_io);
+  local_io_destroy(command.local_io);
+  command.local_io = NULL;
+  command.local_root = NULL;
+  free(root);
+  return (errors || failed) ? 1 : 0;
+}
+/************************************************
+ idb up <bundle_id> <relative_dir>
+************************************************/
+/*
+  With several devices the local tree is walked and read once: every
+  buffer goes to one writer thread per device through a bounded queue,
+  so a slow device only holds up the reader once its queue is full.
+*/
+#define UP_QUEUE_DEPTH 8
+
+enum up_message_kind
+{
+  UP_OPEN,                      /* data is the remote path */
+  UP_DATA,
+  UP_CLOSE,
+  UP_END
+};
+
+struct up_chunk
+{
+  int refs;                     /* one per device still to write it */
+  size_t len;
+  char data[];
+};
+
+struct up_message
+{
+  enum up_message_kind kind;
+  struct up_chunk *chunk;
+};
+
+struct up_writer
+{
+  afc_connection *afc_conn;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct up_message queue[UP_QUEUE_DEPTH];
+  int head, count;
+  int failed;
+};
+
+struct up_dest
+{
+  afc_connection *afc_conn;     /* single device */
+  struct up_writer *writers;    /* or a broadcast */
+  int writer_count;
+};
+
+static struct up_chunk *up_chunk_new(const void *data, size_t len, int refs)
+{
+  struct up_chunk *chunk = malloc(sizeof(*chunk) + len + 1);
+  chunk->refs = refs;
+  chunk->len = len;
+  if (data != NULL) {
+    memcpy(chunk->data, data, len);
+  }
+  chunk->data[len] = '\0';
+  return chunk;
+}
+
+static void up_chunk_release(struct up_chunk *chunk)
+{
+  if (chunk != NULL && __sync_sub_and_fetch(&chunk->refs, 1) == 0) {
+    free(chunk);
+  }
+}
+
+static void up_push(struct up_writer *writer, enum up_message_kind kind, struct up_chunk *chunk)
+{
+  pthread_mutex_lock(&writer->lock);
+  while (writer->count == UP_QUEUE_DEPTH) {
+    pthread_cond_wait(&writer->cond, &writer->lock);
+  }
+  struct up_message *msg = &writer->queue[(writer->head + writer->count) % UP_QUEUE_DEPTH];
+  msg->kind = kind;
+  msg->chunk = chunk;
+  writer->count++;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* Sends a message to every writer; `chunk` must carry one reference per writer. */
+static void up_broadcast(struct up_dest *dest, enum up_message_kind kind, struct up_chunk *chunk)
+{
+  int i;
+  for (i = 0; i < dest->writer_count; i++) {
+    up_push(&dest->writers[i], kind, chunk);
+  }
+}
+
+static void *up_writer_thread(void *arg)
+{
+  struct up_writer *writer = (struct up_writer *)arg;
+  afc_file_ref fd;
+  int opened = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->count == 0) {
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    struct up_message msg = writer->queue[writer->head];
+    writer->head = (writer->head + 1) % UP_QUEUE_DEPTH;
+    writer->count--;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    if (msg.kind == UP_END) break;
+    switch (msg.kind) {
+    case UP_OPEN:
+      opened = (AFCFileRefOpen(writer->afc_conn, msg.chunk->data, AFC_FILE_WRITE, &fd) == 0);
+      if (opened) {
+        idb_printf("[" GREEN "OK" RESET "] %s \n", msg.chunk->data);
+      } else {
+        idb_eprintf("[" RED "NG" RESET "] %s \n", msg.chunk->data);
+        writer->failed++;
+      }
+      break;
+    case UP_DATA:
+      if (opened && AFCFileRefWrite(writer->afc_conn, fd, msg.chunk->data, msg.chunk->len) != 0) {
+        writer->failed++;
+        AFCFileRefClose(writer->afc_conn, fd);
+        opened = 0;
+      }
+      break;
+    case UP_CLOSE:
+      if (opened) {
+        AFCFileRefClose(writer->afc_conn, fd);
+      }
+      opened = 0;
+      break;
+    default:
+      break;
+    }
+    up_chunk_release(msg.chunk);
+  }
+  return NULL;
+}
+
+void on_up_file(struct up_dest *dest, const char *file_name)
+{
+  char *file_path = file_join(command.bundle_id, file_name);
+
+  FILE *file = fopen(file_path, "rb");
+  if (file == NULL) {
+     idb_printf("Cannot Open: %s\n", file_path);
+     free(file_path);
+     return;
+  }
+
+  afc_file_ref fd;
+  if (dest->writers != NULL) {
+    up_broadcast(dest, UP_OPEN, up_chunk_new(file_name, strlen(file_name), dest->writer_count));
+  } else {
+    int ret = AFCFileRefOpen(dest->afc_conn, file_name, AFC_FILE_WRITE, &fd);
+    if (ret) {
+      //idb_printf ( "Cannot Open: %s \n AFCFileRefOpen = %i\n" , file_name, ret );
+      idb_eprintf("[" RED "NG" RESET "] %s \n", file_name);
+      fclose(file);
+      free(file_path);
+      return;
+    }
+    idb_printf("[" GREEN "OK" RESET "] %s \n", file_name);
+  }
+
+  size_t read;
+  char *buf = (char *)malloc(BUFFER_SIZE);
+  if (!buf) {
+    return;
+  }
+
+  uint32_t crc = 0;
+  unsigned long long size = 0;
+  for (;;) {
+    uint64_t start = probe_begin();
+    read = fread(buf, 1, BUFFER_SIZE, file);
+    probe_end(&stats_hist_local_read, "local", "fread", NULL, start, read);
+    if (read == 0) break;
+    if (dest->writers != NULL) {
+      up_broadcast(dest, UP_DATA, up_chunk_new(buf, read, dest->writer_count));
+    } else {
+      AFCFileRefWrite(dest->afc_conn, fd, buf, read);
+    }
+    crc = crc32c_update(crc, buf, read);
+    size += read;
+  }
+
+  free(buf);
+  if (dest->writers != NULL) {
+    up_broadcast(dest, UP_CLOSE, NULL);
+  } else {
+    AFCFileRefClose(dest->afc_conn, fd);
+  }
+
+  fclose(file);
+  manifest_add(file_name, crc, size);
+  free(file_path);
+}
+
+void on_up_dir(struct up_dest *dest, const char *file_name)
+{
+  DIR* dir;
+  struct dirent* dp;
+
+  char *dir_path = file_join(command.bundle_id, file_name);
+  if ((dir = opendir(dir_path)) == NULL){
+    idb_printf("cannnot open dir %s\n", file_name);
+    free(dir_path);
+    return;
+  }
+
+  while((dp = readdir(dir)) != NULL){
+    char *dirent = dp->d_name;
+    if (strcmp(dirent, ".") == 0 || strcmp(dirent, "..") == 0) continue;
+
+    char *path = file_join(dir_path, dirent);
+    char *relative_path = file_join(file_name, dirent);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      on_up_dir(dest, relative_path);
+    } else {
+      uint64_t start = probe_begin();
+      on_up_file(dest, relative_path);
+      probe_end(NULL, "file", "up", relative_path, start, 0);
+    }
+    free(relative_path);
+    free(path);
+  }
+  closedir(dir);
+  free(dir_path);
+}
+
+/*
+  up with IDB_AFC=native on a single device: files are opened
+  AFC_OPEN_AHEAD ahead of the one being sent, and writes are only waited
+  for once AFC_BYTES_AHEAD of them are unanswered.
+*/
+struct native_up_file
+{
+  char *path;                   /* relative to the bundle directory */
+  uint64_t handle;
+  uint32_t crc;
+  unsigned long long size;
+  uint64_t start;
+  int state;                    /* 0 not opened, 1 opening, 2 open, 3 failed */
+};
+
+static int native_up_recv(struct afc_pipe *pending, struct native_up_file *files)
+{
+  struct afc_reply reply;
+  enum afc_pipe_kind kind;
+  int index;
+  if (afc_pipe_recv(pending, &reply, &kind, &index) != 0) {
+    return -1;
+  }
+  struct native_up_file *f = &files[index];
+  switch (kind) {
+  case AFC_PIPE_OPEN:
+    if (reply.op == AFC_OP_FILE_OPEN_RES) {
+      idb_printf("[" GREEN "OK" RESET "] %s \n", f->path);
+      f->handle = reply.handle;
+      f->state = 2;
+    } else {
+      idb_eprintf("[" RED "NG" RESET "] %s \n", f->path);
+      f->state = 3;
+    }
+    break;
+  case AFC_PIPE_DATA:
+    if (!afc_reply_ok(&reply)) {
+      idb_eprintf("Cannot Write: %s\n", f->path);
+    }
+    break;
+  case AFC_PIPE_CLOSE:
+    manifest_add(f->path, f->crc, f->size);
+    probe_end(NULL, "file", "up", f->path, f->start, 0);
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+/* Queues the writes and the close of an opened file. */
+static int native_up_send(struct afc_pipe *pending, struct native_up_file *files, int index, char *buf)
+{
+  struct native_up_file *f = &files[index];
+  char *file_path = file_join(command.bundle_id, f->path);
+  FILE *file = fopen(file_path, "rb");
+  if (file == NULL) {
+    idb_printf("Cannot Open: %s\n", file_path);
+  }
+  free(file_path);
+
+  for (;;) {
+    while (afc_pipe_full(pending)) {
+      if (native_up_recv(pending, files) != 0) {
+        if (file != NULL) fclose(file);
+        return -1;
+      }
+    }
+    if (file == NULL) break;
+    uint64_t start = probe_begin();
+    size_t read = fread(buf, 1, BUFFER_SIZE, file);
+    probe_end(&stats_hist_local_read, "local", "fread", NULL, start, read);
+    if (read == 0) break;
+    if (afc_pipe_push(pending, afc_send_write(pending->client, f->handle, buf, read), AFC_PIPE_DATA, index, read) != 0) {
+      fclose(file);
+      return -1;
+    }
+    f->crc = crc32c_update(f->crc, buf, read);
+    f->size += read;
+  }
+  if (file != NULL) fclose(file);
+  return afc_pipe_push(pending, afc_send_close(pending->client, f->handle), AFC_PIPE_CLOSE, index, 0);
+}
+
+static int native_up_dir(struct afc_pipe *pending, const char *file_name, char *buf)
+{
+  DIR* dir;
+  struct dirent* dp;
+  int count = 0, ndirs = 0, cap = 16, i, failed = 0;
+
+  char *dir_path = file_join(command.bundle_id, file_name);
+  if ((dir = opendir(dir_path)) == NULL){
+    idb_printf("cannnot open dir %s\n", file_name);
+    free(dir_path);
+    return 0;
+  }
+  struct native_up_file *files = calloc(cap, sizeof(*files));
+  char **dirs = calloc(cap, sizeof(char *));
+  while((dp = readdir(dir)) != NULL){
+    if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) continue;
+    if (count == cap || ndirs == cap) {
+      cap *= 2;
+      files = realloc(files, cap * sizeof(*files));
+      dirs = realloc(dirs, cap * sizeof(char *));
+    }
+    char *path = file_join(dir_path, dp->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+      dirs[ndirs++] = file_join(file_name, dp->d_name);
+    } else {
+      memset(&files[count], 0, sizeof(files[count]));
+      files[count++].path = file_join(file_name, dp->d_name);
+    }
+    free(path);
+  }
+  closedir(dir);
+  free(dir_path);
+
+  int next_open = 0;
+  for (i = 0; i < count && !failed;) {
+    while (next_open < count && next_open - i < AFC_OPEN_AHEAD && !afc_pipe_full(pending)) {
+      files[next_open].start = probe_begin();
+      if (afc_pipe_push(pending, afc_send_open(pending->client, files[next_open].path, AFC_FILE_WRITE),
+                        AFC_PIPE_OPEN, next_open, 0) != 0) {
+        failed = 1;
+        break;
+      }
+      files[next_open++].state = 1;
+    }
+    if (failed) break;
+    if (files[i].state == 1) {
+      failed = native_up_recv(pending, files) != 0;
+      continue;
+    }
+    if (files[i].state == 2) {
+      failed = native_up_send(pending, files, i, buf) != 0;
+    }
+    i++;
+  }
+  /* closes still refer to this directory's files */
+  while (!failed && pending->count > 0) {
+    failed = native_up_recv(pending, files) != 0;
+  }
+  for (i = 0; i < count; i++) {
+    free(files[i].path);
+  }
+  free(files);
+
+  for (i = 0; i < ndirs; i++) {
+    if (!failed) {
+      failed = native_up_dir(pending, dirs[i], buf);
+    }
+    free(dirs[i]);
+  }
+  free(dirs);
+  return failed;
+}
+
+int up_dir(AMDeviceRef device)
+{
+  struct up_dest dest = { NULL, NULL, 0 };
+  struct afc_pipe pending = { NULL };
+  int failed = 0;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  create_user();
+
+  if (native_afc()) {
+    pending.client = open_native_afc(device, command.bundle_id);
+  } else {
+    dest.afc_conn = open_house_arrest(device, command.bundle_id);
+  }
+  if (dest.afc_conn == NULL && pending.client == NULL) {
+    return 1;
+  }
+
+  manifest_open();
+  if (pending.client != NULL) {
+    char *buf = (char *)malloc(BUFFER_SIZE);
+    if ((failed = native_up_dir(&pending, command.dir_path, buf)) != 0) {
+      idb_eprintf("AFC connection lost\n");
+    }
+    free(buf);
+    afc_client_free(pending.client);
+  } else {
+    on_up_dir(&dest, command.dir_path);
+    close_house_arrest(dest.afc_conn);
+  }
+  manifest_close();
+
+  return failed;
+}
+
+/* up on several devices, reading the local tree once. */
+int up_dir_broadcast(AMDeviceRef *list, int count)
+{
+  struct up_writer writers[count];
+  struct up_dest dest = { NULL, writers, 0 };
+  char saved[sizeof(output_prefix)];
+  char udid[64];
+  int i, failed = 0;
+
+  create_user();
+  memcpy(saved, output_prefix, sizeof(saved));
+  for (i = 0; i < count; i++) {
+    struct up_writer *writer = &writers[dest.writer_count];
+    copy_udid(list[i], udid, sizeof(udid));
+    snprintf(output_prefix, sizeof(output_prefix), "[%s] ", udid);
+
+    memset(writer, 0, sizeof(*writer));
+    if (connect_device(list[i]) != 0) {
+      failed++;
+      continue;
+    }
+    if ((writer->afc_conn = open_house_arrest(list[i], command.bundle_id)) == NULL) {
+      idb_eprintf("cannot open %s\n", command.bundle_id);
+      failed++;
+      continue;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (start_worker(&writer->thread, up_writer_thread, writer) != 0) {
+      close_house_arrest(writer->afc_conn);
+      failed++;
+      continue;
+    }
+    dest.writer_count++;
+  }
+  memcpy(output_prefix, saved, sizeof(saved));
+
+  if (dest.writer_count > 0) {
+    manifest_open();
+    on_up_dir(&dest, command.dir_path);
+    manifest_close();
+    up_broadcast(&dest, UP_END, NULL);
+  }
+  for (i = 0; i < dest.writer_count; i++) {
+    pthread_join(writers[i].thread, NULL);
+    close_house_arrest(writers[i].afc_conn);
+    pthread_cond_destroy(&writers[i].cond);
+    pthread_mutex_destroy(&writers[i].lock);
+    failed += (writers[i].failed != 0);
+  }
+  if (failed) {
+    idb_eprintf("%d of %d devices failed\n", failed, count);
+  }
+  return failed ? 1 : 0;
+}
+
+/************************************************
+ idb find <bundle_id> <relative_dir> <expression>
+************************************************/
+/*
+  -name <pattern>       fnmatch(3) on the last path component
+  -type <f|d|l>
+  -size [+-]<n>[kMG]    bytes, rounded up to the unit like find(1)
+  -mmin [+-]<n>         both may be given; a file must match each
+  -mtime [+-]<n>
+  -maxdepth <n>         0 tests the starting path only, like find(1)
+  -j <n>                parallel AFC connections
+*/
+static int parse_find_number(const char *str, struct find_number *num, int allow_suffix)
+{
+  char *end;
+
+  num->cmp = 0;
+  num->unit = 1;
+  if (*str == '+') {
+    num->cmp = 1;
+    str++;
+  } else if (*str == '-') {
+    num->cmp = -1;
+    str++;
+  }
+  num->value = strtoull(str, &end, 10);
+  if (end == str) return -1;
+  if (*end != '\0') {
+    if (!allow_suffix || end[1] != '\0') return -1;
+    switch (*end) {
+    case 'c': num->unit = 1; break;
+    case 'k': num->unit = 1024ULL; break;
+    case 'M': num->unit = 1024ULL * 1024; break;
+    case 'G': num->unit = 1024ULL * 1024 * 1024; break;
+    default:  return -1;
+    }
+  }
+  return 0;
+}
+
+static int match_find_number(const struct find_number *num, unsigned long long value)
+{
+  unsigned long long n = (value + num->unit - 1) / num->unit;
+  if (num->cmp < 0) return n < num->value;
+  if (num->cmp > 0) return n > num->value;
+  return n == num->value;
+}
+
+int parse_find_expr(int argc, char *argv[])
+{
+  int i;
+
+  find_expr.max_depth = -1;
+  for (i = 0; i < argc; i++) {
+    const char *opt = argv[i];
+    const char *arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+    if (arg == NULL) {
+      idb_eprintf("find: missing argument to %s\n", opt);
+      return -1;
+    }
+    i++;
+    if (strcmp(opt, "-name") == 0) {
+      find_expr.name = arg;
+    } else if (strcmp(opt, "-type") == 0) {
+      if (strcmp(arg, "f") && strcmp(arg, "d") && strcmp(arg, "l")) {
+        idb_eprintf("find: unknown type %s\n", arg);
+        return -1;
+      }
+      find_expr.type = arg[0];
+    } else if (strcmp(opt, "-size") == 0) {
+      find_expr.has_size = 1;
+      if (parse_find_number(arg, &find_expr.size, 1)) {
+        idb_eprintf("find: invalid size %s\n", arg);
+        return -1;
+      }
+    } else if (strcmp(opt, "-mmin") == 0 || strcmp(opt, "-mtime") == 0) {
+      int minutes = (opt[2] == 'm');
+      struct find_number *num = minutes ? &find_expr.mmin : &find_expr.mtime;
+      *(minutes ? &find_expr.has_mmin : &find_expr.has_mtime) = 1;
+      if (parse_find_number(arg, num, 0)) {
+        idb_eprintf("find: invalid time %s\n", arg);
+        return -1;
+      }
+      num->unit = minutes ? 60 : 24 * 60 * 60;
+    } else if (strcmp(opt, "-maxdepth") == 0) {
+      char *end;
+      long depth = strtol(arg, &end, 10);
+      if (!isdigit((unsigned char)arg[0]) || *end != '\0' || depth > INT_MAX) {
+        idb_eprintf("find: invalid depth %s\n", arg);
+        return -1;
+      }
+      find_expr.max_depth = (int)depth;
+    } else if (strcmp(opt, "-j") == 0) {
+      command.jobs = MAX(atoi(arg), 1);
+    } else {
+      idb_eprintf("find: unknown predicate %s\n", opt);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Age compared in whole units of `num`, truncated like find(1). */
+static int match_find_age(const struct find_number *num, time_t now, time_t mtime)
+{
+  unsigned long long age = (now > mtime) ? (now - mtime) : 0;
+  struct find_number units = *num;
+  units.unit = 1;
+  return match_find_number(&units, age / num->unit);
+}
+
+static int on_find(struct walk *walk, afc_connection *afc_conn,
+                   const char *path, struct afc_stat *st)
+{
+  time_t now = *(time_t *)walk->context;
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  if (find_expr.name && fnmatch(find_expr.name, name, 0) != 0) return 1;
+  if (find_expr.type == 'f' && (st->is_dir || st->is_link)) return 1;
+  if (find_expr.type == 'd' && !st->is_dir) return 1;
+  if (find_expr.type == 'l' && !st->is_link) return 1;
+  if (find_expr.has_size && !match_find_number(&find_expr.size, st->size)) return 1;
+  if (find_expr.has_mmin && !match_find_age(&find_expr.mmin, now, st->mtime)) return 1;
+  if (find_expr.has_mtime && !match_find_age(&find_expr.mtime, now, st->mtime)) return 1;
+  idb_printf("%s\n", path);
+  return 1;
+}
+
+int find_dir(AMDeviceRef device)
+{
+  afc_connection *conns[command.jobs];
+  time_t now = time(NULL);
+  int i;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  int jobs = open_house_arrest_pool(device, command.bundle_id, conns, command.jobs);
+  if (jobs == 0) {
+    return 1;
+  }
+
+  struct walk walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.callback = on_find;
+  walk.context = &now;
+  walk.max_depth = find_expr.max_depth;
+
+  struct afc_stat st;
+  int ret = 0;
+  if (afc_stat_path(conns[0], command.dir_path, &st) != 0) {
+    idb_eprintf("%s doesn't exist \n", command.dir_path);
+    ret = 1;
+  } else if (find_expr.max_depth == 0) {
+    /* like find(1): only the starting path itself is tested */
+    on_find(&walk, conns[0], command.dir_path, &st);
+  } else {
+    walk_tree(&walk, conns, jobs, command.dir_path);
+  }
+
+  for (i = 0; i < jobs; i++) {
+    close_house_arrest(conns[i]);
+  }
+  return ret;
+}
+
+/************************************************
+ idb mv <bundle_id> <src>... <dst>
+************************************************/
+int move_path(AMDeviceRef device)
+{
+  const char *dst = command.paths[command.path_count - 1];
+  int sources = command.path_count - 1;
+  int failed = 0;
+  int into_dir;
+  int i;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  afc_connection *afc_conn = open_house_arrest(device, command.bundle_id);
+  if (afc_conn == NULL) {
+    return 1;
+  }
+
+  /* several sources (or an existing directory) move into dst like mv(1) */
+  struct afc_stat st;
+  into_dir = (afc_stat_path(afc_conn, dst, &st) == 0 && st.is_dir);
+  if (sources > 1 && !into_dir) {
+    idb_eprintf("%s is not a directory\n", dst);
+    close_house_arrest(afc_conn);
+    return 1;
+  }
+
+  for (i = 0; i < sources; i++) {
+    const char *src = command.paths[i];
+    char *to;
+    if (into_dir) {
+      const char *name = strrchr(src, '/');
+      to = file_join(dst, name ? name + 1 : src);
+    } else {
+      to = strdup(dst);
+    }
+    int ret = AFCRenamePath(afc_conn, src, to);
+    if (ret) {
+      idb_eprintf("[" RED "NG" RESET "] %s -> %s (AFCRenamePath = %i)\n", src, to, ret);
+      failed++;
+    } else {
+      idb_printf("[" GREEN "OK" RESET "] %s -> %s\n", src, to);
+    }
+    free(to);
+  }
+
+  close_house_arrest(afc_conn);
+  return failed ? 1 : 0;
+}
+
+/************************************************
+ idb ln [-s] <bundle_id> <target> <link_name>
+************************************************/
+int link_path(AMDeviceRef device)
+{
+  const char *target = command.paths[0];
+  const char *link_name = command.paths[1];
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  afc_connection *afc_conn = open_house_arrest(device, command.bundle_id);
+  if (afc_conn == NULL) {
+    return 1;
+  }
+
+  int ret = AFCLinkPath(afc_conn, command.link_type, target, link_name);
+  close_house_arrest(afc_conn);
+  if (ret) {
+    idb_eprintf("[" RED "NG" RESET "] %s -> %s (AFCLinkPath = %i)\n", link_name, target, ret);
+    return 1;
+  }
+  idb_printf("[" GREEN "OK" RESET "] %s -> %s\n", link_name, target);
+  return 0;
+}
+
+/************************************************
+ idb rm [-r] [-n] [-j jobs] <bundle_id> <path>...
+************************************************/
+struct remove_dir
+{
+  char *path;
+  int depth;
+};
+
+struct remove_context
+{
+  pthread_mutex_t lock;
+  struct remove_dir *dirs;
+  size_t dir_count, dir_capacity;
+
+  /* bottom-up pass: next index into dirs[] */
+  size_t next, end;
+
+  unsigned long long files, bytes, removed_dirs, failed;
+};
+
+static int remove_one(struct remove_context *ctx, afc_connection *afc_conn,
+                      const char *path, struct afc_stat *st)
+{
+  int ret = 0;
+  if (command.dry_run) {
+    idb_printf("would remove %s\n", path);
+  } else if ((ret = AFCRemovePath(afc_conn, path)) != 0) {
+    idb_eprintf("[" RED "NG" RESET "] %s (AFCRemovePath = %i)\n", path, ret);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  if (ret) {
+    ctx->failed++;
+  } else if (st->is_dir) {
+    ctx->removed_dirs++;
+  } else {
+    ctx->files++;
+    ctx->bytes += st->size;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return ret;
+}
+
+static int on_remove(struct walk *walk, afc_connection *afc_conn,
+                     const char *path, struct afc_stat *st)
+{
+  struct remove_context *ctx = (struct remove_context *)walk->context;
+
+  if (!st->is_dir) {
+    remove_one(ctx, afc_conn, path, st);
+    return 0;
+  }
+  /* directories go once their contents are gone, deepest first */
+  pthread_mutex_lock(&ctx->lock);
+  if (ctx->dir_count == ctx->dir_capacity) {
+    ctx->dir_capacity = ctx->dir_capacity ? ctx->dir_capacity * 2 : 64;
+    ctx->dirs = realloc(ctx->dirs, ctx->dir_capacity * sizeof(struct remove_dir));
+  }
+  struct remove_dir *dir = &ctx->dirs[ctx->dir_count++];
+  dir->path = strdup(path);
+  dir->depth = 0;
+  for (const char *p = path; *p; p++) {
+    if (*p == '/') dir->depth++;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return 1;
+}
+
+static int compare_remove_dir(const void *a, const void *b)
+{
+  return ((const struct remove_dir *)b)->depth - ((const struct remove_dir *)a)->depth;
+}
+
+struct remove_worker
+{
+  struct remove_context *ctx;
+  afc_connection *afc_conn;
+};
+
+static void *remove_dir_thread(void *arg)
+{
+  struct remove_worker *worker = (struct remove_worker *)arg;
+  struct remove_context *ctx = worker->ctx;
+  struct afc_stat st = { .is_dir = 1 };
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    size_t i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (i >= ctx->end) break;
+    remove_one(ctx, worker->afc_conn, ctx->dirs[i].path, &st);
+  }
+  return NULL;
+}
+
+/* Removes dirs[] level by level; siblings at one depth go in parallel. */
+static void remove_dirs(struct remove_context *ctx, afc_connection **conns, int jobs)
+{
+  pthread_t threads[jobs];
+  struct remove_worker workers[jobs];
+  size_t start = 0;
+  int i;
+
+  qsort(ctx->dirs, ctx->dir_count, sizeof(struct remove_dir), compare_remove_dir);
+  while (start < ctx->dir_count) {
+    size_t end = start;
+    while (end < ctx->dir_count && ctx->dirs[end].depth == ctx->dirs[start].depth) end++;
+
+    ctx->next = start;
+    ctx->end = end;
+    for (i = 0; i < jobs; i++) {
+      workers[i].ctx = ctx;
+      workers[i].afc_conn = conns[i];
+      start_worker(&threads[i], remove_dir_thread, &workers[i]);
+    }
+    for (i = 0; i < jobs; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    start = end;
+  }
+
+  for (start = 0; start < ctx->dir_count; start++) {
+    free(ctx->dirs[start].path);
+  }
+  free(ctx->dirs);
+  ctx->dirs = NULL;
+  ctx->dir_count = ctx->dir_capacity = 0;
+}
+
+int remove_path(AMDeviceRef device)
+{
+  afc_connection *conns[command.jobs];
+  struct remove_context ctx;
+  int i;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  int jobs = open_house_arrest_pool(device, command.bundle_id, conns, command.jobs);
+  if (jobs == 0) {
+    return 1;
+  }
+  memset(&ctx, 0, sizeof(ctx));
+  pthread_mutex_init(&ctx.lock, NULL);
+
+  for (i = 0; i < command.path_count; i++) {
+    /* "Documents/..", "./" and "a/../" all name the root too */
+    char *path = path_normalize(command.paths[i]);
+    struct afc_stat st;
+
+    if (strcmp(path, "") == 0 || strcmp(path, "/") == 0) {
+      idb_eprintf("refusing to remove container root\n");
+      ctx.failed++;
+      free(path);
+      continue;
+    }
+    if (afc_stat_path(conns[0], path, &st) != 0) {
+      idb_eprintf("%s doesn't exist \n", command.paths[i]);
+      ctx.failed++;
+      free(path);
+      continue;
+    }
+    if (st.is_dir) {
+      if (!command.recursive) {
+        idb_eprintf("%s is a directory\n", command.paths[i]);
+        ctx.failed++;
+        free(path);
+        continue;
+      }
+      struct walk walk;
+      memset(&walk, 0, sizeof(walk));
+      walk.callback = on_remove;
+      walk.context = &ctx;
+      walk.max_depth = -1;
+      walk_tree(&walk, conns, jobs, path);
+
+      on_remove(&walk, conns[0], path, &st);
+      remove_dirs(&ctx, conns, jobs);
+    } else {
+      remove_one(&ctx, conns[0], path, &st);
+    }
+    free(path);
+  }
+
+  idb_printf("%s%llu files, %llu dirs, %llu bytes\n",
+         command.dry_run ? "would remove " : "removed ",
+         ctx.files, ctx.removed_dirs, ctx.bytes);
+  if (ctx.failed) {
+    idb_eprintf("%llu paths failed\n", ctx.failed);
+  }
+
+  pthread_mutex_destroy(&ctx.lock);
+  for (i = 0; i < jobs; i++) {
+    close_house_arrest(conns[i]);
+  }
+  return ctx.failed ? 1 : 0;
+}
+
+/************************************************
+ idb cat [-o offset] [-l length] [-t bytes] [-f] <bundle_id> <path>
+************************************************/
+#define CAT_BLOCK_SIZE    (16 * 1024)
+#define CAT_READAHEAD_MAX (1024 * 1024)
+#define CAT_CACHE_SLOTS   8
+#define CAT_FOLLOW_USEC   500000
+
+/*
+  Each slot holds the result of one device read: a block-aligned span
+  that grows with read-ahead while access stays sequential, and falls
+  back to a single block on a random seek.
+*/
+struct cache_slot
+{
+  unsigned long long offset;
+  unsigned int len;
+  unsigned long long used;
+  char *data;
+};
+
+struct block_cache
+{
+  afc_connection *afc_conn;
+  afc_file_ref fd;
+  unsigned long long position;  /* device side file offset */
+  unsigned long long next;      /* where a sequential reader continues */
+  unsigned int readahead;
+  unsigned long long clock;
+  struct cache_slot slots[CAT_CACHE_SLOTS];
+};
+
+static void cache_init(struct block_cache *cache, afc_connection *afc_conn, afc_file_ref fd)
+{
+  int i;
+  memset(cache, 0, sizeof(*cache));
+  cache->afc_conn = afc_conn;
+  cache->fd = fd;
+  cache->readahead = CAT_BLOCK_SIZE;
+  for (i = 0; i < CAT_CACHE_SLOTS; i++) {
+    cache->slots[i].data = malloc(CAT_READAHEAD_MAX);
+  }
+}
+
+static void cache_free(struct block_cache *cache)
+{
+  int i;
+  for (i = 0; i < CAT_CACHE_SLOTS; i++) {
+    free(cache->slots[i].data);
+  }
+}
+
+static struct cache_slot *cache_fill(struct block_cache *cache, unsigned long long offset)
+{
+  struct cache_slot *slot = &cache->slots[0];
+  unsigned long long start = offset - (offset % CAT_BLOCK_SIZE);
+  unsigned int want, got = 0;
+  int i;
+
+  if (offset == cache->next) {
+    cache->readahead = cache->readahead * 2;
+    if (cache->readahead > CAT_READAHEAD_MAX) cache->readahead = CAT_READAHEAD_MAX;
+  } else {
+    cache->readahead = CAT_BLOCK_SIZE;
+  }
+  want = cache->readahead;
+
+  for (i = 1; i < CAT_CACHE_SLOTS; i++) {
+    if (cache->slots[i].used < slot->used) slot = &cache->slots[i];
+  }
+
+  if (cache->position != start) {
+    if (AFCFileRefSeek(cache->afc_conn, cache->fd, start, 0)) {
+      return NULL;
+    }
+    cache->position = start;
+  }
+  while (got < want) {
+    unsigned int len = want - got;
+    if (AFCFileRefRead(cache->afc_conn, cache->fd, slot->data + got, &len) || len == 0) break;
+    got += len;
+  }
+  cache->position += got;
+
+  slot->offset = start;
+  slot->len = got;
+  slot->used = ++cache->clock;
+  return slot;
+}
+
+/* Returns the number of bytes copied, 0 at end of file. */
+static size_t cache_read(struct block_cache *cache, unsigned long long offset, char *buf, size_t len)
+{
+  struct cache_slot *slot = NULL;
+  int i;
+
+  for (i = 0; i < CAT_CACHE_SLOTS; i++) {
+    struct cache_slot *s = &cache->slots[i];
+    if (s->len && s->offset <= offset && offset < s->offset + s->len) {
+      slot = s;
+      break;
+    }
+  }
+  if (slot == NULL) {
+    slot = cache_fill(cache, offset);
+    if (slot == NULL || offset >= slot->offset + slot->len) {
+      return 0;
+    }
+  }
+  slot->used = ++cache->clock;
+
+  size_t avail = slot->offset + slot->len - offset;
+  if (len > avail) len = avail;
+  memcpy(buf, slot->data + (offset - slot->offset), len);
+  cache->next = offset + len;
+  return len;
+}
+
+static void cache_invalidate(struct block_cache *cache)
+{
+  int i;
+  for (i = 0; i < CAT_CACHE_SLOTS; i++) {
+    cache->slots[i].len = 0;
+  }
+}
+
+static unsigned long long cat_range(struct block_cache *cache, unsigned long long offset,
+                                    unsigned long long end)
+{
+  char buf[CAT_BLOCK_SIZE];
+  while (offset < end) {
+    size_t want = (end - offset < sizeof(buf)) ? (size_t)(end - offset) : sizeof(buf);
+    size_t got = cache_read(cache, offset, buf, want);
+    if (got == 0) break;
+    idb_write(buf, got);
+    offset += got;
+  }
+  fflush(stdout);
+  return offset;
+}
+
+/* [offset, end) read as it is rather than in aligned blocks: a tail that
+   crosses a block boundary is one device read, not two. */
+static unsigned long long cat_exact(struct block_cache *cache, unsigned long long offset,
+                                    unsigned long long end)
+{
+  if (offset >= end) {
+    return offset;
+  }
+  if (cache->position != offset) {
+    if (AFCFileRefSeek(cache->afc_conn, cache->fd, offset, 0)) {
+      return offset;
+    }
+    cache->position = offset;
+  }
+  char *buf = malloc(MIN(end - offset, CAT_READAHEAD_MAX));
+  while (offset < end) {
+    unsigned int len = MIN(end - offset, CAT_READAHEAD_MAX);
+    if (AFCFileRefRead(cache->afc_conn, cache->fd, buf, &len) || len == 0) break;
+    idb_write(buf, len);
+    offset += len;
+    cache->position += len;
+  }
+  free(buf);
+  cache->next = offset;         /* -f continues sequentially from here */
+  fflush(stdout);
+  return offset;
+}
+
+int cat_file(AMDeviceRef device)
+{
+  const char *path = command.paths[0];
+  struct afc_stat st;
+  afc_file_ref fd;
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  afc_connection *afc_conn = open_house_arrest(device, command.bundle_id);
+  if (afc_conn == NULL) {
+    return 1;
+  }
+  if (afc_stat_path(afc_conn, path, &st) != 0 || st.is_dir) {
+    idb_eprintf("%s doesn't exist \n", path);
+    close_house_arrest(afc_conn);
+    return 1;
+  }
+  int ret = AFCFileRefOpen(afc_conn, path, AFC_FILE_READ, &fd);
+  if (ret) {
+    idb_eprintf("Cannot Open: %s AFCFileRefOpen = %i\n", path, ret);
+    close_house_arrest(afc_conn);
+    return 1;
+  }
+
+  unsigned long long offset, end;
+  if (command.offset < 0) {
+    offset = ((unsigned long long)-command.offset > st.size) ? 0 : st.size + command.offset;
+  } else {
+    offset = command.offset;
+  }
+  end = (command.length < 0) ? st.size : MIN(st.size, offset + command.length);
+
+  struct block_cache cache;
+  cache_init(&cache, afc_conn, fd);
+  offset = (command.offset < 0) ? cat_exact(&cache, offset, end) : cat_range(&cache, offset, end);
+
+  while (command.follow) {
+    usleep(CAT_FOLLOW_USEC);
+    if (afc_stat_path(afc_conn, path, &st) != 0) break;
+    if (st.size < offset) {
+      idb_eprintf("%s: file truncated\n", path);
+      offset = 0;
+      cache_invalidate(&cache);
+    }
+    if (st.size > offset) {
+      offset = cat_range(&cache, offset, st.size);
+    }
+  }
+
+  cache_free(&cache);
+  AFCFileRefClose(afc_conn, fd);
+  close_house_arrest(afc_conn);
+  return 0;
+}
+
+/************************************************
+ idb verify [-j jobs] <bundle_id> <relative_dir>
+************************************************/
+struct verify_entry
+{
+  uint32_t crc;
+  unsigned long long size;
+  char *path;
+};
+
+struct verify_context
+{
+  pthread_mutex_t lock;
+  struct verify_entry *entries;
+  size_t count, next;
+  unsigned long long ok, mismatched, missing;
+};
+
+struct verify_worker
+{
+  struct verify_context *ctx;
+  afc_connection *afc_conn;
+};
+
+static int verify_file(afc_connection *afc_conn, struct verify_entry *entry, char *buf)
+{
+  afc_file_ref fd;
+  uint32_t crc = 0;
+  unsigned long long size = 0;
+  unsigned int len;
+
+  if (AFCFileRefOpen(afc_conn, entry->path, AFC_FILE_READ, &fd)) {
+    return -1;
+  }
+  for (;;) {
+    len = BUFFER_SIZE;
+    if (AFCFileRefRead(afc_conn, fd, buf, &len) || len == 0) break;
+    crc = crc32c_update(crc, buf, len);
+    size += len;
+  }
+  AFCFileRefClose(afc_conn, fd);
+  return (crc == entry->crc && size == entry->size) ? 0 : 1;
+}
+
+static void *verify_thread(void *arg)
+{
+  struct verify_worker *worker = (struct verify_worker *)arg;
+  struct verify_context *ctx = worker->ctx;
+  char *buf = malloc(BUFFER_SIZE);
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    size_t i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (i >= ctx->count) break;
+
+    struct verify_entry *entry = &ctx->entries[i];
+    int r = verify_file(worker->afc_conn, entry, buf);
+    if (r == 0) {
+      idb_printf("[" GREEN "OK" RESET "] %s \n", entry->path);
+    } else {
+      idb_eprintf("[" RED "NG" RESET "] %s %s\n", entry->path, r < 0 ? "(missing)" : "(mismatch)");
+    }
+    pthread_mutex_lock(&ctx->lock);
+    if (r == 0) ctx->ok++;
+    else if (r < 0) ctx->missing++;
+    else ctx->mismatched++;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+  free(buf);
+  return NULL;
+}
+
+static int load_manifest(struct verify_context *ctx, const char *prefix)
+{
+  char *path = manifest_path();
+  FILE *file = fopen(path, "r");
+  char line[4096];
+  size_t capacity = 0;
+  size_t plen = strlen(prefix);
+
+  if (file == NULL && errno == ENOENT && command.local_root != NULL &&
+      strcmp(command.local_root, command.bundle_id) != 0) {
+    /* no per-device manifest from cp; fall back to the one `up` wrote */
+    free(path);
+    path = str_join(command.bundle_id, ".crc32c");
+    file = fopen(path, "r");
+  }
+  if (file == NULL) {
+    idb_perror(path);
+    free(path);
+    return -1;
+  }
+  free(path);
+
+  while (fgets(line, sizeof(line), file)) {
+    struct verify_entry entry;
+    int n = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%x %llu %n", &entry.crc, &entry.size, &n) != 2 || n == 0) continue;
+    const char *name = line + n;
+    if (plen && !(strncmp(name, prefix, plen) == 0 && (name[plen] == '/' || name[plen] == '\0'))) continue;
+
+    if (ctx->count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      ctx->entries = realloc(ctx->entries, capacity * sizeof(struct verify_entry));
+    }
+    entry.path = strdup(name);
+    ctx->entries[ctx->count++] = entry;
+  }
+  fclose(file);
+  return 0;
+}
+
+int verify_dir(AMDeviceRef device)
+{
+  afc_connection *conns[command.jobs];
+  struct verify_context ctx;
+  size_t j;
+  int i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  char *root = local_root(device);
+  command.local_root = root;
+  int loaded = load_manifest(&ctx, command.dir_path);
+  command.local_root = NULL;
+  free(root);
+  if (loaded != 0) {
+    return 1;
+  }
+
+  if (connect_device(device) != 0) {
+    return 1;
+  }
+  int jobs = open_house_arrest_pool(device, command.bundle_id, conns, command.jobs);
+  if (jobs == 0) {
+    return 1;
+  }
+
+  pthread_t threads[jobs];
+  struct verify_worker workers[jobs];
+  pthread_mutex_init(&ctx.lock, NULL);
+  for (i = 0; i < jobs; i++) {
+    workers[i].ctx = &ctx;
+    workers[i].afc_conn = conns[i];
+    start_worker(&threads[i], verify_thread, &workers[i]);
+  }
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+    close_house_arrest(conns[i]);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+
+  idb_printf("verified %llu files, %llu mismatched, %llu missing\n",
+         ctx.ok + ctx.mismatched + ctx.missing, ctx.mismatched, ctx.missing);
+  for (j = 0; j < ctx.count; j++) {
+    free(ctx.entries[j].path);
+  }
+  free(ctx.entries);
+  return (ctx.mismatched || ctx.missing) ? 1 : 0;
+}
+
+/************************************************
+ idb crashes [-j jobs] [-p process] [dir]
+************************************************/
+/*
+  Crash reports come from the crash report copy service, an AFC root the
+  mover service first fills from the CrashReporter directory. Reports of a
+  device go to <dir>/<udid>/ and <dir>/<udid>/.crashes records
+  "<mtime> <size> <path>" for each one fetched, so a report is downloaded
+  again only when its mtime or size changes on the device. The listing is
+  walked and the new reports fetched by `jobs` connections at once.
+*/
+#define CRASH_INDEX      ".crashes"
+#define CRASH_MOVER_WAIT 10     /* seconds to wait for the mover's "ping" */
+
+struct crash_entry
+{
+  char *path;
+  unsigned long long mtime;
+  unsigned long long size;
+};
+
+struct crash_context
+{
+  pthread_mutex_t lock;
+  char *store;                  /* <dir>/<udid> */
+  struct crash_entry *known;    /* from the index, sorted by path */
+  size_t known_count;
+  struct crash_entry *fetch;    /* new or changed on the device */
+  size_t fetch_count, fetch_capacity, next;
+  FILE *index;
+  unsigned long long fetched, failed, current, bytes;
+};
+
+struct crash_worker
+{
+  struct crash_context *ctx;
+  afc_connection *afc_conn;
+};
+
+static int compare_crash_path(const void *a, const void *b)
+{
+  return strcmp(((const struct crash_entry *)a)->path, ((const struct crash_entry *)b)->path);
+}
+
+static int compare_crash_entry(const void *a, const void *b)
+{
+  const struct crash_entry *ea = a, *eb = b;
+  int cmp = compare_crash_path(a, b);
+  if (cmp != 0) return cmp;
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Reads the index; of repeated paths (runs append) the newest one counts. */
+static void crash_load_index(struct crash_context *ctx, const char *path)
+{
+  FILE *file = fopen(path, "r");
+  char line[4096];
+  size_t capacity = 0, i, n = 0;
+
+  if (file == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    struct crash_entry entry;
+    int offset = 0;
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%llu %llu %n", &entry.mtime, &entry.size, &offset) != 2 || offset == 0) continue;
+    if (ctx->known_count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      ctx->known = realloc(ctx->known, capacity * sizeof(struct crash_entry));
+    }
+    entry.path = strdup(line + offset);
+    ctx->known[ctx->known_count++] = entry;
+  }
+  fclose(file);
+
+  qsort(ctx->known, ctx->known_count, sizeof(struct crash_entry), compare_crash_entry);
+  for (i = 0; i < ctx->known_count; i++) {
+    if (i + 1 < ctx->known_count && strcmp(ctx->known[i].path, ctx->known[i + 1].path) == 0) {
+      free(ctx->known[i].path);
+      continue;
+    }
+    ctx->known[n++] = ctx->known[i];
+  }
+  ctx->known_count = n;
+}
+
+/* -p: reports are named <process>-<date>.ips or <process>_<date>_<device>.crash */
+static int crash_matches(const char *path)
+{
+  const char *name = strrchr(path, '/');
+  size_t len;
+
+  if (command.process == NULL) {
+    return 1;
+  }
+  name = name ? name + 1 : path;
+  len = strlen(command.process);
+  return strncmp(name, command.process, len) == 0 && name[len] != '\0' && strchr("-_.", name[len]) != NULL;
+}
+
+static int on_crash_entry(struct walk *walk, afc_connection *afc_conn, const char *path, struct afc_stat *st)
+{
+  struct crash_context *ctx = walk->context;
+  if (st->is_dir) {
+    return 1;
+  }
+  if (st->is_link || !crash_matches(path)) {
+    return 0;
+  }
+
+  struct crash_entry key = { (char *)path, 0, 0 };
+  struct crash_entry *known = bsearch(&key, ctx->known, ctx->known_count, sizeof(struct crash_entry),
+                                      compare_crash_path);
+  pthread_mutex_lock(&ctx->lock);
+  if (known != NULL && known->mtime == (unsigned long long)st->mtime && known->size == st->size) {
+    ctx->current++;
+  } else {
+    if (ctx->fetch_count == ctx->fetch_capacity) {
+      ctx->fetch_capacity = ctx->fetch_capacity ? ctx->fetch_capacity * 2 : 64;
+      ctx->fetch = realloc(ctx->fetch, ctx->fetch_capacity * sizeof(struct crash_entry));
+    }
+    ctx->fetch[ctx->fetch_count].path = strdup(path);
+    ctx->fetch[ctx->fetch_count].mtime = st->mtime;
+    ctx->fetch[ctx->fetch_count].size = st->size;
+    ctx->fetch_count++;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+/* Downloads into <path>.part, stamps the device mtime and renames it into place. */
+static int crash_fetch(afc_connection *afc_conn, struct crash_context *ctx, struct crash_entry *entry,
+                       char *buf, unsigned long long *size)
+{
+  char *local = file_join(ctx->store, entry->path);
+  char *part = str_join(local, ".part");
+  afc_file_ref fd;
+  unsigned int len;
+  int ret = -1;
+
+  *size = 0;
+  make_parent_dirs(local);
+  FILE *file = fopen(part, "wb");
+  if (file == NULL) {
+    idb_perror(part);
+  } else if (AFCFileRefOpen(afc_conn, entry->path, AFC_FILE_READ, &fd) == 0) {
+    ret = 0;
+    for (;;) {
+      len = BUFFER_SIZE;
+      if (AFCFileRefRead(afc_conn, fd, buf, &len) || len == 0) break;
+      if (fwrite(buf, 1, len, file) != len) {
+        idb_perror(part);
+        ret = -1;
+        break;
+      }
+      *size += len;
+    }
+    AFCFileRefClose(afc_conn, fd);
+  }
+  if (file != NULL && fclose(file) != 0) {
+    ret = -1;
+  }
+  if (ret == 0) {
+    struct timespec times[2] = { { (time_t)entry->mtime, 0 }, { (time_t)entry->mtime, 0 } };
+    utimensat(AT_FDCWD, part, times, 0);
+    ret = rename(part, local);
+  }
+  if (ret != 0) {
+    unlink(part);
+  }
+  free(part);
+  free(local);
+  return ret;
+}
 
-  */
-#ifdef DEBUG
-  CFIndex count = CFDictionaryGetCount(app_dict);
-  if (count > 0) {
-    CFStringRef *keys[count];
-    CFStringRef *values[count];
-    CFDictionaryGetKeysAndValues(app_dict,
-                                 (const void **)keys, (const void **)values);
+static void *crash_thread(void *arg)
+{
+  struct crash_worker *worker = (struct crash_worker *)arg;
+  struct crash_context *ctx = worker->ctx;
+  char *buf = malloc(BUFFER_SIZE);
 
-    int i;
-    for (i=0; i<count; i++) {
-      CFShow(keys[i]);
-      CFShow(values[i]);
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    size_t i = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (i >= ctx->fetch_count) break;
+
+    struct crash_entry *entry = &ctx->fetch[i];
+    unsigned long long size;
+    uint64_t start = probe_begin();
+    int r = crash_fetch(worker->afc_conn, ctx, entry, buf, &size);
+    probe_end(NULL, "file", "crashes", entry->path, start, 0);
+    if (r != 0) {
+      idb_eprintf("[" RED "NG" RESET "] %s \n", entry->path);
+    } else if (command.json) {
+      struct json_writer *w = json_record();
+      json_string(w, "path", entry->path);
+      json_int(w, "size", (long long)size);
+      json_int(w, "mtime", (long long)entry->mtime);
+      json_end(w);
+    } else {
+      idb_printf("[" GREEN "OK" RESET "] %s \n", entry->path);
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (r == 0) {
+      /* recorded as it arrives, so an interrupted run keeps what it fetched */
+      if (ctx->index != NULL) {
+        fprintf(ctx->index, "%llu %llu %s\n", entry->mtime, entry->size, entry->path);
+        fflush(ctx->index);
+      }
+      ctx->fetched++;
+      ctx->bytes += size;
+    } else {
+      ctx->failed++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+  }
+  free(buf);
+  return NULL;
+}
+
+/* Has the device move new reports to where the copy service serves them. */
+static void crash_move(AMDeviceRef device)
+{
+  service_conn_t socket;
+  char ping[4];
+
+  /* devices without a mover serve the CrashReporter directory as is */
+  if (AMDeviceStartService(device, AMSVC_CRASH_REPORT_MOVER, &socket, NULL) != 0) {
+    return;
+  }
+  struct pollfd pfd = { (int)socket, POLLIN, 0 };
+  if (poll(&pfd, 1, CRASH_MOVER_WAIT * 1000) > 0) {
+    read_all(socket, ping, sizeof(ping));
+  }
+  close(socket);
+}
+
+/* Opens `jobs` crash report copy connections; returns how many opened. */
+static int open_crash_pool(AMDeviceRef device, afc_connection **conns, int jobs)
+{
+  int i;
+  for (i = 0; i < jobs; i++) {
+    service_conn_t socket;
+    if (AMDeviceStartService(device, AMSVC_CRASH_REPORT_COPY, &socket, NULL) != 0 ||
+        AFCConnectionOpen(socket, 0, &conns[i]) != 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+int crash_reports(AMDeviceRef device)
+{
+  afc_connection *conns[command.jobs];
+  struct crash_context ctx;
+  char udid[64];
+  size_t j;
+  int i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  copy_udid(device, udid, sizeof(udid));
+  ctx.store = file_join(command.dir_path, udid);
+  char *index_path = file_join(ctx.store, CRASH_INDEX);
+  make_parent_dirs(index_path);
+  crash_load_index(&ctx, index_path);
+
+  int jobs = 0;
+  if (connect_device(device) == 0) {
+    crash_move(device);
+    jobs = open_crash_pool(device, conns, command.jobs);
+  }
+  if (jobs == 0) {
+    idb_eprintf("cannot start %s\n", "com.apple.crashreportcopymobile");
+    free(index_path);
+    free(ctx.store);
+    return 1;
+  }
+
+  struct walk walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.callback = on_crash_entry;
+  walk.context = &ctx;
+  walk.max_depth = -1;
+  pthread_mutex_init(&ctx.lock, NULL);
+  walk_tree(&walk, conns, jobs, "");
+
+  if ((ctx.index = fopen(index_path, "a")) == NULL) {
+    idb_perror(index_path);
+  }
+  pthread_t threads[jobs];
+  struct crash_worker workers[jobs];
+  for (i = 0; i < jobs; i++) {
+    workers[i].ctx = &ctx;
+    workers[i].afc_conn = conns[i];
+    start_worker(&threads[i], crash_thread, &workers[i]);
+  }
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+    AFCConnectionClose(conns[i]);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+  if (ctx.index != NULL) {
+    fclose(ctx.index);
+  }
+
+  (command.json ? idb_eprintf : idb_printf)("fetched %llu reports (%llu bytes) to %s, %llu up to date, %llu failed\n",
+                                           ctx.fetched, ctx.bytes, ctx.store, ctx.current, ctx.failed);
+  for (j = 0; j < ctx.known_count; j++) {
+    free(ctx.known[j].path);
+  }
+  for (j = 0; j < ctx.fetch_count; j++) {
+    free(ctx.fetch[j].path);
+  }
+  free(ctx.known);
+  free(ctx.fetch);
+  free(index_path);
+  free(ctx.store);
+  return ctx.failed ? 1 : 0;
+}
+
+/************************************************
+ idb screenshot [-r fps] [-n frames] [-t seconds] [-j writers] [path]
+************************************************/
+/*
+  screenshotr answers each ScreenShotRequest with the screen already
+  encoded (PNG, TIFF on old iOS), so what bounds the frame rate is the
+  device round trip. The capture loop keeps only that on its thread: each
+  reply is received into one of a fixed set of frame buffers and handed to
+  `writers` threads that write it out, so a slow disk shows up as waits for
+  a free buffer rather than as a longer capture period.
+*/
+#define SCREENSHOT_WRITERS 2
+#define SCREENSHOT_SPARE   2    /* frames in flight beyond one per writer */
+
+struct screenshot_frame
+{
+  struct devicelink_msg msg;    /* the reply; its buffer is reused */
+  const uint8_t *image;         /* ScreenShotData, inside msg.buf */
+  size_t len;
+  unsigned long index;
+  struct screenshot_frame *next;
+};
+
+struct screenshot_pipe
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct screenshot_frame *free;
+  struct screenshot_frame *ready, **ready_tail;
+  int done;
+  const char *dir;
+  unsigned long written, failed;
+  unsigned long long bytes;
+};
+
+static volatile sig_atomic_t screenshot_stop;
+
+static void on_screenshot_signal(int sig)
+{
+  screenshot_stop = 1;
+}
+
+static const char *screenshot_ext(const uint8_t *image, size_t len)
+{
+  if (len >= 4 && memcmp(image, "\x89PNG", 4) == 0) return "png";
+  if (len >= 4 && (memcmp(image, "II*\0", 4) == 0 || memcmp(image, "MM\0*", 4) == 0)) return "tiff";
+  return "img";
+}
+
+/* Starts screenshotr and does the version exchange; the socket or -1. */
+static int screenshot_open(AMDeviceRef device, struct devicelink_msg *msg)
+{
+  service_conn_t socket;
+
+  if (connect_device(device) != 0) {
+    return -1;
+  }
+  if (AMDeviceStartService(device, AMSVC_SCREENSHOT, &socket, NULL) != 0) {
+    idb_eprintf("cannot start screenshotr (is the developer disk image mounted?)\n");
+    return -1;
+  }
+  if (devicelink_handshake(socket, msg) != 0) {
+    idb_eprintf("screenshotr: version exchange failed\n");
+    close(socket);
+    return -1;
+  }
+  return socket;
+}
+
+/* One request and its reply, read into frame->msg. */
+static int screenshot_capture(int fd, struct screenshot_frame *frame)
+{
+  const void *k[] = { CFSTR("MessageType") };
+  const void *v[] = { CFSTR("ScreenShotRequest") };
+  CFDictionaryRef request = CFDictionaryCreate(NULL, k, v, 1, &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+  struct bplist_obj reply, data;
+  int ret = devicelink_process(fd, request);
+  CFRelease(request);
+
+  if (ret != 0 || devicelink_recv(fd, &frame->msg) != 0 || devicelink_payload(&frame->msg, &reply) != 0 ||
+      bplist_dict_get(&frame->msg.pl, &reply, "ScreenShotData", &data) != 0 || data.type != BPLIST_DATA) {
+    return -1;
+  }
+  frame->image = data.body;
+  frame->len = data.count;
+  return 0;
+}
+
+static int screenshot_write(const char *path, const uint8_t *image, size_t len)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  int ret = write_all(fd, image, len);
+  if (close(fd) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+static void *screenshot_writer(void *arg)
+{
+  struct screenshot_pipe *shots = (struct screenshot_pipe *)arg;
+  char path[PATH_MAX];
+
+  for (;;) {
+    pthread_mutex_lock(&shots->lock);
+    while (shots->ready == NULL && !shots->done) {
+      pthread_cond_wait(&shots->cond, &shots->lock);
+    }
+    struct screenshot_frame *frame = shots->ready;
+    if (frame == NULL) {
+      pthread_mutex_unlock(&shots->lock);
+      break;
+    }
+    if ((shots->ready = frame->next) == NULL) {
+      shots->ready_tail = &shots->ready;
+    }
+    pthread_mutex_unlock(&shots->lock);
+
+    snprintf(path, sizeof(path), "%s/frame-%06lu.%s", shots->dir, frame->index,
+             screenshot_ext(frame->image, frame->len));
+    uint64_t start = probe_begin();
+    int ret = screenshot_write(path, frame->image, frame->len);
+    probe_end(NULL, "file", "screenshot", path, start, 0);
+    if (ret != 0) {
+      idb_perror(path);
+    } else if (command.json) {
+      struct json_writer *w = json_record();
+      json_int(w, "frame", (long long)frame->index);
+      json_string(w, "path", path);
+      json_int(w, "size", (long long)frame->len);
+      json_end(w);
+    }
+
+    pthread_mutex_lock(&shots->lock);
+    if (ret == 0) {
+      shots->written++;
+      shots->bytes += frame->len;
+    } else {
+      shots->failed++;
+    }
+    frame->next = shots->free;
+    shots->free = frame;
+    pthread_cond_broadcast(&shots->cond);
+    pthread_mutex_unlock(&shots->lock);
+  }
+  return NULL;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+  struct timespec ts = { (time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !screenshot_stop) {
+  }
+}
+
+static int screenshot_loop(int fd, struct devicelink_msg *first, const char *dir)
+{
+  struct screenshot_pipe shots;
+  int writers = command.jobs, nframes = command.jobs + SCREENSHOT_SPARE, i;
+  struct screenshot_frame *frames = calloc(nframes, sizeof(*frames));
+  pthread_t threads[writers];
+  uint64_t period = command.rate > 0 ? (uint64_t)(1e9 / command.rate) : 0;
+  uint64_t capture_ns = 0, capture_max = 0;
+  unsigned long captured = 0, late = 0, waits = 0;
+  int ret = 0;
+
+  memset(&shots, 0, sizeof(shots));
+  pthread_mutex_init(&shots.lock, NULL);
+  pthread_cond_init(&shots.cond, NULL);
+  shots.ready_tail = &shots.ready;
+  shots.dir = dir;
+  frames[0].msg = *first;
+  memset(first, 0, sizeof(*first));
+  for (i = 0; i < nframes; i++) {
+    frames[i].next = shots.free;
+    shots.free = &frames[i];
+  }
+  for (i = 0; i < writers; i++) {
+    start_worker(&threads[i], screenshot_writer, &shots);
+  }
+
+  /* in the daemon the loop is bounded by -n/-t and Ctrl-C stays the daemon's */
+  struct sigaction action, saved;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_screenshot_signal;
+  if (!idbd.enabled) {
+    sigaction(SIGINT, &action, &saved);
+  }
+  screenshot_stop = 0;
+
+  uint64_t start = stats_now(), next = start;
+  while (!screenshot_stop) {
+    uint64_t now = stats_now();
+    if ((command.frames > 0 && captured >= (unsigned long)command.frames) ||
+        (command.seconds > 0 && now - start >= (uint64_t)(command.seconds * 1e9))) {
+      break;
+    }
+    if (period > 0) {
+      if (now < next) {
+        sleep_ns(next - now);
+        if (screenshot_stop) break;
+      } else if (now - next >= period) {
+        /* a whole period behind: drop the missed slots rather than burst */
+        late++;
+        next = now;
+      }
+      next += period;
+    }
+
+    pthread_mutex_lock(&shots.lock);
+    if (shots.free == NULL) {
+      waits++;
+      while (shots.free == NULL) {
+        pthread_cond_wait(&shots.cond, &shots.lock);
+      }
+    }
+    struct screenshot_frame *frame = shots.free;
+    shots.free = frame->next;
+    pthread_mutex_unlock(&shots.lock);
+
+    uint64_t capture_start = stats_now();
+    int r = screenshot_capture(fd, frame);
+    uint64_t capture_end = stats_now();
+    probe_end(NULL, "screenshot", "capture", NULL, capture_start, 0);
+
+    pthread_mutex_lock(&shots.lock);
+    if (r != 0) {
+      frame->next = shots.free;
+      shots.free = frame;
+      pthread_mutex_unlock(&shots.lock);
+      idb_eprintf("screenshotr: no reply to frame %lu\n", captured + 1);
+      ret = 1;
+      break;
+    }
+    if (captured == 0) {
+      /* the first frame tells the size: allocate every other buffer now, with
+         some headroom, so later replies are received without reallocating */
+      size_t cap = frame->msg.len + frame->msg.len / 4;
+      for (i = 0; i < nframes; i++) {
+        if (&frames[i] != frame && frames[i].msg.cap < cap) {
+          free(frames[i].msg.buf);
+          frames[i].msg.buf = malloc(cap);
+          frames[i].msg.cap = frames[i].msg.buf ? cap : 0;
+        }
+      }
+    }
+    frame->index = ++captured;
+    frame->next = NULL;
+    *shots.ready_tail = frame;
+    shots.ready_tail = &frame->next;
+    pthread_cond_broadcast(&shots.cond);
+    pthread_mutex_unlock(&shots.lock);
+
+    capture_ns += capture_end - capture_start;
+    capture_max = MAX(capture_max, capture_end - capture_start);
+  }
+  double seconds = (stats_now() - start) / 1e9;
+  if (!idbd.enabled) {
+    sigaction(SIGINT, &saved, NULL);
+  }
+
+  pthread_mutex_lock(&shots.lock);
+  shots.done = 1;
+  pthread_cond_broadcast(&shots.cond);
+  pthread_mutex_unlock(&shots.lock);
+  for (i = 0; i < writers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  double fps = seconds > 0 ? captured / seconds : 0;
+  double capture_avg = captured ? capture_ns / 1e6 / captured : 0;
+  if (command.json) {
+    struct json_writer *w = json_record();
+    json_int(w, "frames", (long long)captured);
+    json_double(w, "seconds", seconds);
+    json_double(w, "fps", fps);
+    json_double(w, "target_fps", command.rate);
+    json_double(w, "capture_ms", capture_avg);
+    json_double(w, "capture_max_ms", capture_max / 1e6);
+    json_int(w, "late", (long long)late);
+    json_int(w, "buffer_waits", (long long)waits);
+    json_int(w, "written", (long long)shots.written);
+    json_int(w, "bytes", (long long)shots.bytes);
+    json_end(w);
+  } else {
+    idb_printf("%lu frames in %.2f s: %.2f frames/s", captured, seconds, fps);
+    if (command.rate > 0) {
+      idb_printf(" (target %.2f, %lu late)", command.rate, late);
+    }
+    idb_printf(", capture %.1f ms avg %.1f ms max, %lu waits for a free buffer, %lu written (%llu bytes) to %s\n",
+               capture_avg, capture_max / 1e6, waits, shots.written, shots.bytes, dir);
+  }
+
+  for (i = 0; i < nframes; i++) {
+    devicelink_msg_free(&frames[i].msg);
+  }
+  free(frames);
+  pthread_cond_destroy(&shots.cond);
+  pthread_mutex_destroy(&shots.lock);
+  return (ret || shots.failed) ? 1 : 0;
+}
+
+int screenshot(AMDeviceRef device)
+{
+  struct screenshot_frame frame;
+  char udid[64];
+  int ret = 1;
+
+  memset(&frame, 0, sizeof(frame));
+  int fd = screenshot_open(device, &frame.msg);
+  if (fd < 0) {
+    devicelink_msg_free(&frame.msg);
+    return 1;
+  }
+  copy_udid(device, udid, sizeof(udid));
+
+  if (command.loop) {
+    /* several devices each get their own directory */
+    char *dir = (output_prefix[0] != '\0') ? file_join(command.dir_path, udid) : strdup(command.dir_path);
+    char *probe = file_join(dir, "frame");
+    make_parent_dirs(probe);
+    ret = screenshot_loop(fd, &frame.msg, dir);
+    free(probe);
+    free(dir);
+  } else if (screenshot_capture(fd, &frame) != 0) {
+    idb_eprintf("screenshotr: no reply\n");
+  } else {
+    char path[PATH_MAX];
+    if (command.dir_path != NULL && output_prefix[0] != '\0') {
+      /* shot.png becomes shot-<udid>.png so devices don't overwrite each other */
+      const char *base = strrchr(command.dir_path, '/');
+      const char *dot = strrchr(base ? base + 1 : command.dir_path, '.');
+      int stem = dot ? (int)(dot - command.dir_path) : (int)strlen(command.dir_path);
+      snprintf(path, sizeof(path), "%.*s-%s%s", stem, command.dir_path, udid, dot ? dot : "");
+    } else if (command.dir_path != NULL) {
+      snprintf(path, sizeof(path), "%s", command.dir_path);
+    } else if (output_prefix[0] != '\0') {
+      snprintf(path, sizeof(path), "screenshot-%s.%s", udid, screenshot_ext(frame.image, frame.len));
+    } else {
+      snprintf(path, sizeof(path), "screenshot.%s", screenshot_ext(frame.image, frame.len));
     }
+    if (screenshot_write(path, frame.image, frame.len) != 0) {
+      idb_perror(path);
+    } else {
+      if (command.json) {
+        struct json_writer *w = json_record();
+        json_string(w, "path", path);
+        json_int(w, "size", (long long)frame.len);
+        json_end(w);
+      } else {
+        idb_printf("%s (%zu bytes)\n", path, frame.len);
+      }
+      ret = 0;
+    }
+  }
+  devicelink_disconnect(fd);
+  close(fd);
+  devicelink_msg_free(&frame.msg);
+  return ret;
+}
+
+/************************************************
+ idb tunnel <iPhone port> <local port>
+************************************************/
+service_conn_t create_local_socket()
+{
+  int reuse = 1;
+  service_conn_t sock_local;
+  struct sockaddr_in addr_local;
+  socklen_t len_local;
+
+  /* socket */
+  if ((sock_local = socket(AF_INET, SOCK_STREAM, 0)) < 0) {  
+    ON_ERROR("create socket failed. \n");
+  }
+  setsockopt(sock_local, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+  addr_local.sin_family = AF_INET;
+  addr_local.sin_port = htons(command.port_local);
+  addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
+  /* bind */
+  len_local = sizeof(addr_local);
+  if (bind(sock_local, (struct sockaddr *)&addr_local, len_local) != 0) {
+    ON_ERROR("bind failed.");
+  }
+  /* listen */
+  if (listen(sock_local, 5) != 0) {
+    ON_ERROR("listen failed.");
+  }
+
+  if (command.port_local == 0 && getsockname(sock_local, (struct sockaddr *)&addr_local, &len_local) == 0) {
+      command.port_local = ntohs(addr_local.sin_port);
+  }
+  idb_printf ("Success: Open    localhost (%d)\n", command.port_local);  
+  return sock_local;
+}
+
+void forward_socket(service_conn_t sock_from, service_conn_t sock_to)
+{
+  char buf[BUFSIZ];
+
+  service_conn_t sock_accept;
+  struct sockaddr_in addr_accept;
+  socklen_t len_accept = sizeof(addr_accept);
+
+  if ((sock_accept = accept(sock_from, (struct sockaddr *)&addr_accept, &len_accept)) < 0) {
+    ON_ERROR("accept failed. \n");
+  }
+  uint64_t start = probe_begin();
+  ssize_t recv_size = recv(sock_accept, buf, sizeof(buf), 0);  
+  if (send(sock_to, buf, recv_size, 0) < 1) {
+    ON_ERROR("Failed: write sock_to.");
+  }
+  recv_size = recv(sock_to, buf, sizeof(buf), 0);
+  
+  if (send(sock_accept, buf, recv_size, 0) < 1) {
+    ON_ERROR("Failed: write sock_accept.");
+  }
+  close(sock_accept);
+  probe_end(NULL, "tunnel", "forward", NULL, start, 0);
+}
+
+int create_tunnel(AMDeviceRef device)
+{
+  if (connect_device(device) != 0) {
+    return 1;
   }
-#endif
 
-  CFStringRef app_type      = CFDictionaryGetValue(app_dict, CFSTR("ApplicationType"));
-  CFStringRef app_name      = CFDictionaryGetValue(app_dict, CFSTR("CFBundleDisplayName"));
-  CFStringRef app_container = CFDictionaryGetValue(app_dict, CFSTR("Container"));
+  /* to iPhone */
+  service_conn_t sock_iphone;
+  int ret = USBMuxConnectByPort(AMDeviceGetConnectionID(device), htons(command.port_ios), &sock_iphone);
+  if (ret != ERR_SUCCESS) {
+    ON_ERROR("Failed: Connect usb port(%d)\n", command.port_ios);
+  }
+  /* afc_connection *afc_conn; */
+  /* ret = AFCConnectionOpen(sock_iphone, 0, &afc_conn); */
+  /* if (ret != ERR_SUCCESS) { */
+  /*   idb_eprintf("AFCConnectionOpen = %i\n" , ret); */
+  /*   unregister_notification(1);   */
+  /* } */
+  idb_printf ("Success: Connect iOS Device(%d)\n", command.port_ios);
+
+  /* local port */
+  service_conn_t sock_local = create_local_socket();
+
+  /* select(2) */
+  fd_set fds, fds_org;
+  int maxfd;
+  int acceible;
+  
+  maxfd = MAX(sock_iphone, sock_local);
+  
+  FD_ZERO(&fds_org);
+  FD_SET(sock_iphone, &fds_org);
+  FD_SET(sock_local, &fds_org);
 
-  char *app_name_cstr      = (app_name      != NULL) ? CFSTR2CSTR(app_name)      : "-";
-  char *app_container_cstr = (app_container != NULL) ? CFSTR2CSTR(app_container) : "-";
+  idb_printf ("forwarding iOS(%u) => local(%u) \n", command.port_ios, command.port_local);
 
-  if (CFStringCompare(app_type, CFSTR("User"), kCFCompareLocalized) == kCFCompareEqualTo) {
-    printf ("%-20s\t%s\t %s\n",app_name_cstr, app_container_cstr, bundle_id);
-  /* } else if (CFStringCompare(app_type, CFSTR("System"), kCFCompareLocalized) == kCFCompareEqualTo) { */
-  /*   printf ("%-20s\t%s\n",app_name_cstr, bundle_id); */
+  while(1) {
+    memcpy(&fds, &fds_org, sizeof(fd_set));
+    if ((acceible = select(maxfd+1, &fds, NULL, NULL, NULL)) < 0) {
+      ON_ERROR("Failed: Select");
+    }
+    
+    if (FD_ISSET(sock_iphone, &fds)) {
+      forward_socket(sock_iphone, sock_local);
+    }
+    if (FD_ISSET(sock_local, &fds)) {
+//      idb_printf("Listening socket is readable.\n");
+      forward_socket(sock_local, sock_iphone);
+    }
   }
+  close(sock_iphone);
+  close(sock_local);  
+  return 0;  
 }
-CFComparisonResult compare_bundle_id (
-  const void *string1, const void *string2, void *locale)
-{
-      static CFOptionFlags compareOptions = kCFCompareCaseInsensitive |
-                                                  kCFCompareNonliteral |
-                                                  kCFCompareLocalized |
-                                                  kCFCompareNumerically |
-                                                  kCFCompareWidthInsensitive |
-        kCFCompareForcedOrdering;
 
-      CFRange string1Range = CFRangeMake(0, CFStringGetLength(string1));
+/*
+  With several devices the tunnel balances: every connection accepted on
+  the local port gets its own usbmux connection to port_ios on a device
+  picked round-robin or by fewest active connections.
+*/
+struct tunnel_device
+{
+  AMDeviceRef device;
+  char udid[64];
+  int active;
+  unsigned long total;
+  unsigned long long bytes_in;  /* device to local */
+  unsigned long long bytes_out; /* local to device */
+};
 
-          return CFStringCompareWithOptionsAndLocale
-            (string1, string2, string1Range, compareOptions, (CFLocaleRef)locale);
-}
-void print_apps(AMDeviceRef device)
+struct tunnel_pool
 {
-  connect_device(device);
+  pthread_mutex_t lock;
+  struct tunnel_device *devices;
+  int count;
+  int next;
+};
 
-  /* CFStringRef k[] = { CFSTR("kLookupReturnAttributesKey") }, v[] = { CFSTR("User") };  */
-  /* CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)&k, (const void **)&v, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks); */
-  CFDictionaryRef options = NULL;
+struct tunnel_conn
+{
+  struct tunnel_pool *pool;
+  struct tunnel_device *target;
+  int local;
+  int remote;
+};
 
-  CFDictionaryRef apps;
-  AMDeviceLookupApplications(device, options, &apps);
-  //CFDictionaryApplyFunction(apps, print_bundle_id, NULL);
-  CFIndex count = CFDictionaryGetCount(apps);
-  CFTypeRef *keysTypeRef = (CFTypeRef *) malloc( count * sizeof(CFTypeRef) );
-  CFDictionaryGetKeysAndValues(apps, (const void **) keysTypeRef, NULL);
-  const void **keys = (const void **) keysTypeRef;
+/* Index of the device for the next connection; caller holds pool->lock. */
+static int tunnel_pick(struct tunnel_pool *pool)
+{
+  int i, best = pool->next;
 
-  /* sort */
-  CFMutableArrayRef keyArray = CFArrayCreateMutable(kCFAllocatorDefault, count, NULL);
-  int i;
-  for (i=0; i<count; i++) {
-    CFArrayAppendValue(keyArray, keys[i]);
-  }
-  CFRange arrayRange = CFRangeMake(0, CFArrayGetCount(keyArray));
-  CFLocaleRef locale = CFLocaleCopyCurrent();
-  CFArraySortValues(keyArray, arrayRange,
-                     compare_bundle_id, (void *)locale);
-  for (i=0; i<count; i++) {
-    CFStringRef bundle_id = CFArrayGetValueAtIndex(keyArray, i);
-    CFDictionaryRef app_dict = CFDictionaryGetValue(apps, bundle_id);
-    on_app(bundle_id, app_dict, NULL);
+  if (command.balance == TUNNEL_LEAST_CONN) {
+    for (i = 1; i < pool->count; i++) {
+      int k = (pool->next + i) % pool->count;
+      if (pool->devices[k].active < pool->devices[best].active) best = k;
+    }
   }
-  
-  CFRelease(apps);
-  unregister_notification(0);  
+  pool->next = (best + 1) % pool->count;
+  return best;
 }
-/************************************************
- idb log
-************************************************/
-void print_syslog(AMDeviceRef device)
+
+static void *tunnel_relay_thread(void *arg)
 {
-  unsigned int socket;          /*  (*afc_connection)  */
-  connect_service(device, AMSVC_SYSLOG_RELAY, &socket);
+  struct tunnel_conn *conn = (struct tunnel_conn *)arg;
+  struct pollfd fds[2] = { { conn->local, POLLIN, 0 }, { conn->remote, POLLIN, 0 } };
+  unsigned long long in = 0, out = 0;
+  char buf[BUFSIZ];
+  uint64_t start = probe_begin();
 
-  char c;
-  while(recv(socket, &c, 1, 0) == 1) {
-    if(c != 0)
-      putchar(c);
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = recv(conn->local, buf, sizeof(buf), 0);
+      if (n <= 0 || write_all(conn->remote, buf, n) != 0) break;
+      out += n;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = recv(conn->remote, buf, sizeof(buf), 0);
+      if (n <= 0 || write_all(conn->local, buf, n) != 0) break;
+      in += n;
+    }
   }
-  unregister_notification(0);
-}
-/************************************************
- idb install 
-************************************************/
-static void on_transfer(CFDictionaryRef dict, int arg) {
-  int percent;
-  CFStringRef status = CFDictionaryGetValue(dict, CFSTR("Status"));
-  CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR("PercentComplete")), kCFNumberSInt32Type, &percent);
-  
-  printf("[%3d%%] %s\n", percent / 2, CFStringGetCStringPtr(status, kCFStringEncodingMacRoman));
-}
-static void on_install(CFDictionaryRef dict, int arg) {
-  int percent;
-  CFStringRef status = CFDictionaryGetValue(dict, CFSTR("Status"));
-  CFNumberGetValue(CFDictionaryGetValue(dict, CFSTR("PercentComplete")), kCFNumberSInt32Type, &percent);
-  
-  printf("[%3d%%] %s\n", (percent / 2) + 50, CFStringGetCStringPtr(status, kCFStringEncodingMacRoman));
+  close(conn->local);
+  close(conn->remote);
+  probe_end(NULL, "tunnel", "connection", conn->target->udid, start, 0);
+
+  struct tunnel_device *target = conn->target;
+  pthread_mutex_lock(&conn->pool->lock);
+  target->active--;
+  target->bytes_in += in;
+  target->bytes_out += out;
+  idb_printf("%s: closed (%llu in, %llu out) active=%d total=%lu in=%llu out=%llu\n",
+             target->udid, in, out, target->active, target->total, target->bytes_in, target->bytes_out);
+  pthread_mutex_unlock(&conn->pool->lock);
+  free(conn);
+  return NULL;
 }
-void install(AMDeviceRef device)
+
+int tunnel_balance(AMDeviceRef *list, int count)
 {
-  printf("[%3d%%] Start: %s\n", 0, command.app_path);  
+  struct tunnel_pool pool;
+  int i;
 
-  CFURLRef path = get_absolute_file_url(command.app_path);
-  
-  CFStringRef keys[] = { CFSTR("PackageType") }, values[] = { CFSTR("Developer") };
-  CFDictionaryRef options = CFDictionaryCreate(NULL, (const void **)&keys, (const void **)&values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  pthread_mutex_init(&pool.lock, NULL);
+  pool.devices = calloc(count, sizeof(struct tunnel_device));
+  pool.count = count;
+  pool.next = 0;
+  for (i = 0; i < count; i++) {
+    connect_device(list[i]);      /* a device that fails is skipped when connecting */
+    pool.devices[i].device = list[i];
+    copy_udid(list[i], pool.devices[i].udid, sizeof(pool.devices[i].udid));
+  }
 
-  /* Transfer */
-  connect_device(device);
-  assert(!AMDeviceSecureTransferPath(0, device, path, options,
-                                             NULL, 0));
+  service_conn_t sock_local = create_local_socket();
+  idb_printf("balancing local(%u) => iOS(%u) on %d devices (%s)\n", command.port_local, command.port_ios,
+             count, command.balance == TUNNEL_LEAST_CONN ? "least connections" : "round robin");
 
-  assert(!AMDeviceSecureInstallApplication(0, device, path,
-                                                   options, NULL, 0));
+  for (;;) {
+    int sock_accept = accept(sock_local, NULL, NULL);
+    if (sock_accept < 0) {
+      if (errno == EINTR) continue;
+      ON_ERROR("accept failed. \n");
+    }
 
-  CFRelease(path);
-  CFRelease(options);
+    struct tunnel_conn *conn = calloc(1, sizeof(*conn));
+    conn->pool = &pool;
+    conn->local = sock_accept;
+    conn->remote = -1;
+    int first = 0;
+    for (i = 0; i < count && conn->remote < 0; i++) {     /* fall through to the next device on failure */
+      /* connect without the lock so closing relays are not held up behind it */
+      pthread_mutex_lock(&pool.lock);
+      if (i == 0) {
+        first = tunnel_pick(&pool);
+      }
+      struct tunnel_device *target = &pool.devices[(first + i) % count];
+      target->active++;
+      pthread_mutex_unlock(&pool.lock);
 
-  printf("[OK] Installed app: %s\n", command.app_path);  
-  unregister_notification(0);
-}
+      service_conn_t sock_iphone;
+      int ret = USBMuxConnectByPort(AMDeviceGetConnectionID(target->device), htons(command.port_ios), &sock_iphone);
 
-/************************************************
- idb uninstall
-************************************************/
-void uninstall(AMDeviceRef device)
-{
-  CFStringRef bundle_id = CSTR2CFSTR(command.bundle_id);
-  connect_device(device);
-  
-  mach_error_t result = AMDeviceSecureUninstallApplication(0,device, bundle_id, 0, NULL, 0);
-  if (result != 0)
-  {
-    printf("AMDeviceSecureUnInstallApplication failed: %d\n", result);
-    unregister_notification(1);
+      pthread_mutex_lock(&pool.lock);
+      if (ret == ERR_SUCCESS) {
+        conn->target = target;
+        conn->remote = sock_iphone;
+        target->total++;
+      } else {
+        target->active--;
+      }
+      pthread_mutex_unlock(&pool.lock);
+      if (ret != ERR_SUCCESS) {
+        idb_eprintf("%s: Failed: Connect usb port(%d)\n", target->udid, command.port_ios);
+      }
+    }
+
+    pthread_t thread;
+    if (conn->remote < 0 || start_worker(&thread, tunnel_relay_thread, conn) != 0) {
+      if (conn->remote >= 0) {
+        pthread_mutex_lock(&pool.lock);
+        conn->target->active--;
+        pthread_mutex_unlock(&pool.lock);
+        close(conn->remote);
+      }
+      close(sock_accept);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
   }
-  
-  printf("Uninstalled bundle_id: %s\n", command.bundle_id);  
-  unregister_notification(0);
+  return 0;
 }
+
 /************************************************
- idb dir 
+ fan-out
 ************************************************/
-/*
-  keys
-  - st_ifmt (S_IFDIR, S_IFLNK)
-  - st_nlink
-  - st_size
-  - st_blocks
-  - st_mtime
-  - st_birthtime
-*/
-static void on_file(char *file_name, CFMutableDictionaryRef file_dict)
+struct fanout_job
 {
+  AMDeviceRef device;
+  pthread_t thread;
+  int status;
+};
 
-  time_t std_time;
-  time(&std_time);
-  std_time -= (24 * 60 * 60 * LS_BORDER_DAY);
-
-//  CFShow(file_dict);
-  CFStringRef ifmt = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_ifmt"));
-  char *ifmt_cstr = (CFStringCompare(ifmt,CFSTR("S_IFDIR"), kCFCompareLocalized) == kCFCompareEqualTo) ? "d" : "-";
-
-  CFStringRef nlink = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_nlink"));
-  CFStringRef size = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_size"));
-  CFStringRef mtime = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_mtime"));
-  time_t mtimel = atoll(CFSTR2CSTR(mtime)) / 1000000000L;
+static void *fanout_thread(void *arg)
+{
+  struct fanout_job *job = (struct fanout_job *)arg;
+  job->status = run_command(job->device);
+  return NULL;
+}
 
-  struct tm *mtimetm = localtime(&mtimel);
+/* Runs the command on every device at once; output is prefixed with the udid. */
+static int fanout_each(AMDeviceRef *list, int count)
+{
+  struct fanout_job jobs[count];
+  char saved[sizeof(output_prefix)];
+  char udid[64];
+  int i, failed = 0;
 
-  char tmbuf[64];
-  if (std_time <= mtimel) {
-    strftime(tmbuf, sizeof tmbuf, "%b %d %H:%M", mtimetm);
-  } else {
-    strftime(tmbuf, sizeof tmbuf, "%b %d  %Y", mtimetm);
+  if (count == 1) {
+    return run_command(list[0]);
   }
+  memcpy(saved, output_prefix, sizeof(saved));
+  for (i = 0; i < count; i++) {
+    jobs[i].device = list[i];
+    jobs[i].status = 1;
+    copy_udid(list[i], udid, sizeof(udid));
+    snprintf(output_prefix, sizeof(output_prefix), "[%s] ", udid);
+    if (start_worker(&jobs[i].thread, fanout_thread, &jobs[i]) != 0) {
+      jobs[i].thread = 0;
+    }
+  }
+  memcpy(output_prefix, saved, sizeof(saved));
 
-
-  printf ("%s---------%4s %s %6s %6s %s %s\n",
-          ifmt_cstr,
-          CFSTR2CSTR(nlink),    /* TOOD  */
-          user.pwd->pw_name,
-          user.grp->gr_name,
-          CFSTR2CSTR(size),
-          tmbuf,
-          file_name);
+  for (i = 0; i < count; i++) {
+    if (jobs[i].thread) {
+      pthread_join(jobs[i].thread, NULL);
+    }
+    if (jobs[i].status != 0) {
+      copy_udid(list[i], udid, sizeof(udid));
+      idb_eprintf("%s: failed with status %d\n", udid, jobs[i].status);
+      failed++;
+    }
+  }
+  if (failed) {
+    idb_eprintf("%d of %d devices failed\n", failed, count);
+  }
+  return failed ? 1 : 0;
 }
 
-void app_dir(AMDeviceRef device)
+int run_fanout(AMDeviceRef *list, int count)
 {
-  CFStringRef bundle_id = CSTR2CFSTR(command.bundle_id);
-  
-  service_conn_t socket;
-  connect_device(device);
-  create_user();
-  
-  AMDeviceStartHouseArrestService(device, bundle_id, NULL, &socket, 0);
-
-  afc_connection *afc_conn;
-  int ret = AFCConnectionOpen(socket, 0, &afc_conn);
-  if (ret != ERR_SUCCESS) {
-    printf ( "AFCConnectionOpen = %i\n" , ret );
-    unregister_notification(1);  
+  if (command.type == INSTALL) {
+    return install_all(list, count);
+  } else if (command.type == UP_DIR && count > 1) {
+    return up_dir_broadcast(list, count);
+  } else if (command.type == TUNNEL && count > 1) {
+    return tunnel_balance(list, count);
   }
-  struct afc_directory *dir;
-  char *dirent;
-  
-  AFCDirectoryOpen(afc_conn, command.dir_path, &dir); 
-  for (;;) {
-    AFCDirectoryRead(afc_conn, dir, &dirent);
-    if (!dirent) break;
+  return fanout_each(list, count);
+}
 
-    /* can't traverse */
-    if (strcmp(command.dir_path, ".") == 0 && strcmp(dirent, "..") == 0) continue;
+/* Picks the targeted devices once they have attached, runs, and exits. */
+static void *targeted_main(void *arg)
+{
+  AMDeviceRef list[MAX_DEVICES];
+  int count = select_devices(list, WAIT_DEVICE, SETTLE_MSEC);
 
-    struct afc_dictionary *file_info;
-    char *dir_path = str_join(command.dir_path, "/");
-    dir_path = str_join(dir_path, dirent);
-    int r = AFCFileInfoOpen(afc_conn, dir_path, &file_info);
-    if (r) {
-      printf("%s doesn't exist \n", dir_path);
-      continue;
-    }
-    CFMutableDictionaryRef file_dict = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
-                                                          &kCFTypeDictionaryKeyCallBacks,
-                                                          &kCFTypeDictionaryValueCallBacks);
-    char *key, *value;
-    AFCKeyValueRead(file_info, &key, &value);
-    while(key || value) {
-      CFStringRef k = CSTR2CFSTR(key);
-      CFStringRef v = CSTR2CFSTR(value);
-      CFDictionarySetValue(file_dict, k, v);
-      AFCKeyValueRead(file_info, &key, &value);
-    }
-    AFCKeyValueClose(file_info);
-    on_file(dirent, file_dict);
+  if (count == 0) {
+    idb_eprintf("No device attached\n");
+    unregister_notification(1);
   }
-  AFCDirectoryClose(afc_conn, dir);
-  unregister_notification(0);
+  int status = run_fanout(list, count);
+  if (count < command.udid_count) {
+    status = 1;
+  }
+  unregister_notification(status);
+  return NULL;
 }
 
 /************************************************
- idb cp <bundle_id> <relative_dir>
+ idb batch
 ************************************************/
-#define BUFFER_SIZE 1024 * 1024
+/*
+  One command per line, written as it would follow `idb` in a shell:
+
+    up com.example.app Documents        # comments run to end of line
+    cp com.example.app Library &
+    cp com.example.app "Application Support" &
+    wait
 
-void on_copy_file(afc_connection *afc_conn, const char *file_name)
+  A trailing `&` runs the line in the background until the next `wait`
+  (or the end of the script). The device session and the house arrest
+  connections, one per bundle id and concurrent line, stay open for the
+  whole batch. The script is parsed before anything runs; execution stops
+  at the first failing line unless -k is given.
+*/
+struct batch_job
 {
-  char *file_path = file_join(command.bundle_id, file_name);
-  FILE *file = fopen(file_path, "wb");
-  if (file == NULL) {
-    printf("Cannot Open: %s\n", file_path);
-  }
+  int lineno;
+  char *line;                   /* owns the strings argv points into */
+  char **argv;
+  int argc;
+  int background;
+  int wait;
+  AMDeviceRef device;
+  pthread_t thread;
+  int status;
+};
 
-  afc_file_ref fd;
-  int ret = AFCFileRefOpen(afc_conn, file_name, AFC_FILE_READ, &fd);
-  if (ret) {
-    //printf ( "Cannot Open: %s \n AFCFileRefOpen = %i\n" , file_name, ret );
-    fprintf(stderr, "[" RED "NG" RESET "] %s/%s \n", command.bundle_id, file_name);
-    fclose(file);
-    return;
-  }
-  fprintf(stdout, "[" GREEN "OK" RESET "] %s/%s \n", command.bundle_id, file_name);
+/* Splits `line` in place; handles '' and "" quoting, backslash escapes and # comments. */
+static int split_line(char *line, char ***argv_out, int *background)
+{
+  char **argv = malloc(sizeof(char *) * 2);
+  int argc = 1;
+  char *src = line, *dst = line;
 
-  int bytesRead = BUFFER_SIZE;
-  char *buf = (char *)malloc(BUFFER_SIZE);
-  if (!buf) {
-    return;
-  }
+  argv[0] = "idb";
+  *background = 0;
+  for (;;) {
+    while (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r') src++;
+    if (*src == '\0' || *src == '#') break;
 
-  for(;;)
-  {
-    ret = AFCFileRefRead(afc_conn, fd, buf, &bytesRead);
-    if (ret) {
-      printf ( "Cannot Read: AFCFileRefOpen = %i\n" ,ret );
-      free(buf);
-      return;
+    char *token = dst;
+    char quote = 0;
+    int quoted = 0;
+    for (; *src != '\0'; src++) {
+      if (quote) {
+        if (*src == quote) {
+          quote = 0;
+        } else if (*src == '\\' && quote == '"' && src[1] != '\0') {
+          *dst++ = *++src;
+        } else {
+          *dst++ = *src;
+        }
+      } else if (*src == '\'' || *src == '"') {
+        quote = *src;
+        quoted = 1;
+      } else if (*src == '\\' && src[1] != '\0') {
+        *dst++ = *++src;
+      } else if (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r') {
+        break;
+      } else {
+        *dst++ = *src;
+      }
     }
-    if (bytesRead == 0) break;
-    if (fwrite(buf, bytesRead, 1, file) != 1) {
-      printf ("%s\n","perrott");
-      perror(file_path);
-      exit(1);
+    if (quote) {
+      free(argv);
+      return -1;
+    }
+    int at_end = (*src == '\0');
+    if (!at_end) src++;
+    *dst++ = '\0';
+
+    if (!quoted && strcmp(token, "&") == 0) {
+      *background = 1;
+      continue;
     }
+    if (*background) {          /* `&` must be last */
+      free(argv);
+      return -1;
+    }
+    argv = realloc(argv, sizeof(char *) * (argc + 2));
+    argv[argc++] = token;
+    if (at_end) break;
   }
+  argv[argc] = NULL;
+  *argv_out = argv;
+  return argc;
+}
 
-  free(buf);
-  ret = AFCFileRefClose(afc_conn, fd);
-  fclose(file);
+static int batch_parse(struct batch_job *job)
+{
+  int json = command.json;      /* idb --json batch: every line writes records */
+  memset(&command, 0, sizeof(command));
+  memset(&find_expr, 0, sizeof(find_expr));
+  if (parse_command(job->argc, job->argv) != 0) return -1;
+  command.json |= json;
+  if (command.type == BATCH || command.udid_count || command.all_devices) return -1;
+  if (idbd.enabled && idbd_local_only()) return -1;
+  return 0;
+}
 
-  free(file_path);
+static int batch_run(struct batch_job *job)
+{
+  batch_parse(job);
+  job->status = run_command(job->device);
+  fflush(stdout);
+  if (job->status != 0) {
+    idb_eprintf("batch: line %d failed with status %d\n", job->lineno, job->status);
+  }
+  return job->status;
 }
 
-static void on_copy_dir(afc_connection *afc_conn, const char *path)
+static void *batch_thread(void *arg)
 {
-  struct afc_directory *dir;
-  char *dirent;
-  AFCDirectoryOpen(afc_conn, path, &dir);
-  for (;;) {
-    AFCDirectoryRead(afc_conn, dir, &dirent);
-    if (!dirent) break;
+  batch_run((struct batch_job *)arg);
+  return NULL;
+}
 
-    /* can't traverse */
-    if (strcmp(dirent, ".") == 0 || strcmp(dirent, "..") == 0) continue;
+/* Joins background jobs [first, last); returns nonzero if any failed. */
+static int batch_wait(struct batch_job *jobs, int first, int last)
+{
+  int i, failed = 0;
+  for (i = first; i < last; i++) {
+    if (jobs[i].background) {
+      pthread_join(jobs[i].thread, NULL);
+      failed |= (jobs[i].status != 0);
+    }
+  }
+  return failed;
+}
 
-    struct afc_dictionary *file_info;
+static int load_batch(const char *script, struct batch_job **jobs_out, int *count_out)
+{
+  FILE *file = (strcmp(script, "-") == 0) ? stdin : fopen(script, "r");
+  struct batch_job *jobs = NULL;
+  char *line = NULL;
+  size_t cap = 0;
+  int count = 0, lineno = 0, ret = 0;
 
-    char *dir_path = malloc(strlen(path) + 1);
-    strcpy(dir_path, path);
-    if (strcmp(dir_path, "") != 0 ) {
-      dir_path = str_join(dir_path, "/");
-    }
-    dir_path = str_join(dir_path, dirent);
+  if (file == NULL) {
+    idb_perror(script);
+    return -1;
+  }
+  while (getline(&line, &cap, file) != -1) {
+    struct batch_job job;
 
-    int r = AFCFileInfoOpen(afc_conn, dir_path, &file_info);
-    if (r) {
-      printf("%s doesn't exist \n", dir_path);
+    lineno++;
+    memset(&job, 0, sizeof(job));
+    job.lineno = lineno;
+    job.line = strdup(line);
+    job.argc = split_line(job.line, &job.argv, &job.background);
+    if (job.argc < 0) {
+      idb_eprintf("batch: line %d: unbalanced quote or misplaced &\n", lineno);
+      free(job.line);
+      ret = -1;
       continue;
     }
-    CFMutableDictionaryRef file_dict = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
-                                                          &kCFTypeDictionaryKeyCallBacks,
-                                                          &kCFTypeDictionaryValueCallBacks);
-    char *key, *value;
-    AFCKeyValueRead(file_info, &key, &value);
-    while(key || value) {
-      CFStringRef k = CSTR2CFSTR(key);
-      CFStringRef v = CSTR2CFSTR(value);
-      CFDictionarySetValue(file_dict, k, v);
-      AFCKeyValueRead(file_info, &key, &value);
+    if (job.argc == 1) {        /* blank or comment */
+      free(job.argv);
+      free(job.line);
+      continue;
     }
-    AFCKeyValueClose(file_info);
-
-    CFStringRef ifmt = (CFStringRef)CFDictionaryGetValue(file_dict,CFSTR("st_ifmt"));
-    if (CFStringCompare(ifmt,CFSTR("S_IFDIR"), kCFCompareLocalized) == kCFCompareEqualTo) {
-      char *tmp = file_join(command.bundle_id, dir_path);
-      make_dir(tmp);
-      free(tmp);
-      on_copy_dir(afc_conn, dir_path);
-    } else {
-      on_copy_file(afc_conn, dir_path);
+    if (job.argc == 2 && !job.background && strcmp(job.argv[1], "wait") == 0) {
+      job.wait = 1;
+    } else if (batch_parse(&job) != 0) {
+      idb_eprintf("batch: line %d: unknown command\n", lineno);
+      ret = -1;
     }
-    free(dir_path);
+    jobs = realloc(jobs, sizeof(struct batch_job) * (count + 1));
+    jobs[count++] = job;
   }
-  AFCDirectoryClose(afc_conn, dir);
+  free(line);
+  if (file != stdin) {
+    fclose(file);
+  }
+  *jobs_out = jobs;
+  *count_out = count;
+  return ret;
 }
 
-void copy_dir(AMDeviceRef device)
+int run_batch(AMDeviceRef device)
 {
-  CFStringRef bundle_id = CSTR2CFSTR(command.bundle_id);
-
-  service_conn_t socket;
-  connect_device(device);
-  create_user();
+  const char *script = command.script;
+  int keep_going = command.keep_going;
+  struct batch_job *jobs;
+  int count, i, first = 0, failed = 0;
 
-  AMDeviceStartHouseArrestService(device, bundle_id, NULL, &socket, 0);
-
-  afc_connection *afc_conn;
-  int ret = AFCConnectionOpen(socket, 0, &afc_conn);
-  if (ret != ERR_SUCCESS) {
-    printf ( "AFCConnectionOpen = %i\n" , ret );
-    unregister_notification(1);
+  int ret = load_batch(script, &jobs, &count);
+  if (ret == 0) {
+    attach_device(device);
+    if (start_session(device) != 0) {
+      idb_eprintf("batch: cannot start session\n");
+      ret = -1;
+    }
   }
 
-  make_dir(command.bundle_id);  /* root_dir */
-  if (strcmp(command.dir_path, "") != 0 ) {
-    char *root_dir = file_join(command.bundle_id, command.dir_path);
-    make_dir(root_dir);
-    free(root_dir);
+  afc_cache.enabled = 1;
+  for (i = 0; ret == 0 && i < count; i++) {
+    struct batch_job *job = &jobs[i];
+    job->device = device;
+    if (job->wait) {
+      failed |= batch_wait(jobs, first, i);
+      first = i + 1;
+    } else if (job->background) {
+      if (start_worker(&job->thread, batch_thread, job) != 0) {
+        job->background = 0;
+        batch_run(job);
+      }
+    } else {
+      failed |= (batch_run(job) != 0);
+    }
+    if (failed && !keep_going) break;
   }
+  failed |= batch_wait(jobs, first, i);
+  afc_cache.enabled = 0;
+  flush_house_arrest_cache();
 
-  on_copy_dir(afc_conn, command.dir_path);
-  unregister_notification(0);
+  if (ret == 0 && !idbd.enabled) {
+    detach_device(device);
+  }
+  for (i = 0; i < count; i++) {
+    free(jobs[i].argv);
+    free(jobs[i].line);
+  }
+  free(jobs);
+  return (ret != 0 || failed) ? 1 : 0;
 }
+
 /************************************************
- idb up <bundle_id> <relative_dir>
+ idb daemon
 ************************************************/
-void on_up_file(afc_connection *afc_conn, const char *file_name)
+/*
+  The daemon keeps devices attached with their sessions open and runs
+  commands sent by idb over a unix socket ($IDB_SOCKET, default
+  /tmp/idbd.<uid>.sock). A request is the client's cwd followed by its
+  argv; the reply is a sequence of frames <type:1><length:4><payload>
+  where type is '1' (stdout), '2' (stderr) or 'x' (exit status).
+*/
+static char *idbd_socket_path()
 {
-  char *file_path = file_join(command.bundle_id, file_name);
-
-  FILE *file = fopen(file_path, "rb");
-  if (file == NULL) {
-     printf("Cannot Open: %s\n", file_path);
-     return;
-  }
-
-  afc_file_ref fd;
-  int ret = AFCFileRefOpen(afc_conn, file_name, AFC_FILE_WRITE, &fd);
-  if (ret) {
-    //printf ( "Cannot Open: %s \n AFCFileRefOpen = %i\n" , file_name, ret );
-    fprintf(stderr, "[" RED "NG" RESET "] %s \n", file_name);
-    fclose(file);
-    return;
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  const char *env = getenv("IDB_SOCKET");
+  if (env != NULL) {
+    snprintf(path, sizeof(path), "%s", env);
+  } else {
+    snprintf(path, sizeof(path), "/tmp/idbd.%u.sock", (unsigned int)getuid());
   }
-  fprintf(stdout, "[" GREEN "OK" RESET "] %s \n", file_name);
+  return path;
+}
 
-  size_t read;
-  char *buf = (char *)malloc(BUFFER_SIZE);
-  if (!buf) {
-    return;
-  }
+/*
+  Commands that run until Ctrl-C, which would stop the daemon rather than
+  them, run in the idb process: syslog, tunnel, cat -f and a screenshot
+  loop without -n or -t.
+*/
+static int idbd_local_only()
+{
+  return command.type == PRINT_SYSLOG || command.type == TUNNEL ||
+    (command.type == CAT && command.follow) ||
+    (command.type == SCREENSHOT && command.loop && command.frames == 0 && command.seconds == 0);
+}
 
-  while ((read = fread(buf, 1, BUFFER_SIZE, file))) {
-    AFCFileRefWrite(afc_conn, fd, buf, read);
-  }
+static int send_frame(int fd, char type, const void *buf, uint32_t len)
+{
+  char header[5];
+  uint32_t be = htonl(len);
+  header[0] = type;
+  memcpy(header + 1, &be, 4);
+  if (write_all(fd, header, sizeof(header)) != 0) return -1;
+  return write_all(fd, buf, len);
+}
 
-  free(buf);
-  ret = AFCFileRefClose(afc_conn, fd);
+static int send_string(int fd, const char *str)
+{
+  uint32_t len = (uint32_t)strlen(str);
+  uint32_t be = htonl(len);
+  if (write_all(fd, &be, 4) != 0) return -1;
+  return write_all(fd, str, len);
+}
 
-  fclose(file);
-  free(file_path);
+static char *recv_string(int fd)
+{
+  uint32_t be, len;
+  if (read_all(fd, &be, 4) != 0) return NULL;
+  len = ntohl(be);
+  if (len > 1024 * 1024) return NULL;
+  char *str = malloc(len + 1);
+  if (read_all(fd, str, len) != 0) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
 }
 
-void on_up_dir(afc_connection *afc_conn, const char *file_name)
+/* Runs the command in the daemon; returns -1 when no daemon is listening. */
+int idbd_request(int argc, char *argv[], int *status)
 {
-  DIR* dir;
-  struct dirent* dp;
+  struct sockaddr_un addr;
+  char cwd[4096];
+  int i;
 
-  char *dir_path = file_join(command.bundle_id, file_name);
-  if ((dir = opendir(dir_path)) == NULL){
-    printf("cannnot open dir %s\n", file_name);
-    exit(1);
+  if (getenv("IDB_NO_DAEMON") != NULL || getcwd(cwd, sizeof(cwd)) == NULL) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, idbd_socket_path(), sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
   }
 
-  while((dp = readdir(dir)) != NULL){
-    char *dirent = dp->d_name;
-    if (strcmp(dirent, ".") == 0 || strcmp(dirent, "..") == 0) continue;
+  uint32_t count = htonl(argc + 1);
+  write_all(fd, &count, 4);
+  send_string(fd, cwd);
+  for (i = 0; i < argc; i++) {
+    send_string(fd, argv[i]);
+  }
 
-    char *path = file_join(dir_path, dirent);
-    char *relative_path = file_join(file_name, dirent);
-    if (opendir(path) == NULL){
-      on_up_file(afc_conn, relative_path);
-    } else {
-      on_up_dir(afc_conn, relative_path);
+  *status = 1;
+  for (;;) {
+    char header[5];
+    uint32_t len;
+    if (read_all(fd, header, sizeof(header)) != 0) break;
+    memcpy(&len, header + 1, 4);
+    len = ntohl(len);
+    char *buf = malloc(len ? len : 1);
+    if (read_all(fd, buf, len) != 0) {
+      free(buf);
+      break;
     }
-    free(relative_path);
-    free(path);
+    if (header[0] == '1') {
+      write_all(STDOUT_FILENO, buf, len);
+    } else if (header[0] == '2') {
+      write_all(STDERR_FILENO, buf, len);
+    } else if (header[0] == 'x' && len == 4) {
+      uint32_t be;
+      memcpy(&be, buf, 4);
+      *status = (int)ntohl(be);
+    }
+    free(buf);
   }
-  closedir(dir);
-  free(dir_path);
+  close(fd);
+  return 0;
 }
 
-void up_dir(AMDeviceRef device)
+struct idbd_pump
 {
-  CFStringRef bundle_id = CSTR2CFSTR(command.bundle_id);
-
-  service_conn_t socket;
-  connect_device(device);
-  create_user();
+  int client;
+  int out, err;
+};
 
-  AMDeviceStartHouseArrestService(device, bundle_id, NULL, &socket, 0);
+/* Frames whatever the command writes to stdout/stderr until both pipes close. */
+static void *idbd_pump_thread(void *arg)
+{
+  struct idbd_pump *pump = (struct idbd_pump *)arg;
+  struct pollfd fds[2] = { { pump->out, POLLIN, 0 }, { pump->err, POLLIN, 0 } };
+  char buf[BUFSIZ];
+  int open_fds = 2;
 
-  afc_connection *afc_conn;
-  int ret = AFCConnectionOpen(socket, 0, &afc_conn);
-  if (ret != ERR_SUCCESS) {
-    printf ( "AFCConnectionOpen = %i\n" , ret );
-    unregister_notification(1);
-    return;
+  while (open_fds > 0) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    int i;
+    for (i = 0; i < 2; i++) {
+      if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP))) continue;
+      ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+      if (n <= 0) {
+        fds[i].fd = -1;
+        open_fds--;
+        continue;
+      }
+      send_frame(pump->client, i == 0 ? '1' : '2', buf, (uint32_t)n);
+    }
   }
-
-  on_up_dir(afc_conn,  command.dir_path);
-
-  unregister_notification(0);
+  return NULL;
 }
 
-/************************************************
- idb tunnel <iPhone port> <local port>
-************************************************/
-service_conn_t create_local_socket()
+static int idbd_run(int client, AMDeviceRef *list, int count)
 {
-  int reuse = 1;
-  service_conn_t sock_local;
-  struct sockaddr_in addr_local;
-  socklen_t len_local;
+  int out[2], err[2];
+  struct idbd_pump pump;
+  pthread_t thread;
 
-  /* socket */
-  if ((sock_local = socket(AF_INET, SOCK_STREAM, 0)) < 0) {  
-    fprintf(stderr, "create socket failed. \n");
-    unregister_notification(1);
+  if (pipe(out) != 0 || pipe(err) != 0) {
+    return 1;
   }
-  setsockopt(sock_local, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+  fflush(stdout);
+  fflush(stderr);
+  int saved_out = dup(STDOUT_FILENO);
+  int saved_err = dup(STDERR_FILENO);
+  dup2(out[1], STDOUT_FILENO);
+  dup2(err[1], STDERR_FILENO);
+  close(out[1]);
+  close(err[1]);
 
-  addr_local.sin_family = AF_INET;
-  addr_local.sin_port = htons(command.port_local);
-  addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
-  /* bind */
-  len_local = sizeof(addr_local);
-  if (bind(sock_local, (struct sockaddr *)&addr_local, len_local) != 0) {
-    ON_ERROR("bind failed.");
-  }
-  /* listen */
-  if (listen(sock_local, 5) != 0) {
-    ON_ERROR("listen failed.");
-  }
+  pump.client = client;
+  pump.out = out[0];
+  pump.err = err[0];
+  pthread_create(&thread, NULL, idbd_pump_thread, &pump);
 
-  if (command.port_local == 0 && getsockname(sock_local, (struct sockaddr *)&addr_local, &len_local) == 0) {
-      command.port_local = ntohs(addr_local.sin_port);
+  int status = run_fanout(list, count);
+  if (count < command.udid_count) {
+    status = 1;
   }
-  printf ("Success: Open    localhost (%d)\n", command.port_local);  
-  return sock_local;
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_out, STDOUT_FILENO);
+  dup2(saved_err, STDERR_FILENO);
+  close(saved_out);
+  close(saved_err);
+  pthread_join(thread, NULL);
+  close(out[0]);
+  close(err[0]);
+  return status;
 }
 
-void forward_socket(service_conn_t sock_from, service_conn_t sock_to)
+static void *idbd_client_thread(void *arg)
 {
-  char buf[BUFSIZ];
-
-  service_conn_t sock_accept;
-  struct sockaddr_in addr_accept;
-  socklen_t len_accept = sizeof(addr_accept);
+  int client = (int)(intptr_t)arg;
+  uint32_t count, be;
+  char **strings = NULL;
+  uint32_t i, received = 0;
+  int status = 1;
 
-  if ((sock_accept = accept(sock_from, (struct sockaddr *)&addr_accept, &len_accept)) < 0) {
-    ON_ERROR("accept failed. \n");
-  }
-  ssize_t recv_size = recv(sock_accept, buf, sizeof(buf), 0);  
-  if (send(sock_to, buf, recv_size, 0) < 1) {
-    ON_ERROR("Failed: write sock_to.");
+  if (read_all(client, &be, 4) != 0 || (count = ntohl(be)) < 2 || count > 4096) {
+    close(client);
+    return NULL;
   }
-  recv_size = recv(sock_to, buf, sizeof(buf), 0);
-  
-  if (send(sock_accept, buf, recv_size, 0) < 1) {
-    ON_ERROR("Failed: write sock_accept.");
+  strings = calloc(count + 1, sizeof(char *));
+  for (i = 0; i < count; i++, received++) {
+    if ((strings[i] = recv_string(client)) == NULL) break;
   }
-  close(sock_accept);
-}
 
-void create_tunnel(AMDeviceRef device)
-{
-  connect_device(device);
+  if (received == count) {
+    char *cwd = strings[0];
+    char **argv = strings + 1;
+    int argc = (int)count - 1;
 
-  /* to iPhone */
-  service_conn_t sock_iphone;
-  int ret = USBMuxConnectByPort(AMDeviceGetConnectionID(device), htons(command.port_ios), &sock_iphone);
-  if (ret != ERR_SUCCESS) {
-    ON_ERROR("Failed: Connect usb port(%d)\n", command.port_ios);
+    pthread_mutex_lock(&idbd.lock);
+    memset(&command, 0, sizeof(command));
+    memset(&find_expr, 0, sizeof(find_expr));
+
+    if (parse_command(argc, argv) != 0) {
+      const char *msg = "Unknown command\n";
+      send_frame(client, '2', msg, (uint32_t)strlen(msg));
+    } else if (idbd_local_only()) {
+      const char *msg = "syslog, tunnel and unbounded screenshot loops run outside the daemon\n";
+      send_frame(client, '2', msg, (uint32_t)strlen(msg));
+    } else {
+      AMDeviceRef list[MAX_DEVICES];
+      int selected = select_devices(list, WAIT_DEVICE, 0);
+      if (selected == 0) {
+        const char *msg = "No device attached\n";
+        send_frame(client, '2', msg, (uint32_t)strlen(msg));
+      } else if (chdir(cwd) != 0) {
+        const char *msg = "Cannot change to client directory\n";
+        send_frame(client, '2', msg, (uint32_t)strlen(msg));
+      } else {
+        status = idbd_run(client, list, selected);
+        chdir("/");
+      }
+    }
+    pthread_mutex_unlock(&idbd.lock);
   }
-  /* afc_connection *afc_conn; */
-  /* ret = AFCConnectionOpen(sock_iphone, 0, &afc_conn); */
-  /* if (ret != ERR_SUCCESS) { */
-  /*   fprintf(stderr,"AFCConnectionOpen = %i\n" , ret); */
-  /*   unregister_notification(1);   */
-  /* } */
-  printf ("Success: Connect iOS Device(%d)\n", command.port_ios);
 
-  /* local port */
-  service_conn_t sock_local = create_local_socket();
+  be = htonl((uint32_t)status);
+  send_frame(client, 'x', &be, 4);
+  close(client);
+  for (i = 0; i < received; i++) {
+    free(strings[i]);
+  }
+  free(strings);
+  return NULL;
+}
 
-  /* select(2) */
-  fd_set fds, fds_org;
-  int maxfd;
-  int acceible;
-  
-  maxfd = MAX(sock_iphone, sock_local);
-  
-  FD_ZERO(&fds_org);
-  FD_SET(sock_iphone, &fds_org);
-  FD_SET(sock_local, &fds_org);
+static void *idbd_accept_thread(void *arg)
+{
+  int sock = (int)(intptr_t)arg;
+  for (;;) {
+    int client = accept(sock, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      idb_perror("idbd: accept");
+      break;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, idbd_client_thread, (void *)(intptr_t)client);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
 
-  printf ("forwarding iOS(%u) => local(%u) \n", command.port_ios, command.port_local);
+int run_daemon()
+{
+  struct sockaddr_un addr;
+  const char *path = idbd_socket_path();
+  pthread_t thread;
 
-  while(1) {
-    memcpy(&fds, &fds_org, sizeof(fd_set));
-    if ((acceible = select(maxfd+1, &fds, NULL, NULL, NULL)) < 0) {
-      ON_ERROR("Failed: Select");
-    }
-    
-    if (FD_ISSET(sock_iphone, &fds)) {
-      forward_socket(sock_iphone, sock_local);
-    }
-    if (FD_ISSET(sock_local, &fds)) {
-//      printf("Listening socket is readable.\n");
-      forward_socket(sock_local, sock_iphone);
-    }
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    idb_perror("idbd: socket");
+    return 1;
   }
-  close(sock_iphone);
-  close(sock_local);  
-  unregister_notification(0);  
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  /* created 0600 rather than chmod'ed after bind, which leaves a window */
+  mode_t mask = umask(077);
+  int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound != 0 || listen(sock, 16) != 0) {
+    idb_perror(path);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  idb_printf("idbd: listening on %s\n", path);
+  fflush(stdout);
+
+  idbd.enabled = 1;
+  pthread_create(&thread, NULL, idbd_accept_thread, (void *)(intptr_t)sock);
+  AMDSetLogLevel(1);
+  register_notification();
+  return 0;
 }
 
 /************************************************************************************************/
@@ -977,33 +6304,92 @@ void usage()
 {
   char* str = HDOC(
   Version: 0.2.0 \n
-    Usage:idb <command>\n
+    Usage:idb [--udid <udid>]... [--all] [--stats] [--trace file] [--json] <command>\n
     command is below \n
     - udid \n
-    - info \n
-    - apps \n
+    - info [-t cache_ttl] [key...]\n
+    - apps [-t cache_ttl]\n
     - logcat \n
     - ls <bundle_id> <relative_path>\n
     - cp <bundle_id> <relative_path>\n
     - up <bundle_id> <relative_path>\n
+    - find <bundle_id> [relative_path] [-name pattern] [-type f|d|l] [-size [+-]n[kMG]] [-mmin [+-]n] [-mtime [+-]n] [-maxdepth n] [-j jobs]\n
+    - mv <bundle_id> <src>... <dst>\n
+    - ln [-s] <bundle_id> <target> <link_name>\n
+    - rm [-r] [-n] [-j jobs] <bundle_id> <path>...\n
+    - cat [-o offset] [-l length] [-t bytes] [-f] <bundle_id> <path>\n
+    - verify [-j jobs] <bundle_id> <relative_path>\n
+    - crashes [-j jobs] [-p process] [dir]\n
+    - screenshot [-r fps] [-n frames] [-t seconds] [-j writers] [path]\n
+    - batch [-k] [script|-]\n
     - install <app_path or ipa_path> \n
     - uninstall <bundle_id> \n 
-    - tunnel <ios_port> <local_port>
+    - tunnel [-b rr|lc] <ios_port> <local_port>\n
+    - daemon \n
   );
-  printf("%s\n", str);
+  idb_printf("%s\n", str);
 }
 
-int main (int argc, char *argv[]) {
-  if (argc < 2) {
-    usage();
-    exit(1);
+/* Consumes leading --udid/--all/--stats/--trace/--json options; returns how many arguments they took. */
+static int parse_targets(int argc, char *argv[])
+{
+  int i = 1;
+  while (i < argc) {
+    if ((strcmp(argv[i], "--udid") == 0 || strcmp(argv[i], "-u") == 0) && i + 1 < argc) {
+      if (command.udid_count == MAX_DEVICES) return -1;
+      command.udids[command.udid_count++] = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--all") == 0) {
+      command.all_devices = 1;
+      i++;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      command.stats = 1;
+      i++;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      command.trace = argv[i + 1];
+      i += 2;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      command.json = 1;
+      i++;
+    } else {
+      break;
+    }
+  }
+  return i - 1;
+}
+
+int parse_command(int argc, char *argv[])
+{
+  int shift = parse_targets(argc, argv);
+  if (shift < 0) {
+    return -1;
   }
+  argc -= shift;
+  argv += shift;
   if ((argc == 2) && (strcmp(argv[1], "udid") == 0)) {
     command.type = PRINT_UDID;
-  } else if ((argc == 2) && (strcmp(argv[1], "info") == 0)) {
+  } else if ((argc >= 2) && (strcmp(argv[1], "info") == 0)) {
+    int i = 2;
     command.type = PRINT_INFO;
-  } else if ((argc == 2) && (strcmp(argv[1], "apps") == 0)) {
+    command.cache_ttl = -1;
+    if (argc > 2 && strcmp(argv[i], "-t") == 0) {
+      if (argc == 3) {
+        return -1;              /* -t without a value */
+      }
+      command.cache_ttl = atol(argv[i + 1]);
+      i += 2;
+    }
+    command.paths      = argv + i;
+    command.path_count = argc - i;
+  } else if ((argc == 2 || argc == 4) && (strcmp(argv[1], "apps") == 0)) {
     command.type = PRINT_APPS;
+    command.cache_ttl = -1;
+    if (argc == 4) {
+      if (strcmp(argv[2], "-t") != 0) {
+        return -1;
+      }
+      command.cache_ttl = atol(argv[3]);
+    }
   } else if ((argc == 2) && (strcmp(argv[1], "logcat") == 0)) {
     command.type = PRINT_SYSLOG;
   } else if ((argc == 3) && (strcmp(argv[1], "ls") == 0)) {
@@ -1026,27 +6412,211 @@ int main (int argc, char *argv[]) {
     command.type = UP_DIR;
     command.bundle_id = argv[2];
     command.dir_path  = argv[3];
+  } else if ((argc >= 3) && (strcmp(argv[1], "find") == 0)) {
+    int i = 3;
+    command.type = FIND;
+    command.bundle_id = argv[2];
+    command.dir_path  = "";
+    command.jobs      = WALK_JOBS;
+    if (i < argc && argv[i][0] != '-') {
+      command.dir_path = argv[i++];
+    }
+    if (parse_find_expr(argc - i, argv + i) != 0) {
+      return -1;
+    }
+  } else if ((argc >= 5) && (strcmp(argv[1], "mv") == 0)) {
+    command.type = MOVE;
+    command.bundle_id  = argv[2];
+    command.paths      = argv + 3;
+    command.path_count = argc - 3;
+  } else if ((argc == 5) && (strcmp(argv[1], "ln") == 0)) {
+    command.type = LINK;
+    command.link_type  = AFC_HARDLINK;
+    command.bundle_id  = argv[2];
+    command.paths      = argv + 3;
+    command.path_count = 2;
+  } else if ((argc == 6) && (strcmp(argv[1], "ln") == 0) && (strcmp(argv[2], "-s") == 0)) {
+    command.type = LINK;
+    command.link_type  = AFC_SYMLINK;
+    command.bundle_id  = argv[3];
+    command.paths      = argv + 4;
+    command.path_count = 2;
+  } else if ((argc >= 4) && (strcmp(argv[1], "rm") == 0)) {
+    int i = 2;
+    command.type = REMOVE;
+    command.jobs = WALK_JOBS;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+      if (strcmp(argv[i], "-r") == 0) {
+        command.recursive = 1;
+      } else if (strcmp(argv[i], "-n") == 0) {
+        command.dry_run = 1;
+      } else if (strcmp(argv[i], "-rn") == 0 || strcmp(argv[i], "-nr") == 0) {
+        command.recursive = command.dry_run = 1;
+      } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+        command.jobs = MAX(atoi(argv[++i]), 1);
+      } else {
+        break;
+      }
+    }
+    if (argc - i < 2) {
+      return -1;
+    }
+    command.bundle_id  = argv[i];
+    command.paths      = argv + i + 1;
+    command.path_count = argc - i - 1;
+  } else if ((argc >= 4) && (strcmp(argv[1], "cat") == 0)) {
+    int i = 2;
+    command.type = CAT;
+    command.offset = 0;
+    command.length = -1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i++) {
+      if (strcmp(argv[i], "-f") == 0) {
+        command.follow = 1;
+      } else if (strcmp(argv[i], "-o") == 0) {
+        command.offset = atoll(argv[++i]);
+      } else if (strcmp(argv[i], "-l") == 0) {
+        command.length = atoll(argv[++i]);
+      } else if (strcmp(argv[i], "-t") == 0) {
+        command.offset = -atoll(argv[++i]);
+      } else {
+        break;
+      }
+    }
+    if (argc - i != 2) {
+      return -1;
+    }
+    command.bundle_id  = argv[i];
+    command.paths      = argv + i + 1;
+    command.path_count = 1;
+  } else if ((argc >= 3) && (strcmp(argv[1], "verify") == 0)) {
+    int i = 2;
+    command.type = VERIFY;
+    command.jobs = WALK_JOBS;
+    if (argc > 4 && strcmp(argv[i], "-j") == 0) {
+      command.jobs = MAX(atoi(argv[i + 1]), 1);
+      i += 2;
+    }
+    if (argc - i < 1 || argc - i > 2) {
+      return -1;
+    }
+    command.bundle_id = argv[i];
+    command.dir_path  = (argc - i == 2) ? argv[i + 1] : "";
+  } else if ((argc >= 2) && (strcmp(argv[1], "crashes") == 0)) {
+    int i = 2;
+    command.type = CRASHES;
+    command.jobs = WALK_JOBS;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+      if (strcmp(argv[i], "-j") == 0) {
+        command.jobs = MAX(atoi(argv[i + 1]), 1);
+      } else if (strcmp(argv[i], "-p") == 0) {
+        command.process = argv[i + 1];
+      } else {
+        return -1;
+      }
+    }
+    if (argc - i > 1) {
+      return -1;
+    }
+    command.dir_path = (i < argc) ? argv[i] : "crashes";
+  } else if ((argc >= 2) && (strcmp(argv[1], "screenshot") == 0)) {
+    int i = 2;
+    command.type = SCREENSHOT;
+    command.jobs = SCREENSHOT_WRITERS;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+      if (strcmp(argv[i], "-r") == 0) {
+        command.rate = atof(argv[i + 1]);
+      } else if (strcmp(argv[i], "-n") == 0) {
+        command.frames = atol(argv[i + 1]);
+      } else if (strcmp(argv[i], "-t") == 0) {
+        command.seconds = atof(argv[i + 1]);
+      } else if (strcmp(argv[i], "-j") == 0) {
+        command.jobs = MAX(atoi(argv[i + 1]), 1);
+      } else {
+        return -1;
+      }
+      command.loop = 1;
+    }
+    if (argc - i > 1) {
+      return -1;
+    }
+    command.dir_path = (i < argc) ? argv[i] : (command.loop ? "screenshots" : NULL);
+  } else if ((argc >= 2) && (argc <= 4) && (strcmp(argv[1], "batch") == 0)) {
+    int i = 2;
+    command.type = BATCH;
+    if (i < argc && strcmp(argv[i], "-k") == 0) {
+      command.keep_going = 1;
+      i++;
+    }
+    if (argc - i > 1) {
+      return -1;
+    }
+    command.script = (i < argc) ? argv[i] : "-";
   } else if ((argc == 3) && (strcmp(argv[1], "install") == 0)) {
     command.type = INSTALL;
     command.app_path = argv[2];
   } else if ((argc == 3) && (strcmp(argv[1], "uninstall") == 0)) {
     command.type = UNINSTLL;
     command.bundle_id = argv[2];
-  } else if ((argc == 3) && (strcmp(argv[1], "tunnel") == 0)) {
-    command.type = TUNNEL;
-    command.port_ios   = (uint16_t)atoi(argv[2]);
-    command.port_local = 0;     /* ANY_PORT */
-  } else if ((argc == 4) && (strcmp(argv[1], "tunnel") == 0)) {
+  } else if ((argc >= 3) && (strcmp(argv[1], "tunnel") == 0)) {
+    int i = 2;
     command.type = TUNNEL;
-    command.port_ios   = (uint16_t)atoi(argv[2]);
-    command.port_local = (uint16_t)atoi(argv[3]);
+    if (argc > 4 && strcmp(argv[i], "-b") == 0) {
+      if (strcmp(argv[i + 1], "lc") == 0) {
+        command.balance = TUNNEL_LEAST_CONN;
+      } else if (strcmp(argv[i + 1], "rr") != 0) {
+        return -1;
+      }
+      i += 2;
+    }
+    if (argc - i < 1 || argc - i > 2) {
+      return -1;
+    }
+    command.port_ios   = (uint16_t)atoi(argv[i]);
+    command.port_local = (argc - i == 2) ? (uint16_t)atoi(argv[i + 1]) : 0;     /* 0: ANY_PORT */
   } else {
-    fprintf(stderr, "Unknown command\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main (int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    exit(1);
+  }
+  if (strcmp(argv[1], "daemon") == 0) {
+    return run_daemon();
+  }
+  if (parse_command(argc, argv) != 0) {
+    idb_eprintf("Unknown command\n");
     usage();
     exit(1);
   }
+  if (command.stats) {
+    stats_enabled = 1;
+    atexit(print_stats);
+  }
+  if (command.trace != NULL) {
+    if (trace_open(command.trace) != 0) {
+      idb_perror(command.trace);
+      exit(1);
+    }
+    atexit(trace_close);
+  }
+  /* the daemon has no access to our stdin, and --stats/--trace measure this process */
+  if (!idbd_local_only() && !command.stats && command.trace == NULL &&
+      !(command.type == BATCH && strcmp(command.script, "-") == 0)) {
+    int status;
+    if (idbd_request(argc, argv, &status) == 0) {
+      return status;
+    }
+  }
   AMDSetLogLevel(5);
   AMDAddLogFileDescriptor(fileno(stderr));
+  if (command.udid_count || command.all_devices) {
+    pthread_t thread;
+    start_worker(&thread, targeted_main, NULL);
+  }
   register_notification();
   return 0;
 }
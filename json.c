@@ -0,0 +1,135 @@
+#include "json.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void json_reserve(struct json_writer *w, size_t n)
+{
+  if (w->len + n > w->cap) {
+    w->cap = (w->len + n) * 2;
+    w->buf = realloc(w->buf, w->cap);
+  }
+}
+
+static void json_append(struct json_writer *w, const char *str, size_t n)
+{
+  json_reserve(w, n);
+  memcpy(w->buf + w->len, str, n);
+  w->len += n;
+}
+
+static void json_escaped(struct json_writer *w, const char *str, size_t n)
+{
+  static const char hex[] = "0123456789abcdef";
+  const char *run = str, *end = str + n;
+
+  json_reserve(w, n + 2);
+  w->buf[w->len++] = '"';
+  for (; str < end; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    /* copy the plain run before the character in one go */
+    json_append(w, run, str - run);
+    run = str + 1;
+    switch (c) {
+    case '"':  json_append(w, "\\\"", 2); break;
+    case '\\': json_append(w, "\\\\", 2); break;
+    case '\n': json_append(w, "\\n", 2); break;
+    case '\r': json_append(w, "\\r", 2); break;
+    case '\t': json_append(w, "\\t", 2); break;
+    default: {
+      char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+      json_append(w, u, sizeof(u));
+    }
+    }
+  }
+  json_append(w, run, end - run);
+  json_append(w, "\"", 1);
+}
+
+/* Separator and key of the next value. */
+static void json_key(struct json_writer *w, const char *key)
+{
+  if (w->len > 0 && w->buf[w->len - 1] != '{' && w->buf[w->len - 1] != '[') {
+    json_append(w, ",", 1);
+  }
+  if (key != NULL) {
+    json_escaped(w, key, strlen(key));
+    json_append(w, ":", 1);
+  }
+}
+
+void json_begin(struct json_writer *w)
+{
+  w->len = 0;
+  json_append(w, "{", 1);
+}
+
+void json_string(struct json_writer *w, const char *key, const char *value)
+{
+  json_stringn(w, key, value, strlen(value));
+}
+
+void json_stringn(struct json_writer *w, const char *key, const char *value, size_t len)
+{
+  json_key(w, key);
+  json_escaped(w, value, len);
+}
+
+void json_int(struct json_writer *w, const char *key, long long value)
+{
+  char num[24];
+  json_key(w, key);
+  json_append(w, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+void json_double(struct json_writer *w, const char *key, double value)
+{
+  char num[32];
+  if (!isfinite(value)) {
+    json_null(w, key);
+    return;
+  }
+  json_key(w, key);
+  json_append(w, num, snprintf(num, sizeof(num), "%.17g", value));
+}
+
+void json_bool(struct json_writer *w, const char *key, int value)
+{
+  json_key(w, key);
+  json_append(w, value ? "true" : "false", value ? 4 : 5);
+}
+
+void json_null(struct json_writer *w, const char *key)
+{
+  json_key(w, key);
+  json_append(w, "null", 4);
+}
+
+void json_open(struct json_writer *w, const char *key, char bracket)
+{
+  json_key(w, key);
+  json_append(w, &bracket, 1);
+}
+
+void json_close(struct json_writer *w, char bracket)
+{
+  json_append(w, &bracket, 1);
+}
+
+void json_end(struct json_writer *w)
+{
+  json_append(w, "}\n", 2);
+  w->write(w->buf, w->len);
+}
+
+void json_free(struct json_writer *w)
+{
+  free(w->buf);
+  w->buf = NULL;
+  w->len = w->cap = 0;
+}
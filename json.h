@@ -0,0 +1,44 @@
+/* ----------------------------------------------------------------------------
+ *   json.h - streaming NDJSON records for --json
+ *
+ *   A record is one JSON object on one line. Fields are appended to a
+ *   buffer the writer keeps between records and the finished line is handed
+ *   to a callback, so a listing of any length is written as it is produced
+ *   and memory is bounded by its largest record. Strings are escaped per
+ *   RFC 8259; UTF-8 is passed through as is.
+ * ------------------------------------------------------------------------- */
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+
+struct json_writer
+{
+  char *buf;
+  size_t len, cap;
+  void (*write)(const char *line, size_t len);  /* one whole record, newline included */
+};
+
+/* Starts a record; the buffer of the previous one is reused. */
+void json_begin(struct json_writer *w);
+
+/* Fields of the current record, or of the innermost open object. Inside
+   an array `key` must be NULL. */
+void json_string(struct json_writer *w, const char *key, const char *value);
+void json_stringn(struct json_writer *w, const char *key, const char *value, size_t len);
+void json_int(struct json_writer *w, const char *key, long long value);
+void json_double(struct json_writer *w, const char *key, double value);  /* null if not finite */
+void json_bool(struct json_writer *w, const char *key, int value);
+void json_null(struct json_writer *w, const char *key);
+
+/* Nested object ('{') or array ('['), closed with the matching bracket. */
+void json_open(struct json_writer *w, const char *key, char bracket);
+void json_close(struct json_writer *w, char bracket);
+
+/* Finishes the record and passes it to w->write. */
+void json_end(struct json_writer *w);
+
+void json_free(struct json_writer *w);
+
+#endif
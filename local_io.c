@@ -0,0 +1,641 @@
+#include "local_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#define URING_ENTRIES        256
+#define URING_BUFFER_SIZE    (64 * 1024)
+#define URING_BUFFERS        128                  /* 8 MiB of write data, registered with the ring */
+
+enum
+{
+  OP_OPEN,
+  OP_WRITE,
+  OP_CLOSE,
+  OP_MKDIR
+};
+
+struct uring_op
+{
+  int type;
+  struct local_file *file;
+  char *buf;                    /* OP_WRITE: a slot of the buffer pool */
+  int buffer;                   /* OP_WRITE: index of that slot */
+  size_t len;
+  unsigned long long offset;
+  const char *path;             /* OP_MKDIR */
+  int done;
+  int result;
+  struct uring_op *next;
+};
+
+struct local_file
+{
+  char *path;
+  FILE *stream;                 /* stdio */
+
+  int fd;                       /* io_uring: -1 until the open completes */
+  int opened;
+  int failed;
+  int close_requested;
+  int writes;                   /* queued or in flight */
+  unsigned long long offset;
+  struct uring_op *pending;     /* writes waiting for the open */
+  struct uring_op **pending_tail;
+};
+
+struct local_io
+{
+  enum local_io_backend backend;
+  int errors;
+
+#ifdef __linux__
+  int ring_fd;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+  struct io_uring_sqe *sqes;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned entries;
+  unsigned cq_entries;
+  unsigned to_submit;
+  unsigned inflight;
+  int has_mkdirat;
+
+  /* writes copy into a fixed pool, reused op and buffer alike; no malloc per write */
+  char *buffers;
+  struct uring_op *write_ops;
+  int *free_slots;
+  int free_count;
+  int registered;               /* pool registered: writes go out as WRITE_FIXED */
+
+  /* follow-up operations produced while reaping completions */
+  struct uring_op *ready;
+  struct uring_op **ready_tail;
+#endif
+};
+
+static int stdio_mkdir(const char *path)
+{
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    return -errno;
+  }
+  return 0;
+}
+
+static void report(struct local_io *io, const char *path, int err)
+{
+  fprintf(stderr, "%s: %s\n", path, strerror(err));
+  io->errors++;
+}
+
+static void free_file(struct local_file *file)
+{
+  free(file->path);
+  free(file);
+}
+
+/************************************************************************************************/
+/* io_uring */
+#ifdef __linux__
+
+static int uring_setup(struct local_io *io)
+{
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t probe_size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+
+  memset(&p, 0, sizeof(p));
+  io->ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (io->ring_fd < 0) {
+    return -1;
+  }
+
+  probe = calloc(1, probe_size);
+  if (syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0 ||
+      probe->last_op < IORING_OP_CLOSE ||
+      !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+      !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) ||
+      !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)) {
+    free(probe);
+    close(io->ring_fd);
+    return -1;
+  }
+  io->has_mkdirat = probe->last_op >= IORING_OP_MKDIRAT &&
+                    (probe->ops[IORING_OP_MKDIRAT].flags & IO_URING_OP_SUPPORTED);
+  int has_write_fixed = (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) != 0;
+  free(probe);
+
+  io->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (io->cq_size > io->sq_size) io->sq_size = io->cq_size;
+    io->cq_size = io->sq_size;
+  }
+  io->sq_ptr = mmap(NULL, io->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    io->ring_fd, IORING_OFF_SQ_RING);
+  if (io->sq_ptr == MAP_FAILED) {
+    close(io->ring_fd);
+    return -1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    io->cq_ptr = io->sq_ptr;
+  } else {
+    io->cq_ptr = mmap(NULL, io->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      io->ring_fd, IORING_OFF_CQ_RING);
+    if (io->cq_ptr == MAP_FAILED) {
+      munmap(io->sq_ptr, io->sq_size);
+      close(io->ring_fd);
+      return -1;
+    }
+  }
+  io->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED) {
+    if (io->cq_ptr != io->sq_ptr) munmap(io->cq_ptr, io->cq_size);
+    munmap(io->sq_ptr, io->sq_size);
+    close(io->ring_fd);
+    return -1;
+  }
+
+  io->sq_head  = (unsigned *)((char *)io->sq_ptr + p.sq_off.head);
+  io->sq_tail  = (unsigned *)((char *)io->sq_ptr + p.sq_off.tail);
+  io->sq_mask  = (unsigned *)((char *)io->sq_ptr + p.sq_off.ring_mask);
+  io->sq_array = (unsigned *)((char *)io->sq_ptr + p.sq_off.array);
+  io->cq_head  = (unsigned *)((char *)io->cq_ptr + p.cq_off.head);
+  io->cq_tail  = (unsigned *)((char *)io->cq_ptr + p.cq_off.tail);
+  io->cq_mask  = (unsigned *)((char *)io->cq_ptr + p.cq_off.ring_mask);
+  io->cqes     = (struct io_uring_cqe *)((char *)io->cq_ptr + p.cq_off.cqes);
+  io->entries  = p.sq_entries;
+  io->cq_entries = p.cq_entries;
+  io->ready = NULL;
+  io->ready_tail = &io->ready;
+
+  io->buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+  io->write_ops = calloc(URING_BUFFERS, sizeof(struct uring_op));
+  io->free_slots = malloc(URING_BUFFERS * sizeof(int));
+  for (io->free_count = 0; io->free_count < URING_BUFFERS; io->free_count++) {
+    io->free_slots[io->free_count] = URING_BUFFERS - 1 - io->free_count;
+  }
+  if (has_write_fixed) {
+    /* fails past RLIMIT_MEMLOCK; plain writes from the same pool then */
+    struct iovec iov[URING_BUFFERS];
+    int i;
+    for (i = 0; i < URING_BUFFERS; i++) {
+      iov[i].iov_base = io->buffers + (size_t)i * URING_BUFFER_SIZE;
+      iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    io->registered = syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+  }
+  return 0;
+}
+
+static void uring_teardown(struct local_io *io)
+{
+  free(io->buffers);
+  free(io->write_ops);
+  free(io->free_slots);
+  munmap(io->sqes, io->entries * sizeof(struct io_uring_sqe));
+  if (io->cq_ptr != io->sq_ptr) munmap(io->cq_ptr, io->cq_size);
+  munmap(io->sq_ptr, io->sq_size);
+  close(io->ring_fd);
+}
+
+static void uring_enter(struct local_io *io, unsigned wait_nr)
+{
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->to_submit, wait_nr,
+                       wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret > 0) {
+    io->to_submit -= ret;
+    io->inflight += ret;
+  }
+}
+
+static void release_write(struct local_io *io, struct uring_op *op)
+{
+  io->free_slots[io->free_count++] = op->buffer;
+}
+
+/* The close that follows a file's last write. */
+static void defer_close(struct local_io *io, struct local_file *file);
+
+static void defer(struct local_io *io, struct uring_op *op)
+{
+  op->next = NULL;
+  *io->ready_tail = op;
+  io->ready_tail = &op->next;
+}
+
+static void complete(struct local_io *io, struct uring_op *op, int res)
+{
+  struct local_file *file = op->file;
+
+  switch (op->type) {
+  case OP_MKDIR:
+    op->done = 1;
+    op->result = (res == -EEXIST) ? 0 : res;
+    return;
+
+  case OP_OPEN:
+    if (res < 0) {
+      report(io, file->path, -res);
+      file->failed = 1;
+      while (file->pending) {
+        struct uring_op *w = file->pending;
+        file->pending = w->next;
+        release_write(io, w);
+      }
+      file->writes = 0;
+      if (file->close_requested) free_file(file);
+    } else {
+      file->fd = res;
+      file->opened = 1;
+      while (file->pending) {
+        struct uring_op *w = file->pending;
+        file->pending = w->next;
+        defer(io, w);
+      }
+      if (file->close_requested && file->writes == 0) {
+        op->type = OP_CLOSE;
+        defer(io, op);
+        return;
+      }
+    }
+    free(op);
+    return;
+
+  case OP_WRITE:
+    if (res == 0) {
+      res = -EIO;
+    } else if (res > 0 && (size_t)res < op->len) {
+      /* short write: queue the remainder at the advanced offset */
+      memmove(op->buf, op->buf + res, op->len - res);
+      op->len -= res;
+      op->offset += res;
+      defer(io, op);
+      return;
+    }
+    if (res < 0 && !file->failed) {
+      report(io, file->path, -res);
+      file->failed = 1;
+    }
+    release_write(io, op);
+    file->writes--;
+    if (file->close_requested && file->writes == 0) {
+      defer_close(io, file);
+    }
+    return;
+
+  case OP_CLOSE:
+    if (res < 0 && !file->failed) {
+      report(io, file->path, -res);
+    }
+    free_file(file);
+    free(op);
+    return;
+  }
+}
+
+static void defer_close(struct local_io *io, struct local_file *file)
+{
+  struct uring_op *op = calloc(1, sizeof(*op));
+  op->type = OP_CLOSE;
+  op->file = file;
+  defer(io, op);
+}
+
+static void uring_reap(struct local_io *io)
+{
+  unsigned head = *io->cq_head;
+  unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+    complete(io, (struct uring_op *)(uintptr_t)cqe->user_data, cqe->res);
+    head++;
+    io->inflight--;
+  }
+  __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+  Entries are submitted only here, once the ring is full, and when the
+  caller waits (uring_pump with wait_nr), so a run of small files costs one
+  io_uring_enter per ring rather than one per call. Keeps the ring from
+  overrunning the completion queue, waiting for half of what is in flight
+  rather than a single completion.
+*/
+static struct io_uring_sqe *uring_get_sqe(struct local_io *io)
+{
+  while (io->inflight + io->to_submit >= io->cq_entries) {
+    uring_enter(io, io->inflight > 1 ? io->inflight / 2 : 1);
+    uring_reap(io);
+  }
+  if (io->to_submit == io->entries) {
+    uring_enter(io, 0);
+  }
+  unsigned tail = *io->sq_tail;
+  unsigned index = tail & *io->sq_mask;
+  struct io_uring_sqe *sqe = &io->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  io->to_submit++;
+  return sqe;
+}
+
+static void uring_prep(struct local_io *io, struct uring_op *op)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(io);
+
+  switch (op->type) {
+  case OP_MKDIR:
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->path;
+    sqe->len = 0755;
+    break;
+  case OP_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->file->path;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    sqe->len = 0644;
+    break;
+  case OP_WRITE:
+    sqe->opcode = io->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->buf_index = io->registered ? op->buffer : 0;
+    sqe->fd = op->file->fd;
+    sqe->addr = (uintptr_t)op->buf;
+    sqe->len = (unsigned)op->len;
+    sqe->off = op->offset;
+    break;
+  case OP_CLOSE:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = op->file->fd;
+    break;
+  }
+  sqe->user_data = (uintptr_t)op;
+}
+
+/* Submits follow-ups; prepping may reap, which can defer more of them. */
+static void uring_drain(struct local_io *io)
+{
+  while (io->ready) {
+    struct uring_op *op = io->ready;
+    io->ready = op->next;
+    if (io->ready == NULL) io->ready_tail = &io->ready;
+    uring_prep(io, op);
+  }
+}
+
+static void uring_pump(struct local_io *io, unsigned wait_nr)
+{
+  uring_drain(io);
+  uring_enter(io, wait_nr);
+  uring_reap(io);
+  uring_drain(io);
+}
+
+/* Picks up completions already posted, without a syscall. */
+static void uring_poll(struct local_io *io)
+{
+  uring_reap(io);
+  uring_drain(io);
+}
+
+static int uring_mkdir(struct local_io *io, const char *path)
+{
+  struct uring_op op;
+
+  if (!io->has_mkdirat) {
+    return stdio_mkdir(path);
+  }
+  memset(&op, 0, sizeof(op));
+  op.type = OP_MKDIR;
+  op.path = path;
+  uring_prep(io, &op);
+  while (!op.done) {
+    /* everything queued so far is submitted with it; wait for all of it at once */
+    uring_pump(io, io->inflight + io->to_submit);
+  }
+  return op.result;
+}
+
+static struct local_file *uring_open(struct local_io *io, struct local_file *file)
+{
+  struct uring_op *op = calloc(1, sizeof(*op));
+  op->type = OP_OPEN;
+  op->file = file;
+  uring_prep(io, op);
+  uring_poll(io);
+  return file;
+}
+
+static int uring_write(struct local_io *io, struct local_file *file, const void *buf, size_t len)
+{
+  const char *data = buf;
+
+  while (len > 0) {
+    /* every slot queued: submit and wait for a write to finish */
+    while (io->free_count == 0) {
+      uring_pump(io, 1);
+    }
+    if (file->failed) {
+      return -1;
+    }
+
+    size_t n = len < URING_BUFFER_SIZE ? len : URING_BUFFER_SIZE;
+    int slot = io->free_slots[--io->free_count];
+    struct uring_op *op = &io->write_ops[slot];
+    memset(op, 0, sizeof(*op));
+    op->type = OP_WRITE;
+    op->file = file;
+    op->buffer = slot;
+    op->buf = io->buffers + (size_t)slot * URING_BUFFER_SIZE;
+    memcpy(op->buf, data, n);
+    op->len = n;
+    op->offset = file->offset;
+    file->offset += n;
+    file->writes++;
+    data += n;
+    len -= n;
+
+    if (file->opened) {
+      uring_prep(io, op);
+    } else {
+      op->next = NULL;
+      *file->pending_tail = op;
+      file->pending_tail = &op->next;
+    }
+  }
+  uring_poll(io);
+  return 0;
+}
+
+static int uring_close(struct local_io *io, struct local_file *file)
+{
+  file->close_requested = 1;
+  if (file->failed && !file->opened) {
+    free_file(file);
+    return -1;
+  }
+  if (file->opened && file->writes == 0) {
+    struct uring_op *op = calloc(1, sizeof(*op));
+    op->type = OP_CLOSE;
+    op->file = file;
+    uring_prep(io, op);
+  }
+  /* open still in flight: its completion issues the close (or frees on failure) */
+  uring_poll(io);
+  return 0;
+}
+
+static void uring_wait(struct local_io *io)
+{
+  uring_drain(io);
+  while (io->inflight > 0 || io->to_submit > 0 || io->ready) {
+    uring_pump(io, io->to_submit ? 0 : 1);
+  }
+}
+
+#endif /* __linux__ */
+
+/************************************************************************************************/
+struct local_io *local_io_create(enum local_io_backend backend)
+{
+  struct local_io *io = calloc(1, sizeof(*io));
+
+  io->backend = LOCAL_IO_STDIO;
+#ifdef __linux__
+  if (backend == LOCAL_IO_URING && uring_setup(io) == 0) {
+    io->backend = LOCAL_IO_URING;
+  }
+#endif
+  return io;
+}
+
+void local_io_destroy(struct local_io *io)
+{
+  local_io_wait(io);
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    uring_teardown(io);
+  }
+#endif
+  free(io);
+}
+
+const char *local_io_name(struct local_io *io)
+{
+  return (io->backend == LOCAL_IO_URING) ? "uring" : "stdio";
+}
+
+enum local_io_backend local_io_backend_from_name(const char *name)
+{
+  if (name == NULL) return LOCAL_IO_DEFAULT;
+  if (strcmp(name, "stdio") == 0) return LOCAL_IO_STDIO;
+  if (strcmp(name, "uring") == 0) return LOCAL_IO_URING;
+  return LOCAL_IO_DEFAULT;
+}
+
+int local_io_mkdir(struct local_io *io, const char *path)
+{
+  int ret;
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    ret = uring_mkdir(io, path);
+  } else
+#endif
+  ret = stdio_mkdir(path);
+
+  if (ret < 0) {
+    report(io, path, -ret);
+  }
+  return ret;
+}
+
+struct local_file *local_io_open(struct local_io *io, const char *path)
+{
+  struct local_file *file = calloc(1, sizeof(*file));
+  file->path = strdup(path);
+  file->fd = -1;
+  file->pending_tail = &file->pending;
+
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    return uring_open(io, file);
+  }
+#endif
+  file->stream = fopen(path, "wb");
+  if (file->stream == NULL) {
+    report(io, path, errno);
+    free_file(file);
+    return NULL;
+  }
+  return file;
+}
+
+int local_io_write(struct local_io *io, struct local_file *file, const void *buf, size_t len)
+{
+  if (file == NULL) return -1;
+  if (len == 0) return 0;
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    return uring_write(io, file, buf, len);
+  }
+#endif
+  if (fwrite(buf, len, 1, file->stream) != 1) {
+    if (!file->failed) report(io, file->path, errno);
+    file->failed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+int local_io_close(struct local_io *io, struct local_file *file)
+{
+  if (file == NULL) return -1;
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    return uring_close(io, file);
+  }
+#endif
+  int ret = fclose(file->stream);
+  if (ret != 0 && !file->failed) {
+    report(io, file->path, errno);
+  }
+  free_file(file);
+  return ret;
+}
+
+int local_io_wait(struct local_io *io)
+{
+  int errors;
+#ifdef __linux__
+  if (io->backend == LOCAL_IO_URING) {
+    uring_wait(io);
+  }
+#endif
+  errors = io->errors;
+  io->errors = 0;
+  return errors;
+}
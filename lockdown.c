@@ -0,0 +1,343 @@
+#include "lockdown.h"
+#include "usbmux.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef IDB_OPENSSL
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#endif
+
+#define PLIST_MAX_MESSAGE (64 * 1024 * 1024)
+
+struct lockdown
+{
+  int fd;
+  uint32_t device_id;
+  char udid[64];
+  CFStringRef session_id;
+  pthread_mutex_t lock;         /* one request at a time */
+#ifdef IDB_OPENSSL
+  SSL_CTX *ctx;
+  SSL *ssl;
+#endif
+};
+
+/* `ssl` is an SSL * on a session that switched to TLS, else NULL. */
+static int io_write(int fd, void *ssl, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n;
+#ifdef IDB_OPENSSL
+    if (ssl != NULL) {
+      n = SSL_write(ssl, p, (int)len);
+    } else
+#endif
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int io_read(int fd, void *ssl, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n;
+#ifdef IDB_OPENSSL
+    if (ssl != NULL) {
+      n = SSL_read(ssl, p, (int)len);
+    } else
+#endif
+    n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int frame_send(int fd, void *ssl, CFPropertyListRef plist)
+{
+  CFDataRef data = CFPropertyListCreateData(NULL, plist, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+  if (data == NULL) {
+    return -1;
+  }
+  uint32_t len = (uint32_t)CFDataGetLength(data);
+  unsigned char header[4] = { len >> 24, len >> 16, len >> 8, len };
+  int ret = io_write(fd, ssl, header, 4);
+  if (ret == 0) {
+    ret = io_write(fd, ssl, CFDataGetBytePtr(data), len);
+  }
+  CFRelease(data);
+  return ret;
+}
+
+static CFPropertyListRef frame_recv(int fd, void *ssl)
+{
+  unsigned char header[4];
+  if (io_read(fd, ssl, header, 4) != 0) {
+    return NULL;
+  }
+  uint32_t len = ((uint32_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+  if (len > PLIST_MAX_MESSAGE) {
+    return NULL;
+  }
+  UInt8 *buf = malloc(len ? len : 1);
+  if (io_read(fd, ssl, buf, len) != 0) {
+    free(buf);
+    return NULL;
+  }
+  CFDataRef data = CFDataCreateWithBytesNoCopy(NULL, buf, len, kCFAllocatorNull);
+  CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+  CFRelease(data);
+  free(buf);
+  return plist;
+}
+
+int plist_send(int fd, CFPropertyListRef plist)
+{
+  return frame_send(fd, NULL, plist);
+}
+
+CFPropertyListRef plist_recv(int fd)
+{
+  return frame_recv(fd, NULL);
+}
+
+static void *lockdown_ssl(struct lockdown *ld)
+{
+#ifdef IDB_OPENSSL
+  return ld->ssl;
+#else
+  return NULL;
+#endif
+}
+
+/* Sends `request` with its Label and returns the reply, NULL on I/O errors or an Error reply. */
+static CFDictionaryRef lockdown_request(struct lockdown *ld, CFMutableDictionaryRef request)
+{
+  CFPropertyListRef reply = NULL;
+
+  CFDictionarySetValue(request, CFSTR("Label"), CFSTR("idb"));
+  pthread_mutex_lock(&ld->lock);
+  if (frame_send(ld->fd, lockdown_ssl(ld), request) == 0) {
+    reply = frame_recv(ld->fd, lockdown_ssl(ld));
+  }
+  pthread_mutex_unlock(&ld->lock);
+  if (reply != NULL && (CFGetTypeID(reply) != CFDictionaryGetTypeID() ||
+                        CFDictionaryGetValue(reply, CFSTR("Error")) != NULL)) {
+    CFRelease(reply);
+    reply = NULL;
+  }
+  return reply;
+}
+
+static CFMutableDictionaryRef lockdown_message(CFStringRef request)
+{
+  CFMutableDictionaryRef msg = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                         &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue(msg, CFSTR("Request"), request);
+  return msg;
+}
+
+struct lockdown *lockdown_open(uint32_t device_id, const char *udid)
+{
+  int fd = usbmux_connect(device_id, USBMUX_LOCKDOWN_PORT);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct lockdown *ld = calloc(1, sizeof(*ld));
+  ld->fd = fd;
+  ld->device_id = device_id;
+  strncpy(ld->udid, udid, sizeof(ld->udid) - 1);
+  pthread_mutex_init(&ld->lock, NULL);
+
+  CFMutableDictionaryRef msg = lockdown_message(CFSTR("QueryType"));
+  CFDictionaryRef reply = lockdown_request(ld, msg);
+  CFRelease(msg);
+  if (reply == NULL) {
+    lockdown_close(ld);
+    return NULL;
+  }
+  CFRelease(reply);
+  return ld;
+}
+
+#ifdef IDB_OPENSSL
+static void lockdown_ssl_free(struct lockdown *ld)
+{
+  if (ld->ssl != NULL) {
+    SSL_free(ld->ssl);          /* no close_notify: the socket stays in use */
+    ld->ssl = NULL;
+  }
+  if (ld->ctx != NULL) {
+    SSL_CTX_free(ld->ctx);
+    ld->ctx = NULL;
+  }
+}
+#endif
+
+void lockdown_close(struct lockdown *ld)
+{
+  if (ld == NULL) {
+    return;
+  }
+  if (ld->session_id != NULL) {
+    lockdown_stop_session(ld);
+  }
+#ifdef IDB_OPENSSL
+  lockdown_ssl_free(ld);
+#endif
+  close(ld->fd);
+  pthread_mutex_destroy(&ld->lock);
+  free(ld);
+}
+
+CFTypeRef lockdown_get_value(struct lockdown *ld, CFStringRef domain, CFStringRef key)
+{
+  CFMutableDictionaryRef msg = lockdown_message(CFSTR("GetValue"));
+  CFTypeRef value = NULL;
+
+  if (domain != NULL) CFDictionarySetValue(msg, CFSTR("Domain"), domain);
+  if (key != NULL) CFDictionarySetValue(msg, CFSTR("Key"), key);
+  CFDictionaryRef reply = lockdown_request(ld, msg);
+  CFRelease(msg);
+  if (reply != NULL) {
+    value = CFDictionaryGetValue(reply, CFSTR("Value"));
+    if (value != NULL) CFRetain(value);
+    CFRelease(reply);
+  }
+  return value;
+}
+
+#ifdef IDB_OPENSSL
+/* TLS on the lockdown socket as the host of the pair record. */
+static int lockdown_start_ssl(struct lockdown *ld, CFDictionaryRef record)
+{
+  CFDataRef cert = CFDictionaryGetValue(record, CFSTR("HostCertificate"));
+  CFDataRef key = CFDictionaryGetValue(record, CFSTR("HostPrivateKey"));
+  if (cert == NULL || key == NULL) {
+    return -1;
+  }
+  BIO *cert_bio = BIO_new_mem_buf(CFDataGetBytePtr(cert), (int)CFDataGetLength(cert));
+  BIO *key_bio = BIO_new_mem_buf(CFDataGetBytePtr(key), (int)CFDataGetLength(key));
+  X509 *x509 = PEM_read_bio_X509(cert_bio, NULL, NULL, NULL);
+  EVP_PKEY *pkey = PEM_read_bio_PrivateKey(key_bio, NULL, NULL, NULL);
+  int ret = -1;
+
+  ld->ctx = SSL_CTX_new(TLS_client_method());
+  if (ld->ctx != NULL && x509 != NULL && pkey != NULL) {
+    /* device certificates are self-signed with old algorithms */
+    SSL_CTX_set_security_level(ld->ctx, 0);
+    SSL_CTX_set_min_proto_version(ld->ctx, 0);
+    SSL_CTX_set_verify(ld->ctx, SSL_VERIFY_NONE, NULL);
+    if (SSL_CTX_use_certificate(ld->ctx, x509) == 1 && SSL_CTX_use_PrivateKey(ld->ctx, pkey) == 1) {
+      ld->ssl = SSL_new(ld->ctx);
+      SSL_set_fd(ld->ssl, ld->fd);
+      ret = (SSL_connect(ld->ssl) == 1) ? 0 : -1;
+    }
+  }
+  if (x509 != NULL) X509_free(x509);
+  if (pkey != NULL) EVP_PKEY_free(pkey);
+  BIO_free(cert_bio);
+  BIO_free(key_bio);
+  if (ret != 0) {
+    lockdown_ssl_free(ld);
+  }
+  return ret;
+}
+#endif
+
+int lockdown_start_session(struct lockdown *ld)
+{
+  CFDictionaryRef record = usbmux_read_pair_record(ld->udid);
+  if (record == NULL) {
+    return -1;
+  }
+  CFMutableDictionaryRef msg = lockdown_message(CFSTR("StartSession"));
+  CFTypeRef host_id = CFDictionaryGetValue(record, CFSTR("HostID"));
+  CFTypeRef buid = CFDictionaryGetValue(record, CFSTR("SystemBUID"));
+  if (host_id != NULL) CFDictionarySetValue(msg, CFSTR("HostID"), host_id);
+  if (buid != NULL) CFDictionarySetValue(msg, CFSTR("SystemBUID"), buid);
+  CFDictionaryRef reply = lockdown_request(ld, msg);
+  CFRelease(msg);
+
+  int ret = -1;
+  if (reply != NULL) {
+    CFStringRef session_id = CFDictionaryGetValue(reply, CFSTR("SessionID"));
+    CFBooleanRef ssl = CFDictionaryGetValue(reply, CFSTR("EnableSessionSSL"));
+    ret = 0;
+    if (ssl != NULL && CFBooleanGetValue(ssl)) {
+#ifdef IDB_OPENSSL
+      ret = lockdown_start_ssl(ld, record);
+#else
+      ret = -1;                 /* the device wants TLS: build with -DIDB_OPENSSL */
+#endif
+    }
+    if (ret == 0 && session_id != NULL) {
+      ld->session_id = CFRetain(session_id);
+    }
+    CFRelease(reply);
+  }
+  CFRelease(record);
+  return ret;
+}
+
+int lockdown_stop_session(struct lockdown *ld)
+{
+  if (ld->session_id == NULL) {
+    return 0;
+  }
+  CFMutableDictionaryRef msg = lockdown_message(CFSTR("StopSession"));
+  CFDictionarySetValue(msg, CFSTR("SessionID"), ld->session_id);
+  CFDictionaryRef reply = lockdown_request(ld, msg);
+  CFRelease(msg);
+  CFRelease(ld->session_id);
+  ld->session_id = NULL;
+#ifdef IDB_OPENSSL
+  /* lockdownd goes back to plain text after StopSession */
+  lockdown_ssl_free(ld);
+#endif
+  if (reply == NULL) {
+    return -1;
+  }
+  CFRelease(reply);
+  return 0;
+}
+
+int lockdown_start_service(struct lockdown *ld, CFStringRef service)
+{
+  CFMutableDictionaryRef msg = lockdown_message(CFSTR("StartService"));
+  CFDictionarySetValue(msg, CFSTR("Service"), service);
+  CFDictionaryRef reply = lockdown_request(ld, msg);
+  CFRelease(msg);
+  if (reply == NULL) {
+    return -1;
+  }
+  CFNumberRef cf_port = CFDictionaryGetValue(reply, CFSTR("Port"));
+  CFBooleanRef ssl = CFDictionaryGetValue(reply, CFSTR("EnableServiceSSL"));
+  int32_t port = 0;
+  if (cf_port != NULL) {
+    CFNumberGetValue(cf_port, kCFNumberSInt32Type, &port);
+  }
+  /* services idb uses are plain; TLS ones are not supported here */
+  int fd = -1;
+  if (ssl != NULL && CFBooleanGetValue(ssl)) {
+    fd = LOCKDOWN_UNSUPPORTED;
+  } else if (port > 0) {
+    fd = usbmux_connect(ld->device_id, (uint16_t)port);
+  }
+  CFRelease(reply);
+  return fd;
+}
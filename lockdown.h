@@ -0,0 +1,41 @@
+/* ----------------------------------------------------------------------------
+ *   lockdown.h - lockdownd client
+ *
+ *   lockdownd (device port 62078) answers value queries and starts services
+ *   once a session is open. Messages are XML plists behind a 4 byte
+ *   big-endian length, the framing plist services such as house_arrest and
+ *   installation_proxy use too. Devices ask for TLS on the session with the
+ *   host's pair record certificate; that needs a build with -DIDB_OPENSSL
+ *   (-lssl -lcrypto).
+ * ------------------------------------------------------------------------- */
+
+#ifndef LOCKDOWN_H
+#define LOCKDOWN_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdint.h>
+
+struct lockdown;
+
+/* Connects through usbmuxd; NULL if lockdownd does not answer. */
+struct lockdown *lockdown_open(uint32_t device_id, const char *udid);
+void lockdown_close(struct lockdown *ld);
+
+/* Value of `key` in `domain` (either may be NULL), retained; NULL on error. */
+CFTypeRef lockdown_get_value(struct lockdown *ld, CFStringRef domain, CFStringRef key);
+
+/* Session with the pair record usbmuxd holds for the device. */
+int lockdown_start_session(struct lockdown *ld);
+int lockdown_stop_session(struct lockdown *ld);
+
+#define LOCKDOWN_UNSUPPORTED (-2)
+
+/* Starts `service` and connects to it; the socket, -1, or LOCKDOWN_UNSUPPORTED
+   if the device wants TLS on the service connection (EnableServiceSSL). */
+int lockdown_start_service(struct lockdown *ld, CFStringRef service);
+
+/* Plist service framing on a plain socket. */
+int plist_send(int fd, CFPropertyListRef plist);
+CFPropertyListRef plist_recv(int fd);
+
+#endif
@@ -0,0 +1,29 @@
+/* ----------------------------------------------------------------------------
+ *   sha256.h - SHA-256 (FIPS 180-4) for content addressed caches
+ *
+ * ------------------------------------------------------------------------- */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+struct sha256
+{
+  uint32_t state[8];
+  uint64_t length;              /* bytes hashed so far */
+  unsigned char block[64];
+  size_t used;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *buf, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+/* Lowercase hex of the digest; `hex` holds 2 * SHA256_DIGEST_LENGTH + 1 bytes. */
+void sha256_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char *hex);
+
+#endif
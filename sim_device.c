@@ -0,0 +1,687 @@
+/* ----------------------------------------------------------------------------
+ *   sim_device.c - simulated MobileDevice backend
+ *
+ *   Implements the part of MobileDevice.h that idb uses on top of the local
+ *   filesystem, so idb can be built and measured without a device (and on
+ *   Linux, given a CoreFoundation such as the one from
+ *   swift-corelibs-foundation). AFC services are served by afc_server.c and
+ *   spoken to through afc_device.c. Link them instead of
+ *   MobileDevice.framework:
+ *
+ *     rake sim        # builds ./idb-sim
+ *
+ *   Layout under $IDB_SIM_ROOT (default ./sim):
+ *
+ *     <udid>/media/               AFC root (com.apple.afc), PublicStaging
+ *     <udid>/apps/<bundle_id>/    house arrest container of each app
+ *     <udid>/info.plist           optional extra lockdown values
+ *     <udid>/syslog               optional, streamed by syslog_relay
+ *     <udid>/crashes/             crash report copy root (idb crashes)
+ *     <udid>/screenshot.png       optional, what screenshotr returns (1x1 if absent)
+ *
+ *   Environment:
+ *
+ *     IDB_SIM_DEVICES       number of devices (default 1), udids sim-device-NN
+ *     IDB_SIM_LATENCY_US    added to every device round trip; AFC replies each
+ *                           leave this long after their request, so pipelined
+ *                           requests overlap
+ *     IDB_SIM_BANDWIDTH     bytes/s for file data, 0 = unlimited
+ *     IDB_SIM_PORT_STRIDE   USBMuxConnectByPort(port) on device n connects to
+ *                           127.0.0.1:(port + n * stride)
+ * ------------------------------------------------------------------------- */
+
+#define _GNU_SOURCE            /* nftw */
+
+#include "MobileDevice.h"
+#include "afc_server.h"
+#include "devicelink.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the opaque MobileDevice structs are packed; ours start with them and are
+   only ever reached through pointers we allocated */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+#endif
+
+#define SIM_MAX_DEVICES  64
+#define SIM_ERR          1      /* any failure; callers only test for non-zero */
+
+struct sim_device
+{
+  struct am_device base;        /* what idb sees */
+  char udid[64];
+  char *root;
+  int index;
+  CFMutableDictionaryRef values;
+};
+
+static struct
+{
+  pthread_once_t once;
+  const char *root;
+  long latency_us;
+  double bandwidth;
+  int port_stride;
+  struct sim_device devices[SIM_MAX_DEVICES];
+  int count;
+  am_device_notification_callback callback;
+  void *callback_arg;
+  CFRunLoopTimerRef timer;
+  struct am_device_notification notification;
+} sim = { PTHREAD_ONCE_INIT };
+
+/************************************************************************************************/
+/* helpers */
+
+static char *sim_join(const char *a, const char *b)
+{
+  size_t la = strlen(a), lb = strlen(b);
+  while (lb > 0 && *b == '/') {
+    b++;
+    lb--;
+  }
+  char *p = malloc(la + 1 + lb + 1);
+  memcpy(p, a, la);
+  p[la] = '/';
+  memcpy(p + la + 1, b, lb + 1);
+  return p;
+}
+
+static void sim_mkdirs(const char *path)
+{
+  char *copy = strdup(path);
+  char *p;
+  for (p = copy + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(copy, 0755);
+      *p = '/';
+    }
+  }
+  mkdir(copy, 0755);
+  free(copy);
+}
+
+/* One device round trip plus the time `bytes` take at the configured bandwidth. */
+static void sim_delay(size_t bytes)
+{
+  double usec = sim.latency_us;
+  if (sim.bandwidth > 0) {
+    usec += bytes * 1e6 / sim.bandwidth;
+  }
+  if (usec >= 1) {
+    struct timespec ts = { (time_t)(usec / 1e6), (long)((long long)usec % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void sim_init(void)
+{
+  const char *env;
+  int i;
+
+  sim.root = getenv("IDB_SIM_ROOT") ? getenv("IDB_SIM_ROOT") : "sim";
+  sim.latency_us = getenv("IDB_SIM_LATENCY_US") ? atol(getenv("IDB_SIM_LATENCY_US")) : 0;
+  sim.bandwidth = getenv("IDB_SIM_BANDWIDTH") ? atof(getenv("IDB_SIM_BANDWIDTH")) : 0;
+  sim.port_stride = getenv("IDB_SIM_PORT_STRIDE") ? atoi(getenv("IDB_SIM_PORT_STRIDE")) : 0;
+  sim.count = (env = getenv("IDB_SIM_DEVICES")) ? atoi(env) : 1;
+  if (sim.count < 0) sim.count = 0;
+  if (sim.count > SIM_MAX_DEVICES) sim.count = SIM_MAX_DEVICES;
+
+  for (i = 0; i < sim.count; i++) {
+    struct sim_device *dev = &sim.devices[i];
+    dev->index = i;
+    dev->base.device_id = i + 1;
+    dev->base.product_id = AMD_IPHONE_PRODUCT_ID;
+    snprintf(dev->udid, sizeof(dev->udid), "sim-device-%02d", i);
+    dev->base.serial = dev->udid;
+    dev->root = sim_join(sim.root, dev->udid);
+
+    char *media = sim_join(dev->root, "media/PublicStaging");
+    char *apps = sim_join(dev->root, "apps");
+    sim_mkdirs(media);
+    sim_mkdirs(apps);
+    free(apps);
+    free(media);
+
+    dev->values = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFStringRef udid = CFStringCreateWithCString(NULL, dev->udid, kCFStringEncodingUTF8);
+    CFDictionarySetValue(dev->values, CFSTR("UniqueDeviceID"), udid);
+    CFDictionarySetValue(dev->values, CFSTR("SerialNumber"), udid);
+    CFDictionarySetValue(dev->values, CFSTR("DeviceName"), udid);
+    CFDictionarySetValue(dev->values, CFSTR("DeviceClass"), CFSTR("iPhone"));
+    CFDictionarySetValue(dev->values, CFSTR("ProductType"), CFSTR("iPhone0,0"));
+    CFDictionarySetValue(dev->values, CFSTR("ProductVersion"), CFSTR("0.0"));
+    CFDictionarySetValue(dev->values, CFSTR("CPUArchitecture"), CFSTR("arm64"));
+    CFRelease(udid);
+
+    /* <udid>/info.plist overrides and extends the defaults */
+    char *info = sim_join(dev->root, "info.plist");
+    FILE *file = fopen(info, "rb");
+    if (file != NULL) {
+      struct stat st;
+      fstat(fileno(file), &st);
+      UInt8 *buf = malloc(st.st_size + 1);
+      size_t len = fread(buf, 1, st.st_size, file);
+      CFDataRef data = CFDataCreate(NULL, buf, len);
+      CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+      if (plist != NULL && CFGetTypeID(plist) == CFDictionaryGetTypeID()) {
+        CFIndex n = CFDictionaryGetCount(plist), k;
+        const void *keys[n], *values[n];
+        CFDictionaryGetKeysAndValues(plist, keys, values);
+        for (k = 0; k < n; k++) {
+          CFDictionarySetValue(dev->values, keys[k], values[k]);
+        }
+      }
+      if (plist != NULL) CFRelease(plist);
+      CFRelease(data);
+      free(buf);
+      fclose(file);
+    }
+    free(info);
+  }
+}
+
+static struct sim_device *sim_device(struct am_device *device)
+{
+  return (struct sim_device *)device;
+}
+
+static char *sim_cstring(CFStringRef str)
+{
+  CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+  char *buf = malloc(size);
+  if (!CFStringGetCString(str, buf, size, kCFStringEncodingUTF8)) buf[0] = '\0';
+  return buf;
+}
+
+/* AFC services are a socket served by afc_server on `root`; the
+   configured latency and bandwidth apply to each reply there. */
+static int sim_service(const char *root, service_conn_t *handle)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return SIM_ERR;
+  }
+  if (afc_server_start(fds[1], root, sim.latency_us, sim.bandwidth) != 0) {
+    close(fds[0]);
+    return SIM_ERR;
+  }
+  *handle = fds[0];
+  return ERR_SUCCESS;
+}
+
+/************************************************************************************************/
+/* device */
+
+void AMDSetLogLevel(int level) {}
+void AMDAddLogFileDescriptor(int fd) {}
+
+static void sim_attach(CFRunLoopTimerRef timer, void *info)
+{
+  static int delivered;
+  int i;
+  if (delivered++) return;
+  for (i = 0; i < sim.count; i++) {
+    struct am_device_notification_callback_info cb = { &sim.devices[i].base, ADNCI_MSG_CONNECTED };
+    sim.callback(&cb, sim.callback_arg);
+  }
+}
+
+/* Devices show up from the run loop, like real attach notifications; the
+   repeating timer also keeps CFRunLoopRun() from returning. */
+mach_error_t AMDeviceNotificationSubscribe(am_device_notification_callback callback,
+    unsigned int unused0, unsigned int unused1, void *arg, struct am_device_notification **notification)
+{
+  pthread_once(&sim.once, sim_init);
+  sim.callback = callback;
+  sim.callback_arg = arg;
+  sim.notification.callback = callback;
+  sim.timer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent(), 3600, 0, 0, sim_attach, NULL);
+  CFRunLoopAddTimer(CFRunLoopGetCurrent(), sim.timer, kCFRunLoopCommonModes);
+  *notification = &sim.notification;
+  return ERR_SUCCESS;
+}
+
+mach_error_t AMDeviceNotificationUnsubscribe(struct am_device_notification *notification)
+{
+  if (sim.timer != NULL) {
+    CFRunLoopTimerInvalidate(sim.timer);
+  }
+  return ERR_SUCCESS;
+}
+
+mach_error_t AMDeviceConnect(struct am_device *device) { sim_delay(0); return ERR_SUCCESS; }
+mach_error_t AMDeviceDisconnect(struct am_device *device) { return ERR_SUCCESS; }
+int AMDeviceIsPaired(struct am_device *device) { return 1; }
+mach_error_t AMDeviceValidatePairing(struct am_device *device) { sim_delay(0); return ERR_SUCCESS; }
+mach_error_t AMDeviceStartSession(struct am_device *device) { sim_delay(0); return ERR_SUCCESS; }
+mach_error_t AMDeviceStopSession(struct am_device *device) { return ERR_SUCCESS; }
+mach_error_t AMDeviceRetain(struct am_device *device) { return ERR_SUCCESS; }
+mach_error_t AMDeviceRelease(struct am_device *device) { return ERR_SUCCESS; }
+
+unsigned int AMDeviceGetConnectionID(struct am_device *device)
+{
+  return sim_device(device)->base.device_id;
+}
+
+CFStringRef AMDeviceCopyDeviceIdentifier(struct am_device *device)
+{
+  return CFStringCreateWithCString(NULL, sim_device(device)->udid, kCFStringEncodingUTF8);
+}
+
+CFStringRef AMDeviceCopyValue(struct am_device *device, unsigned int domain, CFStringRef key)
+{
+  struct sim_device *dev = sim_device(device);
+  sim_delay(0);
+  if (key == NULL) {
+    return (CFStringRef)CFDictionaryCreateCopy(NULL, dev->values);
+  }
+  CFTypeRef value = CFDictionaryGetValue(dev->values, key);
+  return (value != NULL) ? (CFStringRef)CFRetain(value) : NULL;
+}
+
+mach_error_t AMDeviceStartHouseArrestService(struct am_device *device, CFStringRef identifier,
+    void *unknown, service_conn_t *handle, unsigned int *what)
+{
+  struct stat st;
+  char *bundle_id = sim_cstring(identifier);
+  char *apps = sim_join(sim_device(device)->root, "apps");
+  char *root = sim_join(apps, bundle_id);
+  int ret = SIM_ERR;
+
+  sim_delay(0);
+  if (stat(root, &st) == 0 && S_ISDIR(st.st_mode)) {
+    ret = sim_service(root, handle);
+  }
+  free(root);
+  free(apps);
+  free(bundle_id);
+  return ret;
+}
+
+static void *sim_syslog_thread(void *arg)
+{
+  int *fds = (int *)arg;
+  char buf[4096];
+  ssize_t n;
+  FILE *file = fopen((char *)(fds + 2), "rb");
+  if (file != NULL) {
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      if (write(fds[1], buf, n) != n) break;
+    }
+    fclose(file);
+  }
+  /* the relay stays open, like a quiet device */
+  return NULL;
+}
+
+/* a 1x1 grey PNG */
+static const UInt8 sim_blank_png[] =
+  "\x89\x50\x4e\x47\x0d\x0a\x1a\x0a\x00\x00\x00\x0d\x49\x48\x44\x52\x00\x00\x00\x01\x00\x00\x00\x01"
+  "\x08\x00\x00\x00\x00\x3a\x7e\x9b\x55\x00\x00\x00\x0a\x49\x44\x41\x54\x78\x9c\x63\x60\x00\x00"
+  "\x00\x02\x00\x01\x48\xaf\xa4\x71\x00\x00\x00\x00\x49\x45\x4e\x44\xae\x42\x60\x82";
+
+/* screenshotr: the DeviceLink handshake, then <udid>/screenshot.png for
+   every request, taking one round trip plus its transfer time. */
+static void *sim_screenshot_thread(void *arg)
+{
+  int *fds = (int *)arg;
+  int fd = fds[1];
+  struct devicelink_msg msg = { 0 };
+  CFDataRef image = NULL;
+  FILE *file = fopen((char *)(fds + 2), "rb");
+
+  if (file != NULL) {
+    struct stat st;
+    fstat(fileno(file), &st);
+    UInt8 *buf = malloc(st.st_size + 1);
+    size_t len = fread(buf, 1, st.st_size, file);
+    image = CFDataCreate(NULL, buf, len);
+    free(buf);
+    fclose(file);
+  } else {
+    image = CFDataCreate(NULL, sim_blank_png, sizeof(sim_blank_png) - 1);
+  }
+  /* every reply is the same: encode it once */
+  const void *k[] = { CFSTR("MessageType"), CFSTR("ScreenShotData") };
+  const void *v[] = { CFSTR("ScreenShotReply"), image };
+  CFDictionaryRef dict = CFDictionaryCreate(NULL, k, v, 2, &kCFTypeDictionaryKeyCallBacks,
+                                            &kCFTypeDictionaryValueCallBacks);
+  const void *items[] = { CFSTR("DLMessageProcessMessage"), dict };
+  CFArrayRef array = CFArrayCreate(NULL, items, 2, &kCFTypeArrayCallBacks);
+  CFDataRef reply = CFPropertyListCreateData(NULL, array, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+  CFRelease(array);
+  CFRelease(dict);
+
+  int64_t version = DEVICELINK_VERSION, minor = 0;
+  CFNumberRef major_number = CFNumberCreate(NULL, kCFNumberSInt64Type, &version);
+  CFNumberRef minor_number = CFNumberCreate(NULL, kCFNumberSInt64Type, &minor);
+  const void *exchange[] = { CFSTR("DLMessageVersionExchange"), major_number, minor_number };
+  const void *ready[] = { CFSTR("DLMessageDeviceReady") };
+  CFArrayRef exchange_array = CFArrayCreate(NULL, exchange, 3, &kCFTypeArrayCallBacks);
+  CFArrayRef ready_array = CFArrayCreate(NULL, ready, 1, &kCFTypeArrayCallBacks);
+
+  if (devicelink_send(fd, exchange_array) == 0 && devicelink_recv(fd, &msg) == 0 &&
+      devicelink_send(fd, ready_array) == 0) {
+    while (devicelink_recv(fd, &msg) == 0 && devicelink_is(&msg, "DLMessageProcessMessage")) {
+      sim_delay(CFDataGetLength(reply));
+      if (devicelink_send_bytes(fd, CFDataGetBytePtr(reply), CFDataGetLength(reply)) != 0) break;
+    }
+  }
+  CFRelease(ready_array);
+  CFRelease(exchange_array);
+  CFRelease(minor_number);
+  CFRelease(major_number);
+  CFRelease(reply);
+  CFRelease(image);
+  devicelink_msg_free(&msg);
+  close(fd);
+  free(fds);
+  return NULL;
+}
+
+mach_error_t AMDeviceStartService(struct am_device *device, CFStringRef service_name,
+    service_conn_t *handle, unsigned int *unknown)
+{
+  struct sim_device *dev = sim_device(device);
+  sim_delay(0);
+
+  if (CFStringCompare(service_name, AMSVC_AFC, 0) == kCFCompareEqualTo) {
+    char *media = sim_join(dev->root, "media");
+    int ret = sim_service(media, handle);
+    free(media);
+    return ret;
+  }
+  if (CFStringCompare(service_name, AMSVC_CRASH_REPORT_COPY, 0) == kCFCompareEqualTo) {
+    char *crashes = sim_join(dev->root, "crashes");
+    mkdir(crashes, 0755);
+    int ret = sim_service(crashes, handle);
+    free(crashes);
+    return ret;
+  }
+  if (CFStringCompare(service_name, AMSVC_CRASH_REPORT_MOVER, 0) == kCFCompareEqualTo) {
+    /* reports are already in place: answer at once */
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0 || write(fds[1], "ping", 4) != 4) {
+      return SIM_ERR;
+    }
+    close(fds[1]);
+    *handle = fds[0];
+    return ERR_SUCCESS;
+  }
+  if (CFStringCompare(service_name, AMSVC_SCREENSHOT, 0) == kCFCompareEqualTo) {
+    char *path = sim_join(dev->root, "screenshot.png");
+    int *fds = malloc(2 * sizeof(int) + strlen(path) + 1);
+    pthread_t thread;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      free(fds);
+      free(path);
+      return SIM_ERR;
+    }
+    strcpy((char *)(fds + 2), path);
+    free(path);
+    pthread_create(&thread, NULL, sim_screenshot_thread, fds);
+    pthread_detach(thread);
+    *handle = fds[0];
+    return ERR_SUCCESS;
+  }
+  if (CFStringCompare(service_name, AMSVC_SYSLOG_RELAY, 0) == kCFCompareEqualTo) {
+    char *path = sim_join(dev->root, "syslog");
+    int *fds = malloc(2 * sizeof(int) + strlen(path) + 1);
+    pthread_t thread;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      free(fds);
+      free(path);
+      return SIM_ERR;
+    }
+    strcpy((char *)(fds + 2), path);
+    free(path);
+    pthread_create(&thread, NULL, sim_syslog_thread, fds);
+    pthread_detach(thread);
+    *handle = fds[0];
+    return ERR_SUCCESS;
+  }
+  return SIM_ERR;
+}
+
+int USBMuxConnectByPort(int conn, int port, service_conn_t *handle)
+{
+  struct sockaddr_in addr;
+  int index = conn - 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (fd < 0) {
+    return MDERR_USBMUX_FAILED;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(ntohs(port) + index * sim.port_stride);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sim_delay(0);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return MDERR_USBMUX_FAILED;
+  }
+  *handle = fd;
+  return ERR_SUCCESS;
+}
+
+/************************************************************************************************/
+/* apps */
+
+static void sim_progress(void *callback, const char *status, int percent, int arg)
+{
+  if (callback == NULL) return;
+  CFStringRef cf_status = CFStringCreateWithCString(NULL, status, kCFStringEncodingUTF8);
+  CFNumberRef cf_percent = CFNumberCreate(NULL, kCFNumberSInt32Type, &percent);
+  const void *k[] = { CFSTR("Status"), CFSTR("PercentComplete") }, *v[] = { cf_status, cf_percent };
+  CFDictionaryRef dict = CFDictionaryCreate(NULL, k, v, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  ((void (*)(CFDictionaryRef, int))callback)(dict, arg);
+  CFRelease(dict);
+  CFRelease(cf_percent);
+  CFRelease(cf_status);
+}
+
+static int sim_copy(const char *from, const char *to)
+{
+  struct stat st;
+  if (lstat(from, &st) != 0) return -1;
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(from);
+    struct dirent *entry;
+    int ret = 0;
+    if (dir == NULL) return -1;
+    mkdir(to, 0755);
+    while ((entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+      char *a = sim_join(from, entry->d_name), *b = sim_join(to, entry->d_name);
+      ret |= sim_copy(a, b);
+      free(a);
+      free(b);
+    }
+    closedir(dir);
+    return ret;
+  }
+
+  char buf[65536];
+  ssize_t n;
+  int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int ret = (in < 0 || out < 0) ? -1 : 0;
+  while (ret == 0 && (n = read(in, buf, sizeof(buf))) > 0) {
+    sim_delay(n);
+    if (write(out, buf, n) != n) ret = -1;
+  }
+  if (in >= 0) close(in);
+  if (out >= 0) close(out);
+  return ret;
+}
+
+static int sim_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+static int sim_remove_tree(const char *path)
+{
+  return nftw(path, sim_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static char *sim_url_path(CFURLRef url)
+{
+  char *path = malloc(4096);
+  if (!CFURLGetFileSystemRepresentation(url, true, (UInt8 *)path, 4096)) path[0] = '\0';
+  return path;
+}
+
+int AMDeviceSecureTransferPath(int unknown0, struct am_device *device, CFURLRef url,
+    CFDictionaryRef options, void *callback, int cbarg)
+{
+  char *local = sim_url_path(url);
+  const char *name = strrchr(local, '/') ? strrchr(local, '/') + 1 : local;
+  char *staging = sim_join(sim_device(device)->root, "media/PublicStaging");
+  char *remote = sim_join(staging, name);
+
+  sim_progress(callback, "CopyingFile", 0, cbarg);
+  sim_remove_tree(remote);
+  int ret = sim_copy(local, remote);
+  sim_progress(callback, "CopyingFile", 100, cbarg);
+
+  free(remote);
+  free(staging);
+  free(local);
+  return ret ? SIM_ERR : ERR_SUCCESS;
+}
+
+/* Bundle id from the staged .app's Info.plist, else the package file name. */
+static char *sim_bundle_id(const char *staged)
+{
+  char *info = sim_join(staged, "Info.plist");
+  char *bundle_id = NULL;
+  FILE *file = fopen(info, "rb");
+
+  if (file != NULL) {
+    struct stat st;
+    fstat(fileno(file), &st);
+    UInt8 *buf = malloc(st.st_size + 1);
+    size_t len = fread(buf, 1, st.st_size, file);
+    CFDataRef data = CFDataCreate(NULL, buf, len);
+    CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+    if (plist != NULL && CFGetTypeID(plist) == CFDictionaryGetTypeID()) {
+      CFStringRef id = CFDictionaryGetValue(plist, CFSTR("CFBundleIdentifier"));
+      if (id != NULL) bundle_id = sim_cstring(id);
+    }
+    if (plist != NULL) CFRelease(plist);
+    CFRelease(data);
+    free(buf);
+    fclose(file);
+  }
+  free(info);
+
+  if (bundle_id == NULL) {
+    const char *name = strrchr(staged, '/') ? strrchr(staged, '/') + 1 : staged;
+    bundle_id = strdup(name);
+    char *dot = strrchr(bundle_id, '.');
+    if (dot != NULL && dot != bundle_id) *dot = '\0';
+  }
+  return bundle_id;
+}
+
+int AMDeviceSecureInstallApplication(int unknown0, struct am_device *device, CFURLRef url,
+    CFDictionaryRef options, void *callback, int cbarg)
+{
+  struct sim_device *dev = sim_device(device);
+  char *local = sim_url_path(url);
+  const char *name = strrchr(local, '/') ? strrchr(local, '/') + 1 : local;
+  char *staging = sim_join(dev->root, "media/PublicStaging");
+  char *staged = sim_join(staging, name);
+  struct stat st;
+  int ret = SIM_ERR;
+
+  sim_progress(callback, "InstallingApplication", 0, cbarg);
+  if (stat(staged, &st) == 0) {
+    char *bundle_id = sim_bundle_id(staged);
+    char *apps = sim_join(dev->root, "apps");
+    char *container = sim_join(apps, bundle_id);
+    const char *subdirs[] = { "Documents", "Library/Caches", "Library/Preferences", "tmp" };
+    int i;
+    for (i = 0; i < 4; i++) {
+      char *dir = sim_join(container, subdirs[i]);
+      sim_mkdirs(dir);
+      free(dir);
+    }
+    sim_delay(0);
+    ret = ERR_SUCCESS;
+    free(container);
+    free(apps);
+    free(bundle_id);
+  }
+  sim_progress(callback, "InstallingApplication", 100, cbarg);
+
+  free(staged);
+  free(staging);
+  free(local);
+  return ret;
+}
+
+int AMDeviceSecureUninstallApplication(int unknown0, struct am_device *device, CFStringRef bundle_id,
+    int unknown1, void *callback, int cbarg)
+{
+  char *id = sim_cstring(bundle_id);
+  char *apps = sim_join(sim_device(device)->root, "apps");
+  char *container = sim_join(apps, id);
+  struct stat st;
+  int ret = SIM_ERR;
+
+  sim_delay(0);
+  if (id[0] != '\0' && stat(container, &st) == 0) {
+    ret = sim_remove_tree(container) ? SIM_ERR : ERR_SUCCESS;
+  }
+  free(container);
+  free(apps);
+  free(id);
+  return ret;
+}
+
+int AMDeviceLookupApplications(struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps)
+{
+  char *root = sim_join(sim_device(device)->root, "apps");
+  CFMutableDictionaryRef result = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  DIR *dir = opendir(root);
+  struct dirent *entry;
+
+  sim_delay(0);
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    char *container = sim_join(root, entry->d_name);
+    CFStringRef id = CFStringCreateWithCString(NULL, entry->d_name, kCFStringEncodingUTF8);
+    CFStringRef cf_container = CFStringCreateWithCString(NULL, container, kCFStringEncodingUTF8);
+    const void *k[] = { CFSTR("CFBundleIdentifier"), CFSTR("CFBundleDisplayName"), CFSTR("Container"), CFSTR("ApplicationType") };
+    const void *v[] = { id, id, cf_container, CFSTR("User") };
+    CFDictionaryRef app = CFDictionaryCreate(NULL, k, v, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    CFDictionarySetValue(result, id, app);
+    CFRelease(app);
+    CFRelease(cf_container);
+    CFRelease(id);
+    free(container);
+  }
+  if (dir != NULL) closedir(dir);
+  free(root);
+  *apps = result;
+  return ERR_SUCCESS;
+}
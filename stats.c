@@ -0,0 +1,63 @@
+#include "stats.h"
+
+#include <time.h>
+
+int stats_enabled;
+
+static unsigned int stats_bucket(uint64_t ns)
+{
+  if (ns < (2 << STATS_SUB_BITS)) {
+    return (unsigned int)ns;
+  }
+  unsigned int shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+  return (shift << STATS_SUB_BITS) + (unsigned int)(ns >> shift);
+}
+
+/* Largest value that falls into `bucket`. */
+static uint64_t stats_bucket_max(unsigned int bucket)
+{
+  if (bucket < (2 << STATS_SUB_BITS)) {
+    return bucket;
+  }
+  unsigned int shift = (bucket >> STATS_SUB_BITS) - 1;
+  uint64_t mantissa = bucket - (shift << STATS_SUB_BITS);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+uint64_t stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(struct stats_hist *hist, uint64_t ns, uint64_t bytes)
+{
+  __atomic_fetch_add(&hist->counts[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+uint64_t stats_quantile(const struct stats_hist *hist, double q)
+{
+  uint64_t seen = 0, rank;
+  unsigned int i;
+
+  if (hist->calls == 0) {
+    return 0;
+  }
+  rank = (uint64_t)(q * hist->calls + 0.5);
+  if (rank < 1) rank = 1;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      uint64_t value = stats_bucket_max(i);
+      return value < hist->max_ns ? value : hist->max_ns;
+    }
+  }
+  return hist->max_ns;
+}
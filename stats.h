@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------------------
+ *   stats.h - per-operation latency histograms for --stats
+ *
+ *   Log-linear buckets in the style of HdrHistogram: 16 sub-buckets per
+ *   power of two, so any recorded latency is reported within ~6%. Recording
+ *   is a handful of relaxed atomic adds and safe from any thread.
+ * ------------------------------------------------------------------------- */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#define STATS_SUB_BITS 4
+#define STATS_BUCKETS  (64 << STATS_SUB_BITS)
+
+struct stats_hist
+{
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+extern int stats_enabled;
+
+/* Monotonic nanoseconds; the same clock trace.h uses. */
+uint64_t stats_now(void);
+
+/* Records one call that took `ns`. */
+void stats_add(struct stats_hist *hist, uint64_t ns, uint64_t bytes);
+
+/* Latency in ns below which fraction `q` (0..1) of the calls completed. */
+uint64_t stats_quantile(const struct stats_hist *hist, double q);
+
+#endif
@@ -0,0 +1,250 @@
+/* ----------------------------------------------------------------------------
+ *   afc_test.c - the pipelined AFC client against afc_server over a socketpair
+ *
+ *   Queues stats, opens, reads, writes and closes without waiting for their
+ *   replies, then checks every reply in order and the files on disk. Also
+ *   checks short reads from a file that shrank and that the client refuses
+ *   an oversized reply. Exits non-zero on the first failed check.
+ * ------------------------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 700
+
+#include "afc_client.h"
+#include "afc_server.h"
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define CHECK(cond)                                                       \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                            \
+    }                                                                     \
+  } while (0)
+
+static const char content[] = "0123456789abcdefghij";
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+static char *join(const char *root, const char *name)
+{
+  char *path = malloc(strlen(root) + strlen(name) + 2);
+  sprintf(path, "%s/%s", root, name);
+  return path;
+}
+
+static void write_file(const char *root, const char *name, const char *data)
+{
+  char *path = join(root, name);
+  FILE *file = fopen(path, "wb");
+  CHECK(file != NULL);
+  fputs(data, file);
+  fclose(file);
+  free(path);
+}
+
+/* Value of `key` in a GET_FILE_INFO reply. */
+static const char *info_value(const struct afc_reply *reply, const char *key)
+{
+  size_t offset = 0;
+  const char *k, *v;
+  while ((k = afc_reply_next(reply, &offset)) != NULL && (v = afc_reply_next(reply, &offset)) != NULL) {
+    if (strcmp(k, key) == 0) return v;
+  }
+  return NULL;
+}
+
+static void recv_data(struct afc_client *client, struct afc_reply *reply)
+{
+  CHECK(afc_recv(client, reply) == 0);
+  CHECK(reply->op == AFC_OP_DATA);
+}
+
+static void recv_status(struct afc_client *client, uint64_t status)
+{
+  struct afc_reply reply;
+  CHECK(afc_recv(client, &reply) == 0);
+  CHECK(reply.op == AFC_OP_STATUS);
+  CHECK(reply.status == status);
+}
+
+static uint64_t recv_handle(struct afc_client *client)
+{
+  struct afc_reply reply;
+  CHECK(afc_recv(client, &reply) == 0);
+  CHECK(reply.op == AFC_OP_FILE_OPEN_RES);
+  CHECK(reply.handle != 0);
+  return reply.handle;
+}
+
+static void test_pipeline(const char *root)
+{
+  int fds[2];
+  struct afc_reply reply;
+
+  write_file(root, "a.txt", content);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  CHECK(afc_server_start(fds[1], root, 0, 0) == 0);
+  struct afc_client *client = afc_client_new(fds[0]);
+
+  /* stats, opens and a mkdir, all in flight at once */
+  CHECK(afc_send_file_info(client, "a.txt") == 0);
+  CHECK(afc_send_file_info(client, "missing") == 0);
+  CHECK(afc_send_make_dir(client, "sub") == 0);
+  CHECK(afc_send_file_info(client, "sub") == 0);
+  CHECK(afc_send_open(client, "a.txt", 1) == 0);
+  CHECK(afc_send_open(client, "sub/b.txt", 2) == 0);
+  CHECK(afc_client_pending(client) == 6);
+
+  recv_data(client, &reply);
+  CHECK(strcmp(info_value(&reply, "st_size"), "20") == 0);
+  CHECK(strcmp(info_value(&reply, "st_ifmt"), "S_IFREG") == 0);
+  recv_status(client, AFC_STATUS_NOT_FOUND);
+  recv_status(client, AFC_STATUS_SUCCESS);
+  recv_data(client, &reply);
+  CHECK(strcmp(info_value(&reply, "st_ifmt"), "S_IFDIR") == 0);
+  uint64_t in = recv_handle(client);
+  uint64_t out = recv_handle(client);
+  CHECK(in != out);
+  CHECK(afc_client_pending(client) == 0);
+
+  /* reads and writes of both files interleaved, then both closes */
+  CHECK(afc_send_read(client, in, 8) == 0);
+  CHECK(afc_send_write(client, out, "hello ", 6) == 0);
+  CHECK(afc_send_read(client, in, 8) == 0);
+  CHECK(afc_send_write(client, out, "world", 5) == 0);
+  CHECK(afc_send_read(client, in, 8) == 0);
+  CHECK(afc_send_read(client, in, 8) == 0);
+  CHECK(afc_send_close(client, in) == 0);
+  CHECK(afc_send_close(client, out) == 0);
+  CHECK(afc_send_read(client, in, 8) == 0);      /* closed handle */
+
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 8 && memcmp(reply.data, content, 8) == 0);
+  recv_status(client, AFC_STATUS_SUCCESS);
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 8 && memcmp(reply.data, content + 8, 8) == 0);
+  recv_status(client, AFC_STATUS_SUCCESS);
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 4 && memcmp(reply.data, content + 16, 4) == 0);
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 0);
+  recv_status(client, AFC_STATUS_SUCCESS);
+  recv_status(client, AFC_STATUS_SUCCESS);
+  recv_status(client, AFC_STATUS_INVALID_ARG);
+
+  /* the written file, and the directory listing */
+  CHECK(afc_send_file_info(client, "sub/b.txt") == 0);
+  CHECK(afc_send_read_dir(client, "sub") == 0);
+  recv_data(client, &reply);
+  CHECK(strcmp(info_value(&reply, "st_size"), "11") == 0);
+  recv_data(client, &reply);
+  size_t offset = 0;
+  const char *name;
+  int found = 0;
+  while ((name = afc_reply_next(&reply, &offset)) != NULL) {
+    found += strcmp(name, "b.txt") == 0;
+  }
+  CHECK(found == 1);
+  CHECK(afc_recv(client, &reply) == -1);         /* nothing outstanding */
+
+  char *path = join(root, "sub/b.txt");
+  char buf[32] = "";
+  FILE *file = fopen(path, "rb");
+  CHECK(file != NULL);
+  CHECK(fread(buf, 1, sizeof(buf) - 1, file) == 11);
+  CHECK(strcmp(buf, "hello world") == 0);
+  fclose(file);
+  free(path);
+
+  afc_client_free(client);
+}
+
+/* A file that shrinks between its stat and its reads answers a read short;
+   only the last read of the stat'ed size may be short. */
+static void test_short_read(const char *root)
+{
+  int fds[2];
+  struct afc_reply reply;
+
+  write_file(root, "shrinking.txt", content);
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  CHECK(afc_server_start(fds[1], root, 0, 0) == 0);
+  struct afc_client *client = afc_client_new(fds[0]);
+
+  /* stat'ed at 20 bytes, then truncated to 10 before cp reads 8 + 8 + 4 */
+  CHECK(afc_send_open(client, "shrinking.txt", 1) == 0);
+  uint64_t handle = recv_handle(client);
+  char *path = join(root, "shrinking.txt");
+  CHECK(truncate(path, 10) == 0);
+  free(path);
+  CHECK(afc_send_read(client, handle, 8) == 0);
+  CHECK(afc_send_read(client, handle, 8) == 0);
+  CHECK(afc_send_read(client, handle, 4) == 0);
+  CHECK(afc_send_close(client, handle) == 0);
+
+  recv_data(client, &reply);
+  CHECK(afc_read_complete(&reply, 8, 0));
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 2);
+  CHECK(!afc_read_complete(&reply, 8, 0));       /* the file is incomplete */
+  CHECK(afc_read_complete(&reply, 8, 1));        /* unless it was the last read */
+  recv_data(client, &reply);
+  CHECK(reply.data_len == 0 && !afc_read_complete(&reply, 4, 0));
+  recv_status(client, AFC_STATUS_SUCCESS);
+
+  /* an error status is never a complete read */
+  CHECK(afc_send_read(client, handle, 8) == 0);  /* closed handle */
+  recv_status(client, AFC_STATUS_INVALID_ARG);
+  reply.op = AFC_OP_STATUS;
+  CHECK(!afc_read_complete(&reply, 8, 1));
+
+  afc_client_free(client);
+}
+
+/* A reply claiming more than the client accepts fails instead of allocating it. */
+static void test_oversized_reply()
+{
+  int fds[2];
+  char header[AFC_HEADER_SIZE];
+  struct afc_reply reply;
+  uint64_t fields[4] = { 1ULL << 40, AFC_HEADER_SIZE, 0, AFC_OP_DATA };
+  int i, j;
+
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  struct afc_client *client = afc_client_new(fds[0]);
+  CHECK(afc_send_read(client, 1, 8) == 0);
+
+  memcpy(header, AFC_MAGIC, 8);
+  for (i = 0; i < 4; i++) {
+    for (j = 0; j < 8; j++) {
+      header[8 + 8 * i + j] = (char)(fields[i] >> (8 * j));
+    }
+  }
+  CHECK(write(fds[1], header, sizeof(header)) == sizeof(header));
+  CHECK(afc_recv(client, &reply) == -1);
+  afc_client_free(client);
+  close(fds[1]);
+}
+
+int main()
+{
+  char root[] = "/tmp/afc_test.XXXXXX";
+
+  CHECK(mkdtemp(root) != NULL);
+  test_pipeline(root);
+  test_short_read(root);
+  test_oversized_reply();
+  nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  printf("afc_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,90 @@
+#!/bin/sh
+# ----------------------------------------------------------------------------
+#   usbmux_test.sh - idb-usbmux against usbmuxd-sim
+#
+#   Runs idb-usbmux commands against two simulated devices: device listing
+#   (ListDevices and the attach notifications), a lockdown connection and
+#   session (info), StartService of house_arrest and installation_proxy
+#   (ls, apps), a service that asks for TLS (reported as unsupported), and a
+#   daemon that must keep working after usbmuxd replugs the device under a
+#   new DeviceID. Exits non-zero on the first failed check.
+#
+#   usage: test/usbmux_test.sh   (from the top directory, after rake usbmux usbmuxd_sim)
+# ----------------------------------------------------------------------------
+
+set -u
+
+dir=$(mktemp -d)
+sim=
+daemon=
+
+cleanup()
+{
+  [ -n "$daemon" ] && kill "$daemon" 2>/dev/null
+  [ -n "$sim" ] && kill "$sim" 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+  echo "usbmux_test: $*" >&2
+  exit 1
+}
+
+# waits up to 5s for the socket `$1`
+wait_socket()
+{
+  i=0
+  while [ ! -S "$1" ]; do
+    i=$((i + 1))
+    [ $i -gt 50 ] && fail "no socket at $1"
+    sleep 0.1
+  done
+}
+
+export IDB_SIM_ROOT="$dir/sim"
+export IDB_SIM_DEVICES=2
+export IDB_SIM_SSL_SERVICES=com.apple.syslog_relay
+export USBMUXD_SOCKET_ADDRESS="UNIX:$dir/usbmuxd.sock"
+export IDB_SOCKET="$dir/idbd.sock"
+export HOME="$dir"
+
+mkdir -p "$IDB_SIM_ROOT/sim-device-00/apps/com.example.app/Documents"
+echo hello > "$IDB_SIM_ROOT/sim-device-00/apps/com.example.app/Documents/hello.txt"
+
+./usbmuxd-sim "$dir/usbmuxd.sock" 2>/dev/null &
+sim=$!
+wait_socket "$dir/usbmuxd.sock"
+
+# listing and attach: both devices, each reported once
+out=$(./idb-usbmux --all udid) || fail "udid failed"
+[ "$(echo "$out" | grep -c 'sim-device-0[01]$')" -eq 2 ] || fail "udid: $out"
+
+# lockdown connection, session and GetValue
+out=$(./idb-usbmux --udid sim-device-00 info UniqueDeviceID) || fail "info failed"
+echo "$out" | grep -q 'UniqueDeviceID.*sim-device-00' || fail "info: $out"
+
+# StartService: house_arrest and installation_proxy
+out=$(./idb-usbmux --udid sim-device-00 ls com.example.app Documents) || fail "ls failed"
+echo "$out" | grep -q 'hello.txt' || fail "ls: $out"
+out=$(./idb-usbmux --udid sim-device-00 apps) || fail "apps failed"
+echo "$out" | grep -q 'com.example.app' || fail "apps: $out"
+
+# a service that wants TLS fails with a diagnostic instead of silently
+out=$(./idb-usbmux --udid sim-device-00 logcat 2>&1) && fail "logcat started a TLS service"
+echo "$out" | grep -q 'EnableServiceSSL' || fail "logcat: $out"
+
+# a replug gives the device a new DeviceID; the daemon's session must follow
+./idb-usbmux daemon 2>/dev/null &
+daemon=$!
+wait_socket "$IDB_SOCKET"
+out=$(./idb-usbmux --udid sim-device-00 info UniqueDeviceID) || fail "info through the daemon failed"
+echo "$out" | grep -q 'sim-device-00' || fail "info through the daemon: $out"
+kill -USR1 "$sim"
+sleep 3                         # a couple of the backend's 1s polls
+out=$(./idb-usbmux --udid sim-device-00 info UniqueDeviceID) || fail "info after the replug failed"
+echo "$out" | grep -q 'sim-device-00' || fail "info after the replug: $out"
+
+echo "usbmux_test: ok"
@@ -0,0 +1,107 @@
+#include "trace.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int trace_enabled;
+
+static struct
+{
+  pthread_mutex_t lock;
+  FILE *file;
+  uint64_t origin;              /* stats_now() at trace_open */
+  int events;
+  int next_tid;
+} trace = { PTHREAD_MUTEX_INITIALIZER };
+
+static __thread int trace_tid;
+
+static void trace_string(FILE *file, const char *str)
+{
+  fputc('"', file);
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') {
+      fprintf(file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(file, "\\u%04x", c);
+    } else {
+      fputc(c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+static void trace_event(char phase, const char *cat, const char *name, const char *detail,
+                        uint64_t start_ns, uint64_t end_ns)
+{
+  pthread_mutex_lock(&trace.lock);
+  if (trace.file == NULL) {
+    pthread_mutex_unlock(&trace.lock);
+    return;
+  }
+  if (trace_tid == 0) {
+    trace_tid = ++trace.next_tid;
+  }
+  uint64_t ts = start_ns > trace.origin ? start_ns - trace.origin : 0;
+  fprintf(trace.file, "%s{\"ph\":\"%c\",\"cat\":", trace.events++ ? ",\n" : "", phase);
+  trace_string(trace.file, cat);
+  fputs(",\"name\":", trace.file);
+  trace_string(trace.file, name);
+  fprintf(trace.file, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f", (int)getpid(), trace_tid, ts / 1e3);
+  if (phase == 'X') {
+    fprintf(trace.file, ",\"dur\":%.3f", (end_ns - start_ns) / 1e3);
+  } else {
+    fputs(",\"s\":\"t\"", trace.file);
+  }
+  if (detail != NULL) {
+    fputs(",\"args\":{\"detail\":", trace.file);
+    trace_string(trace.file, detail);
+    fputc('}', trace.file);
+  }
+  fputc('}', trace.file);
+  pthread_mutex_unlock(&trace.lock);
+}
+
+int trace_open(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&trace.lock);
+  trace.file = file;
+  trace.origin = stats_now();
+  /* tunnel sessions end with a signal: keep every finished event on disk
+     (viewers accept the array without its closing bracket) */
+  setvbuf(file, NULL, _IOLBF, 0);
+  fputs("[\n", file);
+  pthread_mutex_unlock(&trace.lock);
+  trace_enabled = 1;
+  return 0;
+}
+
+void trace_close(void)
+{
+  pthread_mutex_lock(&trace.lock);
+  trace_enabled = 0;
+  if (trace.file != NULL) {
+    fputs("\n]\n", trace.file);
+    fclose(trace.file);
+    trace.file = NULL;
+  }
+  pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_span(const char *cat, const char *name, const char *detail, uint64_t start_ns, uint64_t end_ns)
+{
+  trace_event('X', cat, name, detail, start_ns, end_ns);
+}
+
+void trace_instant(const char *cat, const char *name, const char *detail)
+{
+  uint64_t now = stats_now();
+  trace_event('i', cat, name, detail, now, now);
+}
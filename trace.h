@@ -0,0 +1,26 @@
+/* ----------------------------------------------------------------------------
+ *   trace.h - Chrome trace event output for --trace
+ *
+ *   Writes a JSON array of trace events that chrome://tracing and Perfetto
+ *   load directly. Spans are complete ("X") events timed with stats_now();
+ *   every thread gets a small sequential id on its first event.
+ * ------------------------------------------------------------------------- */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+extern int trace_enabled;
+
+/* Starts the trace file and enables tracing; -1 with errno set on failure. */
+int trace_open(const char *path);
+
+/* Terminates the JSON array; events after this are dropped. */
+void trace_close(void);
+
+/* `detail` may be NULL; it is stored as args.detail. */
+void trace_span(const char *cat, const char *name, const char *detail, uint64_t start_ns, uint64_t end_ns);
+void trace_instant(const char *cat, const char *name, const char *detail);
+
+#endif
@@ -0,0 +1,274 @@
+#include "usbmux.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define USBMUX_SOCKET       "/var/run/usbmuxd"
+#define USBMUX_HEADER_SIZE  16
+#define USBMUX_VERSION      1         /* plist messages */
+#define USBMUX_MSG_PLIST    8
+#define USBMUX_MAX_MESSAGE  (16 * 1024 * 1024)
+
+static int usbmux_write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int usbmux_read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int usbmux_open()
+{
+  const char *addr = getenv("USBMUXD_SOCKET_ADDRESS");
+  const char *colon;
+
+  if (addr == NULL || *addr == '\0') {
+    addr = USBMUX_SOCKET;
+  } else if (strncmp(addr, "UNIX:", 5) == 0) {
+    addr += 5;
+  }
+  if (addr[0] != '/' && (colon = strrchr(addr, ':')) != NULL) {
+    /* host:port, e.g. usbmuxd forwarded from another machine */
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    int fd = -1;
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+      return -1;
+    }
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(res);
+    return fd;
+  }
+
+  struct sockaddr_un sun;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int usbmux_send(int fd, uint32_t tag, CFDictionaryRef msg)
+{
+  CFDataRef data = CFPropertyListCreateData(NULL, msg, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+  unsigned char header[USBMUX_HEADER_SIZE];
+  int ret;
+
+  if (data == NULL) {
+    return -1;
+  }
+  put_le32(header, USBMUX_HEADER_SIZE + CFDataGetLength(data));
+  put_le32(header + 4, USBMUX_VERSION);
+  put_le32(header + 8, USBMUX_MSG_PLIST);
+  put_le32(header + 12, tag);
+  ret = usbmux_write_all(fd, header, sizeof(header));
+  if (ret == 0) {
+    ret = usbmux_write_all(fd, CFDataGetBytePtr(data), CFDataGetLength(data));
+  }
+  CFRelease(data);
+  return ret;
+}
+
+static CFDictionaryRef usbmux_recv(int fd, uint32_t tag)
+{
+  unsigned char header[USBMUX_HEADER_SIZE];
+
+  if (usbmux_read_all(fd, header, sizeof(header)) != 0) {
+    return NULL;
+  }
+  uint32_t len = get_le32(header);
+  if (len < USBMUX_HEADER_SIZE || len > USBMUX_MAX_MESSAGE || get_le32(header + 8) != USBMUX_MSG_PLIST ||
+      get_le32(header + 12) != tag) {
+    return NULL;
+  }
+  len -= USBMUX_HEADER_SIZE;
+  UInt8 *buf = malloc(len ? len : 1);
+  if (usbmux_read_all(fd, buf, len) != 0) {
+    free(buf);
+    return NULL;
+  }
+  CFDataRef data = CFDataCreateWithBytesNoCopy(NULL, buf, len, kCFAllocatorNull);
+  CFPropertyListRef plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+  CFRelease(data);
+  free(buf);
+  if (plist != NULL && CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+    CFRelease(plist);
+    plist = NULL;
+  }
+  return plist;
+}
+
+/* Message of `type` with the client fields usbmuxd expects, for the caller to extend. */
+static CFMutableDictionaryRef usbmux_message(CFStringRef type)
+{
+  CFMutableDictionaryRef msg = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                         &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue(msg, CFSTR("MessageType"), type);
+  CFDictionarySetValue(msg, CFSTR("ClientVersionString"), CFSTR("idb"));
+  CFDictionarySetValue(msg, CFSTR("ProgName"), CFSTR("idb"));
+  return msg;
+}
+
+/* Sends `msg` on a new connection; the reply, with the connection left open in *fd. */
+static CFDictionaryRef usbmux_request(CFDictionaryRef msg, int *fd)
+{
+  static uint32_t tag;
+  uint32_t my_tag = __sync_add_and_fetch(&tag, 1);
+  CFDictionaryRef reply = NULL;
+
+  *fd = usbmux_open();
+  if (*fd >= 0 && usbmux_send(*fd, my_tag, msg) == 0) {
+    reply = usbmux_recv(*fd, my_tag);
+  }
+  if (reply == NULL && *fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  return reply;
+}
+
+static long usbmux_number(CFDictionaryRef dict, CFStringRef key, long fallback)
+{
+  CFNumberRef number = CFDictionaryGetValue(dict, key);
+  long long value;
+  if (number == NULL || CFGetTypeID(number) != CFNumberGetTypeID() ||
+      !CFNumberGetValue(number, kCFNumberLongLongType, &value)) {
+    return fallback;
+  }
+  return (long)value;
+}
+
+int usbmux_list(struct usbmux_device *list, int max)
+{
+  CFMutableDictionaryRef msg = usbmux_message(CFSTR("ListDevices"));
+  int fd, count = 0;
+  CFDictionaryRef reply = usbmux_request(msg, &fd);
+
+  CFRelease(msg);
+  if (reply == NULL) {
+    return -1;
+  }
+  close(fd);
+  CFArrayRef devices = CFDictionaryGetValue(reply, CFSTR("DeviceList"));
+  CFIndex i, n = (devices != NULL && CFGetTypeID(devices) == CFArrayGetTypeID()) ? CFArrayGetCount(devices) : 0;
+  for (i = 0; i < n && count < max; i++) {
+    CFDictionaryRef entry = CFArrayGetValueAtIndex(devices, i);
+    CFDictionaryRef props = CFDictionaryGetValue(entry, CFSTR("Properties"));
+    if (props == NULL) continue;
+    CFStringRef udid = CFDictionaryGetValue(props, CFSTR("SerialNumber"));
+    CFStringRef type = CFDictionaryGetValue(props, CFSTR("ConnectionType"));
+    struct usbmux_device *dev = &list[count];
+    dev->device_id = (uint32_t)usbmux_number(props, CFSTR("DeviceID"), usbmux_number(entry, CFSTR("DeviceID"), 0));
+    if (udid == NULL || !CFStringGetCString(udid, dev->udid, sizeof(dev->udid), kCFStringEncodingUTF8)) continue;
+    dev->network = type != NULL && CFStringCompare(type, CFSTR("Network"), 0) == kCFCompareEqualTo;
+    count++;
+  }
+  CFRelease(reply);
+  return count;
+}
+
+int usbmux_connect(uint32_t device_id, uint16_t port)
+{
+  CFMutableDictionaryRef msg = usbmux_message(CFSTR("Connect"));
+  int32_t id = device_id, be_port = htons(port);  /* usbmuxd wants the port in network order */
+  CFNumberRef cf_id = CFNumberCreate(NULL, kCFNumberSInt32Type, &id);
+  CFNumberRef cf_port = CFNumberCreate(NULL, kCFNumberSInt32Type, &be_port);
+  int fd;
+
+  CFDictionarySetValue(msg, CFSTR("DeviceID"), cf_id);
+  CFDictionarySetValue(msg, CFSTR("PortNumber"), cf_port);
+  CFRelease(cf_port);
+  CFRelease(cf_id);
+  CFDictionaryRef reply = usbmux_request(msg, &fd);
+  CFRelease(msg);
+  if (reply == NULL) {
+    return -1;
+  }
+  if (usbmux_number(reply, CFSTR("Number"), -1) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  CFRelease(reply);
+  return fd;
+}
+
+CFDictionaryRef usbmux_read_pair_record(const char *udid)
+{
+  CFMutableDictionaryRef msg = usbmux_message(CFSTR("ReadPairRecord"));
+  CFStringRef cf_udid = CFStringCreateWithCString(NULL, udid, kCFStringEncodingUTF8);
+  CFPropertyListRef record = NULL;
+  int fd;
+
+  CFDictionarySetValue(msg, CFSTR("PairRecordID"), cf_udid);
+  CFRelease(cf_udid);
+  CFDictionaryRef reply = usbmux_request(msg, &fd);
+  CFRelease(msg);
+  if (reply == NULL) {
+    return NULL;
+  }
+  close(fd);
+  CFDataRef data = CFDictionaryGetValue(reply, CFSTR("PairRecordData"));
+  if (data != NULL && CFGetTypeID(data) == CFDataGetTypeID()) {
+    record = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+  }
+  CFRelease(reply);
+  if (record != NULL && CFGetTypeID(record) != CFDictionaryGetTypeID()) {
+    CFRelease(record);
+    record = NULL;
+  }
+  return record;
+}
@@ -0,0 +1,36 @@
+/* ----------------------------------------------------------------------------
+ *   usbmux.h - usbmuxd client
+ *
+ *   usbmuxd owns the USB connections to devices on macOS and Linux. Each
+ *   request is a 16 byte header and an XML plist on its socket, which is
+ *   $USBMUXD_SOCKET_ADDRESS ("UNIX:/path", "/path" or "host:port") or
+ *   /var/run/usbmuxd. After a successful Connect the socket carries the
+ *   device port's byte stream.
+ * ------------------------------------------------------------------------- */
+
+#ifndef USBMUX_H
+#define USBMUX_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdint.h>
+
+#define USBMUX_LOCKDOWN_PORT 62078
+
+struct usbmux_device
+{
+  uint32_t device_id;           /* usbmuxd's id, valid while attached */
+  char udid[64];
+  int network;                  /* attached over Wi-Fi rather than USB */
+};
+
+/* Attached devices, at most `max`; -1 when usbmuxd is not reachable. */
+int usbmux_list(struct usbmux_device *list, int max);
+
+/* Socket connected to `port` (host byte order) on the device, or -1. */
+int usbmux_connect(uint32_t device_id, uint16_t port);
+
+/* Pair record usbmuxd keeps for the device (HostID, SystemBUID, HostCertificate,
+   HostPrivateKey, ...), NULL if it was never paired with this host. */
+CFDictionaryRef usbmux_read_pair_record(const char *udid);
+
+#endif
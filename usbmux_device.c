@@ -0,0 +1,590 @@
+/* ----------------------------------------------------------------------------
+ *   usbmux_device.c - MobileDevice backend on usbmuxd and lockdownd
+ *
+ *   Implements the part of MobileDevice.h that idb uses by speaking the
+ *   usbmuxd protocol (usbmux.c) and lockdownd (lockdown.c) directly, so idb
+ *   runs where MobileDevice.framework does not, e.g. Linux hosts with the
+ *   open source usbmuxd. Link it instead of the framework:
+ *
+ *     rake usbmux     # builds ./idb-usbmux
+ *
+ *   Devices usbmuxd already knows are reported from inside
+ *   AMDeviceNotificationSubscribe(), so a command against an attached
+ *   device starts without waiting for the run loop; later attach and
+ *   detach events come from a ListDevices poll on the run loop. AFC
+ *   services are spoken to through afc_device.c. Sessions that ask for TLS
+ *   need a build with -DIDB_OPENSSL (see lockdown.h); services that ask for
+ *   it (EnableServiceSSL) are reported as unsupported and fail to start.
+ *
+ *   Environment:
+ *
+ *     USBMUXD_SOCKET_ADDRESS  "UNIX:/path", "/path" or "host:port" of usbmuxd
+ * ------------------------------------------------------------------------- */
+
+#include "MobileDevice.h"
+#include "afc_client.h"
+#include "lockdown.h"
+#include "usbmux.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the opaque MobileDevice structs are packed; ours start with them and are
+   only ever reached through pointers we allocated */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+#endif
+
+#define UM_MAX_DEVICES   64
+#define UM_POLL_SECONDS  1.0
+#define UM_ERR           1      /* any failure; callers only test for non-zero */
+#define UM_CHUNK         (1024 * 1024)
+#define UM_STAGING       "PublicStaging"
+#define UM_AFC_WRITE     2      /* idb's AFC_FILE_WRITE: create, truncate */
+
+struct um_device
+{
+  struct am_device base;        /* what idb sees */
+  struct usbmux_device info;
+  int attached;
+  struct lockdown *ld;          /* opened by AMDeviceConnect() */
+  pthread_mutex_t lock;
+};
+
+/* Devices are never freed: idb keeps pointers to detached ones until its
+   disconnect handling has run, and a device that comes back reuses its slot. */
+static struct
+{
+  struct um_device *devices[UM_MAX_DEVICES];
+  int count;
+  am_device_notification_callback callback;
+  void *callback_arg;
+  CFRunLoopTimerRef timer;
+  struct am_device_notification notification;
+} um;
+
+/************************************************************************************************/
+/* helpers */
+
+static struct um_device *um_device(struct am_device *device)
+{
+  return (struct um_device *)device;
+}
+
+static CFMutableDictionaryRef um_dictionary(void)
+{
+  return CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+}
+
+static int um_equal(CFTypeRef value, CFStringRef str)
+{
+  return value != NULL && CFGetTypeID(value) == CFStringGetTypeID() &&
+         CFStringCompare(value, str, 0) == kCFCompareEqualTo;
+}
+
+static char *um_join(const char *a, const char *b)
+{
+  char *p = malloc(strlen(a) + 1 + strlen(b) + 1);
+  strcpy(p, a);
+  strcat(p, "/");
+  strcat(p, b);
+  return p;
+}
+
+static char *um_url_path(CFURLRef url)
+{
+  char *path = malloc(4096);
+  if (!CFURLGetFileSystemRepresentation(url, true, (UInt8 *)path, 4096)) path[0] = '\0';
+  return path;
+}
+
+/* Plist service started through the device's lockdown session; -1 without one.
+   Like every use of dev->ld this holds dev->lock: callers on several threads
+   share the one lockdown connection, which MobileDevice serializes too. */
+static int um_service(struct um_device *dev, CFStringRef name)
+{
+  pthread_mutex_lock(&dev->lock);
+  int fd = (dev->ld != NULL) ? lockdown_start_service(dev->ld, name) : -1;
+  pthread_mutex_unlock(&dev->lock);
+  if (fd == LOCKDOWN_UNSUPPORTED) {
+    char buf[128];
+    if (!CFStringGetCString(name, buf, sizeof(buf), kCFStringEncodingUTF8)) buf[0] = '\0';
+    fprintf(stderr, "%s: %s needs a TLS service connection (EnableServiceSSL), which is not supported\n",
+            dev->info.udid, buf);
+    return -1;
+  }
+  return fd;
+}
+
+static void um_notify(struct um_device *dev, unsigned int msg)
+{
+  struct am_device_notification_callback_info cb = { &dev->base, msg };
+  um.callback(&cb, um.callback_arg);
+}
+
+/************************************************************************************************/
+/* device */
+
+void AMDSetLogLevel(int level) {}
+void AMDAddLogFileDescriptor(int fd) {}
+
+/* Slot of the device with `udid`, or -1. */
+static int um_find(const char *udid)
+{
+  int i;
+  for (i = 0; i < um.count; i++) {
+    if (strcmp(um.devices[i]->info.udid, udid) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Diffs usbmuxd's device list against ours and reports the changes. A
+   device attached both over USB and Wi-Fi is reported once, on USB. */
+static void um_poll(CFRunLoopTimerRef timer, void *info)
+{
+  struct usbmux_device list[UM_MAX_DEVICES];
+  int seen[UM_MAX_DEVICES] = { 0 };
+  int i, j, n = usbmux_list(list, UM_MAX_DEVICES);
+
+  if (n < 0) {
+    return;                     /* usbmuxd restarting; keep what we have */
+  }
+  /* one entry per serial, so a device on both links keeps one DeviceID */
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < i; j++) {
+      if (list[j].udid[0] != '\0' && strcmp(list[j].udid, list[i].udid) == 0) {
+        if (list[j].network && !list[i].network) list[j] = list[i];
+        list[i].udid[0] = '\0';
+        break;
+      }
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (list[i].udid[0] == '\0') continue;
+    int index = um_find(list[i].udid);
+    struct um_device *dev;
+    if (index < 0) {
+      if (um.count == UM_MAX_DEVICES) continue;
+      dev = calloc(1, sizeof(*dev));
+      pthread_mutex_init(&dev->lock, NULL);
+      index = um.count++;
+      um.devices[index] = dev;
+    }
+    dev = um.devices[index];
+    seen[index] = 1;
+    if (dev->attached && dev->info.device_id != list[i].device_id) {
+      /* replugged, or now on USB, between two polls: the same serial under
+         a new DeviceID, and lockdown still talks to the old one */
+      dev->attached = 0;
+      um_notify(dev, ADNCI_MSG_DISCONNECTED);
+    }
+    dev->info = list[i];
+    dev->base.device_id = list[i].device_id;
+    dev->base.product_id = AMD_IPHONE_PRODUCT_ID;
+    dev->base.serial = dev->info.udid;
+    if (!dev->attached) {
+      /* a lockdown connection from before the device went away is dead */
+      pthread_mutex_lock(&dev->lock);
+      lockdown_close(dev->ld);
+      dev->ld = NULL;
+      pthread_mutex_unlock(&dev->lock);
+      dev->attached = 1;
+      um_notify(dev, ADNCI_MSG_CONNECTED);
+    }
+  }
+  for (i = 0; i < um.count; i++) {
+    if (um.devices[i]->attached && !seen[i]) {
+      um.devices[i]->attached = 0;
+      um_notify(um.devices[i], ADNCI_MSG_DISCONNECTED);
+    }
+  }
+}
+
+/* Unlike MobileDevice, devices already attached are reported before this
+   returns; the repeating timer picks up later changes and keeps
+   CFRunLoopRun() from returning. */
+mach_error_t AMDeviceNotificationSubscribe(am_device_notification_callback callback,
+    unsigned int unused0, unsigned int unused1, void *arg, struct am_device_notification **notification)
+{
+  um.callback = callback;
+  um.callback_arg = arg;
+  um.notification.callback = callback;
+  *notification = &um.notification;
+  um.timer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + UM_POLL_SECONDS, UM_POLL_SECONDS, 0, 0,
+                                  um_poll, NULL);
+  CFRunLoopAddTimer(CFRunLoopGetCurrent(), um.timer, kCFRunLoopCommonModes);
+  um_poll(NULL, NULL);
+  return ERR_SUCCESS;
+}
+
+mach_error_t AMDeviceNotificationUnsubscribe(struct am_device_notification *notification)
+{
+  if (um.timer != NULL) {
+    CFRunLoopTimerInvalidate(um.timer);
+  }
+  return ERR_SUCCESS;
+}
+
+mach_error_t AMDeviceConnect(struct am_device *device)
+{
+  struct um_device *dev = um_device(device);
+  pthread_mutex_lock(&dev->lock);
+  if (dev->ld == NULL) {
+    dev->ld = lockdown_open(dev->info.device_id, dev->info.udid);
+  }
+  mach_error_t ret = (dev->ld != NULL) ? ERR_SUCCESS : UM_ERR;
+  pthread_mutex_unlock(&dev->lock);
+  return ret;
+}
+
+mach_error_t AMDeviceDisconnect(struct am_device *device)
+{
+  struct um_device *dev = um_device(device);
+  pthread_mutex_lock(&dev->lock);
+  lockdown_close(dev->ld);
+  dev->ld = NULL;
+  pthread_mutex_unlock(&dev->lock);
+  return ERR_SUCCESS;
+}
+
+/* Pairing is usbmuxd's business; a device is paired if it holds a record for it. */
+int AMDeviceIsPaired(struct am_device *device)
+{
+  CFDictionaryRef record = usbmux_read_pair_record(um_device(device)->info.udid);
+  if (record == NULL) {
+    return 0;
+  }
+  CFRelease(record);
+  return 1;
+}
+
+mach_error_t AMDeviceValidatePairing(struct am_device *device)
+{
+  return AMDeviceIsPaired(device) ? ERR_SUCCESS : UM_ERR;
+}
+
+mach_error_t AMDeviceStartSession(struct am_device *device)
+{
+  struct um_device *dev = um_device(device);
+  pthread_mutex_lock(&dev->lock);
+  int ok = dev->ld != NULL && lockdown_start_session(dev->ld) == 0;
+  pthread_mutex_unlock(&dev->lock);
+  return ok ? ERR_SUCCESS : UM_ERR;
+}
+
+mach_error_t AMDeviceStopSession(struct am_device *device)
+{
+  struct um_device *dev = um_device(device);
+  pthread_mutex_lock(&dev->lock);
+  int ok = dev->ld != NULL && lockdown_stop_session(dev->ld) == 0;
+  pthread_mutex_unlock(&dev->lock);
+  return ok ? ERR_SUCCESS : UM_ERR;
+}
+
+mach_error_t AMDeviceRetain(struct am_device *device) { return ERR_SUCCESS; }
+mach_error_t AMDeviceRelease(struct am_device *device) { return ERR_SUCCESS; }
+
+unsigned int AMDeviceGetConnectionID(struct am_device *device)
+{
+  return um_device(device)->info.device_id;
+}
+
+CFStringRef AMDeviceCopyDeviceIdentifier(struct am_device *device)
+{
+  return CFStringCreateWithCString(NULL, um_device(device)->info.udid, kCFStringEncodingUTF8);
+}
+
+CFStringRef AMDeviceCopyValue(struct am_device *device, unsigned int domain, CFStringRef key)
+{
+  struct um_device *dev = um_device(device);
+  pthread_mutex_lock(&dev->lock);
+  CFTypeRef value = (dev->ld != NULL) ? lockdown_get_value(dev->ld, NULL, key) : NULL;
+  pthread_mutex_unlock(&dev->lock);
+  return (CFStringRef)value;
+}
+
+mach_error_t AMDeviceStartService(struct am_device *device, CFStringRef service_name,
+    service_conn_t *handle, unsigned int *unknown)
+{
+  int fd = um_service(um_device(device), service_name);
+  if (fd < 0) {
+    return UM_ERR;
+  }
+  *handle = fd;
+  return ERR_SUCCESS;
+}
+
+mach_error_t AMDeviceStartHouseArrestService(struct am_device *device, CFStringRef identifier,
+    void *unknown, service_conn_t *handle, unsigned int *what)
+{
+  int fd = um_service(um_device(device), CFSTR("com.apple.mobile.house_arrest"));
+  if (fd < 0) {
+    return UM_ERR;
+  }
+  CFMutableDictionaryRef msg = um_dictionary();
+  CFDictionarySetValue(msg, CFSTR("Command"), CFSTR("VendContainer"));
+  CFDictionarySetValue(msg, CFSTR("Identifier"), identifier);
+  CFDictionaryRef reply = (plist_send(fd, msg) == 0) ? plist_recv(fd) : NULL;
+  CFRelease(msg);
+
+  /* after Complete the socket speaks AFC in the app's container */
+  int ok = reply != NULL && CFGetTypeID(reply) == CFDictionaryGetTypeID() &&
+           um_equal(CFDictionaryGetValue(reply, CFSTR("Status")), CFSTR("Complete"));
+  if (reply != NULL) CFRelease(reply);
+  if (!ok) {
+    close(fd);
+    return UM_ERR;
+  }
+  *handle = fd;
+  return ERR_SUCCESS;
+}
+
+int USBMuxConnectByPort(int conn, int port, service_conn_t *handle)
+{
+  int fd = usbmux_connect(conn, ntohs(port));
+  if (fd < 0) {
+    return MDERR_USBMUX_FAILED;
+  }
+  *handle = fd;
+  return ERR_SUCCESS;
+}
+
+/************************************************************************************************/
+/* apps */
+
+/* Sends an installation_proxy command and feeds every reply to `callback`
+   (may be NULL) until Status is Complete; ERR_SUCCESS unless an Error came. */
+static int um_proxy_command(struct um_device *dev, CFDictionaryRef msg, void *callback, int cbarg,
+                            CFMutableDictionaryRef apps)
+{
+  int fd = um_service(dev, AMSVC_INSTALLATION_PROXY);
+  int ret = UM_ERR;
+
+  if (fd < 0) {
+    return UM_ERR;
+  }
+  if (plist_send(fd, msg) == 0) {
+    CFDictionaryRef reply;
+    while ((reply = plist_recv(fd)) != NULL) {
+      if (CFGetTypeID(reply) != CFDictionaryGetTypeID() || CFDictionaryGetValue(reply, CFSTR("Error")) != NULL) {
+        CFRelease(reply);
+        break;
+      }
+      CFArrayRef list = CFDictionaryGetValue(reply, CFSTR("CurrentList"));
+      if (apps != NULL && list != NULL && CFGetTypeID(list) == CFArrayGetTypeID()) {
+        CFIndex i, n = CFArrayGetCount(list);
+        for (i = 0; i < n; i++) {
+          CFDictionaryRef app = CFArrayGetValueAtIndex(list, i);
+          CFStringRef id = CFDictionaryGetValue(app, CFSTR("CFBundleIdentifier"));
+          if (id != NULL) CFDictionarySetValue(apps, id, app);
+        }
+      }
+      if (callback != NULL) {
+        ((void (*)(CFDictionaryRef, int))callback)(reply, cbarg);
+      }
+      CFTypeRef status = CFDictionaryGetValue(reply, CFSTR("Status"));
+      int done = status == NULL || um_equal(status, CFSTR("Complete"));
+      CFRelease(reply);
+      if (done) {
+        ret = ERR_SUCCESS;
+        break;
+      }
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+int AMDeviceLookupApplications(struct am_device *device, CFDictionaryRef options, CFDictionaryRef *apps)
+{
+  CFMutableDictionaryRef msg = um_dictionary(), result = um_dictionary();
+  CFDictionarySetValue(msg, CFSTR("Command"), CFSTR("Browse"));
+  if (options != NULL) CFDictionarySetValue(msg, CFSTR("ClientOptions"), options);
+  int ret = um_proxy_command(um_device(device), msg, NULL, 0, result);
+  CFRelease(msg);
+  if (ret != ERR_SUCCESS) {
+    CFRelease(result);
+    return ret;
+  }
+  *apps = result;
+  return ERR_SUCCESS;
+}
+
+static void um_progress(void *callback, const char *status, int percent, int arg)
+{
+  if (callback == NULL) return;
+  CFStringRef cf_status = CFStringCreateWithCString(NULL, status, kCFStringEncodingUTF8);
+  CFNumberRef cf_percent = CFNumberCreate(NULL, kCFNumberSInt32Type, &percent);
+  const void *k[] = { CFSTR("Status"), CFSTR("PercentComplete") }, *v[] = { cf_status, cf_percent };
+  CFDictionaryRef dict = CFDictionaryCreate(NULL, k, v, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  ((void (*)(CFDictionaryRef, int))callback)(dict, arg);
+  CFRelease(dict);
+  CFRelease(cf_percent);
+  CFRelease(cf_status);
+}
+
+/* Status of the oldest outstanding request: 0, or -1 for errors. */
+static int um_afc_wait(struct afc_client *client)
+{
+  struct afc_reply reply;
+  if (afc_recv(client, &reply) != 0) {
+    return -1;
+  }
+  return (reply.op == AFC_OP_STATUS && reply.status != AFC_STATUS_SUCCESS) ? -1 : 0;
+}
+
+/* Removes `path` and everything below it; a missing path is not an error. */
+static void um_afc_remove_tree(struct afc_client *client, const char *path)
+{
+  struct afc_reply reply;
+  size_t offset = 0, count = 0, i;
+  char **names = NULL;
+  const char *name;
+
+  if (afc_send_read_dir(client, path) != 0 || afc_recv(client, &reply) != 0) {
+    return;
+  }
+  if (reply.op == AFC_OP_DATA) {
+    while ((name = afc_reply_next(&reply, &offset)) != NULL) {
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+      names = realloc(names, (count + 1) * sizeof(*names));
+      names[count++] = um_join(path, name);
+    }
+  }
+  for (i = 0; i < count; i++) {
+    um_afc_remove_tree(client, names[i]);
+    free(names[i]);
+  }
+  free(names);
+  if (afc_send_remove(client, path) == 0) {
+    um_afc_wait(client);
+  }
+}
+
+/* Uploads `local` to `remote`; file data goes out as pipelined writes
+   whose statuses are collected after the close. */
+static int um_afc_upload(struct afc_client *client, const char *local, const char *remote)
+{
+  struct stat st;
+  if (stat(local, &st) != 0) {
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(local);
+    struct dirent *entry;
+    int ret = 0;
+    if (dir == NULL || afc_send_make_dir(client, remote) != 0 || um_afc_wait(client) != 0) {
+      if (dir != NULL) closedir(dir);
+      return -1;
+    }
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+      char *a = um_join(local, entry->d_name), *b = um_join(remote, entry->d_name);
+      ret = um_afc_upload(client, a, b);
+      free(a);
+      free(b);
+    }
+    closedir(dir);
+    return ret;
+  }
+
+  struct afc_reply reply;
+  int fd = open(local, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  if (afc_send_open(client, remote, UM_AFC_WRITE) != 0 || afc_recv(client, &reply) != 0 ||
+      reply.op != AFC_OP_FILE_OPEN_RES) {
+    close(fd);
+    return -1;
+  }
+  uint64_t handle = reply.handle;
+  char *buf = malloc(UM_CHUNK);
+  size_t writes = 0;
+  ssize_t n;
+  int ret = 0;
+  while ((n = read(fd, buf, UM_CHUNK)) > 0) {
+    if (afc_send_write(client, handle, buf, n) != 0) {
+      ret = -1;
+      break;
+    }
+    writes++;
+  }
+  if (n < 0) ret = -1;
+  if (afc_send_close(client, handle) == 0) {
+    writes++;
+  }
+  while (writes-- > 0) {
+    if (um_afc_wait(client) != 0) ret = -1;
+  }
+  free(buf);
+  close(fd);
+  return ret;
+}
+
+int AMDeviceSecureTransferPath(int unknown0, struct am_device *device, CFURLRef url,
+    CFDictionaryRef options, void *callback, int cbarg)
+{
+  int fd = um_service(um_device(device), AMSVC_AFC);
+  if (fd < 0) {
+    return UM_ERR;
+  }
+  struct afc_client *client = afc_client_new(fd);
+  char *local = um_url_path(url);
+  const char *name = strrchr(local, '/') ? strrchr(local, '/') + 1 : local;
+  char *remote = um_join(UM_STAGING, name);
+
+  um_progress(callback, "CopyingFile", 0, cbarg);
+  if (afc_send_make_dir(client, UM_STAGING) == 0) {
+    um_afc_wait(client);
+  }
+  um_afc_remove_tree(client, remote);
+  int ret = um_afc_upload(client, local, remote);
+  um_progress(callback, "CopyingFile", 100, cbarg);
+
+  free(remote);
+  free(local);
+  afc_client_free(client);
+  return ret ? UM_ERR : ERR_SUCCESS;
+}
+
+int AMDeviceSecureInstallApplication(int unknown0, struct am_device *device, CFURLRef url,
+    CFDictionaryRef options, void *callback, int cbarg)
+{
+  char *local = um_url_path(url);
+  const char *name = strrchr(local, '/') ? strrchr(local, '/') + 1 : local;
+  char *staged = um_join(UM_STAGING, name);
+  CFStringRef path = CFStringCreateWithCString(NULL, staged, kCFStringEncodingUTF8);
+  CFMutableDictionaryRef msg = um_dictionary();
+
+  CFDictionarySetValue(msg, CFSTR("Command"), CFSTR("Install"));
+  CFDictionarySetValue(msg, CFSTR("PackagePath"), path);
+  if (options != NULL) CFDictionarySetValue(msg, CFSTR("ClientOptions"), options);
+  int ret = um_proxy_command(um_device(device), msg, callback, cbarg, NULL);
+
+  CFRelease(msg);
+  CFRelease(path);
+  free(staged);
+  free(local);
+  return ret;
+}
+
+int AMDeviceSecureUninstallApplication(int unknown0, struct am_device *device, CFStringRef bundle_id,
+    int unknown1, void *callback, int cbarg)
+{
+  CFMutableDictionaryRef msg = um_dictionary();
+  CFDictionarySetValue(msg, CFSTR("Command"), CFSTR("Uninstall"));
+  CFDictionarySetValue(msg, CFSTR("ApplicationIdentifier"), bundle_id);
+  int ret = um_proxy_command(um_device(device), msg, callback, cbarg, NULL);
+  CFRelease(msg);
+  return ret;
+}
@@ -0,0 +1,836 @@
+/* ----------------------------------------------------------------------------
+ *   usbmuxd_sim.c - stand-in usbmuxd with simulated devices
+ *
+ *   Answers the usbmuxd protocol on a unix socket and plays lockdownd and
+ *   the services idb starts through it (afc, house_arrest,
+ *   installation_proxy, syslog_relay, crash report copy and mover) on the
+ *   $IDB_SIM_ROOT layout of
+ *   sim_device.c, so idb-usbmux can be exercised without a device:
+ *
+ *     rake usbmuxd-sim
+ *     ./usbmuxd-sim /tmp/usbmuxd.sock &
+ *     USBMUXD_SOCKET_ADDRESS=UNIX:/tmp/usbmuxd.sock ./idb-usbmux ls
+ *
+ *   Sessions are plain text (EnableSessionSSL false). Connecting to any
+ *   other device port connects to 127.0.0.1:port, for tunnel.
+ *
+ *   SIGUSR1 replugs every device: each gets a new DeviceID and lockdown
+ *   connections opened under the old one are closed, as usbmuxd does when
+ *   a device comes back.
+ *
+ *   Environment: IDB_SIM_ROOT, IDB_SIM_DEVICES, IDB_SIM_LATENCY_US and
+ *   IDB_SIM_BANDWIDTH as for sim_device.c; IDB_SIM_SSL_SERVICES, a comma
+ *   separated list of services StartService answers with EnableServiceSSL.
+ * ------------------------------------------------------------------------- */
+
+#define _GNU_SOURCE            /* nftw */
+
+#include "afc_server.h"
+#include "lockdown.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MUX_HEADER_SIZE   16
+#define MUX_MSG_PLIST     8
+#define MUX_MAX_MESSAGE   (16 * 1024 * 1024)
+#define MUX_MAX_DEVICES   64
+#define MUX_MAX_SERVICES  256
+#define MUX_FIRST_PORT    49152
+#define LOCKDOWN_PORT     62078
+
+/* usbmuxd Result numbers */
+#define RESULT_OK         0
+#define RESULT_BADDEV     2
+#define RESULT_REFUSED    3
+
+struct device
+{
+  int id;
+  char udid[64];
+  char *root;
+};
+
+/* ports StartService handed out, each good for one connection */
+struct service
+{
+  int port;
+  int device;
+  char name[128];
+};
+
+static struct
+{
+  const char *root;
+  const char *ssl_services;
+  long latency_us;
+  double bandwidth;
+  struct device devices[MUX_MAX_DEVICES];
+  int count;
+  pthread_mutex_t lock;
+  struct service services[MUX_MAX_SERVICES];
+  int next_port;
+} mux = { .lock = PTHREAD_MUTEX_INITIALIZER, .next_port = MUX_FIRST_PORT };
+
+static volatile sig_atomic_t replug;
+
+/************************************************************************************************/
+/* helpers */
+
+static char *join(const char *a, const char *b)
+{
+  char *p = malloc(strlen(a) + 1 + strlen(b) + 1);
+  strcpy(p, a);
+  strcat(p, "/");
+  strcat(p, b);
+  return p;
+}
+
+static void mkdirs(const char *path)
+{
+  char *copy = strdup(path);
+  char *p;
+  for (p = copy + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(copy, 0755);
+      *p = '/';
+    }
+  }
+  mkdir(copy, 0755);
+  free(copy);
+}
+
+static char *cstring(CFStringRef str)
+{
+  CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(str), kCFStringEncodingUTF8) + 1;
+  char *buf = malloc(size);
+  if (!CFStringGetCString(str, buf, size, kCFStringEncodingUTF8)) buf[0] = '\0';
+  return buf;
+}
+
+static int is_string(CFTypeRef value, CFStringRef str)
+{
+  return value != NULL && CFGetTypeID(value) == CFStringGetTypeID() &&
+         CFStringCompare(value, str, 0) == kCFCompareEqualTo;
+}
+
+static long number(CFDictionaryRef dict, CFStringRef key)
+{
+  CFNumberRef value = CFDictionaryGetValue(dict, key);
+  long long n = -1;
+  if (value != NULL && CFGetTypeID(value) == CFNumberGetTypeID()) {
+    CFNumberGetValue(value, kCFNumberLongLongType, &n);
+  }
+  return (long)n;
+}
+
+static void set_number(CFMutableDictionaryRef dict, CFStringRef key, int value)
+{
+  CFNumberRef n = CFNumberCreate(NULL, kCFNumberSInt32Type, &value);
+  CFDictionarySetValue(dict, key, n);
+  CFRelease(n);
+}
+
+static CFMutableDictionaryRef dictionary(void)
+{
+  return CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+}
+
+static void delay(void)
+{
+  if (mux.latency_us > 0) {
+    struct timespec ts = { mux.latency_us / 1000000, (mux.latency_us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+static CFPropertyListRef read_plist_file(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  CFPropertyListRef plist = NULL;
+  if (file != NULL) {
+    struct stat st;
+    fstat(fileno(file), &st);
+    UInt8 *buf = malloc(st.st_size + 1);
+    size_t len = fread(buf, 1, st.st_size, file);
+    CFDataRef data = CFDataCreate(NULL, buf, len);
+    plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+    CFRelease(data);
+    free(buf);
+    fclose(file);
+  }
+  if (plist != NULL && CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+    CFRelease(plist);
+    plist = NULL;
+  }
+  return plist;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  return remove(path);
+}
+
+/************************************************************************************************/
+/* usbmuxd protocol */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static CFDictionaryRef mux_recv(int fd, uint32_t *tag)
+{
+  unsigned char header[MUX_HEADER_SIZE];
+  if (read_all(fd, header, sizeof(header)) != 0) {
+    return NULL;
+  }
+  uint32_t len = get_le32(header);
+  if (len < MUX_HEADER_SIZE || len > MUX_MAX_MESSAGE || get_le32(header + 8) != MUX_MSG_PLIST) {
+    return NULL;
+  }
+  *tag = get_le32(header + 12);
+  len -= MUX_HEADER_SIZE;
+  UInt8 *buf = malloc(len ? len : 1);
+  CFPropertyListRef plist = NULL;
+  if (read_all(fd, buf, len) == 0) {
+    CFDataRef data = CFDataCreateWithBytesNoCopy(NULL, buf, len, kCFAllocatorNull);
+    plist = CFPropertyListCreateWithData(NULL, data, kCFPropertyListImmutable, NULL, NULL);
+    CFRelease(data);
+  }
+  free(buf);
+  if (plist != NULL && CFGetTypeID(plist) != CFDictionaryGetTypeID()) {
+    CFRelease(plist);
+    plist = NULL;
+  }
+  return plist;
+}
+
+static int mux_send(int fd, uint32_t tag, CFDictionaryRef msg)
+{
+  CFDataRef data = CFPropertyListCreateData(NULL, msg, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+  unsigned char header[MUX_HEADER_SIZE];
+  put_le32(header, MUX_HEADER_SIZE + CFDataGetLength(data));
+  put_le32(header + 4, 1);
+  put_le32(header + 8, MUX_MSG_PLIST);
+  put_le32(header + 12, tag);
+  int ret = write_all(fd, header, sizeof(header));
+  if (ret == 0) ret = write_all(fd, CFDataGetBytePtr(data), CFDataGetLength(data));
+  CFRelease(data);
+  return ret;
+}
+
+static int mux_result(int fd, uint32_t tag, int result)
+{
+  CFMutableDictionaryRef msg = dictionary();
+  CFDictionarySetValue(msg, CFSTR("MessageType"), CFSTR("Result"));
+  set_number(msg, CFSTR("Number"), result);
+  int ret = mux_send(fd, tag, msg);
+  CFRelease(msg);
+  return ret;
+}
+
+static CFDictionaryRef device_list(void)
+{
+  CFMutableArrayRef list = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+  int i;
+  for (i = 0; i < mux.count; i++) {
+    CFMutableDictionaryRef entry = dictionary(), props = dictionary();
+    CFStringRef udid = CFStringCreateWithCString(NULL, mux.devices[i].udid, kCFStringEncodingUTF8);
+    CFDictionarySetValue(props, CFSTR("SerialNumber"), udid);
+    CFDictionarySetValue(props, CFSTR("ConnectionType"), CFSTR("USB"));
+    set_number(props, CFSTR("DeviceID"), mux.devices[i].id);
+    set_number(props, CFSTR("ProductID"), 0x12a8);
+    CFDictionarySetValue(entry, CFSTR("MessageType"), CFSTR("Attached"));
+    set_number(entry, CFSTR("DeviceID"), mux.devices[i].id);
+    CFDictionarySetValue(entry, CFSTR("Properties"), props);
+    CFArrayAppendValue(list, entry);
+    CFRelease(udid);
+    CFRelease(props);
+    CFRelease(entry);
+  }
+  CFMutableDictionaryRef reply = dictionary();
+  CFDictionarySetValue(reply, CFSTR("DeviceList"), list);
+  CFRelease(list);
+  return reply;
+}
+
+static CFDictionaryRef pair_record(void)
+{
+  CFMutableDictionaryRef record = dictionary(), reply = dictionary();
+  CFDictionarySetValue(record, CFSTR("HostID"), CFSTR("00000000-0000-0000-0000-000000000000"));
+  CFDictionarySetValue(record, CFSTR("SystemBUID"), CFSTR("00000000-0000-0000-0000-000000000000"));
+  CFDataRef data = CFPropertyListCreateData(NULL, record, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+  CFDictionarySetValue(reply, CFSTR("PairRecordData"), data);
+  CFRelease(data);
+  CFRelease(record);
+  return reply;
+}
+
+/************************************************************************************************/
+/* services */
+
+static CFDictionaryRef reply_status(CFStringRef status)
+{
+  CFMutableDictionaryRef reply = dictionary();
+  CFDictionarySetValue(reply, CFSTR("Status"), status);
+  return reply;
+}
+
+static void send_release(int fd, CFDictionaryRef msg)
+{
+  plist_send(fd, msg);
+  CFRelease(msg);
+}
+
+static CFDictionaryRef reply_error(CFStringRef error)
+{
+  CFMutableDictionaryRef reply = dictionary();
+  CFDictionarySetValue(reply, CFSTR("Error"), error);
+  return reply;
+}
+
+static void serve_house_arrest(int fd, struct device *dev)
+{
+  CFDictionaryRef msg = plist_recv(fd);
+  if (msg == NULL || CFGetTypeID(msg) != CFDictionaryGetTypeID()) {
+    if (msg != NULL) CFRelease(msg);
+    close(fd);
+    return;
+  }
+  CFStringRef identifier = CFDictionaryGetValue(msg, CFSTR("Identifier"));
+  char *id = (identifier != NULL) ? cstring(identifier) : strdup("");
+  char *apps = join(dev->root, "apps");
+  char *container = join(apps, id);
+  struct stat st;
+
+  delay();
+  if (id[0] != '\0' && strchr(id, '/') == NULL && stat(container, &st) == 0 && S_ISDIR(st.st_mode)) {
+    send_release(fd, reply_status(CFSTR("Complete")));
+    afc_server_start(fd, container, mux.latency_us, mux.bandwidth);
+  } else {
+    send_release(fd, reply_error(CFSTR("ApplicationLookupFailed")));
+    close(fd);
+  }
+  free(container);
+  free(apps);
+  free(id);
+  CFRelease(msg);
+}
+
+static CFDictionaryRef app_entry(const char *root, const char *id)
+{
+  char *container = join(root, id);
+  CFStringRef cf_id = CFStringCreateWithCString(NULL, id, kCFStringEncodingUTF8);
+  CFStringRef cf_container = CFStringCreateWithCString(NULL, container, kCFStringEncodingUTF8);
+  const void *k[] = { CFSTR("CFBundleIdentifier"), CFSTR("CFBundleDisplayName"), CFSTR("Container"), CFSTR("ApplicationType") };
+  const void *v[] = { cf_id, cf_id, cf_container, CFSTR("User") };
+  CFDictionaryRef app = CFDictionaryCreate(NULL, k, v, 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFRelease(cf_container);
+  CFRelease(cf_id);
+  free(container);
+  return app;
+}
+
+/* Bundle id from the staged .app's Info.plist, else the package file name. */
+static char *bundle_id(const char *staged)
+{
+  char *info = join(staged, "Info.plist");
+  CFDictionaryRef plist = read_plist_file(info);
+  char *id = NULL;
+  free(info);
+  if (plist != NULL) {
+    CFStringRef cf_id = CFDictionaryGetValue(plist, CFSTR("CFBundleIdentifier"));
+    if (cf_id != NULL) id = cstring(cf_id);
+    CFRelease(plist);
+  }
+  if (id == NULL) {
+    const char *name = strrchr(staged, '/') ? strrchr(staged, '/') + 1 : staged;
+    id = strdup(name);
+    char *dot = strrchr(id, '.');
+    if (dot != NULL && dot != id) *dot = '\0';
+  }
+  return id;
+}
+
+static void serve_installation_proxy(int fd, struct device *dev)
+{
+  CFDictionaryRef msg;
+  char *apps = join(dev->root, "apps");
+
+  while ((msg = plist_recv(fd)) != NULL) {
+    CFStringRef command = CFGetTypeID(msg) == CFDictionaryGetTypeID() ? CFDictionaryGetValue(msg, CFSTR("Command")) : NULL;
+    delay();
+    if (is_string(command, CFSTR("Browse"))) {
+      CFMutableArrayRef list = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+      DIR *dir = opendir(apps);
+      struct dirent *entry;
+      while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        CFDictionaryRef app = app_entry(apps, entry->d_name);
+        CFArrayAppendValue(list, app);
+        CFRelease(app);
+      }
+      if (dir != NULL) closedir(dir);
+      CFMutableDictionaryRef reply = dictionary();
+      CFDictionarySetValue(reply, CFSTR("Status"), CFSTR("BrowsingProgress"));
+      CFDictionarySetValue(reply, CFSTR("CurrentList"), list);
+      send_release(fd, reply);
+      CFRelease(list);
+      send_release(fd, reply_status(CFSTR("Complete")));
+    } else if (is_string(command, CFSTR("Install"))) {
+      CFStringRef package = CFDictionaryGetValue(msg, CFSTR("PackagePath"));
+      char *path = (package != NULL) ? cstring(package) : strdup("");
+      char *media = join(dev->root, "media");
+      char *staged = join(media, path);
+      struct stat st;
+      if (path[0] != '\0' && strstr(path, "..") == NULL && stat(staged, &st) == 0) {
+        char *id = bundle_id(staged);
+        char *container = join(apps, id);
+        const char *subdirs[] = { "Documents", "Library/Caches", "Library/Preferences", "tmp" };
+        int i;
+        CFMutableDictionaryRef progress = dictionary();
+        CFDictionarySetValue(progress, CFSTR("Status"), CFSTR("InstallingApplication"));
+        set_number(progress, CFSTR("PercentComplete"), 50);
+        send_release(fd, progress);
+        for (i = 0; i < 4; i++) {
+          char *dir = join(container, subdirs[i]);
+          mkdirs(dir);
+          free(dir);
+        }
+        send_release(fd, reply_status(CFSTR("Complete")));
+        free(container);
+        free(id);
+      } else {
+        send_release(fd, reply_error(CFSTR("PackageInspectionFailed")));
+      }
+      free(staged);
+      free(media);
+      free(path);
+    } else if (is_string(command, CFSTR("Uninstall"))) {
+      CFStringRef cf_id = CFDictionaryGetValue(msg, CFSTR("ApplicationIdentifier"));
+      char *id = (cf_id != NULL) ? cstring(cf_id) : strdup("");
+      char *container = join(apps, id);
+      struct stat st;
+      if (id[0] != '\0' && strchr(id, '/') == NULL && stat(container, &st) == 0 &&
+          nftw(container, remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0) {
+        send_release(fd, reply_status(CFSTR("Complete")));
+      } else {
+        send_release(fd, reply_error(CFSTR("APIInternalError")));
+      }
+      free(container);
+      free(id);
+    } else {
+      send_release(fd, reply_error(CFSTR("UnknownCommand")));
+    }
+    CFRelease(msg);
+  }
+  free(apps);
+  close(fd);
+}
+
+static void serve_syslog_relay(int fd, struct device *dev)
+{
+  char *path = join(dev->root, "syslog");
+  FILE *file = fopen(path, "rb");
+  char buf[4096];
+  size_t n;
+  free(path);
+  if (file != NULL) {
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+      if (write_all(fd, buf, n) != 0) break;
+    }
+    fclose(file);
+  }
+  /* the relay stays open, like a quiet device, until idb goes away */
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+  close(fd);
+}
+
+/* Runs on the connection's thread; takes over `fd`. */
+static void serve_service(int fd, struct device *dev, const char *name)
+{
+  if (strcmp(name, "com.apple.afc") == 0) {
+    char *media = join(dev->root, "media");
+    afc_server_start(fd, media, mux.latency_us, mux.bandwidth);
+    free(media);
+  } else if (strcmp(name, "com.apple.mobile.house_arrest") == 0) {
+    serve_house_arrest(fd, dev);
+  } else if (strcmp(name, "com.apple.mobile.installation_proxy") == 0) {
+    serve_installation_proxy(fd, dev);
+  } else if (strcmp(name, "com.apple.syslog_relay") == 0) {
+    serve_syslog_relay(fd, dev);
+  } else if (strcmp(name, "com.apple.crashreportcopymobile") == 0) {
+    char *crashes = join(dev->root, "crashes");
+    mkdir(crashes, 0755);
+    afc_server_start(fd, crashes, mux.latency_us, mux.bandwidth);
+    free(crashes);
+  } else if (strcmp(name, "com.apple.crashreportmover") == 0) {
+    write_all(fd, "ping", 4);
+    close(fd);
+  } else {
+    close(fd);
+  }
+}
+
+/************************************************************************************************/
+/* lockdownd */
+
+static CFDictionaryRef device_values(struct device *dev)
+{
+  CFMutableDictionaryRef values = dictionary();
+  CFStringRef udid = CFStringCreateWithCString(NULL, dev->udid, kCFStringEncodingUTF8);
+  CFDictionarySetValue(values, CFSTR("UniqueDeviceID"), udid);
+  CFDictionarySetValue(values, CFSTR("SerialNumber"), udid);
+  CFDictionarySetValue(values, CFSTR("DeviceName"), udid);
+  CFDictionarySetValue(values, CFSTR("DeviceClass"), CFSTR("iPhone"));
+  CFDictionarySetValue(values, CFSTR("ProductType"), CFSTR("iPhone0,0"));
+  CFDictionarySetValue(values, CFSTR("ProductVersion"), CFSTR("0.0"));
+  CFDictionarySetValue(values, CFSTR("CPUArchitecture"), CFSTR("arm64"));
+  CFRelease(udid);
+
+  /* <udid>/info.plist overrides and extends the defaults */
+  char *info = join(dev->root, "info.plist");
+  CFDictionaryRef plist = read_plist_file(info);
+  free(info);
+  if (plist != NULL) {
+    CFIndex n = CFDictionaryGetCount(plist), k;
+    const void *keys[n], *vals[n];
+    CFDictionaryGetKeysAndValues(plist, keys, vals);
+    for (k = 0; k < n; k++) {
+      CFDictionarySetValue(values, keys[k], vals[k]);
+    }
+    CFRelease(plist);
+  }
+  return values;
+}
+
+/* Listed in IDB_SIM_SSL_SERVICES. */
+static int wants_ssl(const char *name)
+{
+  const char *p = mux.ssl_services;
+  size_t len = strlen(name);
+  while (p != NULL && *p != '\0') {
+    if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0')) return 1;
+    p = strchr(p, ',');
+    if (p != NULL) p++;
+  }
+  return 0;
+}
+
+static int start_service(struct device *dev, const char *name)
+{
+  int i, port = -1;
+  pthread_mutex_lock(&mux.lock);
+  for (i = 0; i < MUX_MAX_SERVICES; i++) {
+    if (mux.services[i].port == 0) {
+      port = mux.next_port++;
+      if (mux.next_port > 65000) mux.next_port = MUX_FIRST_PORT;
+      mux.services[i].port = port;
+      mux.services[i].device = dev->id;
+      snprintf(mux.services[i].name, sizeof(mux.services[i].name), "%s", name);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mux.lock);
+  return port;
+}
+
+/* Service started on `port` of `dev`, claimed for this connection; 0 if none. */
+static int claim_service(struct device *dev, int port, char *name, size_t size)
+{
+  int i, found = 0;
+  pthread_mutex_lock(&mux.lock);
+  for (i = 0; i < MUX_MAX_SERVICES && !found; i++) {
+    if (mux.services[i].port == port && mux.services[i].device == dev->id) {
+      snprintf(name, size, "%s", mux.services[i].name);
+      mux.services[i].port = 0;
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&mux.lock);
+  return found;
+}
+
+static void serve_lockdown(int fd, struct device *dev)
+{
+  CFDictionaryRef values = device_values(dev);
+  CFDictionaryRef msg;
+  int id = dev->id;
+
+  while ((msg = plist_recv(fd)) != NULL) {
+    if (dev->id != id) {
+      CFRelease(msg);           /* replugged: this connection went with the old device */
+      break;
+    }
+    CFStringRef request = CFGetTypeID(msg) == CFDictionaryGetTypeID() ? CFDictionaryGetValue(msg, CFSTR("Request")) : NULL;
+    CFMutableDictionaryRef reply = dictionary();
+    if (request != NULL) CFDictionarySetValue(reply, CFSTR("Request"), request);
+    delay();
+
+    if (is_string(request, CFSTR("QueryType"))) {
+      CFDictionarySetValue(reply, CFSTR("Type"), CFSTR("com.apple.mobile.lockdown"));
+    } else if (is_string(request, CFSTR("GetValue"))) {
+      CFStringRef key = CFDictionaryGetValue(msg, CFSTR("Key"));
+      CFTypeRef value = (key != NULL) ? CFDictionaryGetValue(values, key) : values;
+      if (value != NULL) {
+        CFDictionarySetValue(reply, CFSTR("Value"), value);
+      } else {
+        CFDictionarySetValue(reply, CFSTR("Error"), CFSTR("MissingValue"));
+      }
+    } else if (is_string(request, CFSTR("StartSession"))) {
+      CFDictionarySetValue(reply, CFSTR("SessionID"), CFSTR("sim-session"));
+      CFDictionarySetValue(reply, CFSTR("EnableSessionSSL"), kCFBooleanFalse);
+    } else if (is_string(request, CFSTR("StopSession"))) {
+    } else if (is_string(request, CFSTR("StartService"))) {
+      CFStringRef service = CFDictionaryGetValue(msg, CFSTR("Service"));
+      char *name = (service != NULL) ? cstring(service) : strdup("");
+      int port = start_service(dev, name);
+      if (port > 0) {
+        CFDictionarySetValue(reply, CFSTR("Service"), service);
+        set_number(reply, CFSTR("Port"), port);
+        if (wants_ssl(name)) CFDictionarySetValue(reply, CFSTR("EnableServiceSSL"), kCFBooleanTrue);
+      } else {
+        CFDictionarySetValue(reply, CFSTR("Error"), CFSTR("ServiceLimit"));
+      }
+      free(name);
+    } else {
+      CFDictionarySetValue(reply, CFSTR("Error"), CFSTR("InvalidRequest"));
+    }
+    send_release(fd, reply);
+    CFRelease(msg);
+  }
+  CFRelease(values);
+  close(fd);
+}
+
+/* Any other port is a TCP port on this host, as sim_device.c does for tunnel. */
+static void *splice_thread(void *arg)
+{
+  int *fds = arg;
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    if (write_all(fds[1], buf, n) != 0) break;
+  }
+  shutdown(fds[1], SHUT_WR);
+  return NULL;
+}
+
+static int connect_local(int port)
+{
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void serve_forward(int fd, int remote)
+{
+  int up[2] = { fd, remote }, down[2] = { remote, fd };
+  pthread_t thread;
+  pthread_create(&thread, NULL, splice_thread, up);
+  splice_thread(down);
+  pthread_join(thread, NULL);
+  close(remote);
+  close(fd);
+}
+
+/************************************************************************************************/
+/* connections */
+
+static struct device *find_device(long id)
+{
+  int i;
+  for (i = 0; i < mux.count; i++) {
+    if (mux.devices[i].id == id) return &mux.devices[i];
+  }
+  return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+  int fd = (int)(intptr_t)arg;
+  CFDictionaryRef msg;
+  uint32_t tag;
+
+  while ((msg = mux_recv(fd, &tag)) != NULL) {
+    CFStringRef type = CFDictionaryGetValue(msg, CFSTR("MessageType"));
+    if (is_string(type, CFSTR("ListDevices"))) {
+      CFDictionaryRef reply = device_list();
+      mux_send(fd, tag, reply);
+      CFRelease(reply);
+    } else if (is_string(type, CFSTR("ReadPairRecord"))) {
+      CFDictionaryRef reply = pair_record();
+      mux_send(fd, tag, reply);
+      CFRelease(reply);
+    } else if (is_string(type, CFSTR("Connect"))) {
+      struct device *dev = find_device(number(msg, CFSTR("DeviceID")));
+      int port = ntohs((uint16_t)number(msg, CFSTR("PortNumber")));
+      char name[128];
+      CFRelease(msg);
+      if (dev == NULL) {
+        mux_result(fd, tag, RESULT_BADDEV);
+        continue;
+      }
+      /* after the Result the socket is the device port's stream */
+      if (port == LOCKDOWN_PORT) {
+        mux_result(fd, tag, RESULT_OK);
+        serve_lockdown(fd, dev);
+      } else if (claim_service(dev, port, name, sizeof(name))) {
+        mux_result(fd, tag, RESULT_OK);
+        serve_service(fd, dev, name);
+      } else {
+        int remote = connect_local(port);
+        if (remote < 0) {
+          mux_result(fd, tag, RESULT_REFUSED);
+          continue;
+        }
+        mux_result(fd, tag, RESULT_OK);
+        serve_forward(fd, remote);
+      }
+      return NULL;
+    } else {
+      mux_result(fd, tag, 1);
+    }
+    CFRelease(msg);
+  }
+  close(fd);
+  return NULL;
+}
+
+static void on_replug(int sig)
+{
+  replug = 1;
+}
+
+/* New DeviceIDs after the highest one used, so none is ever reused. */
+static void replug_devices(void)
+{
+  int i;
+  pthread_mutex_lock(&mux.lock);
+  for (i = 0; i < mux.count; i++) {
+    mux.devices[i].id += mux.count;
+  }
+  pthread_mutex_unlock(&mux.lock);
+  fprintf(stderr, "usbmuxd-sim: devices replugged\n");
+}
+
+int main(int argc, char *argv[])
+{
+  const char *path = (argc > 1) ? argv[1] : "usbmuxd.sock";
+  struct sockaddr_un sun;
+  const char *env;
+  int i, listener;
+
+  struct sigaction sa;
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_replug;    /* no SA_RESTART: accept() returns to notice it */
+  sigaction(SIGUSR1, &sa, NULL);
+  mux.ssl_services = getenv("IDB_SIM_SSL_SERVICES");
+  mux.root = getenv("IDB_SIM_ROOT") ? getenv("IDB_SIM_ROOT") : "sim";
+  mux.latency_us = getenv("IDB_SIM_LATENCY_US") ? atol(getenv("IDB_SIM_LATENCY_US")) : 0;
+  mux.bandwidth = getenv("IDB_SIM_BANDWIDTH") ? atof(getenv("IDB_SIM_BANDWIDTH")) : 0;
+  mux.count = (env = getenv("IDB_SIM_DEVICES")) ? atoi(env) : 1;
+  if (mux.count < 0) mux.count = 0;
+  if (mux.count > MUX_MAX_DEVICES) mux.count = MUX_MAX_DEVICES;
+  for (i = 0; i < mux.count; i++) {
+    struct device *dev = &mux.devices[i];
+    dev->id = i + 1;
+    snprintf(dev->udid, sizeof(dev->udid), "sim-device-%02d", i);
+    dev->root = join(mux.root, dev->udid);
+    char *media = join(dev->root, "media/PublicStaging");
+    char *apps = join(dev->root, "apps");
+    mkdirs(media);
+    mkdirs(apps);
+    free(apps);
+    free(media);
+  }
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+  unlink(path);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(listener, 64) != 0) {
+    fprintf(stderr, "usbmuxd-sim: cannot listen on %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fprintf(stderr, "usbmuxd-sim: %d device(s) on %s\n", mux.count, path);
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    pthread_t thread;
+    if (replug) {
+      replug = 0;
+      replug_devices();
+    }
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (pthread_create(&thread, NULL, client_thread, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return 1;
+}